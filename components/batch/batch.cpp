@@ -0,0 +1,223 @@
+#include "batch.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "network_helpers.hpp"
+#include "wifi_link.hpp"
+#include "power.hpp"
+
+namespace
+{
+    using namespace batch;
+
+    constexpr auto TAG = "BATCH";
+    constexpr auto MAX_BYTES = CONFIG_MODEM_BATCH_MAX_BYTES;
+    constexpr int64_t MAX_AGE_US = CONFIG_MODEM_BATCH_MAX_AGE_MS * 1000LL;
+    constexpr auto MAX_HOST_LEN = 64;        //
+    constexpr auto MAX_PATH_LEN = 128;       //
+    constexpr auto RETRY_MS = 5000;          // How long a sealed batch waits for the WiFi link before trying again
+    constexpr auto TASK_STACK_SIZE = 6144;   // HTTP client with its event handler runs on this stack
+    constexpr auto TASK_PRIORITY = 4;        // Uploads run below the command loop
+
+    enum class State : uint8_t
+    {
+        FREE,
+        OPEN,   // Accepting items
+        SEALED, // Waiting for the upload task
+    };
+
+    struct Slot
+    {
+        State state;
+        Format format;
+        char host[MAX_HOST_LEN];
+        char path[MAX_PATH_LEN];
+        char body[MAX_BYTES + 1]; // Reserved up front, batching never touches the heap
+        uint16_t len;
+        uint16_t count;
+        uint32_t id;
+        int64_t opened_at; // When the first item was added
+    };
+
+    Slot slots[MAX_BATCHES];
+    SemaphoreHandle_t mutex; // Guards "slots"
+    TaskHandle_t upload_task = NULL;
+    Acknowledge acknowledge = NULL;
+    uint32_t next_id = 0;
+
+    auto matches(const Slot &s, const char *host, const char *path) -> bool
+    {
+        return strcmp(s.host, host) == 0 && strcmp(s.path, path) == 0;
+    }
+
+    // Close the body so it can be sent as it is
+    auto seal_locked(Slot &s) -> void
+    {
+        if (s.format == Format::JSON)
+            s.body[s.len++] = ']';
+        s.body[s.len] = '\0';
+        s.state = State::SEALED;
+    }
+
+    auto open_locked(const char *host, const char *path, Format format) -> Slot *
+    {
+        for (auto &s : slots)
+        {
+            if (s.state != State::FREE)
+                continue;
+            strcpy(s.host, host);
+            strcpy(s.path, path);
+            s.state = State::OPEN;
+            s.format = format;
+            s.len = 0;
+            s.count = 0;
+            s.id = next_id++;
+            s.opened_at = esp_timer_get_time();
+            if (format == Format::JSON)
+                s.body[s.len++] = '[';
+            return &s;
+        }
+        return NULL;
+    }
+
+    auto post(Slot &s) -> int
+    {
+        auto status = -1;
+        const network_helpers::ResponseSink sink = {
+            .on_status = [](void *ctx, int code) { *(int *)ctx = code; },
+            .on_header = NULL,
+            .on_data = NULL,
+            .ctx = &status,
+        };
+        if (network_helpers::make_http_request(HTTP_METHOD_POST, s.host, s.path, s.body, s.len, &sink) != ESP_OK)
+            return -1;
+        return status;
+    }
+
+    // Seal open batches that are old enough, returns how long until the next one is
+    auto seal_expired() -> TickType_t
+    {
+        auto wait = portMAX_DELAY;
+        const auto now = esp_timer_get_time();
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (auto &s : slots)
+        {
+            if (s.state != State::OPEN)
+                continue;
+            const auto left = s.opened_at + MAX_AGE_US - now;
+            if (left <= 0)
+                seal_locked(s);
+            else if (pdMS_TO_TICKS(left / 1000) + 1 < wait)
+                wait = pdMS_TO_TICKS(left / 1000) + 1;
+        }
+        xSemaphoreGive(mutex);
+        return wait;
+    }
+
+    auto upload(void *arg) -> void
+    {
+        auto wait = portMAX_DELAY;
+        while (true)
+        {
+            ulTaskNotifyTake(pdTRUE, wait);
+            wait = seal_expired();
+
+            // Sealed slots are left alone by everyone else, so they are uploaded without the lock
+            for (auto &s : slots)
+            {
+                if (s.state != State::SEALED)
+                    continue;
+                if (!wifi_link::wait_up(0))
+                {
+                    wait = wait < pdMS_TO_TICKS(RETRY_MS) ? wait : pdMS_TO_TICKS(RETRY_MS);
+                    break;
+                }
+                power::wait_tx_window(); // Batches are not urgent, go out with the rest of the queued work
+                const auto status = post(s);
+                ESP_LOGI(TAG, "Batch %" PRIu32 ": %u items, %u bytes, status %d", s.id, s.count, s.len, status);
+                acknowledge(s.id, s.count, status);
+                xSemaphoreTake(mutex, portMAX_DELAY);
+                s.state = State::FREE;
+                xSemaphoreGive(mutex);
+            }
+        }
+    }
+}
+
+namespace batch
+{
+    auto init(Acknowledge ack) -> void
+    {
+        acknowledge = ack;
+        mutex = xSemaphoreCreateMutex();
+        xTaskCreatePinnedToCore(upload, "batch_upload", TASK_STACK_SIZE, NULL, TASK_PRIORITY, &upload_task, CONFIG_MODEM_NETWORK_CORE);
+    }
+
+    auto add(const char *host, const char *path, Format format, const char *item, uint16_t len, Ticket *ticket) -> esp_err_t
+    {
+        const auto overhead = format == Format::JSON ? 2 : 1; // Separator and closing bracket, or the newline
+        if (strlen(host) >= MAX_HOST_LEN || strlen(path) >= MAX_PATH_LEN || len + overhead + 1 > MAX_BYTES)
+            return ESP_ERR_INVALID_SIZE;
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        Slot *slot = NULL;
+        for (auto &s : slots)
+            if (s.state == State::OPEN && matches(s, host, path))
+                slot = &s;
+
+        // Start a new batch when the item does not fit or the format changes
+        auto sealed = false;
+        if (slot != NULL && (slot->format != format || slot->len + len + overhead > MAX_BYTES))
+        {
+            seal_locked(*slot);
+            slot = NULL;
+            sealed = true;
+        }
+        if (slot == NULL)
+            slot = open_locked(host, path, format);
+        if (slot == NULL)
+        {
+            xSemaphoreGive(mutex);
+            if (sealed)
+                xTaskNotifyGive(upload_task);
+            return ESP_ERR_NO_MEM;
+        }
+
+        if (format == Format::JSON && slot->count > 0)
+            slot->body[slot->len++] = ',';
+        memcpy(slot->body + slot->len, item, len);
+        slot->len += len;
+        if (format == Format::LINES)
+            slot->body[slot->len++] = '\n';
+        *ticket = Ticket{slot->id, slot->count};
+        slot->count += 1;
+        xSemaphoreGive(mutex);
+
+        // The upload task sends sealed batches and tracks the age of new ones
+        if (sealed || ticket->index == 0)
+            xTaskNotifyGive(upload_task);
+        return ESP_OK;
+    }
+
+    auto flush(const char *host, const char *path) -> uint8_t
+    {
+        uint8_t queued = 0;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (auto &s : slots)
+        {
+            if (s.state != State::OPEN || (host != NULL && !matches(s, host, path)))
+                continue;
+            seal_locked(s);
+            queued += 1;
+        }
+        xSemaphoreGive(mutex);
+        if (queued > 0)
+            xTaskNotifyGive(upload_task);
+        return queued;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_err.h"
+
+// Coalesces small POST bodies for the same host and path into a single upload.
+// Items are appended to an open batch, which is uploaded by a background task once it is full,
+// once its first item is old enough, or when the host asks for it.
+namespace batch
+{
+    constexpr uint8_t MAX_BATCHES = 4; // Open and uploading batches, at most one open batch per destination
+
+    enum class Format : uint8_t
+    {
+        LINES, // One item per line (NDJSON when the items are JSON)
+        JSON,  // Items joined into a JSON array
+    };
+
+    // Where an item ended up: item "index" of batch "id"
+    struct Ticket
+    {
+        uint32_t id;
+        uint16_t index;
+    };
+
+    typedef void (*Acknowledge)(uint32_t id, uint16_t count, int status); // Batch "id" with "count" items was uploaded, "status" is the HTTP status or -1
+
+    auto init(Acknowledge acknowledge) -> void; // Start the upload task
+    auto add(const char *host, const char *path, Format format, const char *item, uint16_t len, Ticket *ticket) -> esp_err_t;
+    auto flush(const char *host, const char *path) -> uint8_t; // Upload the open batch for a destination (or all of them if "host" is NULL), returns how many were queued
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+
+// Checksums shared by the gzip trailer and the OTA block protocol.
+// This module has no ESP-IDF dependencies so the same code can be compiled on the host side.
+namespace checksum
+{
+    // CRC-32 (reflected, polynomial 0xEDB88320) lookup table indexed by a single nibble (keeps the table at 64 bytes)
+    inline constexpr uint32_t crc32_nibble_table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+
+    // CRC-32 as used by zlib and gzip, chain calls by passing the previous result
+    inline auto crc32(const uint8_t *bytes, size_t len, uint32_t crc = 0) -> uint32_t
+    {
+        crc = ~crc;
+        for (size_t i = 0; i < len; i++)
+        {
+            crc ^= bytes[i];
+            crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0F];
+            crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0F];
+        }
+        return ~crc;
+    }
+}
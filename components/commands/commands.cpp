@@ -1,31 +1,338 @@
 #include "commands.hpp"
 
+#include "sdkconfig.h"
 #include "driver/uart.h"
 #include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_intr_alloc.h"
 #include "string.h"
+#include "stdlib.h"
+#include "stdarg.h"
 #include "esp_vfs_dev.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
+#include "frames.hpp"
+#include "parser.hpp"
+#include "stats.hpp"
+#include "pools.hpp"
+#include "power.hpp"
+
+constexpr auto TAG = "COMMANDS";
 constexpr auto UART_PORT_NUM = 0;
 constexpr auto UART_RX_PIN = 3;
 constexpr auto UART_TX_PIN = 1;
-constexpr auto BUF_SIZE = 1024;
+constexpr auto UART_RTS_PIN = CONFIG_MODEM_UART_RTS_PIN;
+constexpr auto UART_CTS_PIN = CONFIG_MODEM_UART_CTS_PIN;
+constexpr auto MIN_BAUD_RATE = 9600;
+constexpr auto MAX_BAUD_RATE = 3000000;
+constexpr auto FLOW_CTRL_THRESHOLD = 100; // RX FIFO level (of 128 bytes) at which RTS is deasserted
+constexpr auto FRAME_BUF_SIZE = 4096;     // Maximum size of a single binary frame (header + args + data + crc)
+constexpr auto STREAM_TIMEOUT_MS = 5000;  // Maximum gap between bytes of a streamed payload
+constexpr auto MAX_LINE_LEN = CONFIG_MODEM_CMD_MAX_LINE_LEN; // Maximum length of a text protocol line
+#if CONFIG_UART_ISR_IN_IRAM
+constexpr auto UART_INTR_FLAGS = ESP_INTR_FLAG_IRAM; // Keeps receiving while flash writes (OTA) have the cache disabled
+#else
+constexpr auto UART_INTR_FLAGS = 0;
+#endif
 
 namespace
 {
-    auto str_has_prefix(const char *s, const char *prefix) -> bool
+    using namespace commands;
+
+    // Protocol used on the UART link (switched with the "FRAMED" handshake)
+    enum class Mode
+    {
+        TEXT,
+        FRAMED,
+    };
+
+    Mode mode = Mode::TEXT;
+    uint8_t frame_buf[FRAME_BUF_SIZE];
+    frames::Parser frame_parser;
+    SemaphoreHandle_t output_mutex; // Responses can come from several tasks at once
+    QueueHandle_t uart_events;       // Events reported by the UART driver
+    LinkStats link = {};
+
+    // Bytes already taken out of the driver ring buffer but not consumed by the parser yet
+    uint8_t rx_buf[128];
+    size_t rx_pos = 0;
+    size_t rx_len = 0;
+
+    // Names of the commands that can be sent as binary frames
+    struct FramedCommand
+    {
+        uint8_t id;
+        const char *name;
+    };
+    constexpr FramedCommand framed_commands[] = {
+        {frames::CMD_SERVE, "SERVE"},
+        {frames::CMD_CONNECT, "CONNECT"},
+        {frames::CMD_HTTP, "HTTP"},
+        {frames::CMD_ASYNC, "ASYNC"},
+        {frames::CMD_BAUD, "BAUD"},
+        {frames::CMD_OTA, "OTA"},
+        {frames::CMD_STATS, "STATS"},
+        {frames::CMD_SOCK, "SOCK"},
+        {frames::CMD_MQTT, "MQTT"},
+        {frames::CMD_BATCH, "BATCH"},
+        {frames::CMD_QUEUE, "QUEUE"},
+        {frames::CMD_SCAN, "SCAN"},
+        {frames::CMD_PROFILE, "PROFILE"},
+        {frames::CMD_TASKS, "TASKS"},
+        {frames::CMD_IPCONFIG, "IPCONFIG"},
+        {frames::CMD_CLOSE, "CLOSE"},
+    };
+
+    // Watches the UART driver events for lost bytes
+    auto uart_event_task(void *arg) -> void
+    {
+        uart_event_t event;
+        while (true)
+        {
+            if (xQueueReceive(uart_events, &event, portMAX_DELAY) != pdTRUE)
+                continue;
+            switch (event.type)
+            {
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                link.overruns += 1;
+                ESP_LOGW(TAG, "UART RX overrun (%d)", event.type);
+                break;
+            case UART_FRAME_ERR:
+            case UART_PARITY_ERR:
+                link.line_errors += 1;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // Read up to "len" bytes, consuming the staging buffer first and then reading straight from the driver
+    auto input_read(uint8_t *dst, size_t len, TickType_t timeout) -> size_t
+    {
+        auto copied = rx_len - rx_pos < len ? rx_len - rx_pos : len;
+        memcpy(dst, rx_buf + rx_pos, copied);
+        rx_pos += copied;
+        if (copied < len)
+        {
+            const auto got = uart_read_bytes(UART_PORT_NUM, dst + copied, len - copied, timeout);
+            copied += got > 0 ? got : 0;
+            power::activity(); // More of the frame (or payload) is on its way
+        }
+        return copied;
+    }
+
+    // Get a single byte, refilling the staging buffer with whatever the driver already holds
+    auto input_byte() -> uint8_t
     {
-        if (strlen(prefix) > strlen(s))
-            return false;
-        return memcmp(s, prefix, strlen(prefix)) == 0;
+        if (rx_pos == rx_len)
+        {
+            size_t buffered = 0;
+            uart_get_buffered_data_len(UART_PORT_NUM, &buffered);
+            const auto want = buffered == 0 ? 1 : buffered < sizeof(rx_buf) ? buffered : sizeof(rx_buf);
+            auto got = 0;
+            while (got <= 0)
+                got = uart_read_bytes(UART_PORT_NUM, rx_buf, want, portMAX_DELAY);
+            rx_pos = 0;
+            rx_len = got;
+            power::activity(); // Stay awake for the rest of the line
+        }
+        return rx_buf[rx_pos++];
+    }
+
+    // Read a line without the line ending. Returns false if the line did not fit (the rest is dropped).
+    auto read_line(char *line, size_t max_len, int64_t *started = NULL) -> bool
+    {
+        size_t len = 0;
+        auto fits = true;
+        while (true)
+        {
+            const auto c = input_byte();
+            if (started != NULL && len == 0 && fits)
+                *started = esp_timer_get_time();
+            if (c == '\n')
+                break;
+            if (len + 1 < max_len)
+                line[len++] = c;
+            else
+                fits = false;
+        }
+        if (len > 0 && line[len - 1] == '\r')
+            len -= 1;
+        line[len] = '\0';
+        return fits;
+    }
+
+    // Write a text protocol line straight to the driver
+    auto write_line(const char *fmt, ...) -> void
+    {
+        static char line[MAX_LINE_LEN + 64];
+        va_list args;
+        va_start(args, fmt);
+        auto len = vsnprintf(line, sizeof(line) - 2, fmt, args);
+        va_end(args);
+        if (len > (int)sizeof(line) - 3)
+            len = sizeof(line) - 3;
+        line[len++] = '\r';
+        line[len++] = '\n';
+        power::activity(); // Keep the UART clocked until the bytes are out
+        uart_write_bytes(UART_PORT_NUM, line, len);
+    }
+
+    // Switch the link to a new baud rate once everything queued so far went out
+    auto change_baud_rate(const Command &c) -> void
+    {
+        const auto baud_rate = c.args_len > 0 ? strtoul(c.args[0], NULL, 10) : 0;
+        const auto flow_control = c.args_len > 1 && strcmp(c.args[1], "RTSCTS") == 0;
+        if (baud_rate < MIN_BAUD_RATE || baud_rate > MAX_BAUD_RATE || (flow_control && (UART_RTS_PIN < 0 || UART_CTS_PIN < 0)))
+            return send_resp(c.id, "FAIL");
+
+        // The host switches its side after receiving the response
+        send_resp(c.id, "OK");
+        xSemaphoreTake(output_mutex, portMAX_DELAY);
+        uart_wait_tx_done(UART_PORT_NUM, portMAX_DELAY);
+        uart_set_baudrate(UART_PORT_NUM, baud_rate);
+        if (flow_control)
+        {
+            uart_set_pin(UART_PORT_NUM, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_RTS_PIN, UART_CTS_PIN);
+            uart_set_hw_flow_ctrl(UART_PORT_NUM, UART_HW_FLOWCTRL_CTS_RTS, FLOW_CTRL_THRESHOLD);
+        }
+        else
+            uart_set_hw_flow_ctrl(UART_PORT_NUM, UART_HW_FLOWCTRL_DISABLE, 0);
+        link.baud_rate = baud_rate;
+        link.flow_control = flow_control;
+        xSemaphoreGive(output_mutex);
+        ESP_LOGI(TAG, "Link changed to %lu baud (flow control %s)", baud_rate, flow_control ? "on" : "off");
     }
 
-    auto strip_cr_lf(char *s) -> void
+    // Encode a frame and write it to the driver (the output mutex must be held)
+    auto write_frame(uint8_t cmd_id, const char *const *args, uint8_t argc, const uint8_t *data, uint16_t len) -> void
     {
-        const auto len = strlen(s);
-        if (s[len - 2] == '\r')
-            s[len - 2] = '\0';
-        if (s[len - 1] == '\n')
-            s[len - 1] = '\0';
+        static uint8_t out[FRAME_BUF_SIZE];
+        const auto frame_len = frames::encode(out, sizeof(out), cmd_id, args, argc, data, len);
+        power::activity();
+        uart_write_bytes(UART_PORT_NUM, (const char *)out, frame_len);
+    }
+
+    // Write a response frame, the request id (if any) goes into the argument table
+    auto send_frame(uint8_t cmd_id, int32_t id, const uint8_t *data, uint16_t len) -> void
+    {
+        char id_str[12];
+        const char *args[] = {id_str};
+        snprintf(id_str, sizeof(id_str), "%d", id);
+        write_frame(cmd_id, args, id >= 0 ? 1 : 0, data, len);
+    }
+
+    // Read and parse a single "ESP_CMD" line (and its data section if present)
+    auto wait_for_text_cmd(int64_t *started) -> Command
+    {
+        // Create the structure
+        static char *args_buf[parser::MAX_ARGS];
+        Command c = {
+            .cmd = NULL,
+            .args = args_buf,
+            .args_len = 0,
+            .data = NULL,
+            .data_len = 0,
+            .stream_len = 0,
+            .id = -1,
+            .block = NULL,
+        };
+
+        // Find a line starting with "ESP_CMD"
+        static char line[MAX_LINE_LEN]; // Buffer holding the line
+        auto fits = false;
+        while (!fits || !parser::is_command_line(line)) // Repeat until a complete line starts with "ESP_CMD"
+            fits = read_line(line, MAX_LINE_LEN, started);
+
+        // Parse the command, return if there is no data to read
+        if (!parser::parse_line(line, c))
+            c.cmd = NULL;
+        if (c.cmd == NULL || !parser::take_data_marker(c))
+            return c;
+
+        // Read lines until "ESP_DATA_END"
+        constexpr auto max_data_len = CONFIG_MODEM_CMD_MAX_DATA_LEN;
+        static char data_line[MAX_LINE_LEN] = "";
+        static uint8_t data[max_data_len] = "";
+        c.data = data;
+        data[0] = '\0';
+        auto overflow = false;
+        while (true)
+        {
+            overflow |= !read_line(data_line, MAX_LINE_LEN);
+            if (strcmp(data_line, "ESP_DATA_END") == 0)
+                break;
+            overflow |= !parser::append_data_line(c, max_data_len, data_line);
+        }
+
+        // Drop commands whose data did not fit
+        if (overflow)
+        {
+            send_resp("FAIL");
+            c.cmd = NULL;
+        }
+        return c;
+    }
+
+    // Read a single binary frame straight from the UART driver into the parser buffer
+    auto wait_for_framed_cmd(int64_t *started) -> Command
+    {
+        static char *args_buf[frames::MAX_ARGS];
+        Command c = {
+            .cmd = NULL,
+            .args = args_buf,
+            .args_len = 0,
+            .data = NULL,
+            .data_len = 0,
+            .stream_len = 0,
+            .id = -1,
+            .block = NULL,
+        };
+
+        // Read until a complete frame is in the buffer
+        auto status = frames::Status::NEED_MORE;
+        while (status == frames::Status::NEED_MORE)
+        {
+            uint8_t *dst;
+            const auto want = frames::next_chunk(frame_parser, &dst);
+            const auto got = input_read(dst, want, portMAX_DELAY);
+            if (frame_parser.filled == 0)
+                *started = esp_timer_get_time(); // Candidate first magic byte
+            status = frames::commit(frame_parser, got);
+        }
+        if (status != frames::Status::FRAME)
+        {
+            commands::send_resp("FAIL");
+            return c;
+        }
+
+        // Translate the frame into a command
+        const auto &f = frame_parser.frame;
+        if (f.cmd_id == frames::CMD_TEXT)
+            c.cmd = (char *)"TEXT";
+        for (const auto &fc : framed_commands)
+            if (fc.id == f.cmd_id)
+                c.cmd = (char *)fc.name;
+        if (c.cmd == NULL)
+        {
+            commands::send_resp("FAIL");
+            return c;
+        }
+        for (uint8_t i = 0; i < f.argc; i++)
+            c.args[i] = f.args[i];
+        c.args_len = f.argc;
+        if (f.data_len > 0)
+        {
+            c.data = f.data;
+            c.data_len = f.data_len;
+        }
+        return c;
     }
 }
 
@@ -34,85 +341,204 @@ namespace commands
     auto init() -> void
     {
         auto config = uart_config_t{};
-        config.baud_rate = 115200;
+        config.baud_rate = CONFIG_MODEM_UART_BAUD_RATE;
         config.data_bits = UART_DATA_8_BITS;
         config.parity = UART_PARITY_DISABLE;
         config.stop_bits = UART_STOP_BITS_1;
         config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
         config.source_clk = UART_SCLK_APB;
-        ESP_ERROR_CHECK(uart_driver_install(UART_PORT_NUM, BUF_SIZE * 2, 0, 0, NULL, 0));
+        ESP_ERROR_CHECK(uart_driver_install(UART_PORT_NUM,
+                                            CONFIG_MODEM_UART_RX_BUFFER_SIZE,
+                                            CONFIG_MODEM_UART_TX_BUFFER_SIZE,
+                                            CONFIG_MODEM_UART_EVENT_QUEUE_SIZE,
+                                            &uart_events,
+                                            UART_INTR_FLAGS));
         ESP_ERROR_CHECK(uart_param_config(UART_PORT_NUM, &config));
         ESP_ERROR_CHECK(uart_set_pin(UART_PORT_NUM, UART_TX_PIN, UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+        link.baud_rate = CONFIG_MODEM_UART_BAUD_RATE;
+
+        // The protocol talks to the driver directly, stdio is only used by the logs
         esp_vfs_dev_uart_use_driver(UART_PORT_NUM);
-        esp_vfs_dev_uart_port_set_rx_line_endings(UART_PORT_NUM, ESP_LINE_ENDINGS_CRLF);
         esp_vfs_dev_uart_port_set_tx_line_endings(UART_PORT_NUM, ESP_LINE_ENDINGS_CRLF);
+        frames::init(frame_parser, frame_buf, FRAME_BUF_SIZE);
+        output_mutex = xSemaphoreCreateMutex();
+        // The UART ISR is installed on the core calling uart_driver_install (the host task),
+        // keep the task that handles its events there too
+        xTaskCreatePinnedToCore(uart_event_task, "uart_events", 2048, NULL, 12, NULL, CONFIG_MODEM_HOST_CORE);
+        power::init(UART_PORT_NUM); // Light sleep wakes up on this UART
     }
 
     auto send_resp(const char *response) -> void
     {
-        printf("ESP_RESP %s\n", response);
+        send_resp(-1, response);
     }
 
-    auto wait_for_cmd() -> Command
+    auto send_resp(int32_t id, const char *response) -> void
     {
-        // Create the structure
-        static char *args_buf[10];
-        Command c = {
-            .cmd = NULL,
-            .args = args_buf,
-            .args_len = 0,
-            .data = NULL,
-            .data_len = 0,
-        };
+        xSemaphoreTake(output_mutex, portMAX_DELAY);
+        if (mode == Mode::TEXT && id < 0)
+            write_line("ESP_RESP %s", response);
+        else if (mode == Mode::TEXT)
+            write_line("ESP_RESP %d %s", id, response);
+        else
+            send_frame(frames::CMD_RESP, id, (const uint8_t *)response, strlen(response));
+        xSemaphoreGive(output_mutex);
+    }
 
-        // Find a line starting with "ESP_CMD"
-        constexpr auto max_line_len = 200;       // Maximum line length
-        static char line[max_line_len];          // Buffer holding the line
-        strcpy(line, "");                        // Initialize the buffer
-        while (!str_has_prefix(line, "ESP_CMD")) // Repeat while buffer doesn't start with "ESP_CMD"
-            fgets(line, max_line_len, stdin);    // Read a line
-        strip_cr_lf(line);                       // Strip end of line symbols
+    auto send_event(const char *event, const char *data, int len) -> void
+    {
+        xSemaphoreTake(output_mutex, portMAX_DELAY);
+        if (mode == Mode::TEXT && data == NULL)
+            write_line("ESP_EVT %s", event);
+        else if (mode == Mode::TEXT)
+        {
+            write_line("ESP_EVT %s %d", event, len);
+            power::activity();
+            uart_write_bytes(UART_PORT_NUM, data, len);
+        }
+        else if (data == NULL)
+            send_frame(frames::CMD_EVT, -1, (const uint8_t *)event, strlen(event));
+        else
+        {
+            // The event text goes into the argument table, so the payload stays raw
+            const char *args[] = {event};
+            const auto max_chunk = (int)(FRAME_BUF_SIZE - frames::OVERHEAD - strlen(event) - 1);
+            for (auto offset = 0; offset < len; offset += max_chunk)
+            {
+                const auto chunk = len - offset < max_chunk ? len - offset : max_chunk;
+                write_frame(frames::CMD_EVT, args, 1, (const uint8_t *)data + offset, chunk);
+            }
+        }
+        xSemaphoreGive(output_mutex);
+    }
 
-        // Parse the command
-        char *buf = line;          // Pointer to the currently parsed token
-        strsep(&buf, " ");         // Consume "ESP_CMD" prefix
-        c.cmd = strsep(&buf, " "); // Get the command
+    auto send_data(int32_t id, const char *data, int len) -> void
+    {
+        xSemaphoreTake(output_mutex, portMAX_DELAY);
+        if (mode == Mode::TEXT)
+        {
+            if (id < 0)
+                write_line("ESP_RESP DATA %d", len);
+            else
+                write_line("ESP_RESP %d DATA %d", id, len);
+            power::activity();
+            uart_write_bytes(UART_PORT_NUM, data, len);
+        }
+        else
+        {
+            constexpr auto max_chunk = (int)(FRAME_BUF_SIZE - frames::OVERHEAD - 12); // Leave room for the id argument
+            for (auto offset = 0; offset < len; offset += max_chunk)
+            {
+                const auto chunk = len - offset < max_chunk ? len - offset : max_chunk;
+                send_frame(frames::CMD_DATA, id, (const uint8_t *)data + offset, chunk);
+            }
+        }
+        xSemaphoreGive(output_mutex);
+    }
 
-        // Parse arguments
-        while (buf != NULL)
+    auto read_data(char *buf, int max_len) -> int
+    {
+        return input_read((uint8_t *)buf, max_len, pdMS_TO_TICKS(STREAM_TIMEOUT_MS));
+    }
+
+    auto discard_data(uint32_t len) -> void
+    {
+        uint8_t chunk[64];
+        while (len > 0)
         {
-            c.args[c.args_len] = strsep(&buf, " ");
-            c.args_len += 1;
+            const auto got = input_read(chunk, len < sizeof(chunk) ? len : sizeof(chunk), pdMS_TO_TICKS(STREAM_TIMEOUT_MS));
+            if (got == 0)
+                return; // The host stopped sending, nothing left to skip
+            len -= got;
         }
+    }
 
-        // Return if there is no data to read
-        if (strcmp(c.args[c.args_len - 1], "ESP_DATA_BEGIN") != 0)
-            return c;
+    auto link_stats() -> LinkStats
+    {
+        return link;
+    }
 
-        // Remove "ESP_DATA_BEGIN" from the argument list
-        c.args_len -= 1;
+    auto wait_for_cmd() -> Command
+    {
+        while (true)
+        {
+            // Parse time runs from the first byte of the command, so it includes the data section on the wire
+            int64_t started = 0;
+            auto c = mode == Mode::TEXT ? wait_for_text_cmd(&started) : wait_for_framed_cmd(&started);
+            if (c.cmd == NULL)
+                continue;
+            if (!parser::parse_async_prefix(c))
+            {
+                send_resp("FAIL");
+                continue;
+            }
+            parser::parse_stream_suffix(c);
 
-        // Create the data buffer
-        constexpr auto max_data_len = 500;
-        static char data_line[max_line_len] = "";
-        static uint8_t data[max_data_len] = "";
-        c.data = data;
+            // Handle protocol switching here, it is invisible to the command executors
+            if (mode == Mode::TEXT && strcmp(c.cmd, "FRAMED") == 0)
+            {
+                send_resp("OK");
+                uart_wait_tx_done(UART_PORT_NUM, portMAX_DELAY);
+                mode = Mode::FRAMED;
+                continue;
+            }
+            if (strcmp(c.cmd, "BAUD") == 0)
+            {
+                change_baud_rate(c);
+                continue;
+            }
+            if (mode == Mode::FRAMED && strcmp(c.cmd, "TEXT") == 0)
+            {
+                send_resp("OK");
+                mode = Mode::TEXT;
+                continue;
+            }
+            stats::record(stats::Stage::PARSE, esp_timer_get_time() - started);
+            return c;
+        }
+    }
 
-        // Read lines until "ESP_DATA_END"
-        while (strcmp(data_line, "ESP_DATA_END") != 0)
+    auto clone(const Command &c) -> Command
+    {
+        // Everything goes into a single pool block: argument pointers, strings, then data
+        auto size = sizeof(char *) * c.args_len + strlen(c.cmd) + 1 + c.data_len + 1;
+        for (uint8_t i = 0; i < c.args_len; i++)
+            size += strlen(c.args[i]) + 1;
+        size += (pools::ALIGN - 1) * (c.args_len + 3); // Arena alignment of every piece
+        auto copy = c;
+        size_t capacity = 0;
+        const auto block = pools::take(size, &capacity);
+        if (block == NULL)
         {
-            fgets(data_line, max_line_len, stdin);
-            strcat((char *)data, data_line);
-            strip_cr_lf(data_line);
-            c.data_len = strlen(data_line);
+            copy.cmd = NULL;
+            return copy;
         }
 
-        // Remove "ESP_DATA_END" from the data buffer
-        strip_cr_lf((char *)data);
-        data[strlen((char *)data) - strlen("ESP_DATA_END")] = '\0';
-        c.data_len = strlen((char *)data);
+        pools::Arena arena(block, capacity);
+        const auto copy_str = [&arena](const char *s) -> char * {
+            const auto dst = (char *)arena.alloc(strlen(s) + 1);
+            strcpy(dst, s);
+            return dst;
+        };
+        copy.args = (char **)arena.alloc(sizeof(char *) * c.args_len);
+        copy.cmd = copy_str(c.cmd);
+        for (uint8_t i = 0; i < c.args_len; i++)
+            copy.args[i] = copy_str(c.args[i]);
+        if (c.data != NULL)
+        {
+            copy.data = (uint8_t *)arena.alloc(c.data_len + 1);
+            memcpy(copy.data, c.data, c.data_len);
+            copy.data[c.data_len] = '\0';
+        }
+        copy.block = block;
+        return copy;
+    }
 
-        // Return the command
-        return c;
+    auto release(Command &c) -> void
+    {
+        pools::give(c.block);
+        c.block = NULL;
+        c.args = NULL;
+        c.cmd = NULL;
     }
-}
\ No newline at end of file
+}
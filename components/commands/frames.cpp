@@ -0,0 +1,197 @@
+#include "frames.hpp"
+
+#include "string.h"
+
+namespace
+{
+    using namespace frames;
+
+    // CRC-16/CCITT-FALSE lookup table indexed by a single nibble (keeps the table at 32 bytes)
+    constexpr uint16_t crc_nibble_table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    };
+
+    auto read_u16(const uint8_t *p) -> uint16_t
+    {
+        return (uint16_t)(p[0] | (p[1] << 8));
+    }
+
+    auto write_u16(uint8_t *p, uint16_t v) -> void
+    {
+        p[0] = v & 0xFF;
+        p[1] = v >> 8;
+    }
+
+    // Split the argument table into NUL-terminated strings (pointers into the parser buffer)
+    auto parse_args(Frame &f, char *args, uint16_t args_size) -> bool
+    {
+        if (f.argc > MAX_ARGS)
+            return false;
+        uint16_t offset = 0;
+        for (uint8_t i = 0; i < f.argc; i++)
+        {
+            const auto end = (char *)memchr(args + offset, '\0', args_size - offset);
+            if (end == NULL)
+                return false;
+            f.args[i] = args + offset;
+            offset = end - args + 1;
+        }
+        return offset == args_size;
+    }
+
+    // Called once the whole frame is in the buffer
+    auto finish_frame(Parser &p) -> Status
+    {
+        const auto size = p.expected;
+        p.filled = 0;
+        p.expected = 0;
+
+        const auto crc = read_u16(p.buf + size - CRC_SIZE);
+        if (crc16(p.buf + 2, size - 2 - CRC_SIZE) != crc)
+            return Status::BAD_CRC;
+
+        auto &f = p.frame;
+        const auto args_size = read_u16(p.buf + 4);
+        f.cmd_id = p.buf[2];
+        f.argc = p.buf[3];
+        f.data_len = read_u16(p.buf + 6);
+        f.data = p.buf + HEADER_SIZE + args_size;
+        if (!parse_args(f, (char *)p.buf + HEADER_SIZE, args_size))
+            return Status::BAD_ARGS;
+
+        // The CRC has already been checked, so its first byte can hold the terminator.
+        // This lets text payloads be used as C strings like in the text protocol.
+        f.data[f.data_len] = '\0';
+        return Status::FRAME;
+    }
+}
+
+namespace frames
+{
+    auto crc16(const uint8_t *bytes, size_t len, uint16_t crc) -> uint16_t
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            crc ^= (uint16_t)bytes[i] << 8;
+            crc = (crc << 4) ^ crc_nibble_table[crc >> 12];
+            crc = (crc << 4) ^ crc_nibble_table[crc >> 12];
+        }
+        return crc;
+    }
+
+    auto init(Parser &p, uint8_t *buf, size_t capacity) -> void
+    {
+        p.buf = buf;
+        p.capacity = capacity;
+        p.filled = 0;
+        p.expected = 0;
+        memset(&p.frame, 0, sizeof(p.frame));
+    }
+
+    auto next_chunk(Parser &p, uint8_t **dst) -> size_t
+    {
+        *dst = p.buf + p.filled;
+        if (p.filled < 2)
+            return 1; // Hunt for the magic one byte at a time
+        if (p.filled < HEADER_SIZE)
+            return HEADER_SIZE - p.filled;
+        return p.expected - p.filled;
+    }
+
+    auto commit(Parser &p, size_t len) -> Status
+    {
+        // Synchronize on the magic bytes
+        if (p.filled < 2)
+        {
+            if (len == 0)
+                return Status::NEED_MORE;
+            const auto byte = p.buf[p.filled];
+            const auto magic = p.filled == 0 ? MAGIC_0 : MAGIC_1;
+            if (byte == magic)
+                p.filled += 1;
+            else
+            {
+                p.filled = byte == MAGIC_0 ? 1 : 0;
+                p.buf[0] = byte;
+            }
+            return Status::NEED_MORE;
+        }
+
+        p.filled += len;
+
+        // Header is complete, work out the size of the whole frame
+        if (p.expected == 0 && p.filled >= HEADER_SIZE)
+        {
+            p.expected = HEADER_SIZE + read_u16(p.buf + 4) + read_u16(p.buf + 6) + CRC_SIZE;
+            if (p.expected > p.capacity)
+            {
+                p.filled = 0;
+                p.expected = 0;
+                return Status::TOO_LONG;
+            }
+        }
+
+        if (p.expected == 0 || p.filled < p.expected)
+            return Status::NEED_MORE;
+        return finish_frame(p);
+    }
+
+    auto feed(Parser &p, const uint8_t *bytes, size_t len, size_t *consumed) -> Status
+    {
+        *consumed = 0;
+        while (*consumed < len)
+        {
+            uint8_t *dst;
+            auto n = next_chunk(p, &dst);
+            if (n > len - *consumed)
+                n = len - *consumed;
+            memcpy(dst, bytes + *consumed, n);
+            *consumed += n;
+            const auto status = commit(p, n);
+            if (status != Status::NEED_MORE)
+                return status;
+        }
+        return Status::NEED_MORE;
+    }
+
+    auto encode(uint8_t *out, size_t out_capacity, uint8_t cmd_id,
+                const char *const *args, uint8_t argc,
+                const uint8_t *data, uint16_t data_len) -> size_t
+    {
+        if (argc > MAX_ARGS)
+            return 0;
+
+        // Measure the argument table
+        size_t args_size = 0;
+        for (uint8_t i = 0; i < argc; i++)
+            args_size += strlen(args[i]) + 1;
+        const auto size = OVERHEAD + args_size + data_len;
+        if (args_size > 0xFFFF || size > out_capacity)
+            return 0;
+
+        // Header
+        out[0] = MAGIC_0;
+        out[1] = MAGIC_1;
+        out[2] = cmd_id;
+        out[3] = argc;
+        write_u16(out + 4, args_size);
+        write_u16(out + 6, data_len);
+
+        // Arguments and data
+        auto cursor = out + HEADER_SIZE;
+        for (uint8_t i = 0; i < argc; i++)
+        {
+            const auto len = strlen(args[i]) + 1;
+            memcpy(cursor, args[i], len);
+            cursor += len;
+        }
+        if (data_len > 0)
+            memcpy(cursor, data, data_len);
+        cursor += data_len;
+
+        // Checksum
+        write_u16(cursor, crc16(out + 2, size - 2 - CRC_SIZE));
+        return size;
+    }
+}
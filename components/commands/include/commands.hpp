@@ -1,3 +1,6 @@
+#pragma once
+
+#include "stddef.h"
 #include "inttypes.h"
 
 namespace commands
@@ -9,10 +12,29 @@ namespace commands
         uint8_t args_len;
         uint8_t *data;
         uint16_t data_len;
+        uint32_t stream_len; // Number of raw bytes following the command ("ESP_DATA_STREAM <len>"), read with "read_data"
+        int32_t id;          // Host supplied request id ("ESP_CMD ASYNC <id> ..."), -1 for synchronous commands
+        void *block;         // Pool block holding a cloned command, NULL for commands straight from the parser
+    };
+
+    // State of the UART link to the host
+    struct LinkStats
+    {
+        uint32_t baud_rate;
+        bool flow_control;    // RTS/CTS enabled
+        uint32_t overruns;    // Times the RX FIFO or ring buffer overflowed (bytes were lost)
+        uint32_t line_errors; // Framing and parity errors
     };
 
     auto init() -> void;
     auto send_resp(const char *response) -> void;
+    auto send_resp(int32_t id, const char *response) -> void;        // Response tagged with a request id ("ESP_RESP <id> ..."), untagged if id is -1
+    auto send_event(const char *event, const char *data = NULL, int len = 0) -> void; // Unsolicited "ESP_EVT <event>" line, with data: "ESP_EVT <event> <len>" + bytes
+    auto send_data(int32_t id, const char *data, int len) -> void;   // Send raw bytes to the host ("ESP_RESP [id] DATA <len>" + bytes), blocks until queued
     auto wait_for_cmd() -> Command;
-    auto read_something(char *buf, uint16_t max_len) -> void;
+    auto read_data(char *buf, int max_len) -> int; // Read raw bytes of a streamed payload (returns 0 on timeout)
+    auto discard_data(uint32_t len) -> void;       // Skip a streamed payload that will not be used, so the next command is read in step
+    auto link_stats() -> LinkStats;
+    auto clone(const Command &c) -> Command;       // Copy a command into a pool block so it outlives the parser buffers (free with "release")
+    auto release(Command &c) -> void;
 }
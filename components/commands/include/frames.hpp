@@ -0,0 +1,89 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+
+// Length-prefixed binary framing used as an alternative to the ESP_CMD text protocol.
+// This module has no ESP-IDF dependencies so the same code can be compiled on the host side.
+//
+// Frame layout (all integers are little endian):
+//
+//   magic[2] | cmd_id u8 | argc u8 | args_size u16 | data_len u16 | args | data | crc16
+//
+// "args" holds "argc" NUL-terminated strings packed back to back ("args_size" bytes in total).
+// "crc16" is CRC-16/CCITT-FALSE computed over everything between the magic and the crc itself.
+namespace frames
+{
+    constexpr uint8_t MAGIC_0 = 0xE5;
+    constexpr uint8_t MAGIC_1 = 0x1A;
+    constexpr size_t HEADER_SIZE = 8;
+    constexpr size_t CRC_SIZE = 2;
+    constexpr size_t OVERHEAD = HEADER_SIZE + CRC_SIZE;
+    constexpr uint8_t MAX_ARGS = 10;
+
+    // Command identifiers carried in the "cmd_id" field, one per command of the text protocol
+    enum CommandId : uint8_t
+    {
+        CMD_TEXT = 0x00,     // Leave framed mode and go back to the text protocol
+        CMD_SERVE = 0x01,    // ESP_CMD SERVE
+        CMD_CONNECT = 0x02,  // ESP_CMD CONNECT
+        CMD_HTTP = 0x03,     // ESP_CMD HTTP
+        CMD_ASYNC = 0x04,    // ESP_CMD ASYNC <id> <command> <args...>
+        CMD_BAUD = 0x05,     // ESP_CMD BAUD <rate> [RTSCTS]
+        CMD_OTA = 0x06,      // ESP_CMD OTA <subcommand> <args...> (the data of "WRITE" is the block)
+        CMD_STATS = 0x07,    // ESP_CMD STATS [RESET]
+        CMD_SOCK = 0x08,     // ESP_CMD SOCK <subcommand> <args...> (the data of "SEND" is the payload)
+        CMD_MQTT = 0x09,     // ESP_CMD MQTT <subcommand> <args...> (the data of "PUB" is the message)
+        CMD_BATCH = 0x0A,    // ESP_CMD BATCH <subcommand> <args...> (the data of "ADD" is the item)
+        CMD_QUEUE = 0x0B,    // ESP_CMD QUEUE <subcommand>
+        CMD_SCAN = 0x0C,     // ESP_CMD SCAN
+        CMD_PROFILE = 0x0D,  // ESP_CMD PROFILE <subcommand> <args...>
+        CMD_TASKS = 0x0E,    // ESP_CMD TASKS
+        CMD_IPCONFIG = 0x0F, // ESP_CMD IPCONFIG <ssid> <args...>
+        CMD_CLOSE = 0x10,    // ESP_CMD CLOSE [host]
+        CMD_RESP = 0x80,     // Response sent by the modem (the payload holds the ESP_RESP text, the request id is the only argument if present)
+        CMD_DATA = 0x81,     // Raw data sent by the modem (e.g. a chunk of an HTTP response body, tagged like CMD_RESP)
+        CMD_EVT = 0x82,      // Unsolicited event sent by the modem (the payload holds the ESP_EVT text, or it is the only argument and the payload holds raw data)
+    };
+
+    enum class Status
+    {
+        NEED_MORE, // Frame is not complete yet
+        FRAME,     // A complete frame is available through "Parser::frame"
+        BAD_CRC,   // Frame was dropped because of a CRC mismatch
+        TOO_LONG,  // Frame was dropped because it does not fit in the parser buffer
+        BAD_ARGS,  // Frame was dropped because its argument table is malformed
+    };
+
+    struct Frame
+    {
+        uint8_t cmd_id;
+        uint8_t argc;
+        char *args[MAX_ARGS];
+        uint8_t *data;
+        uint16_t data_len;
+    };
+
+    // Incremental frame parser.
+    // Bytes are written straight into the parser buffer (see "next_chunk" and "commit"),
+    // so a frame is read from the UART driver exactly once and never copied afterwards.
+    struct Parser
+    {
+        uint8_t *buf;    // Storage for a single frame (header + args + data + crc)
+        size_t capacity; // Size of "buf"
+        size_t filled;   // Number of bytes of the current frame already in "buf"
+        size_t expected; // Number of bytes the current frame will have once complete
+        Frame frame;     // Last parsed frame (valid after "Status::FRAME" until the next call)
+    };
+
+    auto crc16(const uint8_t *bytes, size_t len, uint16_t crc = 0xFFFF) -> uint16_t; // CRC-16/CCITT-FALSE
+    auto init(Parser &p, uint8_t *buf, size_t capacity) -> void;                      // Prepare parser for the first frame
+    auto next_chunk(Parser &p, uint8_t **dst) -> size_t;                               // Where to write and how many bytes are needed next
+    auto commit(Parser &p, size_t len) -> Status;                                      // Process "len" bytes written to the "next_chunk" destination
+    auto feed(Parser &p, const uint8_t *bytes, size_t len, size_t *consumed) -> Status; // Copy bytes from an arbitrary stream (stops after a frame)
+
+    // Encode a frame into "out". Returns the number of bytes written or 0 if it does not fit.
+    auto encode(uint8_t *out, size_t out_capacity, uint8_t cmd_id,
+                const char *const *args, uint8_t argc,
+                const uint8_t *data, uint16_t data_len) -> size_t;
+}
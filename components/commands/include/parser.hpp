@@ -0,0 +1,19 @@
+#pragma once
+
+#include "stddef.h"
+
+#include "commands.hpp"
+
+// Text protocol parsing, kept free of ESP-IDF dependencies so it can also be compiled on a workstation.
+// All functions work in place: the command points into the line and data buffers it was parsed from.
+namespace parser
+{
+    constexpr uint8_t MAX_ARGS = 10;
+
+    auto is_command_line(const char *line) -> bool;                                         // Line starts with "ESP_CMD"
+    auto parse_line(char *line, commands::Command &c) -> bool;                              // Split "ESP_CMD <cmd> <args...>", false if there is no command
+    auto take_data_marker(commands::Command &c) -> bool;                                    // Remove a trailing "ESP_DATA_BEGIN", true if it was there
+    auto append_data_line(commands::Command &c, size_t capacity, const char *line) -> bool; // Join data lines with "\n", false if "capacity" is exceeded
+    auto parse_async_prefix(commands::Command &c) -> bool;                                  // Unwrap "ASYNC <id> <command> <args...>", false if malformed
+    auto parse_stream_suffix(commands::Command &c) -> void;                                 // Take "ESP_DATA_STREAM <len>" off the arguments
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "stddef.h"
+#include "string.h"
+
+#include "commands.hpp"
+
+// Compile-time command registry.
+// The table of commands is turned into a perfect hash while compiling, so looking a command up
+// costs one hash of its name and a single string comparison no matter how many commands exist.
+namespace registry
+{
+    typedef void (*Handler)(commands::Command c);
+
+    struct Entry
+    {
+        const char *name;
+        uint8_t min_args;   // Arguments are validated before the handler is called
+        uint8_t max_args;   //
+        bool takes_data;    // Command accepts a payload (ESP_DATA_BEGIN / ESP_DATA_STREAM / frame data)
+        bool can_run_async; // Command may run on the worker pool when it comes with a request id
+        Handler handler;
+    };
+
+    // FNV-1a with a seed mixed into the offset basis
+    constexpr auto hash(const char *s, uint32_t seed) -> uint32_t
+    {
+        uint32_t h = 2166136261u ^ seed;
+        while (*s != '\0')
+        {
+            h ^= (uint8_t)*s++;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    constexpr auto next_power_of_two(size_t n) -> size_t
+    {
+        size_t p = 1;
+        while (p < n)
+            p *= 2;
+        return p;
+    }
+
+    template <size_t N>
+    class Registry
+    {
+        static_assert(N < 255, "Slots store entry indices in a byte");
+
+    public:
+        static constexpr size_t TABLE_SIZE = next_power_of_two(N * 4); // Sparse table keeps the seed search short
+        static constexpr uint32_t MAX_SEED = 100000;
+
+        constexpr Registry(const Entry (&table)[N])
+        {
+            for (size_t i = 0; i < N; i++)
+                entries[i] = table[i];
+            for (seed = 0; seed < MAX_SEED; seed++)
+                if (try_seed())
+                    return;
+        }
+
+        // False if no collision-free seed was found (or two commands share a name)
+        constexpr auto valid() const -> bool
+        {
+            return seed < MAX_SEED;
+        }
+
+        auto find(const char *name) const -> const Entry *
+        {
+            const auto slot = slots[hash(name, seed) & (TABLE_SIZE - 1)];
+            if (slot == 0 || strcmp(entries[slot - 1].name, name) != 0)
+                return NULL;
+            return &entries[slot - 1];
+        }
+
+    private:
+        Entry entries[N] = {};
+        uint8_t slots[TABLE_SIZE] = {}; // Index of the entry + 1, 0 marks an empty slot
+        uint32_t seed = 0;
+
+        constexpr auto try_seed() -> bool
+        {
+            for (size_t i = 0; i < TABLE_SIZE; i++)
+                slots[i] = 0;
+            for (size_t i = 0; i < N; i++)
+            {
+                const auto slot = hash(entries[i].name, seed) & (TABLE_SIZE - 1);
+                if (slots[slot] != 0)
+                    return false;
+                slots[slot] = i + 1;
+            }
+            return true;
+        }
+    };
+
+    template <size_t N>
+    constexpr auto make_registry(const Entry (&table)[N]) -> Registry<N>
+    {
+        return Registry<N>(table);
+    }
+}
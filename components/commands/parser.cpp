@@ -0,0 +1,74 @@
+#include "parser.hpp"
+
+#include "string.h"
+#include "stdlib.h"
+
+namespace parser
+{
+    auto is_command_line(const char *line) -> bool
+    {
+        return strncmp(line, "ESP_CMD", strlen("ESP_CMD")) == 0;
+    }
+
+    auto parse_line(char *line, commands::Command &c) -> bool
+    {
+        char *buf = line;          // Pointer to the currently parsed token
+        strsep(&buf, " ");         // Consume "ESP_CMD" prefix
+        c.cmd = strsep(&buf, " "); // Get the command
+
+        // Parse arguments
+        while (buf != NULL && c.args_len < MAX_ARGS)
+        {
+            c.args[c.args_len] = strsep(&buf, " ");
+            c.args_len += 1;
+        }
+        return c.cmd != NULL && c.cmd[0] != '\0';
+    }
+
+    auto take_data_marker(commands::Command &c) -> bool
+    {
+        if (c.args_len == 0 || strcmp(c.args[c.args_len - 1], "ESP_DATA_BEGIN") != 0)
+            return false;
+        c.args_len -= 1;
+        return true;
+    }
+
+    auto append_data_line(commands::Command &c, size_t capacity, const char *line) -> bool
+    {
+        const auto len = strlen(line);
+        const auto separator = c.data_len > 0 ? 1 : 0;
+        if (c.data_len + separator + len + 1 > capacity)
+            return false;
+        if (separator)
+            c.data[c.data_len++] = '\n';
+        memcpy(c.data + c.data_len, line, len);
+        c.data_len += len;
+        c.data[c.data_len] = '\0';
+        return true;
+    }
+
+    auto parse_async_prefix(commands::Command &c) -> bool
+    {
+        if (strcmp(c.cmd, "ASYNC") != 0)
+            return true;
+        if (c.args_len < 2)
+            return false;
+        char *end;
+        const auto id = strtol(c.args[0], &end, 10);
+        if (*end != '\0' || id < 0 || id > INT32_MAX)
+            return false;
+        c.id = id;
+        c.cmd = c.args[1];
+        c.args += 2;
+        c.args_len -= 2;
+        return true;
+    }
+
+    auto parse_stream_suffix(commands::Command &c) -> void
+    {
+        if (c.args_len < 2 || strcmp(c.args[c.args_len - 2], "ESP_DATA_STREAM") != 0)
+            return;
+        c.stream_len = strtoul(c.args[c.args_len - 1], NULL, 10);
+        c.args_len -= 2;
+    }
+}
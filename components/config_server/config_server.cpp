@@ -1,10 +1,17 @@
 #include "config_server.hpp"
 
+#include "inttypes.h"
+#include "string.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
 
 #include "config_page.hpp"
+#include "form.hpp"
+#include "scan_cache.hpp"
 
 namespace
 {
@@ -13,21 +20,204 @@ namespace
     // Tag used during logging
     static const char *TAG = "CONFIG_SERVER";
 
-    // This array holds all access points foudn during scanning
-    wifi_ap_record_t *access_points;
-    uint8_t access_points_len;
+    constexpr auto TEST_TIMEOUT_MS = 20000;   // Longest a test connect may take (association + DHCP)
+    constexpr auto HANDOVER_DELAY_MS = 5000;  // Leaves the page time to show the result before the access point goes away
+    constexpr auto CONNECT_RETRIES = 10;      // "esp_wifi_connect" fails while a background scan runs, retry for a while
+    constexpr auto CONNECT_RETRY_MS = 500;    //
+    constexpr auto TASK_STACK_SIZE = 4096;    // Handlers write to the host and to NVS on this stack
+    constexpr auto TASK_PRIORITY = 5;         //
+    constexpr auto RECV_CHUNK_SIZE = 64;      // Form bodies are parsed as they arrive, in pieces this big
+    constexpr auto MAX_RECV_TIMEOUTS = 3;     //
+    constexpr EventBits_t GOT_IP_BIT = BIT0;
+    constexpr EventBits_t DISCONNECTED_BIT = BIT1;
+
+    // Credentials waiting for (or going through) a test connect
+    struct Submission
+    {
+        char ssid[33];
+        char password[65];
+        bool valid; // Form parsed and values have acceptable lengths
+    };
+
+    Handlers handlers;
+    httpd_handle_t server = NULL;
+    TaskHandle_t provisioning_task = NULL;
+    EventGroupHandle_t test_bits;
+    esp_event_handler_instance_t wifi_handler;
+    esp_event_handler_instance_t ip_handler;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED; // Guards "result" and "submission" handover
+    Submission submission;
+    Result result = Result::IDLE;
+    volatile uint8_t disconnect_reason = 0;
+
+    // Networks listed by GET "/networks" (too big for the httpd task stack)
+    scan_cache::Network networks[scan_cache::MAX_NETWORKS];
 
     /* -------------------------------------------------------------------------- */
     /* --------------------------------- Helpers -------------------------------- */
     /* -------------------------------------------------------------------------- */
 
-    // Parse body of the form send request (Warning: this will modify the "body" array)
-    void parse_connection_form(char *body, char *ssid, char *pass)
+    // Sends a JSON string with quotes, backslashes and control characters escaped
+    void send_json_string(httpd_req_t *req, const char *text)
+    {
+        char escaped[6 * 32 + 3]; // Long enough for an SSID made only of control characters
+        size_t len = 0;
+        escaped[len++] = '"';
+        for (; *text != '\0' && len < sizeof(escaped) - 8; text++)
+        {
+            if (*text == '"' || *text == '\\')
+            {
+                escaped[len++] = '\\';
+                escaped[len++] = *text;
+            }
+            else if ((uint8_t)*text < 0x20)
+                len += sprintf(escaped + len, "\\u%04x", *text);
+            else
+                escaped[len++] = *text;
+        }
+        escaped[len++] = '"';
+        escaped[len] = '\0';
+        httpd_resp_sendstr_chunk(req, escaped);
+    }
+
+    auto current_result() -> Result
     {
-        strtok(body, "&");
-        sscanf(body, "ssid=%s", ssid);
-        body += strlen(body) + 1;
-        sscanf(body, "password=%s", pass);
+        portENTER_CRITICAL(&lock);
+        const auto r = result;
+        portEXIT_CRITICAL(&lock);
+        return r;
+    }
+
+    auto report(Result r) -> void
+    {
+        portENTER_CRITICAL(&lock);
+        result = r;
+        portEXIT_CRITICAL(&lock);
+        ESP_LOGI(TAG, "%s %s", result_name(r), submission.ssid);
+        if (handlers.on_result != NULL)
+            handlers.on_result(r, submission.ssid);
+    }
+
+    // Read the form as it comes off the socket, the body can be of any length.
+    // Returns false if the connection broke (there is nobody to answer then).
+    auto receive_form(httpd_req_t *req, Submission &s) -> bool
+    {
+        form::Field fields[] = {
+            {"ssid", s.ssid, sizeof(s.ssid), 0, false},
+            {"password", s.password, sizeof(s.password), 0, false},
+        };
+        form::Parser parser;
+        form::init(parser, fields, sizeof(fields) / sizeof(fields[0]));
+
+        char chunk[RECV_CHUNK_SIZE];
+        auto remaining = req->content_len;
+        auto timeouts = 0;
+        while (remaining > 0)
+        {
+            const auto received = httpd_req_recv(req, chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+            if (received == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < MAX_RECV_TIMEOUTS)
+                continue;
+            if (received <= 0)
+                return false;
+            form::feed(parser, chunk, received);
+            remaining -= received;
+        }
+
+        // WPA passphrases are 8 to 63 characters (64 hex digits for a raw key), open networks have none
+        const auto pass_len = fields[1].len;
+        s.valid = form::finish(parser) && fields[0].len > 0 && (pass_len == 0 || pass_len >= 8);
+        return true;
+    }
+
+    // Runs on the default event loop task, only records what happened to the test connect
+    auto event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) -> void
+    {
+        if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+            xEventGroupSetBits(test_bits, GOT_IP_BIT);
+        else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+        {
+            // Leaving on purpose (the previous test) says nothing about the credentials under test
+            const auto reason = ((wifi_event_sta_disconnected_t *)event_data)->reason;
+            if (reason == WIFI_REASON_ASSOC_LEAVE)
+                return;
+            disconnect_reason = reason;
+            xEventGroupSetBits(test_bits, DISCONNECTED_BIT);
+        }
+    }
+
+    // Try the submitted credentials on the station interface, the access point stays up meanwhile
+    auto test_connect(const Submission &s) -> Result
+    {
+        esp_wifi_disconnect(); // Drop whatever the previous test left behind
+        xEventGroupClearBits(test_bits, GOT_IP_BIT | DISCONNECTED_BIT);
+
+        wifi_config_t config = {};
+        memcpy(config.sta.ssid, s.ssid, strlen(s.ssid)); // Fields are not NUL-terminated when full
+        memcpy(config.sta.password, s.password, strlen(s.password));
+        config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+        if (esp_wifi_set_config(WIFI_IF_STA, &config) != ESP_OK)
+            return Result::FAILED;
+
+        auto err = esp_wifi_connect();
+        for (auto i = 0; err != ESP_OK && i < CONNECT_RETRIES; i++)
+        {
+            vTaskDelay(pdMS_TO_TICKS(CONNECT_RETRY_MS));
+            err = esp_wifi_connect();
+        }
+        if (err != ESP_OK)
+            return Result::FAILED;
+
+        const auto bits = xEventGroupWaitBits(test_bits, GOT_IP_BIT | DISCONNECTED_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(TEST_TIMEOUT_MS));
+        if (bits & GOT_IP_BIT)
+            return Result::CONNECTED;
+
+        esp_wifi_disconnect(); // Stop an attempt that timed out
+        if ((bits & DISCONNECTED_BIT) == 0)
+            return Result::FAILED;
+        switch (disconnect_reason)
+        {
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_MIC_FAILURE:
+            return Result::WRONG_PASSWORD;
+        case WIFI_REASON_NO_AP_FOUND:
+            return Result::NOT_FOUND;
+        default:
+            return Result::FAILED;
+        }
+    }
+
+    // Tests every submission, and once one works stops the portal and hands the credentials over
+    auto provision(void *arg) -> void
+    {
+        while (true)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            if (!submission.valid)
+            {
+                report(Result::FAILED);
+                continue;
+            }
+            report(Result::TESTING);
+            const auto r = test_connect(submission);
+            report(r);
+            if (r == Result::CONNECTED)
+                break;
+        }
+
+        wifi_ap_record_t ap = {};
+        esp_wifi_sta_get_ap_info(&ap);
+        vTaskDelay(pdMS_TO_TICKS(HANDOVER_DELAY_MS));
+
+        httpd_stop(server);
+        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_handler);
+        esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_handler);
+        vEventGroupDelete(test_bits);
+        server = NULL;
+        provisioning_task = NULL;
+        handlers.on_verified(submission.ssid, submission.password, ap.bssid, ap.primary);
+        vTaskDelete(NULL);
     }
 
     /* -------------------------------------------------------------------------- */
@@ -37,32 +227,79 @@ namespace
     // GET "/" - Returns configuration form
     esp_err_t root_get_handler(httpd_req_t *req)
     {
-        config_page::send_config_page(req, access_points, access_points_len);
+        config_page::send_config_page(req);
         return ESP_OK;
     }
 
-    // POST "/connect" - Calls the callback with WiFi credentials
-    esp_err_t connect_post_handler(httpd_req_t *req)
+    // GET "/networks" - Returns the cached scan results as JSON, strongest first (the page polls it)
+    esp_err_t networks_get_handler(httpd_req_t *req)
     {
-        // Receive the request body
-        const uint8_t max_response_size = 100;
-        char response[max_response_size];
-        httpd_req_recv(req, response, max_response_size);
+        const auto count = scan_cache::snapshot(networks, scan_cache::MAX_NETWORKS);
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+        httpd_resp_sendstr_chunk(req, "[");
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const auto &n = networks[i];
+            char fields[96];
+            httpd_resp_sendstr_chunk(req, i == 0 ? "{\"ssid\":" : ",{\"ssid\":");
+            send_json_string(req, n.ssid);
+            snprintf(fields, sizeof(fields), ",\"rssi\":%d,\"ch\":%u,\"auth\":%d,\"hidden\":%s,\"age\":%" PRIu32 "}",
+                     n.rssi, n.channel, n.authmode, n.ssid[0] == '\0' ? "true" : "false", n.age_s);
+            httpd_resp_sendstr_chunk(req, fields);
+        }
+        httpd_resp_sendstr_chunk(req, "]");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_OK;
+    }
 
-        // Send response
-        config_page::send_connecting_page(req);
+    // GET "/status" - Returns the state of the last test connect as JSON (the connecting page polls it)
+    esp_err_t status_get_handler(httpd_req_t *req)
+    {
+        const auto r = current_result();
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+        httpd_resp_sendstr_chunk(req, "{\"state\":\"");
+        httpd_resp_sendstr_chunk(req, result_name(r));
+        httpd_resp_sendstr_chunk(req, "\",\"ssid\":");
+        send_json_string(req, r == Result::IDLE ? "" : submission.ssid);
+        httpd_resp_sendstr_chunk(req, "}");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_OK;
+    }
 
-        // Parse the request body
-        char ssid[50];
-        char pass[50];
-        parse_connection_form(response, ssid, pass);
+    // POST "/connect" - Starts a test connect with the submitted credentials
+    esp_err_t connect_post_handler(httpd_req_t *req)
+    {
+        static Submission received; // Parsed apart from "submission", which may be under test
+        if (!receive_form(req, received))
+            return ESP_FAIL;
 
-        // Call the callback
-        CallbackFunction cb = (CallbackFunction)req->user_ctx;
-        cb(ssid, pass);
+        // A submission made while another one is being tested is dropped, the page shows the running test
+        portENTER_CRITICAL(&lock);
+        const auto accepted = result != Result::TESTING && result != Result::CONNECTED;
+        if (accepted)
+        {
+            submission = received;
+            result = Result::TESTING;
+        }
+        portEXIT_CRITICAL(&lock);
+        if (accepted)
+            xTaskNotifyGive(provisioning_task);
 
+        config_page::send_connecting_page(req);
         return ESP_OK;
     }
+
+    // Registers a handler for a route
+    auto register_route(const char *uri, httpd_method_t method, esp_err_t (*handler)(httpd_req_t *)) -> void
+    {
+        httpd_uri_t route = {};
+        route.uri = uri;
+        route.method = method;
+        route.handler = handler;
+        httpd_register_uri_handler(server, &route);
+    }
 }
 
 namespace config_server
@@ -71,34 +308,61 @@ namespace config_server
     /* ----------------------------------- Run ---------------------------------- */
     /* -------------------------------------------------------------------------- */
 
-    auto run(CallbackFunction cb, wifi_ap_record_t *ap_list, uint16_t ap_count) -> void
+    auto run(const Handlers &h) -> esp_err_t
     {
-        // Get a list of available access points
-        access_points = ap_list;
-        access_points_len = ap_count;
+        if (server != NULL)
+            return ESP_ERR_INVALID_STATE;
 
         // Initialize the variables
-        httpd_handle_t server = NULL;
+        handlers = h;
+        result = Result::IDLE;
         httpd_config_t config = HTTPD_DEFAULT_CONFIG();
         config.lru_purge_enable = true;
 
         // Start the httpd server
         ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
-        ESP_ERROR_CHECK(httpd_start(&server, &config));
-
-        // Register GET "/"
-        httpd_uri_t root_handler_config;
-        root_handler_config.uri = "/",
-        root_handler_config.method = HTTP_GET,
-        root_handler_config.handler = root_get_handler,
-        httpd_register_uri_handler(server, &root_handler_config);
-
-        // Register POST "/connect"
-        httpd_uri_t connect_handler_config;
-        connect_handler_config.uri = "/connect";
-        connect_handler_config.method = HTTP_POST;
-        connect_handler_config.handler = connect_post_handler;
-        connect_handler_config.user_ctx = (void *)cb;
-        httpd_register_uri_handler(server, &connect_handler_config);
+        auto err = httpd_start(&server, &config);
+        if (err != ESP_OK)
+        {
+            server = NULL;
+            return err;
+        }
+
+        register_route("/", HTTP_GET, root_get_handler);
+        register_route("/networks", HTTP_GET, networks_get_handler);
+        register_route("/status", HTTP_GET, status_get_handler);
+        register_route("/connect", HTTP_POST, connect_post_handler);
+
+        // Test connects report through the event loop
+        test_bits = xEventGroupCreate();
+        esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, &wifi_handler);
+        esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &ip_handler);
+        xTaskCreatePinnedToCore(provision, "provisioning", TASK_STACK_SIZE, NULL, TASK_PRIORITY, &provisioning_task, CONFIG_MODEM_NETWORK_CORE);
+        return ESP_OK;
     }
-}
\ No newline at end of file
+
+    auto running() -> bool
+    {
+        return server != NULL;
+    }
+
+    auto result_name(Result result) -> const char *
+    {
+        switch (result)
+        {
+        case Result::IDLE:
+            return "IDLE";
+        case Result::TESTING:
+            return "TESTING";
+        case Result::CONNECTED:
+            return "CONNECTED";
+        case Result::WRONG_PASSWORD:
+            return "WRONG_PASSWORD";
+        case Result::NOT_FOUND:
+            return "NOT_FOUND";
+        case Result::FAILED:
+            return "FAILED";
+        }
+        return "";
+    }
+}
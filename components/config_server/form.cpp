@@ -0,0 +1,139 @@
+#include "form.hpp"
+
+#include "string.h"
+
+namespace
+{
+    using namespace form;
+
+    auto hex_value(char c) -> int
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // Store a decoded character of the current key or value
+    auto put(Parser &p, char c) -> void
+    {
+        if (!p.in_value)
+        {
+            if (p.key_len < MAX_KEY_LEN)
+                p.key[p.key_len] = c;
+            p.key_len += 1;
+            return;
+        }
+        if (p.field == NULL)
+            return;
+        if (p.field->len + 1 < p.field->capacity)
+            p.field->value[p.field->len] = c;
+        p.field->len += 1;
+    }
+
+    // A key ended with '=', pick the field its value goes to
+    auto start_value(Parser &p) -> void
+    {
+        p.in_value = true;
+        p.field = NULL;
+        if (p.key_len > MAX_KEY_LEN)
+            return;
+        p.key[p.key_len] = '\0';
+        for (uint8_t i = 0; i < p.field_count; i++)
+            if (strcmp(p.fields[i].name, p.key) == 0)
+            {
+                p.field = &p.fields[i];
+                p.field->len = 0; // The last occurrence of a field wins
+                p.field->found = true;
+            }
+    }
+
+    auto end_pair(Parser &p) -> void
+    {
+        if (p.field != NULL)
+        {
+            const auto end = p.field->len < p.field->capacity ? p.field->len : p.field->capacity - 1;
+            p.field->value[end] = '\0';
+        }
+        p.field = NULL;
+        p.in_value = false;
+        p.key_len = 0;
+    }
+
+    // A "%" that is not followed by two hex digits is kept as it is
+    auto flush_escape(Parser &p) -> void
+    {
+        if (p.escape == 0)
+            return;
+        put(p, '%');
+        if (p.escape == 2)
+            put(p, p.digit);
+        p.escape = 0;
+    }
+}
+
+namespace form
+{
+    auto init(Parser &p, Field *fields, uint8_t field_count) -> void
+    {
+        memset(&p, 0, sizeof(p));
+        p.fields = fields;
+        p.field_count = field_count;
+        for (uint8_t i = 0; i < field_count; i++)
+        {
+            fields[i].len = 0;
+            fields[i].found = false;
+            fields[i].value[0] = '\0';
+        }
+    }
+
+    auto feed(Parser &p, const char *bytes, size_t len) -> void
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            const auto c = bytes[i];
+            if (p.escape > 0)
+            {
+                const auto digit = hex_value(c);
+                if (digit >= 0)
+                {
+                    p.digit = c;
+                    p.escaped = p.escaped * 16 + digit;
+                    p.escape += 1;
+                    if (p.escape == 3)
+                    {
+                        put(p, (char)p.escaped);
+                        p.escape = 0;
+                    }
+                    continue;
+                }
+                flush_escape(p);
+            }
+
+            if (c == '&')
+                end_pair(p);
+            else if (c == '=' && !p.in_value)
+                start_value(p);
+            else if (c == '%')
+            {
+                p.escape = 1;
+                p.escaped = 0;
+            }
+            else
+                put(p, c == '+' ? ' ' : c);
+        }
+    }
+
+    auto finish(Parser &p) -> bool
+    {
+        flush_escape(p);
+        end_pair(p);
+        for (uint8_t i = 0; i < p.field_count; i++)
+            if (p.fields[i].len >= p.fields[i].capacity)
+                return false;
+        return true;
+    }
+}
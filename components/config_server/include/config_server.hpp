@@ -1,7 +1,30 @@
+#include "esp_err.h"
 #include "esp_wifi.h"
 
+// Provisioning portal.
+// Credentials submitted on the page are tried with a test connect while the access point stays up,
+// so a mistyped password is reported on the page (and to the host) and can be corrected right away.
+// Only credentials that got an address are handed over. Everything runs on the httpd and provisioning
+// tasks, the command loop is never blocked.
 namespace config_server
 {
-    typedef void (*CallbackFunction)(const char *ssid, const char *password);            // Callback called when user enters wifi credentials
-    auto run(CallbackFunction cb, wifi_ap_record_t *ap_list, uint16_t ap_count) -> void; // Does the WiFi setup, and starts the server
+    enum class Result : uint8_t
+    {
+        IDLE,           // Nothing submitted yet
+        TESTING,        // Test connect in progress
+        CONNECTED,      // Credentials work, handed over shortly
+        WRONG_PASSWORD, // Access point rejected the password
+        NOT_FOUND,      // No access point with this SSID answered
+        FAILED,         // Any other failure (timeout, bad form, ...)
+    };
+
+    struct Handlers
+    {
+        void (*on_result)(Result result, const char *ssid);                                                // Progress of a test connect (provisioning task)
+        void (*on_verified)(const char *ssid, const char *password, const uint8_t *bssid, uint8_t channel); // Working credentials, the portal is already stopped (provisioning task)
+    };
+
+    auto run(const Handlers &handlers) -> esp_err_t; // Starts the server on the access point set up by the caller
+    auto running() -> bool;
+    auto result_name(Result result) -> const char *;
 }
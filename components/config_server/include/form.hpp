@@ -0,0 +1,39 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+
+// Incremental parser for "application/x-www-form-urlencoded" bodies.
+// The body can be fed in pieces of any size as it comes off the socket, so it never has to fit in memory.
+// Only the fields the caller asks for are kept (decoded), everything else is skipped.
+// This module has no ESP-IDF dependencies so the same code can be compiled on the host side.
+namespace form
+{
+    constexpr size_t MAX_KEY_LEN = 15; // Longer keys cannot match a field and are skipped
+
+    struct Field
+    {
+        const char *name;
+        char *value;     // Decoded value, always NUL-terminated
+        size_t capacity; // Size of "value" (including the terminator)
+        size_t len;      // Decoded length (keeps counting past the capacity)
+        bool found;      // Field was present in the body
+    };
+
+    struct Parser
+    {
+        Field *fields;
+        uint8_t field_count;
+        char key[MAX_KEY_LEN + 1];
+        size_t key_len;
+        Field *field;    // Field receiving the current value, NULL while in a key or in a skipped value
+        bool in_value;   //
+        uint8_t escape;  // Hex digits of a "%XX" sequence seen so far
+        uint8_t escaped; // Value of those digits
+        char digit;      // First of them as it was sent, kept if the second one is missing
+    };
+
+    auto init(Parser &p, Field *fields, uint8_t field_count) -> void;
+    auto feed(Parser &p, const char *bytes, size_t len) -> void;
+    auto finish(Parser &p) -> bool; // False if a value did not fit its field
+}
@@ -0,0 +1,32 @@
+#!/usr/bin/env python
+# Builds a page for the configuration server: stylesheets referenced with <link rel="stylesheet">
+# are inlined (so the page is a single response) and the result is gzip-compressed.
+# The gzip header carries no name or timestamp, so the output only changes when the page does.
+import argparse
+import gzip
+import io
+import os
+import re
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--input', required=True)
+parser.add_argument('--output', required=True)
+args = parser.parse_args()
+
+directory = os.path.dirname(os.path.abspath(args.input))
+with open(args.input) as f:
+    page = f.read()
+
+
+def inline_stylesheet(match):
+    with open(os.path.join(directory, match.group(1))) as f:
+        return '<style>' + f.read().strip() + '</style>'
+
+
+page = re.sub(r'<link rel="stylesheet" href="([^"]+)">', inline_stylesheet, page)
+
+buffer = io.BytesIO()
+with gzip.GzipFile(filename='', mode='wb', fileobj=buffer, compresslevel=9, mtime=0) as f:
+    f.write(page.encode('utf-8'))
+with open(args.output, 'wb') as f:
+    f.write(buffer.getvalue())
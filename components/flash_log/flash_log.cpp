@@ -0,0 +1,308 @@
+#include "flash_log.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+
+#include "log_format.hpp"
+
+namespace
+{
+    using namespace flash_log;
+    using namespace log_format;
+
+    constexpr auto TAG = "FLASH_LOG";
+    static_assert(SECTOR_SIZE == SPI_FLASH_SEC_SIZE, "Log sectors match flash erase sectors");
+
+    auto sector_of(uint32_t offset) -> uint32_t
+    {
+        return offset / SECTOR_SIZE;
+    }
+
+    // Sector a head or tail offset belongs to (an offset right at the end of a sector still belongs to it)
+    auto sector_before(uint32_t offset) -> uint32_t
+    {
+        return sector_of(offset - 1);
+    }
+
+    auto read_sector_header(const Log &log, uint32_t sector, SectorHeader *header) -> bool
+    {
+        return esp_partition_read(log.partition, sector * SECTOR_SIZE, header, sizeof(*header)) == ESP_OK &&
+               header->magic == SECTOR_MAGIC;
+    }
+
+    // Read a record header. Returns false where the records of the sector end.
+    auto read_record(const Log &log, uint32_t offset, RecordHeader *header) -> bool
+    {
+        const auto in_sector = offset % SECTOR_SIZE;
+        if (in_sector < FIRST_RECORD || in_sector + sizeof(RecordHeader) > SECTOR_SIZE)
+            return false;
+        return esp_partition_read(log.partition, offset, header, sizeof(*header)) == ESP_OK && header_fits(*header, in_sector);
+    }
+
+    // Check the payload CRC without a buffer for the whole record
+    auto payload_valid(const Log &log, uint32_t offset, const RecordHeader &header) -> bool
+    {
+        uint8_t chunk[64];
+        uint16_t crc = 0xFFFF;
+        for (uint16_t done = 0; done < header.len;)
+        {
+            const uint16_t n = (uint16_t)(header.len - done) < sizeof(chunk) ? header.len - done : sizeof(chunk);
+            if (esp_partition_read(log.partition, offset + sizeof(RecordHeader) + done, chunk, n) != ESP_OK)
+                return false;
+            crc = crc16(chunk, n, crc);
+            done += n;
+        }
+        return crc == header.crc;
+    }
+
+    auto is_erased(const Log &log, uint32_t offset, uint32_t len) -> bool
+    {
+        uint32_t words[16];
+        while (len > 0)
+        {
+            const auto chunk = len < sizeof(words) ? len : sizeof(words);
+            esp_partition_read(log.partition, offset, words, chunk);
+            for (uint32_t i = 0; i < chunk / 4; i++)
+                if (words[i] != 0xFFFFFFFF)
+                    return false;
+            offset += chunk;
+            len -= chunk;
+        }
+        return true;
+    }
+
+    // Write a header with its magic last, so a header torn by a power cut is never taken for a valid one
+    template <typename Header>
+    auto write_header(const Log &log, uint32_t offset, const Header &header) -> esp_err_t
+    {
+        constexpr auto magic_size = sizeof(header.magic);
+        const auto bytes = (const uint8_t *)&header;
+        const auto err = esp_partition_write(log.partition, offset + magic_size, bytes + magic_size, sizeof(header) - magic_size);
+        if (err != ESP_OK)
+            return err;
+        return esp_partition_write(log.partition, offset, bytes, magic_size);
+    }
+
+    // Erase a sector and stamp it with the next sequence number
+    auto start_sector(Log &log, uint32_t sector, uint32_t seq) -> esp_err_t
+    {
+        auto err = esp_partition_erase_range(log.partition, sector * SECTOR_SIZE, SECTOR_SIZE);
+        if (err != ESP_OK)
+            return err;
+        err = write_header(log, sector * SECTOR_SIZE, SectorHeader{SECTOR_MAGIC, seq});
+        if (err != ESP_OK)
+            return err;
+        log.head = sector * SECTOR_SIZE + FIRST_RECORD;
+        log.head_seq = seq;
+        return ESP_OK;
+    }
+
+    // Number of live records in a sector (only the ones that are still valid are counted)
+    auto count_live(const Log &log, uint32_t sector, uint32_t from) -> uint32_t
+    {
+        uint32_t live = 0;
+        RecordHeader header;
+        for (auto offset = from; read_record(log, offset, &header); offset += record_size(header.len))
+            if (header.state == RECORD_LIVE && payload_valid(log, offset, header))
+                live += 1;
+        return live;
+    }
+
+    // Id of the record at the tail
+    auto set_id(const Log &log, uint32_t *id) -> void
+    {
+        SectorHeader sector;
+        if (id != NULL && read_sector_header(log, sector_of(log.tail), &sector))
+            *id = record_id(sector.seq, log.tail % SECTOR_SIZE);
+    }
+
+    // Move the tail to the next live record and read its header, false if there is none.
+    // Popped records are skipped by their size alone, their payload is never read.
+    auto find_tail(Log &log, RecordHeader *header) -> bool
+    {
+        while (log.records > 0 && log.tail != log.head)
+        {
+            if (!read_record(log, log.tail, header))
+                log.tail = ((sector_before(log.tail) + 1) % log.sector_count) * SECTOR_SIZE + FIRST_RECORD; // End of the sector
+            else if (header->state != RECORD_LIVE)
+                log.tail += record_size(header->len);
+            else
+                return true;
+        }
+        return false;
+    }
+
+    // Move the head to the next sector, dropping it first if it still holds the tail
+    auto advance_sector(Log &log) -> esp_err_t
+    {
+        const auto next = (sector_before(log.head) + 1) % log.sector_count;
+        if (log.records > 0 && sector_before(log.tail) == next)
+        {
+            const auto dropped = count_live(log, next, log.tail);
+            ESP_LOGW(TAG, "Log full, dropping %" PRIu32 " records", dropped);
+            log.records -= dropped;
+            log.dropped += dropped;
+            log.tail = ((next + 1) % log.sector_count) * SECTOR_SIZE + FIRST_RECORD;
+        }
+        const auto err = start_sector(log, next, log.head_seq + 1);
+        if (log.records == 0)
+            log.tail = log.head;
+        return err;
+    }
+}
+
+namespace flash_log
+{
+    auto open(Log &log, const char *label) -> esp_err_t
+    {
+        log = Log{};
+        log.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)PARTITION_SUBTYPE, label);
+        if (log.partition == NULL)
+            return ESP_ERR_NOT_FOUND;
+        log.sector_count = log.partition->size / SECTOR_SIZE;
+        if (log.sector_count < 2)
+            return ESP_ERR_INVALID_SIZE;
+
+        // The newest sector holds the head, the oldest one the tail
+        auto newest = log.sector_count;
+        auto oldest = log.sector_count;
+        uint32_t newest_seq = 0;
+        uint32_t oldest_seq = UINT32_MAX;
+        for (uint32_t sector = 0; sector < log.sector_count; sector++)
+        {
+            SectorHeader header;
+            if (!read_sector_header(log, sector, &header))
+                continue;
+            if (newest == log.sector_count || header.seq > newest_seq)
+            {
+                newest = sector;
+                newest_seq = header.seq;
+            }
+            if (header.seq < oldest_seq)
+            {
+                oldest = sector;
+                oldest_seq = header.seq;
+            }
+        }
+        if (newest == log.sector_count)
+        {
+            ESP_LOGI(TAG, "Formatting %s", label);
+            const auto err = start_sector(log, 0, 1);
+            log.tail = log.head;
+            return err;
+        }
+
+        // Find the end of the newest sector. Anything but erased flash after the last record
+        // is a write torn by a power cut, new records then go into a fresh sector.
+        log.head_seq = newest_seq;
+        log.head = newest * SECTOR_SIZE + FIRST_RECORD;
+        RecordHeader header;
+        while (read_record(log, log.head, &header))
+            log.head += record_size(header.len);
+        const auto sector_end = (newest + 1) * SECTOR_SIZE;
+        const auto torn = !is_erased(log, log.head, sector_end - log.head);
+
+        // Count the records still waiting, from the oldest sector up to the head
+        log.tail = log.head;
+        for (auto sector = oldest;; sector = (sector + 1) % log.sector_count)
+        {
+            const auto live = count_live(log, sector, sector * SECTOR_SIZE + FIRST_RECORD);
+            if (live > 0 && log.records == 0)
+                log.tail = sector * SECTOR_SIZE + FIRST_RECORD;
+            log.records += live;
+            if (sector == newest)
+                break;
+        }
+        ESP_LOGI(TAG, "Opened %s, %" PRIu32 " records waiting", label, log.records);
+        return torn ? advance_sector(log) : ESP_OK;
+    }
+
+    auto append(Log &log, const uint8_t *data, uint16_t len, uint32_t *id) -> esp_err_t
+    {
+        if (len > max_record_size())
+            return ESP_ERR_INVALID_SIZE;
+        const auto size = record_size(len);
+        if (log.head % SECTOR_SIZE == 0 || log.head % SECTOR_SIZE + size > SECTOR_SIZE)
+        {
+            const auto err = advance_sector(log);
+            if (err != ESP_OK)
+                return err;
+        }
+
+        // Payload first, the header makes the record visible
+        auto err = esp_partition_write(log.partition, log.head + sizeof(RecordHeader), data, len);
+        const auto header = RecordHeader{RECORD_MAGIC, len, crc16(data, len), RECORD_LIVE, 0xFF};
+        if (err == ESP_OK)
+            err = write_header(log, log.head, header);
+        if (err != ESP_OK)
+            return err;
+        if (id != NULL)
+            *id = record_id(log.head_seq, log.head % SECTOR_SIZE);
+        if (log.records == 0)
+            log.tail = log.head;
+        log.head += size;
+        log.records += 1;
+        return ESP_OK;
+    }
+
+    auto peek(Log &log, uint8_t *buf, uint16_t capacity, uint16_t *len, uint32_t *id) -> esp_err_t
+    {
+        RecordHeader header;
+        while (find_tail(log, &header))
+        {
+            if (header.len > capacity)
+            {
+                set_id(log, id);
+                return ESP_ERR_INVALID_SIZE;
+            }
+            const auto err = esp_partition_read(log.partition, log.tail + sizeof(RecordHeader), buf, header.len);
+            if (err != ESP_OK)
+                return err;
+            if (crc16(buf, header.len) != header.crc)
+            {
+                log.tail += record_size(header.len); // Torn payload
+                continue;
+            }
+            set_id(log, id);
+            *len = header.len;
+            return ESP_OK;
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto tail_id(Log &log, uint32_t *id) -> esp_err_t
+    {
+        RecordHeader header;
+        while (find_tail(log, &header))
+        {
+            if (payload_valid(log, log.tail, header))
+            {
+                set_id(log, id);
+                return ESP_OK;
+            }
+            log.tail += record_size(header.len);
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto pop(Log &log) -> esp_err_t
+    {
+        RecordHeader header;
+        if (log.records == 0 || !read_record(log, log.tail, &header))
+            return ESP_ERR_NOT_FOUND;
+        const auto popped = RECORD_POPPED;
+        const auto err = esp_partition_write(log.partition, log.tail + offsetof(RecordHeader, state), &popped, 1);
+        if (err != ESP_OK)
+            return err;
+        log.tail += record_size(header.len);
+        log.records -= 1;
+        if (log.records == 0)
+            log.tail = log.head;
+        return ESP_OK;
+    }
+
+    auto max_record_size() -> uint16_t
+    {
+        return MAX_PAYLOAD;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+
+// Append-only record log in a raw data partition, used to keep messages across link outages and reboots.
+//
+// The partition is a ring of flash sectors. Every sector starts with a sequence number, so the order
+// survives a reboot. Records never span sectors and are checked with a CRC, so a record torn by a power
+// cut is skipped. Popping a record only clears a byte of its header; a sector is erased once the ring
+// wraps around to it, and if it still holds records at that point they are dropped (oldest first).
+//
+// Every record gets an id that grows with each append and survives reboots (see log_format.hpp).
+// A log is not thread-safe, callers serialize access to it.
+namespace flash_log
+{
+    constexpr uint8_t PARTITION_SUBTYPE = 0x40; // Data partition subtype used for logs (see partitions.csv)
+
+    struct Log
+    {
+        const esp_partition_t *partition;
+        uint32_t sector_count;
+        uint32_t head;     // Offset where the next record goes
+        uint32_t head_seq; // Sequence number of the sector holding "head"
+        uint32_t tail;     // Offset of the oldest record that was not popped (== head when empty)
+        uint32_t records;  // Records waiting between "tail" and "head"
+        uint32_t dropped;  // Records lost to wrap-around since the log was opened
+    };
+
+    auto open(Log &log, const char *label) -> esp_err_t;                                                   // Mount the partition, recovering the records it holds
+    auto append(Log &log, const uint8_t *data, uint16_t len, uint32_t *id = NULL) -> esp_err_t;            // Add a record (drops the oldest sector when full)
+    auto peek(Log &log, uint8_t *buf, uint16_t capacity, uint16_t *len, uint32_t *id = NULL) -> esp_err_t; // Oldest record, ESP_ERR_NOT_FOUND if empty (ESP_ERR_INVALID_SIZE if it does not fit, "id" is still set)
+    auto tail_id(Log &log, uint32_t *id) -> esp_err_t;                                                     // Id of the oldest record without reading it, ESP_ERR_NOT_FOUND if empty
+    auto pop(Log &log) -> esp_err_t;                                                                       // Remove the record returned by "peek"
+    auto max_record_size() -> uint16_t;
+}
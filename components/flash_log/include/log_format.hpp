@@ -0,0 +1,58 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+
+// On-flash layout of a flash_log partition.
+// This module has no ESP-IDF dependencies so a partition dump can be read (or fuzzed) on the host side.
+//
+// The partition is a ring of sectors (all integers are little endian):
+//
+//   sector: SectorHeader | record | record | ... | erased (0xFF)
+//   record: RecordHeader | payload | padding to 4 bytes
+//
+// Headers are written with their magic last, so a header torn by a power cut never looks valid.
+namespace log_format
+{
+    constexpr uint32_t SECTOR_SIZE = 4096;
+    constexpr uint32_t SECTOR_MAGIC = 0x474F4C46; // "FLOG"
+    constexpr uint16_t RECORD_MAGIC = 0xA55A;
+    constexpr uint8_t RECORD_LIVE = 0xFF; // Erased flash, the state byte can only go from live to popped
+    constexpr uint8_t RECORD_POPPED = 0x00;
+
+    struct SectorHeader
+    {
+        uint32_t magic;
+        uint32_t seq; // Grows by one every time the ring moves to the next sector
+    };
+
+    struct RecordHeader
+    {
+        uint16_t magic;
+        uint16_t len; // Payload bytes
+        uint16_t crc; // CRC-16/CCITT-FALSE of the payload
+        uint8_t state;
+        uint8_t reserved;
+    };
+
+    constexpr uint32_t FIRST_RECORD = sizeof(SectorHeader);
+    constexpr uint16_t MAX_PAYLOAD = SECTOR_SIZE - FIRST_RECORD - sizeof(RecordHeader);
+    static_assert(sizeof(RecordHeader) == 8, "Records are kept 4-byte aligned");
+
+    enum class Record
+    {
+        END,     // No record at this offset, the records of the sector end here
+        LIVE,    // Valid record waiting to be popped
+        POPPED,  // Valid record that was already popped
+        CORRUPT, // Header is valid but the payload does not match its CRC (torn write)
+    };
+
+    auto crc16(const uint8_t *bytes, size_t len, uint16_t crc = 0xFFFF) -> uint16_t; // CRC-16/CCITT-FALSE
+    auto record_size(uint16_t len) -> uint32_t;                                       // Bytes a record takes in the sector
+    auto header_fits(const RecordHeader &header, uint32_t in_sector) -> bool;        // Record at "in_sector" is well formed and inside the sector
+    auto record_id(uint32_t seq, uint32_t in_sector) -> uint32_t;                    // Position of a record, grows with every append
+
+    // Helpers working on a whole sector image in memory (e.g. read from a partition dump)
+    auto read_sector(const uint8_t *sector, uint32_t *seq) -> bool; // False if the sector was never started
+    auto read_record(const uint8_t *sector, uint32_t in_sector, RecordHeader *header) -> Record;
+}
@@ -0,0 +1,63 @@
+#include "log_format.hpp"
+
+#include "string.h"
+
+namespace
+{
+    // CRC-16/CCITT-FALSE lookup table indexed by a single nibble (keeps the table at 32 bytes)
+    constexpr uint16_t crc_nibble_table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    };
+}
+
+namespace log_format
+{
+    auto crc16(const uint8_t *bytes, size_t len, uint16_t crc) -> uint16_t
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            crc ^= (uint16_t)bytes[i] << 8;
+            crc = (crc << 4) ^ crc_nibble_table[crc >> 12];
+            crc = (crc << 4) ^ crc_nibble_table[crc >> 12];
+        }
+        return crc;
+    }
+
+    auto record_size(uint16_t len) -> uint32_t
+    {
+        return sizeof(RecordHeader) + ((len + 3) & ~3u);
+    }
+
+    auto header_fits(const RecordHeader &header, uint32_t in_sector) -> bool
+    {
+        return header.magic == RECORD_MAGIC &&
+               in_sector >= FIRST_RECORD &&
+               in_sector + record_size(header.len) <= SECTOR_SIZE;
+    }
+
+    auto record_id(uint32_t seq, uint32_t in_sector) -> uint32_t
+    {
+        return seq * (SECTOR_SIZE / 4) + in_sector / 4;
+    }
+
+    auto read_sector(const uint8_t *sector, uint32_t *seq) -> bool
+    {
+        SectorHeader header;
+        memcpy(&header, sector, sizeof(header));
+        *seq = header.seq;
+        return header.magic == SECTOR_MAGIC;
+    }
+
+    auto read_record(const uint8_t *sector, uint32_t in_sector, RecordHeader *header) -> Record
+    {
+        if (in_sector < FIRST_RECORD || in_sector + sizeof(RecordHeader) > SECTOR_SIZE)
+            return Record::END;
+        memcpy(header, sector + in_sector, sizeof(*header));
+        if (!header_fits(*header, in_sector))
+            return Record::END;
+        if (crc16(sector + in_sector + sizeof(RecordHeader), header->len) != header->crc)
+            return Record::CORRUPT;
+        return header->state == RECORD_LIVE ? Record::LIVE : Record::POPPED;
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_err.h"
+
+// Persistent MQTT broker connection with an offline publish queue.
+// Messages published while the broker is unreachable wait in a bounded RAM queue, which spills to
+// the "spool" flash partition once full. They are replayed in order, a batch at a time, on reconnect.
+namespace mqtt_link
+{
+    struct Handlers
+    {
+        void (*on_state)(bool connected);                                                  // Broker connection came up or went down
+        void (*on_message)(const char *topic, const char *data, int len, int offset, int total); // Incoming message (or a part of a large one)
+    };
+
+    struct Status
+    {
+        bool connected;
+        uint32_t queued_ram;   // Messages waiting in RAM
+        uint32_t queued_flash; // Messages waiting in the flash spool
+        uint32_t dropped;      // Messages lost because both queues were full
+    };
+
+    auto init(const Handlers &handlers) -> void; // Mount the flash spool and start the replay task
+    auto connect(const char *uri, const char *client_id, const char *username, const char *password) -> esp_err_t;
+    auto disconnect() -> void;
+    auto publish(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain, bool *queued) -> esp_err_t;
+    auto subscribe(const char *topic, uint8_t qos) -> esp_err_t;
+    auto unsubscribe(const char *topic) -> esp_err_t;
+    auto status() -> Status;
+}
@@ -0,0 +1,385 @@
+#include "mqtt_link.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_crt_bundle.h"
+#include "mqtt_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "flash_log.hpp"
+#include "pools.hpp"
+#include "power.hpp"
+
+namespace
+{
+    using namespace mqtt_link;
+
+    constexpr auto TAG = "MQTT_LINK";
+    constexpr auto SPOOL_LABEL = "spool";
+    constexpr auto RAM_QUEUE_LEN = 4;         // Messages kept in RAM (pool blocks shared with commands) before spilling to flash
+    constexpr auto REPLAY_BATCH = 8;          // Messages replayed before waiting for the broker to acknowledge them
+    constexpr auto ACK_TIMEOUT_MS = 5000;     // Replay goes on without the acknowledgement after this
+    constexpr auto MAX_TOPIC_LEN = 127;       //
+    constexpr auto MAX_QUEUED_SIZE = 1024;    // Largest message (header + topic + payload) that can be queued
+    constexpr auto MAX_SUBSCRIPTIONS = 8;     // Subscriptions restored after every reconnect
+    constexpr auto TASK_STACK_SIZE = 4096;    //
+    constexpr auto TASK_PRIORITY = 4;         // Replay runs below the workers
+    constexpr uint8_t FLAG_RETAIN = 0x04;     // Queued flags: QoS in the low two bits
+
+    // Queued message (same layout in RAM and flash): flags u8 | topic_len u8 | topic | payload
+    struct Queued
+    {
+        uint8_t *bytes;
+        uint16_t len;
+    };
+
+    struct Subscription
+    {
+        char topic[MAX_TOPIC_LEN + 1];
+        uint8_t qos;
+    };
+
+    Handlers handlers = {};
+    esp_mqtt_client_handle_t client = NULL;
+    SemaphoreHandle_t client_mutex; // Guards "client" while it is used, so a DISCONNECT on one worker cannot destroy it under another
+    volatile bool connected = false;
+    SemaphoreHandle_t mutex; // Guards the queues and the subscriptions (taken after "client_mutex" when both are needed)
+    Queued ram_queue[RAM_QUEUE_LEN];
+    uint32_t ram_head = 0; // Oldest message
+    uint32_t ram_count = 0;
+    flash_log::Log spool;
+    bool spool_ready = false;
+    uint32_t dropped = 0;
+    Subscription subscriptions[MAX_SUBSCRIPTIONS];
+    TaskHandle_t replay_task = NULL;
+    volatile int awaited_msg_id = -1; // Last QoS 1 message of a replayed batch
+
+    auto queued_locked() -> uint32_t
+    {
+        return ram_count + (spool_ready ? spool.records : 0);
+    }
+
+    // Messages go to RAM (pool blocks) until it is full. After that everything goes to flash until the flash
+    // is empty again, so replaying RAM first and flash second keeps the original order.
+    auto enqueue_locked(const uint8_t *bytes, uint16_t len) -> esp_err_t
+    {
+        const auto spooled = spool_ready && spool.records > 0;
+        if (!spooled && ram_count < RAM_QUEUE_LEN)
+        {
+            auto copy = (uint8_t *)pools::take(len);
+            if (copy != NULL)
+            {
+                memcpy(copy, bytes, len);
+                ram_queue[(ram_head + ram_count) % RAM_QUEUE_LEN] = Queued{copy, len};
+                ram_count += 1;
+                return ESP_OK;
+            }
+        }
+        if (spool_ready)
+        {
+            const auto before = spool.dropped;
+            const auto err = flash_log::append(spool, bytes, len);
+            dropped += spool.dropped - before;
+            return err;
+        }
+        dropped += 1;
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Copy the oldest queued message into "buf", returns its length or 0 if nothing is queued
+    auto peek_locked(uint8_t *buf) -> uint16_t
+    {
+        if (ram_count > 0)
+        {
+            const auto &q = ram_queue[ram_head];
+            memcpy(buf, q.bytes, q.len);
+            return q.len;
+        }
+        uint16_t len = 0;
+        if (spool_ready && flash_log::peek(spool, buf, MAX_QUEUED_SIZE, &len) == ESP_OK)
+            return len;
+        return 0;
+    }
+
+    auto pop_locked() -> void
+    {
+        if (ram_count > 0)
+        {
+            pools::give(ram_queue[ram_head].bytes);
+            ram_queue[ram_head] = Queued{};
+            ram_head = (ram_head + 1) % RAM_QUEUE_LEN;
+            ram_count -= 1;
+        }
+        else if (spool_ready)
+            flash_log::pop(spool);
+    }
+
+    auto publish_queued(const uint8_t *bytes, uint16_t len) -> int
+    {
+        const auto flags = bytes[0];
+        const auto topic_len = bytes[1];
+        char topic[MAX_TOPIC_LEN + 1];
+        memcpy(topic, bytes + 2, topic_len);
+        topic[topic_len] = '\0';
+        const auto payload = (const char *)bytes + 2 + topic_len;
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        const auto msg_id = client != NULL ? esp_mqtt_client_publish(client, topic, payload, len - 2 - topic_len, flags & 0x03, (flags & FLAG_RETAIN) != 0) : -1;
+        xSemaphoreGive(client_mutex);
+        return msg_id;
+    }
+
+    // Replays the queues in batches whenever the broker is reachable
+    auto replay(void *arg) -> void
+    {
+        static uint8_t buf[MAX_QUEUED_SIZE];
+        while (true)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            while (connected)
+            {
+                auto sent = 0;
+                power::wait_tx_window(); // The whole batch goes out in one window
+                for (; sent < REPLAY_BATCH && connected; sent++)
+                {
+                    xSemaphoreTake(mutex, portMAX_DELAY);
+                    const auto len = peek_locked(buf);
+                    xSemaphoreGive(mutex);
+                    if (len == 0)
+                        break;
+                    const auto msg_id = publish_queued(buf, len);
+                    if (msg_id < 0)
+                        break;
+                    if ((buf[0] & 0x03) > 0)
+                        awaited_msg_id = msg_id;
+                    xSemaphoreTake(mutex, portMAX_DELAY);
+                    pop_locked();
+                    xSemaphoreGive(mutex);
+                }
+                if (sent == 0)
+                    break;
+
+                // Let the broker acknowledge the batch before sending the next one
+                const auto deadline = xTaskGetTickCount() + pdMS_TO_TICKS(ACK_TIMEOUT_MS);
+                while (awaited_msg_id >= 0 && connected && (int32_t)(deadline - xTaskGetTickCount()) > 0)
+                    ulTaskNotifyTake(pdTRUE, deadline - xTaskGetTickCount());
+                awaited_msg_id = -1;
+                ESP_LOGI(TAG, "Replayed %d messages", sent);
+            }
+        }
+    }
+
+    // Runs on the MQTT task of "handle", which is not destroyed while it runs
+    auto resubscribe(esp_mqtt_client_handle_t handle) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (const auto &s : subscriptions)
+            if (s.topic[0] != '\0')
+                esp_mqtt_client_subscribe(handle, s.topic, s.qos);
+        xSemaphoreGive(mutex);
+    }
+
+    // Slot holding "topic", or the first free one for an empty topic
+    auto find_subscription(const char *topic) -> Subscription *
+    {
+        for (auto &s : subscriptions)
+            if (strcmp(s.topic, topic) == 0)
+                return &s;
+        return NULL;
+    }
+
+    auto publish_locked(const char *topic, size_t topic_len, const uint8_t *data, uint16_t len, uint8_t qos, bool retain, bool *queued) -> esp_err_t
+    {
+        if (client == NULL)
+            return ESP_ERR_INVALID_ARG;
+
+        // Send right away unless older messages are still waiting
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto backlog = queued_locked() > 0;
+        xSemaphoreGive(mutex);
+        if (connected && !backlog && esp_mqtt_client_publish(client, topic, (const char *)data, len, qos, retain) >= 0)
+            return ESP_OK;
+
+        // Queue it in the replay format
+        static uint8_t buf[MAX_QUEUED_SIZE];
+        const auto size = 2 + topic_len + len;
+        if (size > MAX_QUEUED_SIZE)
+            return ESP_ERR_INVALID_SIZE;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        buf[0] = qos | (retain ? FLAG_RETAIN : 0);
+        buf[1] = topic_len;
+        memcpy(buf + 2, topic, topic_len);
+        memcpy(buf + 2 + topic_len, data, len);
+        const auto err = enqueue_locked(buf, size);
+        xSemaphoreGive(mutex);
+        *queued = err == ESP_OK;
+        if (connected)
+            xTaskNotifyGive(replay_task);
+        return err;
+    }
+
+    auto disconnect_locked() -> void
+    {
+        if (client == NULL)
+            return;
+        esp_mqtt_client_destroy(client);
+        client = NULL;
+        if (connected && handlers.on_state)
+            handlers.on_state(false);
+        connected = false;
+    }
+
+    auto event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data) -> void
+    {
+        auto event = (esp_mqtt_event_handle_t)event_data;
+        switch ((esp_mqtt_event_id_t)event_id)
+        {
+        case MQTT_EVENT_CONNECTED:
+            connected = true;
+            resubscribe(event->client);
+            if (handlers.on_state)
+                handlers.on_state(true);
+            xTaskNotifyGive(replay_task);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            if (connected && handlers.on_state)
+                handlers.on_state(false);
+            connected = false;
+            xTaskNotifyGive(replay_task);
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            if (event->msg_id == awaited_msg_id)
+            {
+                awaited_msg_id = -1;
+                xTaskNotifyGive(replay_task);
+            }
+            break;
+        case MQTT_EVENT_DATA:
+        {
+            // Large messages arrive in parts, only the first one carries the topic
+            char topic[MAX_TOPIC_LEN + 1];
+            const auto topic_len = event->topic_len < MAX_TOPIC_LEN ? event->topic_len : MAX_TOPIC_LEN;
+            memcpy(topic, event->topic, topic_len);
+            topic[topic_len] = '\0';
+            if (handlers.on_message)
+                handlers.on_message(topic, event->data, event->data_len, event->current_data_offset, event->total_data_len);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+namespace mqtt_link
+{
+    auto init(const Handlers &h) -> void
+    {
+        handlers = h;
+        mutex = xSemaphoreCreateMutex();
+        client_mutex = xSemaphoreCreateMutex();
+        const auto err = flash_log::open(spool, SPOOL_LABEL);
+        spool_ready = err == ESP_OK;
+        if (!spool_ready)
+            ESP_LOGW(TAG, "No flash spool (%s), offline messages are kept in RAM only", esp_err_to_name(err));
+        xTaskCreatePinnedToCore(replay, "mqtt_replay", TASK_STACK_SIZE, NULL, TASK_PRIORITY, &replay_task, CONFIG_MODEM_NETWORK_CORE);
+    }
+
+    auto connect(const char *uri, const char *client_id, const char *username, const char *password) -> esp_err_t
+    {
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        disconnect_locked();
+
+        esp_mqtt_client_config_t config = {};
+        config.uri = uri;
+        config.client_id = client_id;
+        config.username = username;
+        config.password = password;
+        if (strncmp(uri, "mqtts://", 8) == 0 || strncmp(uri, "wss://", 6) == 0)
+            config.crt_bundle_attach = esp_crt_bundle_attach;
+        client = esp_mqtt_client_init(&config);
+        auto err = ESP_FAIL;
+        if (client != NULL)
+        {
+            esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, event_handler, NULL);
+            err = esp_mqtt_client_start(client); // Reconnects on its own from now on
+        }
+        xSemaphoreGive(client_mutex);
+        return err;
+    }
+
+    auto disconnect() -> void
+    {
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        disconnect_locked();
+        xSemaphoreGive(client_mutex);
+    }
+
+    auto publish(const char *topic, const uint8_t *data, uint16_t len, uint8_t qos, bool retain, bool *queued) -> esp_err_t
+    {
+        *queued = false;
+        const auto topic_len = strlen(topic);
+        if (qos > 1 || topic_len > MAX_TOPIC_LEN)
+            return ESP_ERR_INVALID_ARG;
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        const auto err = publish_locked(topic, topic_len, data, len, qos, retain, queued);
+        xSemaphoreGive(client_mutex);
+        return err;
+    }
+
+    auto subscribe(const char *topic, uint8_t qos) -> esp_err_t
+    {
+        if (qos > 1 || strlen(topic) > MAX_TOPIC_LEN)
+            return ESP_ERR_INVALID_ARG;
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        auto err = ESP_ERR_INVALID_ARG;
+        if (client != NULL)
+        {
+            // Remember it, so it is restored after a reconnect
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            auto slot = find_subscription(topic);
+            if (slot == NULL)
+                slot = find_subscription("");
+            if (slot != NULL)
+            {
+                strcpy(slot->topic, topic);
+                slot->qos = qos;
+            }
+            xSemaphoreGive(mutex);
+            err = slot != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+        }
+        if (err == ESP_OK && connected && esp_mqtt_client_subscribe(client, topic, qos) < 0)
+            err = ESP_FAIL;
+        xSemaphoreGive(client_mutex);
+        return err;
+    }
+
+    auto unsubscribe(const char *topic) -> esp_err_t
+    {
+        xSemaphoreTake(client_mutex, portMAX_DELAY);
+        auto err = ESP_OK;
+        if (client == NULL)
+            err = ESP_ERR_INVALID_STATE;
+        else
+        {
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            const auto slot = topic[0] != '\0' ? find_subscription(topic) : NULL;
+            if (slot != NULL)
+                *slot = Subscription{};
+            xSemaphoreGive(mutex);
+            if (connected && esp_mqtt_client_unsubscribe(client, topic) < 0)
+                err = ESP_FAIL;
+        }
+        xSemaphoreGive(client_mutex);
+        return err;
+    }
+
+    auto status() -> Status
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto s = Status{connected, ram_count, spool_ready ? spool.records : 0, dropped};
+        xSemaphoreGive(mutex);
+        return s;
+    }
+}
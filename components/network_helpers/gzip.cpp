@@ -0,0 +1,228 @@
+#include "gzip.hpp"
+
+#include "string.h"
+
+#include "checksum.hpp"
+
+namespace
+{
+    using namespace gzip;
+
+    constexpr size_t MIN_MATCH = 3;
+    constexpr size_t MAX_MATCH = 258;
+    constexpr uint16_t NIL = 0xFFFF; // Empty hash slot
+    constexpr uint16_t END_OF_BLOCK = 256;
+    constexpr uint8_t HEADER[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF}; // Deflate, no name, no time, unknown OS
+
+    // Deflate length and distance codes (RFC 1951, 3.2.5)
+    constexpr uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    constexpr uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    constexpr uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    constexpr uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    auto flush_out(Encoder &e) -> void
+    {
+        if (e.out_len == 0)
+            return;
+        e.sink(e.ctx, e.out, e.out_len);
+        e.size_out += e.out_len;
+        e.out_len = 0;
+    }
+
+    auto put_byte(Encoder &e, uint8_t byte) -> void
+    {
+        e.out[e.out_len++] = byte;
+        if (e.out_len == OUT_SIZE)
+            flush_out(e);
+    }
+
+    auto put_bits(Encoder &e, uint32_t value, uint8_t count) -> void
+    {
+        e.bits |= value << e.bit_count;
+        e.bit_count += count;
+        while (e.bit_count >= 8)
+        {
+            put_byte(e, e.bits & 0xFF);
+            e.bits >>= 8;
+            e.bit_count -= 8;
+        }
+    }
+
+    // Huffman codes are sent starting from their most significant bit
+    auto put_code(Encoder &e, uint16_t code, uint8_t len) -> void
+    {
+        uint16_t reversed = 0;
+        for (uint8_t i = 0; i < len; i++)
+            reversed |= ((code >> i) & 1) << (len - 1 - i);
+        put_bits(e, reversed, len);
+    }
+
+    // Fixed literal/length code (RFC 1951, 3.2.6)
+    auto put_symbol(Encoder &e, uint16_t symbol) -> void
+    {
+        if (symbol < 144)
+            put_code(e, 0x30 + symbol, 8);
+        else if (symbol < 256)
+            put_code(e, 0x190 + symbol - 144, 9);
+        else if (symbol < 280)
+            put_code(e, symbol - 256, 7);
+        else
+            put_code(e, 0xC0 + symbol - 280, 8);
+    }
+
+    auto put_match(Encoder &e, size_t length, size_t distance) -> void
+    {
+        uint8_t l = 28;
+        while (length_base[l] > length)
+            l--;
+        put_symbol(e, 257 + l);
+        put_bits(e, length - length_base[l], length_extra[l]);
+
+        uint8_t d = 29;
+        while (distance_base[d] > distance)
+            d--;
+        put_code(e, d, 5);
+        put_bits(e, distance - distance_base[d], distance_extra[d]);
+    }
+
+    auto hash(const uint8_t *p) -> uint16_t
+    {
+        return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << HASH_BITS) - 1);
+    }
+
+    auto insert(Encoder &e, size_t pos) -> uint16_t
+    {
+        const auto h = hash(e.window + pos);
+        const auto candidate = e.head[h];
+        e.prev[pos & (WINDOW_SIZE - 1)] = candidate;
+        e.head[h] = pos;
+        return candidate;
+    }
+
+    // Longest earlier match for the bytes at "pos", 0 if there is none worth sending
+    auto find_match(Encoder &e, size_t pos, uint16_t candidate, size_t *distance) -> size_t
+    {
+        const auto limit = e.filled - pos < MAX_MATCH ? e.filled - pos : MAX_MATCH;
+        size_t best = 0;
+        for (size_t chain = 0; chain < MAX_CHAIN && candidate != NIL && candidate < pos && pos - candidate < WINDOW_SIZE; chain++)
+        {
+            const auto a = e.window + candidate;
+            const auto b = e.window + pos;
+            if (a[best] == b[best]) // Cheap reject before the full compare
+            {
+                size_t len = 0;
+                while (len < limit && a[len] == b[len])
+                    len++;
+                if (len > best)
+                {
+                    best = len;
+                    *distance = pos - candidate;
+                    if (len == limit)
+                        break;
+                }
+            }
+            const auto next = e.prev[candidate & (WINDOW_SIZE - 1)];
+            if (next == NIL || next >= candidate)
+                break;
+            candidate = next;
+        }
+        return best >= MIN_MATCH ? best : 0;
+    }
+
+    // Encode the window up to "end" (while "end" keeps a full match of lookahead, unless finishing)
+    auto compress(Encoder &e, size_t end) -> void
+    {
+        while (e.pos < end)
+        {
+            size_t length = 0;
+            size_t distance = 0;
+            if (e.filled - e.pos >= MIN_MATCH)
+                length = find_match(e, e.pos, insert(e, e.pos), &distance);
+            if (length == 0)
+            {
+                put_symbol(e, e.window[e.pos]);
+                e.pos += 1;
+                continue;
+            }
+            put_match(e, length, distance);
+            for (size_t i = 1; i < length && e.pos + i + MIN_MATCH <= e.filled; i++)
+                insert(e, e.pos + i);
+            e.pos += length;
+        }
+    }
+
+    // Drop the older half of the window to make room for more input
+    auto slide(Encoder &e) -> void
+    {
+        memmove(e.window, e.window + WINDOW_SIZE, e.filled - WINDOW_SIZE);
+        e.filled -= WINDOW_SIZE;
+        e.pos -= WINDOW_SIZE;
+        for (auto &p : e.head)
+            p = p != NIL && p >= WINDOW_SIZE ? p - WINDOW_SIZE : NIL;
+        for (auto &p : e.prev)
+            p = p != NIL && p >= WINDOW_SIZE ? p - WINDOW_SIZE : NIL;
+    }
+}
+
+namespace gzip
+{
+    auto init(Encoder &e, Sink sink, void *ctx) -> void
+    {
+        memset(e.head, 0xFF, sizeof(e.head));
+        memset(e.prev, 0xFF, sizeof(e.prev));
+        e.filled = 0;
+        e.pos = 0;
+        e.bits = 0;
+        e.bit_count = 0;
+        e.crc = 0;
+        e.size_in = 0;
+        e.size_out = 0;
+        e.out_len = 0;
+        e.sink = sink;
+        e.ctx = ctx;
+        for (const auto byte : HEADER)
+            put_byte(e, byte);
+        put_bits(e, 0x3, 3); // The whole stream is one final block with fixed codes
+    }
+
+    auto write(Encoder &e, const uint8_t *data, size_t len) -> void
+    {
+        e.crc = checksum::crc32(data, len, e.crc);
+        e.size_in += len;
+        while (len > 0)
+        {
+            if (e.filled == sizeof(e.window))
+                slide(e);
+            const auto room = sizeof(e.window) - e.filled;
+            const auto n = len < room ? len : room;
+            memcpy(e.window + e.filled, data, n);
+            e.filled += n;
+            data += n;
+            len -= n;
+            if (e.filled >= MAX_MATCH)
+                compress(e, e.filled - MAX_MATCH);
+        }
+    }
+
+    auto finish(Encoder &e) -> void
+    {
+        compress(e, e.filled);
+        put_symbol(e, END_OF_BLOCK);
+        if (e.bit_count > 0)
+            put_bits(e, 0, 8 - e.bit_count);
+        const uint32_t trailer[2] = {e.crc, e.size_in};
+        for (const auto value : trailer)
+            for (uint8_t i = 0; i < 4; i++)
+                put_byte(e, value >> (8 * i));
+        flush_out(e);
+    }
+
+    auto max_compressed_size(size_t len) -> size_t
+    {
+        return sizeof(HEADER) + len + len / 8 + 2 + 8; // Literals take 9 bits at most
+    }
+}
@@ -0,0 +1,179 @@
+#include "http_pool.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+namespace
+{
+    constexpr auto TAG = "HTTP_POOL";
+    constexpr auto POOL_SIZE = 4;                       // Maximum number of open connections
+    constexpr auto MAX_HOST_LEN = 64;                   // Longest host name that can be pooled
+    constexpr int64_t IDLE_TIMEOUT_US = 30 * 1000000LL; // Idle connections older than this are closed
+
+    struct Entry
+    {
+        esp_http_client_handle_t client; // NULL when the slot is free
+        esp_http_client_transport_t transport;
+        char host[MAX_HOST_LEN];
+        int64_t last_used;
+        uint32_t heap_cost;
+        bool in_use;
+    };
+
+    Entry pool[POOL_SIZE];
+    SemaphoreHandle_t mutex; // Requests run on several worker tasks
+    esp_timer_handle_t evict_timer;
+
+    auto free_entry(Entry &e) -> void
+    {
+        ESP_LOGI(TAG, "Closing connection to %s", e.host);
+        esp_http_client_cleanup(e.client);
+        e = Entry{};
+    }
+
+    auto find(esp_http_client_handle_t client) -> Entry *
+    {
+        for (auto &e : pool)
+            if (e.client == client)
+                return &e;
+        return NULL;
+    }
+
+    auto evict_idle_locked() -> void
+    {
+        const auto now = esp_timer_get_time();
+        for (auto &e : pool)
+            if (e.client != NULL && !e.in_use && now - e.last_used > IDLE_TIMEOUT_US)
+                free_entry(e);
+    }
+
+    // Closes connections to hosts that went quiet, even if no other request comes to do it
+    auto evict_idle(void *arg) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        evict_idle_locked();
+        xSemaphoreGive(mutex);
+    }
+
+    // Free slot, or the least recently used idle connection if the pool is full
+    auto find_slot() -> Entry *
+    {
+        Entry *lru = NULL;
+        for (auto &e : pool)
+        {
+            if (e.client == NULL)
+                return &e;
+            if (!e.in_use && (lru == NULL || e.last_used < lru->last_used))
+                lru = &e;
+        }
+        if (lru != NULL)
+            free_entry(*lru);
+        return lru;
+    }
+}
+
+namespace http_pool
+{
+    auto init() -> void
+    {
+        mutex = xSemaphoreCreateMutex();
+        esp_timer_create_args_t args = {};
+        args.callback = evict_idle;
+        args.name = "http_pool_evict";
+        ESP_ERROR_CHECK(esp_timer_create(&args, &evict_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(evict_timer, IDLE_TIMEOUT_US / 2));
+    }
+
+    auto acquire(const esp_http_client_config_t &config, bool *reused) -> esp_http_client_handle_t
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        evict_idle_locked();
+        *reused = false;
+
+        // Reuse an idle connection to the same host
+        for (auto &e : pool)
+        {
+            if (e.client == NULL || e.in_use || e.transport != config.transport_type || strcmp(e.host, config.host) != 0)
+                continue;
+            e.in_use = true;
+            esp_http_client_set_url(e.client, config.path);
+            esp_http_client_set_method(e.client, config.method);
+            esp_http_client_set_user_data(e.client, config.user_data);
+            *reused = true;
+            xSemaphoreGive(mutex);
+            return e.client;
+        }
+
+        // Open a new one (hosts that do not fit in the pool get a one-off client)
+        auto client = esp_http_client_init(&config);
+        auto e = client != NULL && strlen(config.host) < MAX_HOST_LEN ? find_slot() : NULL;
+        if (e != NULL)
+        {
+            e->client = client;
+            e->transport = config.transport_type;
+            strcpy(e->host, config.host);
+            e->in_use = true;
+        }
+        xSemaphoreGive(mutex);
+        return client;
+    }
+
+    auto release(esp_http_client_handle_t client, bool reusable) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        auto e = find(client);
+        if (e == NULL)
+            esp_http_client_cleanup(client);
+        else if (!reusable)
+            free_entry(*e);
+        else
+        {
+            e->in_use = false;
+            e->last_used = esp_timer_get_time();
+        }
+        xSemaphoreGive(mutex);
+    }
+
+    auto close(const char *host) -> uint8_t
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        uint8_t closed = 0;
+        for (auto &e : pool)
+        {
+            if (e.client == NULL || e.in_use || (host != NULL && strcmp(e.host, host) != 0))
+                continue;
+            free_entry(e);
+            closed += 1;
+        }
+        xSemaphoreGive(mutex);
+        return closed;
+    }
+
+    auto set_heap_cost(esp_http_client_handle_t client, uint32_t bytes) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        auto e = find(client);
+        if (e != NULL)
+            e->heap_cost = bytes;
+        xSemaphoreGive(mutex);
+    }
+
+    auto usage() -> Usage
+    {
+        auto u = Usage{};
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (const auto &e : pool)
+        {
+            if (e.client == NULL)
+                continue;
+            u.open += 1;
+            u.secure += e.transport == HTTP_TRANSPORT_OVER_SSL ? 1 : 0;
+            u.heap_cost += e.heap_cost;
+        }
+        xSemaphoreGive(mutex);
+        return u;
+    }
+}
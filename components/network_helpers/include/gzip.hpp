@@ -0,0 +1,43 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+
+// Streaming gzip encoder for request bodies.
+// This module has no ESP-IDF dependencies so the same code can be compiled on the host side.
+//
+// It trades ratio for memory: LZ77 over a small sliding window with short hash chains, and a single
+// deflate block with the fixed Huffman codes, so no code tables are built or stored. Verbose JSON
+// still shrinks to a fraction of its size while the whole encoder stays around 12 KB.
+namespace gzip
+{
+    constexpr size_t WINDOW_SIZE = 2048; // Longest distance a match can reach back (power of two)
+    constexpr size_t HASH_BITS = 11;     //
+    constexpr size_t MAX_CHAIN = 16;     // Candidates tried per position
+    constexpr size_t OUT_SIZE = 256;     // Output is handed to the sink in pieces of this size
+
+    typedef void (*Sink)(void *ctx, const uint8_t *bytes, size_t len); // Receives the compressed stream
+
+    struct Encoder
+    {
+        uint8_t window[2 * WINDOW_SIZE]; // Input history followed by the lookahead
+        uint16_t head[1 << HASH_BITS];   // Newest window position for every hash
+        uint16_t prev[WINDOW_SIZE];      // Older positions with the same hash
+        size_t filled;                   // Bytes in "window"
+        size_t pos;                      // Next window position to encode
+        uint32_t bits;                   // Bits waiting to be written (LSB first)
+        uint8_t bit_count;               //
+        uint32_t crc;                    // CRC-32 and size of the input, for the trailer
+        uint32_t size_in;                //
+        uint32_t size_out;               // Compressed bytes handed to the sink
+        uint8_t out[OUT_SIZE];           //
+        size_t out_len;                  //
+        Sink sink;
+        void *ctx;
+    };
+
+    auto init(Encoder &e, Sink sink, void *ctx) -> void;                // Emits the gzip header
+    auto write(Encoder &e, const uint8_t *data, size_t len) -> void;    // Compress more input
+    auto finish(Encoder &e) -> void;                                    // Flush everything and emit the trailer
+    auto max_compressed_size(size_t len) -> size_t;                     // Worst case output for "len" bytes of input
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "esp_http_client.h"
+
+// Pool of persistent (keep-alive) HTTP client handles, keyed by host and transport
+namespace http_pool
+{
+    auto init() -> void; // Call once before using the pool, also starts closing connections that stay idle
+
+    // Get a client for "config.host" (reuses an idle connection when possible, "reused" tells which one happened)
+    auto acquire(const esp_http_client_config_t &config, bool *reused) -> esp_http_client_handle_t;
+
+    // Give the client back, connections that are not "reusable" are closed and freed
+    auto release(esp_http_client_handle_t client, bool reusable) -> void;
+
+    // Close idle connections to "host" (all hosts if NULL), returns the number of closed connections
+    auto close(const char *host) -> uint8_t;
+
+    struct Usage
+    {
+        uint8_t open;       // Pooled connections (idle or in use)
+        uint8_t secure;     // How many of them are HTTPS
+        uint32_t heap_cost; // Heap taken by opening them (approximate, measured around the connect)
+    };
+
+    auto set_heap_cost(esp_http_client_handle_t client, uint32_t bytes) -> void; // Remember what opening the connection cost
+    auto usage() -> Usage;
+}
@@ -3,9 +3,37 @@
 
 namespace network_helpers
 {
+    // Request body compression ("Content-Encoding: gzip")
+    enum class Compression : uint8_t
+    {
+        DEFAULT, // As configured with CONFIG_MODEM_HTTP_GZIP
+        GZIP,
+        NONE,
+    };
+
+    struct CompressionStats
+    {
+        uint32_t requests; // Bodies sent compressed
+        uint32_t bytes_in; // Their size before and after compression
+        uint32_t bytes_out;
+    };
+
+    typedef int (*BodyReader)(char *buf, int max_len); // Fills "buf" with the next part of a streamed body, returns 0 on failure
+
+    // Receives parts of an HTTP response as they arrive (every callback is optional)
+    struct ResponseSink
+    {
+        void (*on_status)(void *ctx, int status_code);
+        void (*on_header)(void *ctx, const char *key, const char *value); // Only selected headers are reported
+        void (*on_data)(void *ctx, const char *data, int len);            // Body chunk (chunked encoding already removed)
+        void *ctx;
+    };
+
     auto init_tcp_stack() -> void;                                                  // Initialize the TCP stack (Call this before any other networking)
     auto init_wifi_as_apsta(const char *ap_ssid) -> void;                           // Start WiFi as access point + station
-    auto init_wifi_as_sta(const char *ssid, const char *pass) -> esp_err_t;         // Start WiFi as a station
     auto scan_wifi(wifi_ap_record_t *result, uint16_t max_result_size) -> uint16_t; // Scan for WiFi networks
-    auto make_http_request(esp_http_client_method_t method, const char *host, const char *path, const char *body) -> esp_err_t;
+    auto make_http_request(esp_http_client_method_t method, const char *host, const char *path, const char *body, size_t body_len, const ResponseSink *sink = NULL, Compression compression = Compression::DEFAULT) -> esp_err_t;
+    auto make_http_stream_request(esp_http_client_method_t method, const char *host, const char *path, uint32_t body_len, BodyReader read_body, const ResponseSink *sink = NULL, Compression compression = Compression::DEFAULT) -> esp_err_t;
+    auto close_connections(const char *host) -> uint8_t; // Close idle keep-alive connections to "host" (or all of them if NULL)
+    auto compression_stats() -> CompressionStats;
 }
\ No newline at end of file
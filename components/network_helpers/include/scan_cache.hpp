@@ -0,0 +1,27 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_wifi_types.h"
+
+// Access points seen by a background scan task.
+// Every scan is merged into the cache instead of replacing it: networks are deduplicated by SSID
+// (hidden ones by BSSID), keep their strongest signal, and age out once they stop showing up.
+// Readers get a copy sorted by signal strength right away, they never wait for a scan.
+namespace scan_cache
+{
+    constexpr uint8_t MAX_NETWORKS = 20;
+
+    struct Network
+    {
+        char ssid[33]; // Empty for hidden networks
+        uint8_t bssid[6];
+        int8_t rssi;
+        uint8_t channel;
+        wifi_auth_mode_t authmode;
+        uint32_t age_s; // Seconds since it was last seen
+    };
+
+    auto start() -> void;                                        // Start the scan task (scans only run once WiFi is up)
+    auto refresh() -> void;                                      // Scan now, and keep scanning for a while even outside the portal
+    auto snapshot(Network *networks, uint8_t max) -> uint8_t;    // Copy of the cache, strongest first
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+// Station connection manager.
+// A background task keeps the station connected. Lost links are retried with exponential backoff
+// and never make the modem give up, so the link is started once and then only watched.
+namespace wifi_link
+{
+    // Static address of a network, in network byte order (ip 0 uses DHCP, dns may be 0)
+    struct Address
+    {
+        uint32_t ip;
+        uint32_t netmask;
+        uint32_t gateway;
+        uint32_t dns;
+    };
+
+    // Shortcuts for connecting (every field is optional)
+    struct StationHint
+    {
+        uint8_t bssid[6]; // Access point joined last time
+        uint8_t channel;  // Its channel (0 if unknown, the station then scans every channel)
+        Address address;  // Skips DHCP
+    };
+
+    enum class State : uint8_t
+    {
+        IDLE,       // Not started
+        CONNECTING, // Associating with the access point or waiting for an address
+        UP,         // Connected and has an address
+        BACKOFF,    // Last attempt failed, waiting before the next one
+    };
+
+    // Network to switch to, filled in by a Selector
+    struct Network
+    {
+        char ssid[33];
+        char pass[65];
+        uint8_t bssid[6]; // Access point to join (channel 0 lets the station pick one)
+        uint8_t channel;  //
+        Address address;  // Static address on this network (ip 0 uses DHCP)
+    };
+
+    typedef void (*Listener)(State state, const char *detail); // Called from the manager task on every state change
+
+    // Called from the manager task before connecting without a known access point ("failed" is NULL), and when the
+    // current network keeps failing. Returns true to switch to "next". The station is idle, so it may scan.
+    typedef bool (*Selector)(const char *failed, Network *next);
+
+    auto start(const char *ssid, const char *pass, const StationHint &hint, Listener listener, Selector selector = NULL) -> esp_err_t; // Returns right away (retries at once if already started, takes over a driver the portal left running)
+    auto state() -> State;
+    auto ssid() -> const char *;                                  // Network the station is using
+    auto wait_up(TickType_t timeout) -> bool;                     // Wait until the link is up (a timeout of 0 only checks)
+    auto access_point(uint8_t *bssid, uint8_t *channel) -> bool; // Access point the station is connected to
+    auto state_name(State state) -> const char *;
+}
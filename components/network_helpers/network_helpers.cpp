@@ -1,25 +1,51 @@
 #include "network_helpers.hpp"
 
 #include "string.h"
+#include "strings.h"
+#include "inttypes.h"
 #include "esp_netif.h"
 #include "esp_event.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "esp_http_client.h"
 #include "esp_tls.h"
-#include "freertos/event_groups.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_crt_bundle.h"
+#include "sdkconfig.h"
 #include "lwip/sys.h"
+#include <atomic>
 
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+#include "http_pool.hpp"
+#include "stats.hpp"
+#include "gzip.hpp"
+#include "pools.hpp"
+
+#ifdef CONFIG_MODEM_HTTPS_PINNED_CERT
+extern const char pinned_cert_start[] asm("_binary_pinned_pem_start"); // Embedded as text, so NUL-terminated
+#endif
 
 namespace
 {
     using namespace network_helpers;
 
     constexpr auto TAG = "NETWORK_HELPERS";
-    static EventGroupHandle_t s_wifi_event_group;
-    static int s_retry_num = 0;
+    constexpr auto STREAM_CHUNK_SIZE = 512; // Size of the buffer used to forward streamed bodies to the socket
+
+#ifdef CONFIG_MODEM_HTTP_GZIP
+    constexpr auto GZIP_BY_DEFAULT = true;
+#else
+    constexpr auto GZIP_BY_DEFAULT = false;
+#endif
+    constexpr auto GZIP_MIN_SIZE = 64; // Smaller bodies are never worth compressing
+    constexpr auto GZIP_BLOCK_SIZE = (sizeof(gzip::Encoder) + pools::ALIGN - 1) & ~(pools::ALIGN - 1);
+
+    // Encoders are reserved up front, a request that finds them all busy is sent uncompressed
+    pools::StaticPool<GZIP_BLOCK_SIZE, CONFIG_MODEM_HTTP_GZIP_ENCODERS> gzip_pool("gzip");
+
+    std::atomic<uint32_t> gzip_requests = {0}; // Totals reported by "compression_stats"
+    std::atomic<uint32_t> gzip_bytes_in = {0};
+    std::atomic<uint32_t> gzip_bytes_out = {0};
 
     // Event handler for WiFi events
     auto wifi_ap_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) -> void
@@ -36,39 +62,76 @@ namespace
         }
     }
 
-    auto wifi_sta_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) -> void
+    // Headers forwarded to the response sink
+    constexpr const char *forwarded_headers[] = {"Content-Type", "Content-Length", "Location", "ETag", "Retry-After"};
+
+    // State of a single request, passed to the event handler as "user_data"
+    struct ResponseState
     {
-        if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
-        {
-            esp_wifi_connect();
-        }
-        else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
-        {
-            if (s_retry_num < 5)
-            {
-                esp_wifi_connect();
-                s_retry_num++;
-                ESP_LOGI(TAG, "retry to connect to the AP");
-            }
-            else
-            {
-                xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-            }
-            ESP_LOGI(TAG, "connect to the AP fail");
-        }
-        else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+        const ResponseSink *sink;
+        bool status_sent;
+        bool reused;          // Connection came from the pool, there is no connect stage
+        int64_t started;      // Timestamps (esp_timer) of the request stages, 0 if not reached
+        int64_t connected;    //
+        int64_t first_header; //
+        uint32_t heap_before; // Free heap when the request started, used to measure what a new connection costs
+    };
+
+    auto make_state(const ResponseSink *sink) -> ResponseState
+    {
+        return ResponseState{sink, false, false, esp_timer_get_time(), 0, 0, esp_get_free_heap_size()};
+    }
+
+    // Report the status code before the first header or body chunk
+    auto send_status_once(ResponseState *state, esp_http_client_handle_t client) -> void
+    {
+        if (state->status_sent)
+            return;
+        state->status_sent = true;
+        if (state->sink->on_status)
+            state->sink->on_status(state->sink->ctx, esp_http_client_get_status_code(client));
+    }
+
+    auto is_forwarded_header(const char *key) -> bool
+    {
+        for (const auto header : forwarded_headers)
+            if (strcasecmp(key, header) == 0)
+                return true;
+        return false;
+    }
+
+    // Account for a freshly opened connection (TLS sessions hold tens of kilobytes each)
+    auto record_connection(ResponseState *state, esp_http_client_handle_t client) -> void
+    {
+        const auto heap_now = esp_get_free_heap_size();
+        const auto cost = state->heap_before > heap_now ? state->heap_before - heap_now : 0;
+        http_pool::set_heap_cost(client, cost);
+        if (esp_http_client_get_transport_type(client) != HTTP_TRANSPORT_OVER_SSL)
+            return;
+        const auto handshake_us = state->connected - state->started;
+        stats::record(stats::Stage::HANDSHAKE, handshake_us);
+        ESP_LOGI(TAG, "TLS handshake took %" PRId64 " ms, %" PRIu32 " bytes of heap", handshake_us / 1000, cost);
+    }
+
+    // "https://host" selects TLS, a bare host (or "http://host") plain TCP
+    auto split_scheme(const char *host, esp_http_client_transport_t *transport) -> const char *
+    {
+        constexpr auto https = "https://";
+        constexpr auto http = "http://";
+        *transport = HTTP_TRANSPORT_OVER_TCP;
+        if (strncasecmp(host, https, strlen(https)) == 0)
         {
-            ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-            ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-            s_retry_num = 0;
-            xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+            *transport = HTTP_TRANSPORT_OVER_SSL;
+            return host + strlen(https);
         }
+        if (strncasecmp(host, http, strlen(http)) == 0)
+            return host + strlen(http);
+        return host;
     }
 
     auto _http_event_handler(esp_http_client_event_t *evt) -> esp_err_t
     {
-        static char *output_buffer; // Buffer to store response of http request from event handler
-        static int output_len;      // Stores number of bytes read
+        auto state = (ResponseState *)evt->user_data;
         switch (evt->event_id)
         {
         case HTTP_EVENT_ERROR:
@@ -76,54 +139,39 @@ namespace
             break;
         case HTTP_EVENT_ON_CONNECTED:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+            state->connected = esp_timer_get_time();
+            stats::record(stats::Stage::CONNECT, state->connected - state->started);
+            record_connection(state, evt->client);
             break;
         case HTTP_EVENT_HEADER_SENT:
             ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
             break;
         case HTTP_EVENT_ON_HEADER:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+            if (state->first_header == 0)
+            {
+                state->first_header = esp_timer_get_time();
+                const auto ready = state->connected != 0 ? state->connected : state->started;
+                stats::record(stats::Stage::SEND, state->first_header - ready);
+            }
+            if (state->sink == NULL)
+                break;
+            send_status_once(state, evt->client);
+            if (state->sink->on_header && is_forwarded_header(evt->header_key))
+                state->sink->on_header(state->sink->ctx, evt->header_key, evt->header_value);
             break;
         case HTTP_EVENT_ON_DATA:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            /*
-             *  Check for chunked encoding is added as the URL for chunked encoding used in this example returns binary data.
-             *  However, event handler can also be used in case chunked encoding is used.
-             */
-            if (!esp_http_client_is_chunked_response(evt->client))
-            {
-                // If user_data buffer is configured, copy the response into the buffer
-                if (evt->user_data)
-                {
-                    memcpy(evt->user_data + output_len, evt->data, evt->data_len);
-                }
-                else
-                {
-                    if (output_buffer == NULL)
-                    {
-                        output_buffer = (char *)malloc(esp_http_client_get_content_length(evt->client));
-                        output_len = 0;
-                        if (output_buffer == NULL)
-                        {
-                            ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
-                            return ESP_FAIL;
-                        }
-                    }
-                    memcpy(output_buffer + output_len, evt->data, evt->data_len);
-                }
-                output_len += evt->data_len;
-            }
-
+            // Chunks are forwarded straight from the client buffer (chunked encoding is already decoded here).
+            // The sink blocks while the host link is busy, which in turn stops reading from the socket.
+            if (state->sink == NULL)
+                break;
+            send_status_once(state, evt->client);
+            if (state->sink->on_data)
+                state->sink->on_data(state->sink->ctx, (const char *)evt->data, evt->data_len);
             break;
         case HTTP_EVENT_ON_FINISH:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-            if (output_buffer != NULL)
-            {
-                // Response is accumulated in output_buffer. Uncomment the below line to print the accumulated response
-                // ESP_LOG_BUFFER_HEX(TAG, output_buffer, output_len);
-                free(output_buffer);
-                output_buffer = NULL;
-            }
-            output_len = 0;
             break;
         case HTTP_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
@@ -134,16 +182,169 @@ namespace
                 ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
                 ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
             }
-            if (output_buffer != NULL)
-            {
-                free(output_buffer);
-                output_buffer = NULL;
-            }
-            output_len = 0;
             break;
         }
         return ESP_OK;
     }
+
+    // Get a pooled client set up for a single request
+    auto acquire_client(esp_http_client_method_t method, const char *host, const char *path, ResponseState *state, bool *reused) -> esp_http_client_handle_t
+    {
+        esp_http_client_config_t client_config = {};
+        client_config.host = split_scheme(host, &client_config.transport_type);
+        client_config.path = path;
+        client_config.method = method;
+        client_config.event_handler = _http_event_handler;
+        if (client_config.transport_type == HTTP_TRANSPORT_OVER_SSL)
+        {
+            client_config.port = 443;
+#ifdef CONFIG_MODEM_HTTPS_PINNED_CERT
+            client_config.cert_pem = pinned_cert_start;
+#ifdef CONFIG_MODEM_HTTPS_SKIP_CN_CHECK
+            client_config.skip_cert_common_name_check = true;
+#endif
+#else
+            client_config.crt_bundle_attach = esp_crt_bundle_attach;
+#endif
+        }
+        else
+            client_config.port = 80;
+        client_config.user_data = state;
+        client_config.keep_alive_enable = true;
+        return http_pool::acquire(client_config, reused);
+    }
+
+    // Record the timing of the request and report the status code of responses that had neither headers nor body
+    auto finish_response(ResponseState *state, esp_http_client_handle_t client, esp_err_t err) -> void
+    {
+        if (err != ESP_OK)
+        {
+            const auto stage = state->first_header != 0                      ? stats::Stage::RECEIVE
+                               : state->connected != 0 || state->reused ? stats::Stage::SEND
+                                                                         : stats::Stage::CONNECT;
+            stats::record_error(stage);
+            stats::record_error(stats::Stage::TOTAL);
+            return;
+        }
+
+        const auto now = esp_timer_get_time();
+        if (state->first_header != 0)
+            stats::record(stats::Stage::RECEIVE, now - state->first_header);
+        stats::record(stats::Stage::TOTAL, now - state->started);
+        if (state->sink != NULL)
+            send_status_once(state, client);
+    }
+
+    auto wants_gzip(Compression compression, uint32_t len) -> bool
+    {
+        if (len < GZIP_MIN_SIZE)
+            return false;
+        return compression == Compression::GZIP || (compression == Compression::DEFAULT && GZIP_BY_DEFAULT);
+    }
+
+    auto account_gzip(uint32_t bytes_in, uint32_t bytes_out) -> void
+    {
+        gzip_requests += 1;
+        gzip_bytes_in += bytes_in;
+        gzip_bytes_out += bytes_out;
+    }
+
+    // Pooled handles keep their headers, so the body headers are set (or cleared) for every request
+    auto set_body_headers(esp_http_client_handle_t client, bool gzipped, bool chunked) -> void
+    {
+        if (gzipped)
+            esp_http_client_set_header(client, "Content-Encoding", "gzip");
+        else
+            esp_http_client_delete_header(client, "Content-Encoding");
+        esp_http_client_delete_header(client, chunked ? "Content-Length" : "Transfer-Encoding");
+    }
+
+    // Output of the encoder for a body that is already in memory
+    struct GzipBuffer
+    {
+        uint8_t *bytes;
+        size_t len;
+        size_t capacity;
+        bool overflow;
+    };
+
+    // Compress a whole body into a pool block. Returns NULL (and the body is sent as it is)
+    // if there is no encoder or block free, or if the body does not get smaller.
+    auto gzip_body(const char *body, size_t len, size_t *gzipped_len) -> uint8_t *
+    {
+        auto encoder = (gzip::Encoder *)gzip_pool.take();
+        GzipBuffer out = {NULL, 0, 0, false};
+        if (encoder != NULL)
+            out.bytes = (uint8_t *)pools::take(len, &out.capacity);
+        if (out.bytes == NULL)
+        {
+            if (encoder != NULL)
+                gzip_pool.give(encoder);
+            return NULL;
+        }
+        out.capacity = out.capacity < len ? out.capacity : len; // Anything bigger is not worth sending
+
+        const auto started = esp_timer_get_time();
+        const auto append = [](void *ctx, const uint8_t *bytes, size_t n)
+        {
+            auto out = (GzipBuffer *)ctx;
+            out->overflow |= out->len + n > out->capacity;
+            if (out->overflow)
+                return;
+            memcpy(out->bytes + out->len, bytes, n);
+            out->len += n;
+        };
+        gzip::init(*encoder, append, &out);
+        gzip::write(*encoder, (const uint8_t *)body, len);
+        gzip::finish(*encoder);
+        stats::record(stats::Stage::COMPRESS, esp_timer_get_time() - started);
+        gzip_pool.give(encoder);
+
+        if (out.overflow || out.len >= len)
+        {
+            pools::give(out.bytes);
+            return NULL;
+        }
+        account_gzip(len, out.len);
+        *gzipped_len = out.len;
+        return out.bytes;
+    }
+
+    auto write_all(esp_http_client_handle_t client, const char *data, int len) -> esp_err_t
+    {
+        for (auto written = 0; written < len;)
+        {
+            const auto n = esp_http_client_write(client, data + written, len - written);
+            if (n <= 0)
+                return ESP_FAIL;
+            written += n;
+        }
+        return ESP_OK;
+    }
+
+    // Compressed streams have no known length, the encoder output goes out with chunked encoding
+    struct ChunkWriter
+    {
+        esp_http_client_handle_t client;
+        esp_err_t err;
+        int64_t io_us; // Time spent writing to the socket, not compressing
+    };
+
+    auto write_chunk(void *ctx, const uint8_t *bytes, size_t len) -> void
+    {
+        auto w = (ChunkWriter *)ctx;
+        if (w->err != ESP_OK)
+            return;
+        const auto started = esp_timer_get_time();
+        char size_line[12];
+        const auto size_len = snprintf(size_line, sizeof(size_line), "%x\r\n", (unsigned)len);
+        w->err = write_all(w->client, size_line, size_len);
+        if (w->err == ESP_OK)
+            w->err = write_all(w->client, (const char *)bytes, len);
+        if (w->err == ESP_OK)
+            w->err = write_all(w->client, "\r\n", 2);
+        w->io_us += esp_timer_get_time() - started;
+    }
 }
 
 namespace network_helpers
@@ -153,6 +354,7 @@ namespace network_helpers
     {
         ESP_ERROR_CHECK(esp_netif_init());                // Initialize the networking interface
         ESP_ERROR_CHECK(esp_event_loop_create_default()); // Create default event loop
+        http_pool::init();                                // Prepare the keep-alive connection pool
     }
 
     // Initialize WiFi as access point + station
@@ -190,83 +392,179 @@ namespace network_helpers
         ESP_ERROR_CHECK(esp_wifi_start());
     }
 
-    // Initialize WiFi as a station
-    auto init_wifi_as_sta(const char *ssid, const char *pass) -> esp_err_t
+    // Scan for WiFi networks (blocks for the whole scan, returns 0 if WiFi cannot scan right now)
+    auto scan_wifi(wifi_ap_record_t *result, uint16_t max_result_size) -> uint16_t
     {
-        s_wifi_event_group = xEventGroupCreate();
-        esp_netif_create_default_wifi_sta();
+        memset(result, 0, sizeof(wifi_ap_record_t) * max_result_size); // Clear the memory
 
-        wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-        ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+        // Start scanning, hidden networks are reported with an empty SSID
+        wifi_scan_config_t scan_config = {};
+        scan_config.show_hidden = true;
+        if (esp_wifi_scan_start(&scan_config, true) != ESP_OK)
+            return 0;
 
-        esp_event_handler_instance_t instance_any_id;
-        esp_event_handler_instance_t instance_got_ip;
-        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                            ESP_EVENT_ANY_ID,
-                                                            &wifi_sta_event_handler,
-                                                            NULL,
-                                                            &instance_any_id));
-        ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                            IP_EVENT_STA_GOT_IP,
-                                                            &wifi_sta_event_handler,
-                                                            NULL,
-                                                            &instance_got_ip));
+        // Get results
+        uint16_t access_points_found = max_result_size;
+        if (esp_wifi_scan_get_ap_records(&access_points_found, result) != ESP_OK)
+            return 0;
 
-        wifi_config_t wifi_config = {};
-        strcpy((char *)wifi_config.sta.ssid, ssid);
-        strcpy((char *)wifi_config.sta.password, pass);
-        wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+        return access_points_found;
+    }
 
-        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
+    // Make an http request
+    auto make_http_request(esp_http_client_method_t method, const char *host, const char *path, const char *body, size_t body_len, const ResponseSink *sink, Compression compression) -> esp_err_t
+    {
+        // Compress before taking a connection, so it is not held while the CPU is busy
+        size_t gzipped_len = 0;
+        const auto gzipped = wants_gzip(compression, body_len) ? gzip_body(body, body_len, &gzipped_len) : NULL;
 
-        ESP_LOGI(TAG, "wifi_init_sta finished.");
+        auto state = make_state(sink);
+        auto client = acquire_client(method, host, path, &state, &state.reused);
+        if (client == NULL)
+        {
+            pools::give(gzipped);
+            return ESP_ERR_NO_MEM;
+        }
 
-        /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-         * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-        EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-                                               WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                                               pdFALSE,
-                                               pdFALSE,
-                                               portMAX_DELAY);
+        // Handles are reused, so the body always has to be set (or cleared)
+        set_body_headers(client, gzipped != NULL, false);
+        if (gzipped != NULL)
+            esp_http_client_set_post_field(client, (const char *)gzipped, gzipped_len);
+        else
+            esp_http_client_set_post_field(client, body, body_len);
+        auto err = esp_http_client_perform(client);
 
-        /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-         * happened. */
-        if (!(bits & WIFI_CONNECTED_BIT))
-            return ESP_FAIL;
-        return ESP_OK;
+        // The server may have closed an idle keep-alive connection, retry once on a fresh one.
+        // Only if nothing came back: past that point the server had the request, and the host part of the answer.
+        if (err != ESP_OK && state.reused && state.first_header == 0 && !state.status_sent)
+        {
+            ESP_LOGI(TAG, "Reused connection failed, reconnecting");
+            esp_http_client_close(client);
+            state.status_sent = false;
+            state.reused = false;
+            state.first_header = 0;
+            state.heap_before = esp_get_free_heap_size();
+            err = esp_http_client_perform(client);
+        }
+        finish_response(&state, client, err);
+        esp_http_client_set_post_field(client, NULL, 0); // Do not keep a pointer to the buffer freed below
+        http_pool::release(client, err == ESP_OK);
+        pools::give(gzipped);
+        return err;
     }
 
-    // Scan for WiFi networks
-    auto scan_wifi(wifi_ap_record_t *result, uint16_t max_result_size) -> uint16_t
+    // Make an http request with a body that is forwarded to the socket as it is being read.
+    // The UART driver keeps receiving into its ring buffer while a chunk is being written,
+    // so together with "chunk" it works as a double buffer and memory use does not depend on "body_len".
+    auto make_http_stream_request(esp_http_client_method_t method, const char *host, const char *path, uint32_t body_len, BodyReader read_body, const ResponseSink *sink, Compression compression) -> esp_err_t
     {
-        memset(result, 0, max_result_size); // Clear the memmory
-        esp_wifi_scan_start(NULL, true);    // Start scanning
+        // The encoder is only held while the body is being sent (the body goes out plain if none is free)
+        auto encoder = wants_gzip(compression, body_len) ? (gzip::Encoder *)gzip_pool.take() : NULL;
+        const auto send_len = encoder != NULL ? -1 : (int)body_len; // -1 selects chunked encoding
 
-        // Get results
-        uint16_t access_points_found = max_result_size;
-        ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&access_points_found, result));
+        auto state = make_state(sink);
+        auto client = acquire_client(method, host, path, &state, &state.reused);
+        if (client == NULL)
+        {
+            if (encoder != NULL)
+                gzip_pool.give(encoder);
+            // Still read the body, so the host stream stays in sync
+            char skipped[64];
+            for (auto remaining = body_len; remaining > 0;)
+            {
+                const auto len = read_body(skipped, remaining < sizeof(skipped) ? remaining : sizeof(skipped));
+                if (len <= 0)
+                    break;
+                remaining -= len;
+            }
+            return ESP_ERR_NO_MEM;
+        }
+        esp_http_client_set_post_field(client, NULL, 0);
+        set_body_headers(client, encoder != NULL, encoder != NULL);
 
-        return access_points_found;
-    }
+        // Send the headers, the body follows. Nothing was read from the host yet, so a stale
+        // keep-alive connection can still be replaced.
+        auto err = esp_http_client_open(client, send_len);
+        if (err != ESP_OK && state.reused)
+        {
+            state.reused = false;
+            state.heap_before = esp_get_free_heap_size();
+            esp_http_client_close(client);
+            err = esp_http_client_open(client, send_len);
+        }
+        if (err != ESP_OK)
+            ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
 
-    // Make an http request
-    auto make_http_request(esp_http_client_method_t method, const char *host, const char *path, const char *body) -> esp_err_t
-    {
-        esp_http_client_config_t client_config = {};
-        client_config.host = host;
-        client_config.path = "/";
-        client_config.transport_type = HTTP_TRANSPORT_OVER_TCP;
-        client_config.event_handler = _http_event_handler;
-        esp_http_client_handle_t client = esp_http_client_init(&client_config);
+        ChunkWriter writer = {client, err, 0};
+        int64_t compress_us = 0;
+        if (encoder != NULL)
+            gzip::init(*encoder, write_chunk, &writer);
 
-        esp_http_client_set_url(client, path);
-        esp_http_client_set_method(client, HTTP_METHOD_POST);
-        if (body != NULL)
+        // Forward the body chunk by chunk. Keep reading after an error so the host stream stays in sync.
+        static char chunk[STREAM_CHUNK_SIZE];
+        auto remaining = body_len;
+        while (remaining > 0)
         {
-            esp_http_client_set_post_field(client, body, strlen(body));
+            const auto len = read_body(chunk, remaining < STREAM_CHUNK_SIZE ? remaining : STREAM_CHUNK_SIZE);
+            if (len <= 0)
+            {
+                ESP_LOGE(TAG, "Streamed body ended %" PRIu32 " bytes early", remaining);
+                err = ESP_ERR_TIMEOUT;
+                break;
+            }
+            remaining -= len;
+            if (err != ESP_OK)
+                continue;
+            if (encoder == NULL)
+            {
+                err = write_all(client, chunk, len);
+                continue;
+            }
+            const auto started = esp_timer_get_time();
+            gzip::write(*encoder, (const uint8_t *)chunk, len);
+            compress_us += esp_timer_get_time() - started;
+            err = writer.err;
+        }
+
+        // Close the compressed stream and the chunked body
+        if (encoder != NULL)
+        {
+            if (err == ESP_OK)
+            {
+                const auto started = esp_timer_get_time();
+                gzip::finish(*encoder);
+                compress_us += esp_timer_get_time() - started;
+                err = writer.err == ESP_OK ? write_all(client, "0\r\n\r\n", 5) : writer.err;
+                stats::record(stats::Stage::COMPRESS, compress_us - writer.io_us);
+                account_gzip(encoder->size_in, encoder->size_out);
+            }
+            gzip_pool.give(encoder);
+        }
+
+        // Read the response (body chunks reach the sink through the event handler)
+        if (err == ESP_OK)
+        {
+            esp_http_client_fetch_headers(client);
+            if (esp_http_client_get_status_code(client) <= 0)
+                err = ESP_FAIL;
         }
-        return esp_http_client_perform(client);
+        while (err == ESP_OK && esp_http_client_read(client, chunk, STREAM_CHUNK_SIZE) > 0)
+            ;
+        finish_response(&state, client, err);
+
+        http_pool::release(client, err == ESP_OK && esp_http_client_is_complete_data_received(client));
+        return err;
+    }
+
+    auto compression_stats() -> CompressionStats
+    {
+        return CompressionStats{gzip_requests, gzip_bytes_in, gzip_bytes_out};
+    }
+
+    // Close idle keep-alive connections
+    auto close_connections(const char *host) -> uint8_t
+    {
+        esp_http_client_transport_t transport;
+        return http_pool::close(host != NULL ? split_scheme(host, &transport) : NULL);
     }
 }
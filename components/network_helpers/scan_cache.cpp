@@ -0,0 +1,153 @@
+#include "scan_cache.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "network_helpers.hpp"
+
+namespace
+{
+    using namespace scan_cache;
+
+    constexpr auto TAG = "SCAN_CACHE";
+    constexpr auto SCAN_INTERVAL_MS = 15000;    // Time between scans while scanning is wanted
+    constexpr auto DEMAND_WINDOW_MS = 60000;    // How long a refresh keeps scanning outside the portal
+    constexpr int64_t MAX_AGE_US = 60000000;    // Networks not seen for this long are dropped
+    constexpr auto TASK_STACK_SIZE = 3072;      //
+    constexpr auto TASK_PRIORITY = 3;           // Below everything on the command path
+
+    struct Entry
+    {
+        Network network;
+        int64_t seen_at; // esp_timer time of the last scan that found it
+    };
+
+    Entry entries[MAX_NETWORKS];
+    uint8_t entry_count = 0;
+    SemaphoreHandle_t mutex; // Guards "entries"
+    TaskHandle_t scan_task = NULL;
+    volatile int64_t demand_until = 0; // Scanning outside the portal is wanted until then
+
+    auto same_network(const Network &n, const wifi_ap_record_t &ap) -> bool
+    {
+        if (ap.ssid[0] == '\0')
+            return n.ssid[0] == '\0' && memcmp(n.bssid, ap.bssid, sizeof(n.bssid)) == 0;
+        return strcmp(n.ssid, (const char *)ap.ssid) == 0;
+    }
+
+    // Fold a scan result into the cache, "scan_at" tells apart the first sighting in this scan
+    auto merge_locked(const wifi_ap_record_t &ap, int64_t scan_at) -> void
+    {
+        Entry *entry = NULL;
+        for (uint8_t i = 0; i < entry_count && entry == NULL; i++)
+            if (same_network(entries[i].network, ap))
+                entry = &entries[i];
+
+        // A full cache gives up its weakest network for a stronger one
+        if (entry == NULL && entry_count < MAX_NETWORKS)
+            entry = &entries[entry_count++];
+        else if (entry == NULL)
+        {
+            entry = &entries[MAX_NETWORKS - 1]; // Sorted, so the last one is the weakest
+            if (entry->network.rssi >= ap.rssi)
+                return;
+        }
+        else if (entry->seen_at == scan_at && entry->network.rssi >= ap.rssi)
+            return; // Another access point of the same network is stronger
+
+        auto &n = entry->network;
+        memcpy(n.ssid, ap.ssid, sizeof(n.ssid)); // Same size, NUL-terminated by the driver
+        memcpy(n.bssid, ap.bssid, sizeof(n.bssid));
+        n.rssi = ap.rssi;
+        n.channel = ap.primary;
+        n.authmode = ap.authmode;
+        entry->seen_at = scan_at;
+    }
+
+    // Drop networks that are gone and sort the rest, strongest first
+    auto tidy_locked(int64_t now) -> void
+    {
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < entry_count; i++)
+            if (now - entries[i].seen_at <= MAX_AGE_US)
+                entries[kept++] = entries[i];
+        entry_count = kept;
+
+        for (uint8_t i = 1; i < entry_count; i++)
+        {
+            const auto e = entries[i];
+            auto j = i;
+            for (; j > 0 && entries[j - 1].network.rssi < e.network.rssi; j--)
+                entries[j] = entries[j - 1];
+            entries[j] = e;
+        }
+    }
+
+    // Scans run while the portal is up (AP + station) or for a while after the host asked for one
+    auto scan_wanted() -> bool
+    {
+        wifi_mode_t mode;
+        if (esp_wifi_get_mode(&mode) != ESP_OK || mode == WIFI_MODE_NULL || mode == WIFI_MODE_AP)
+            return false; // WiFi is not running, or cannot scan
+        return mode == WIFI_MODE_APSTA || esp_timer_get_time() < demand_until;
+    }
+
+    auto scan_loop(void *arg) -> void
+    {
+        static wifi_ap_record_t found[MAX_NETWORKS];
+        while (true)
+        {
+            if (scan_wanted())
+            {
+                const auto count = network_helpers::scan_wifi(found, MAX_NETWORKS);
+                const auto now = esp_timer_get_time();
+                xSemaphoreTake(mutex, portMAX_DELAY);
+                for (uint16_t i = 0; i < count; i++)
+                    merge_locked(found[i], now);
+                tidy_locked(now);
+                xSemaphoreGive(mutex);
+                ESP_LOGD(TAG, "Scan found %u access points, %u networks cached", count, entry_count);
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SCAN_INTERVAL_MS));
+        }
+    }
+}
+
+namespace scan_cache
+{
+    auto start() -> void
+    {
+        if (scan_task != NULL)
+            return;
+        mutex = xSemaphoreCreateMutex();
+        xTaskCreatePinnedToCore(scan_loop, "scan_cache", TASK_STACK_SIZE, NULL, TASK_PRIORITY, &scan_task, CONFIG_MODEM_NETWORK_CORE);
+    }
+
+    auto refresh() -> void
+    {
+        demand_until = esp_timer_get_time() + DEMAND_WINDOW_MS * 1000LL;
+        if (scan_task != NULL)
+            xTaskNotifyGive(scan_task);
+    }
+
+    auto snapshot(Network *networks, uint8_t max) -> uint8_t
+    {
+        if (scan_task == NULL)
+            return 0;
+        const auto now = esp_timer_get_time();
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto count = entry_count < max ? entry_count : max;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            networks[i] = entries[i].network;
+            networks[i].age_s = (now - entries[i].seen_at) / 1000000;
+        }
+        xSemaphoreGive(mutex);
+        return count;
+    }
+}
@@ -0,0 +1,374 @@
+#include "wifi_link.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+
+namespace
+{
+    using namespace wifi_link;
+
+    constexpr auto TAG = "WIFI_LINK";
+    constexpr auto TASK_STACK_SIZE = 4096; // Listener writes to the host and to NVS on this stack
+    constexpr auto TASK_PRIORITY = 6;      // Above the workers, link events are short
+    constexpr auto QUEUE_LENGTH = 8;
+    constexpr uint32_t BACKOFF_BASE_MS = 500;  // Delay after the first failed attempt, doubled on every further one
+    constexpr uint32_t BACKOFF_MAX_MS = 60000; //
+    constexpr uint32_t FAILOVER_AFTER = 3;     // Failed attempts before asking the selector for another network
+    constexpr EventBits_t UP_BIT = BIT0;
+#if CONFIG_MODEM_WIFI_PS_NONE
+    constexpr auto POWER_SAVE = WIFI_PS_NONE;
+    constexpr uint16_t LISTEN_INTERVAL = 0; // Driver default
+#elif CONFIG_MODEM_WIFI_PS_MAX_MODEM
+    constexpr auto POWER_SAVE = WIFI_PS_MAX_MODEM;
+    constexpr uint16_t LISTEN_INTERVAL = CONFIG_MODEM_WIFI_LISTEN_INTERVAL;
+#else
+    constexpr auto POWER_SAVE = WIFI_PS_MIN_MODEM;
+    constexpr uint16_t LISTEN_INTERVAL = 0;
+#endif
+
+    // Events forwarded from the default event loop to the manager task
+    enum class Kind : uint8_t
+    {
+        STARTED,
+        DISCONNECTED,
+        GOT_IP,
+        LOST_IP,
+        KICK, // "start" called again, retry right away
+    };
+
+    struct Event
+    {
+        Kind kind;
+        uint8_t reason; // Disconnect reason (wifi_err_reason_t)
+        uint32_t ip;    // Address (GOT_IP)
+    };
+
+    QueueHandle_t events;
+    EventGroupHandle_t link_bits;
+    esp_netif_t *station = NULL;
+    Listener listener = NULL;
+    Selector selector = NULL;
+    wifi_config_t wifi_config = {};
+    volatile State current = State::IDLE;
+    uint32_t failures = 0; // Failed attempts since the link was last up
+    int64_t started = 0;   // When "start" was called, until the link is up for the first time
+
+    auto set_state(State state, const char *detail) -> void
+    {
+        current = state;
+        if (state == State::UP)
+            xEventGroupSetBits(link_bits, UP_BIT);
+        else
+            xEventGroupClearBits(link_bits, UP_BIT);
+        ESP_LOGI(TAG, "%s %s", state_name(state), detail != NULL ? detail : "");
+        if (listener != NULL)
+            listener(state, detail);
+    }
+
+    // A static address skips DHCP altogether (GOT_IP is posted as soon as the link is up), without one DHCP runs again
+    auto apply_address(const Address &address) -> void
+    {
+        if (address.ip == 0)
+        {
+            esp_netif_dhcpc_start(station); // Already running unless the previous network had a static address
+            return;
+        }
+        esp_netif_dhcpc_stop(station);
+        esp_netif_ip_info_t ip_info = {};
+        ip_info.ip.addr = address.ip;
+        ip_info.netmask.addr = address.netmask;
+        ip_info.gw.addr = address.gateway;
+        esp_netif_set_ip_info(station, &ip_info);
+        if (address.dns != 0)
+        {
+            esp_netif_dns_info_t dns = {};
+            dns.ip.u_addr.ip4.addr = address.dns;
+            dns.ip.type = ESP_IPADDR_TYPE_V4;
+            esp_netif_set_dns_info(station, ESP_NETIF_DNS_MAIN, &dns);
+        }
+    }
+
+    auto connect() -> void
+    {
+        set_state(State::CONNECTING, NULL);
+        esp_wifi_connect();
+    }
+
+    // Ask the selector for a network, returns true if the station was switched to another one
+    auto select(const char *failed) -> bool
+    {
+        Network next = {};
+        if (selector == NULL || !selector(failed, &next))
+            return false;
+        if (strlen(next.ssid) >= sizeof(wifi_config.sta.ssid) || strlen(next.pass) >= sizeof(wifi_config.sta.password))
+            return false;
+        if (failed != NULL && strcmp(next.ssid, failed) == 0)
+            return false; // Still the best network around, keep backing off
+
+        ESP_LOGI(TAG, "Joining '%s' (channel %u)", next.ssid, next.channel);
+        memset(&wifi_config.sta, 0, sizeof(wifi_config.sta));
+        strcpy((char *)wifi_config.sta.ssid, next.ssid);
+        strcpy((char *)wifi_config.sta.password, next.pass);
+        wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+        wifi_config.sta.listen_interval = LISTEN_INTERVAL;
+        if (next.channel != 0)
+        {
+            wifi_config.sta.bssid_set = true;
+            memcpy(wifi_config.sta.bssid, next.bssid, sizeof(next.bssid));
+            wifi_config.sta.channel = next.channel;
+        }
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+        apply_address(next.address); // The address of the previous network is no use on this one
+        return true;
+    }
+
+    // Exponential backoff with +-12.5% jitter, so a fleet does not hammer a recovering access point in sync
+    auto backoff_ms() -> uint32_t
+    {
+        const auto shift = failures < 8 ? failures - 1 : 7;
+        auto delay = BACKOFF_BASE_MS << shift;
+        delay = delay < BACKOFF_MAX_MS ? delay : BACKOFF_MAX_MS;
+        return delay - delay / 8 + esp_random() % (delay / 4);
+    }
+
+    // Returns the delay before the next attempt
+    auto on_disconnected(uint8_t reason) -> uint32_t
+    {
+        failures += 1;
+
+        // The cached access point may have moved to another channel (or been replaced), fall back to a full scan at once
+        if (wifi_config.sta.bssid_set)
+        {
+            ESP_LOGI(TAG, "Cached access point not found, scanning all channels");
+            wifi_config.sta.bssid_set = false;
+            wifi_config.sta.channel = 0;
+            esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+            connect();
+            return 0;
+        }
+
+        // The network keeps failing, another known one may be in range
+        if (failures % FAILOVER_AFTER == 0 && select((const char *)wifi_config.sta.ssid))
+        {
+            connect();
+            return 0;
+        }
+
+        const auto delay = backoff_ms();
+        char detail[40];
+        snprintf(detail, sizeof(detail), "reason=%u retry_ms=%" PRIu32, reason, delay);
+        set_state(State::BACKOFF, detail);
+        return delay;
+    }
+
+    auto manager_task(void *arg) -> void
+    {
+        Event ev;
+        auto retry_at = (TickType_t)0;
+        while (true)
+        {
+            // Sleep until the next event, or until the backoff runs out
+            auto wait = (TickType_t)portMAX_DELAY;
+            if (current == State::BACKOFF)
+            {
+                const auto now = xTaskGetTickCount();
+                wait = (int32_t)(retry_at - now) > 0 ? retry_at - now : 0;
+            }
+            if (xQueueReceive(events, &ev, wait) != pdTRUE)
+            {
+                connect();
+                continue;
+            }
+
+            switch (ev.kind)
+            {
+            case Kind::STARTED:
+                // Without a known access point the selector scans anyway, and may know a better network
+                if (!wifi_config.sta.bssid_set)
+                    select(NULL);
+                connect();
+                break;
+            case Kind::KICK:
+                if (current == State::BACKOFF)
+                    connect();
+                break;
+            case Kind::DISCONNECTED:
+            {
+                const auto delay = on_disconnected(ev.reason);
+                retry_at = xTaskGetTickCount() + pdMS_TO_TICKS(delay);
+                break;
+            }
+            case Kind::GOT_IP:
+            {
+                failures = 0;
+                char ip[16];
+                esp_ip4_addr_t addr = {ev.ip};
+                esp_ip4addr_ntoa(&addr, ip, sizeof(ip));
+                if (started != 0)
+                {
+                    ESP_LOGI(TAG, "Connected in %" PRId64 " ms", (esp_timer_get_time() - started) / 1000);
+                    started = 0;
+                }
+                set_state(State::UP, ip);
+                break;
+            }
+            case Kind::LOST_IP:
+                // Still associated, the DHCP client keeps trying on its own
+                if (current == State::UP)
+                    set_state(State::CONNECTING, "lost_ip");
+                break;
+            }
+        }
+    }
+
+    // Take over a driver that is already started. The access point is shut down, and a station that is
+    // still connected keeps its link (and address): there are no start or connect events to wait for.
+    auto adopt(esp_netif_t *netif, wifi_mode_t mode) -> esp_err_t
+    {
+        if (mode != WIFI_MODE_STA)
+            ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+        esp_wifi_set_ps(POWER_SAVE); // The portal ran without power save
+
+        wifi_ap_record_t ap;
+        esp_netif_ip_info_t ip_info = {};
+        auto ev = Event{Kind::STARTED, 0, 0};
+        if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK && ip_info.ip.addr != 0)
+            ev = Event{Kind::GOT_IP, 0, ip_info.ip.addr};
+        else
+            ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+        xQueueSend(events, &ev, 0);
+        return ESP_OK;
+    }
+
+    // Runs on the default event loop task, so it only hands the event over
+    auto event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) -> void
+    {
+        auto ev = Event{};
+        if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+            ev.kind = Kind::STARTED;
+        else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+        {
+            ev.kind = Kind::DISCONNECTED;
+            ev.reason = ((wifi_event_sta_disconnected_t *)event_data)->reason;
+        }
+        else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+        {
+            ev.kind = Kind::GOT_IP;
+            ev.ip = ((ip_event_got_ip_t *)event_data)->ip_info.ip.addr;
+        }
+        else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP)
+            ev.kind = Kind::LOST_IP;
+        else
+            return;
+        xQueueSend(events, &ev, 0);
+    }
+}
+
+namespace wifi_link
+{
+    auto start(const char *ssid, const char *pass, const StationHint &hint, Listener on_change, Selector on_select) -> esp_err_t
+    {
+        if (current != State::IDLE)
+        {
+            const auto ev = Event{Kind::KICK, 0, 0};
+            xQueueSend(events, &ev, 0);
+            return ESP_OK;
+        }
+        if (strlen(ssid) >= sizeof(wifi_config.sta.ssid) || strlen(pass) >= sizeof(wifi_config.sta.password))
+            return ESP_ERR_INVALID_ARG;
+
+        started = esp_timer_get_time();
+        listener = on_change;
+        selector = on_select;
+        events = xQueueCreate(QUEUE_LENGTH, sizeof(Event));
+        link_bits = xEventGroupCreate();
+
+        // The provisioning portal hands over a running WiFi driver, usually with the station already connected
+        wifi_mode_t mode;
+        const auto adopted = esp_wifi_get_mode(&mode) == ESP_OK;
+        station = adopted ? esp_netif_get_handle_from_ifkey("WIFI_STA_DEF") : esp_netif_create_default_wifi_sta();
+        if (!adopted)
+        {
+            wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+            ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+        }
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, NULL));
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, NULL));
+
+        if (hint.address.ip != 0 && !adopted)
+            apply_address(hint.address);
+
+        // With a cached access point the station probes a single channel for a single BSSID
+        strcpy((char *)wifi_config.sta.ssid, ssid);
+        strcpy((char *)wifi_config.sta.password, pass);
+        wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+        wifi_config.sta.listen_interval = LISTEN_INTERVAL;
+        if (hint.channel != 0)
+        {
+            wifi_config.sta.bssid_set = true;
+            memcpy(wifi_config.sta.bssid, hint.bssid, sizeof(hint.bssid));
+            wifi_config.sta.channel = hint.channel;
+        }
+
+        current = State::CONNECTING;
+        xTaskCreatePinnedToCore(manager_task, "wifi_link", TASK_STACK_SIZE, NULL, TASK_PRIORITY, NULL, CONFIG_MODEM_NETWORK_CORE); // Same core as the WiFi driver
+        if (adopted)
+            return adopt(station, mode);
+        ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+        ESP_ERROR_CHECK(esp_wifi_start());
+        esp_wifi_set_ps(POWER_SAVE);
+        return ESP_OK;
+    }
+
+    auto state() -> State
+    {
+        return current;
+    }
+
+    auto ssid() -> const char *
+    {
+        return (const char *)wifi_config.sta.ssid;
+    }
+
+    auto wait_up(TickType_t timeout) -> bool
+    {
+        if (current == State::IDLE)
+            return false;
+        return (xEventGroupWaitBits(link_bits, UP_BIT, pdFALSE, pdTRUE, timeout) & UP_BIT) != 0;
+    }
+
+    auto access_point(uint8_t *bssid, uint8_t *channel) -> bool
+    {
+        wifi_ap_record_t ap;
+        if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+            return false;
+        memcpy(bssid, ap.bssid, sizeof(ap.bssid));
+        *channel = ap.primary;
+        return true;
+    }
+
+    auto state_name(State state) -> const char *
+    {
+        switch (state)
+        {
+        case State::IDLE:
+            return "IDLE";
+        case State::CONNECTING:
+            return "CONNECTING";
+        case State::UP:
+            return "UP";
+        case State::BACKOFF:
+            return "DOWN";
+        }
+        return "";
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "esp_err.h"
+#include "inttypes.h"
+
+// Firmware update streamed over the host link.
+// Blocks go straight into the inactive OTA slot as they arrive (see ota_blocks.hpp for the protocol),
+// the progress is saved so an interrupted update picks up where it stopped, and a new image stays
+// on trial until the host reaches it: if it does not, the bootloader goes back to the previous one.
+namespace ota
+{
+    typedef int (*Reader)(char *buf, int max_len); // Fills "buf" with the next part of a block, returns 0 on failure
+
+    // Outcome of a block, the host continues from "next" unless the update failed
+    enum class Block
+    {
+        ACK,    // Written (or written before)
+        RESEND, // Lost, corrupted or out of order
+        FAILED, // Flash error or no update in progress
+    };
+
+    // Where the host starts and how it sends
+    struct Offer
+    {
+        uint32_t offset;    // Bytes already in flash from an interrupted update
+        uint32_t max_block; // Largest block accepted
+        uint32_t window;    // Blocks the host may send before waiting for an answer
+    };
+
+    struct Stats
+    {
+        bool active;           // Update in progress
+        uint32_t image_size;
+        uint32_t received;     // Bytes in flash
+        uint32_t resumed_from; // Bytes that were already in flash when the update (re)started
+        uint32_t elapsed_ms;   // Since the update (re)started, until it finished
+        uint32_t blocks;
+        uint32_t duplicates;
+        uint32_t rejected;     // Blocks the host had to send again
+    };
+
+    auto init() -> void;         // Put a freshly updated image on trial
+    auto confirm_boot() -> void; // The host got through, keep the running image (cheap when not on trial)
+    auto begin(uint32_t image_size, uint32_t image_crc, Offer *offer) -> esp_err_t;
+    auto receive_block(uint32_t offset, uint32_t crc, uint32_t len, Reader read, uint32_t *next) -> Block; // Always consumes "len" bytes from "read"
+    auto finish() -> esp_err_t;  // Verify the image and boot it on the next restart
+    auto abort() -> void;        // Drop the update and its resume point
+    auto can_roll_back() -> bool;
+    auto rollback() -> esp_err_t; // Boot the previous image on the next restart, the caller restarts
+    auto stats() -> Stats;
+    auto running_slot() -> const char *; // Label of the running partition
+    auto trial_state() -> const char *;  // "TRIAL", "VALID" or "ROLLED_BACK" (the last update did not survive its trial)
+}
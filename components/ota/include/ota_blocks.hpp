@@ -0,0 +1,42 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+
+// Block protocol used to stream a firmware image over the UART link.
+// This module has no ESP-IDF dependencies so the same code can be compiled on the host side.
+//
+// The host announces the image size and its CRC-32, then sends blocks of at most "max_block" bytes,
+// each tagged with its offset and its own CRC-32. Up to "window" blocks may be in flight. Every block
+// is answered with the offset the modem expects next: a block that arrives out of order (because an
+// earlier one was lost) is rejected with that offset and the host goes back to it. Blocks below it were
+// already written and are acknowledged again without touching the flash.
+namespace ota_blocks
+{
+    // What to do with a received block
+    enum class Verdict
+    {
+        WRITE,        // Next block in sequence, write it and call "accept"
+        DUPLICATE,    // Already written (a retransmission), acknowledge it
+        OUT_OF_ORDER, // An earlier block is missing, ask for "next" again
+        BAD_CRC,      // Corrupted on the way, ask for "next" again
+        TOO_LONG,     // Runs past the end of the image
+    };
+
+    struct Receiver
+    {
+        uint32_t image_size;
+        uint32_t image_crc;   // CRC-32 of the whole image, announced by the host
+        uint32_t next;        // Offset of the next block to write (everything before it is in flash)
+        uint32_t crc;         // CRC-32 of the bytes before "next"
+        uint32_t blocks;      // Blocks written
+        uint32_t duplicates;  // Blocks received twice
+        uint32_t rejected;    // Blocks that had to be sent again (lost, corrupted or out of order)
+    };
+
+
+    auto start(Receiver &r, uint32_t image_size, uint32_t image_crc, uint32_t offset = 0, uint32_t prefix_crc = 0) -> void; // Resumes at "offset" if it is not 0
+    auto check(Receiver &r, uint32_t offset, const uint8_t *data, size_t len, uint32_t crc) -> Verdict;                    // Classify a block (counts rejects)
+    auto accept(Receiver &r, const uint8_t *data, size_t len) -> void;                                                      // The block "check" returned WRITE for is in flash
+    auto complete(const Receiver &r) -> bool;                                                                                // Whole image received and its CRC matches
+}
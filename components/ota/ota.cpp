@@ -0,0 +1,355 @@
+#include "ota.hpp"
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "stdlib.h"
+#include "string.h"
+#include <atomic>
+
+#include "checksum.hpp"
+#include "ota_blocks.hpp"
+
+namespace
+{
+    using namespace ota;
+
+    constexpr auto TAG = "OTA";
+    constexpr auto NAMESPACE = "ota";
+    constexpr auto RESUME_KEY = "resume";
+    constexpr uint32_t BUFFER_SIZE = 4096;          // One flash sector, also the largest block
+    constexpr uint32_t MAX_BLOCK = CONFIG_MODEM_OTA_BLOCK_SIZE;
+    constexpr uint32_t SAVE_EVERY = 64 * 1024;      // Bytes between two saved resume points (limits NVS wear)
+    constexpr uint32_t COMMAND_OVERHEAD = 64;       // "ESP_CMD OTA WRITE <offset> <crc> ESP_DATA_STREAM <len>" line
+    constexpr uint32_t WINDOW = CONFIG_MODEM_UART_RX_BUFFER_SIZE / (MAX_BLOCK + COMMAND_OVERHEAD); // Blocks that fit in the UART ring while a sector is erased
+    static_assert(MAX_BLOCK <= BUFFER_SIZE, "A block must fit in the buffer");
+
+    // Resume point kept in NVS, only valid for the same image going to the same slot
+    struct ResumePoint
+    {
+        uint32_t slot_address;
+        uint32_t image_size;
+        uint32_t image_crc;
+        uint32_t offset;
+        uint32_t prefix_crc; // CRC-32 of the first "offset" bytes of the slot
+    };
+
+    const esp_partition_t *slot = NULL; // Slot being written, NULL when no update is in progress
+    esp_ota_handle_t handle;
+    uint8_t *buffer = NULL;
+    ota_blocks::Receiver receiver;
+    uint32_t saved_offset = 0;
+    uint32_t resumed_from = 0;
+    int64_t started_us = 0;
+    int64_t finished_us = 0;
+
+    std::atomic<bool> on_trial = {false};
+    esp_timer_handle_t trial_timer = NULL;
+
+    auto load_resume_point(ResumePoint *point) -> bool
+    {
+        nvs_handle_t nvs;
+        if (nvs_open(NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+            return false;
+        auto size = sizeof(*point);
+        const auto err = nvs_get_blob(nvs, RESUME_KEY, point, &size);
+        nvs_close(nvs);
+        return err == ESP_OK && size == sizeof(*point);
+    }
+
+    auto save_resume_point() -> void
+    {
+        const ResumePoint point = {slot->address, receiver.image_size, receiver.image_crc, receiver.next, receiver.crc};
+        nvs_handle_t nvs;
+        if (nvs_open(NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+            return;
+        nvs_set_blob(nvs, RESUME_KEY, &point, sizeof(point));
+        nvs_commit(nvs);
+        nvs_close(nvs);
+        saved_offset = receiver.next;
+    }
+
+    auto forget_resume_point() -> void
+    {
+        nvs_handle_t nvs;
+        if (nvs_open(NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+            return;
+        nvs_erase_key(nvs, RESUME_KEY);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+
+    auto prefix_crc(uint32_t len) -> uint32_t
+    {
+        uint32_t crc = 0;
+        for (uint32_t pos = 0; pos < len; pos += BUFFER_SIZE)
+        {
+            const auto n = len - pos < BUFFER_SIZE ? len - pos : BUFFER_SIZE;
+            if (esp_partition_read(slot, pos, buffer, n) != ESP_OK)
+                return ~crc; // Cannot match
+            crc = checksum::crc32(buffer, n, crc);
+        }
+        return crc;
+    }
+
+    // A fresh handle starts writing at offset 0, so the part that survived is fed through it again.
+    // Each sector is read before the handle erases it, nothing crosses the UART.
+    auto replay_prefix(uint32_t len) -> esp_err_t
+    {
+        for (uint32_t pos = 0; pos < len; pos += BUFFER_SIZE)
+        {
+            const auto n = len - pos < BUFFER_SIZE ? len - pos : BUFFER_SIZE;
+            auto err = esp_partition_read(slot, pos, buffer, n);
+            if (err == ESP_OK)
+                err = esp_ota_write(handle, buffer, n);
+            if (err != ESP_OK)
+                return err;
+        }
+        return ESP_OK;
+    }
+
+    auto close_session() -> void
+    {
+        free(buffer);
+        buffer = NULL;
+        slot = NULL;
+        finished_us = esp_timer_get_time();
+    }
+
+    auto fail_session(esp_err_t err) -> void
+    {
+        ESP_LOGE(TAG, "Update failed at %" PRIu32 " (%s), resume point kept at %" PRIu32, receiver.next, esp_err_to_name(err), saved_offset);
+        esp_ota_abort(handle);
+        close_session();
+    }
+
+    // The new image was not reached by the host in time
+    auto trial_expired(void *arg) -> void
+    {
+        if (!on_trial.exchange(false))
+            return;
+        ESP_LOGE(TAG, "No command received since the update, going back to the previous image");
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+}
+
+namespace ota
+{
+    auto init() -> void
+    {
+#if CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+        esp_ota_img_states_t state;
+        if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY)
+            return;
+        ESP_LOGW(TAG, "Running a new image on trial");
+        on_trial = true;
+#if CONFIG_MODEM_OTA_TRIAL_TIMEOUT_S > 0
+        esp_timer_create_args_t args = {};
+        args.callback = trial_expired;
+        args.name = "ota_trial";
+        ESP_ERROR_CHECK(esp_timer_create(&args, &trial_timer));
+        esp_timer_start_once(trial_timer, CONFIG_MODEM_OTA_TRIAL_TIMEOUT_S * 1000000LL);
+#endif
+#endif
+    }
+
+    auto confirm_boot() -> void
+    {
+        if (!on_trial.exchange(false))
+            return;
+        if (trial_timer != NULL)
+            esp_timer_stop(trial_timer);
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "New image confirmed");
+    }
+
+    auto begin(uint32_t image_size, uint32_t image_crc, Offer *offer) -> esp_err_t
+    {
+        // The host reconnected without the modem restarting, carry on from memory
+        if (slot != NULL && receiver.image_size == image_size && receiver.image_crc == image_crc)
+        {
+            *offer = {receiver.next, MAX_BLOCK, WINDOW > 0 ? WINDOW : 1};
+            return ESP_OK;
+        }
+        if (slot != NULL)
+            ota::abort(); // A different image, start over
+
+        const auto next = esp_ota_get_next_update_partition(NULL);
+        if (next == NULL)
+            return ESP_ERR_NOT_FOUND;
+        if (image_size == 0 || image_size > next->size)
+            return ESP_ERR_INVALID_SIZE;
+        buffer = (uint8_t *)malloc(BUFFER_SIZE);
+        if (buffer == NULL)
+            return ESP_ERR_NO_MEM;
+        slot = next;
+
+        // Sectors are erased one by one as the image arrives instead of all at once up front
+        auto err = esp_ota_begin(slot, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+        if (err != ESP_OK)
+        {
+            close_session();
+            return err;
+        }
+
+        // Only trust what an earlier attempt wrote if it still reads back the same
+        ResumePoint point;
+        auto offset = 0u;
+        auto crc = 0u;
+        if (load_resume_point(&point) && point.slot_address == slot->address && point.image_size == image_size &&
+            point.image_crc == image_crc && point.offset <= image_size && prefix_crc(point.offset) == point.prefix_crc)
+        {
+            err = replay_prefix(point.offset);
+            if (err != ESP_OK)
+            {
+                fail_session(err);
+                return err;
+            }
+            offset = point.offset;
+            crc = point.prefix_crc;
+            ESP_LOGI(TAG, "Resuming update of %s at %" PRIu32 " of %" PRIu32, slot->label, offset, image_size);
+        }
+        else
+            ESP_LOGI(TAG, "Updating %s with %" PRIu32 " bytes", slot->label, image_size);
+
+        ota_blocks::start(receiver, image_size, image_crc, offset, crc);
+        saved_offset = offset;
+        resumed_from = offset;
+        started_us = esp_timer_get_time();
+        finished_us = 0;
+        *offer = {offset, MAX_BLOCK, WINDOW > 0 ? WINDOW : 1};
+        return ESP_OK;
+    }
+
+    auto receive_block(uint32_t offset, uint32_t crc, uint32_t len, Reader read, uint32_t *next) -> Block
+    {
+        // Read the whole block first, so the link stays in step even when it is rejected
+        auto fits = slot != NULL && len <= MAX_BLOCK;
+        static char sink[64];
+        for (uint32_t got = 0; got < len;)
+        {
+            const auto want = len - got;
+            const auto n = fits ? read((char *)buffer + got, want) : read(sink, want < sizeof(sink) ? want : sizeof(sink));
+            if (n <= 0)
+            {
+                fits = false; // Timed out, the rest of the block is lost
+                break;
+            }
+            got += n;
+        }
+        if (slot == NULL)
+            return Block::FAILED;
+        *next = receiver.next;
+        if (!fits)
+        {
+            receiver.rejected += 1;
+            return Block::RESEND;
+        }
+
+        switch (ota_blocks::check(receiver, offset, buffer, len, crc))
+        {
+        case ota_blocks::Verdict::WRITE:
+            break;
+        case ota_blocks::Verdict::DUPLICATE:
+            return Block::ACK;
+        default:
+            return Block::RESEND;
+        }
+
+        const auto err = esp_ota_write(handle, buffer, len);
+        if (err != ESP_OK)
+        {
+            fail_session(err);
+            return Block::FAILED;
+        }
+        ota_blocks::accept(receiver, buffer, len);
+        if (receiver.next - saved_offset >= SAVE_EVERY)
+            save_resume_point();
+        *next = receiver.next;
+        return Block::ACK;
+    }
+
+    auto finish() -> esp_err_t
+    {
+        if (slot == NULL)
+            return ESP_ERR_INVALID_STATE;
+        if (!ota_blocks::complete(receiver))
+        {
+            ESP_LOGE(TAG, "Image incomplete or corrupted (%" PRIu32 " of %" PRIu32 " bytes)", receiver.next, receiver.image_size);
+            return receiver.next == receiver.image_size ? ESP_ERR_INVALID_CRC : ESP_ERR_INVALID_STATE;
+        }
+
+        // esp_ota_end checks the image headers and its hash before it can be booted
+        const auto target = slot;
+        auto err = esp_ota_end(handle);
+        close_session();
+        forget_resume_point();
+        if (err == ESP_OK)
+            err = esp_ota_set_boot_partition(target);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Image rejected (%s)", esp_err_to_name(err));
+            return err;
+        }
+        ESP_LOGI(TAG, "Image written to %s, it boots on the next restart", target->label);
+        return ESP_OK;
+    }
+
+    auto abort() -> void
+    {
+        if (slot != NULL)
+        {
+            esp_ota_abort(handle);
+            close_session();
+        }
+        forget_resume_point();
+    }
+
+    auto can_roll_back() -> bool
+    {
+        return esp_ota_check_rollback_is_possible();
+    }
+
+    auto rollback() -> esp_err_t
+    {
+        // With two app slots the previous image is in the one an update would go to
+        const auto previous = esp_ota_get_next_update_partition(NULL);
+        if (previous == NULL)
+            return ESP_ERR_NOT_FOUND;
+        const auto err = esp_ota_set_boot_partition(previous); // Checks the image before selecting it
+        if (err == ESP_OK)
+            on_trial = false; // The trial timer must not restart before the host got its answer
+        return err;
+    }
+
+    auto stats() -> Stats
+    {
+        const auto until = finished_us != 0 ? finished_us : esp_timer_get_time();
+        return Stats{
+            .active = slot != NULL,
+            .image_size = receiver.image_size,
+            .received = receiver.next,
+            .resumed_from = resumed_from,
+            .elapsed_ms = started_us != 0 ? (uint32_t)((until - started_us) / 1000) : 0,
+            .blocks = receiver.blocks,
+            .duplicates = receiver.duplicates,
+            .rejected = receiver.rejected,
+        };
+    }
+
+    auto running_slot() -> const char *
+    {
+        return esp_ota_get_running_partition()->label;
+    }
+
+    auto trial_state() -> const char *
+    {
+        if (on_trial)
+            return "TRIAL";
+        if (esp_ota_get_last_invalid_partition() != NULL)
+            return "ROLLED_BACK";
+        return "VALID";
+    }
+}
@@ -0,0 +1,52 @@
+#include "ota_blocks.hpp"
+
+#include "checksum.hpp"
+
+namespace ota_blocks
+{
+    auto start(Receiver &r, uint32_t image_size, uint32_t image_crc, uint32_t offset, uint32_t prefix_crc) -> void
+    {
+        r = {};
+        r.image_size = image_size;
+        r.image_crc = image_crc;
+        r.next = offset;
+        r.crc = prefix_crc;
+    }
+
+    auto check(Receiver &r, uint32_t offset, const uint8_t *data, size_t len, uint32_t crc) -> Verdict
+    {
+        if (len == 0 || offset > r.image_size || len > r.image_size - offset)
+        {
+            r.rejected += 1;
+            return Verdict::TOO_LONG;
+        }
+        if (checksum::crc32(data, len) != crc)
+        {
+            r.rejected += 1;
+            return Verdict::BAD_CRC;
+        }
+        if (offset + len <= r.next)
+        {
+            r.duplicates += 1;
+            return Verdict::DUPLICATE;
+        }
+        if (offset != r.next)
+        {
+            r.rejected += 1;
+            return Verdict::OUT_OF_ORDER;
+        }
+        return Verdict::WRITE;
+    }
+
+    auto accept(Receiver &r, const uint8_t *data, size_t len) -> void
+    {
+        r.crc = checksum::crc32(data, len, r.crc);
+        r.next += len;
+        r.blocks += 1;
+    }
+
+    auto complete(const Receiver &r) -> bool
+    {
+        return r.next == r.image_size && r.crc == r.image_crc;
+    }
+}
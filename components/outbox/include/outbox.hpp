@@ -0,0 +1,28 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+// Durable queue of outbound HTTP requests.
+// Requests that could not be delivered are appended to the "outbox" flash partition and sent in
+// order by a background task once the WiFi link is back, surviving reboots in between.
+namespace outbox
+{
+    constexpr uint16_t MAX_REQUEST_SIZE = 2048; // Host, path and body of a queued request
+
+    struct Status
+    {
+        uint32_t pending; // Requests waiting in flash
+        uint32_t dropped; // Requests lost because the partition wrapped around
+        uint32_t retries; // Failed delivery attempts since boot
+        bool waiting;     // Backing off after a failed attempt
+    };
+
+    typedef void (*Delivered)(uint32_t id, int status); // A queued request reached the server with HTTP status "status"
+
+    auto init(Delivered delivered) -> esp_err_t; // Mount the partition and start the drain task
+    auto push(esp_http_client_method_t method, const char *host, const char *path, const char *body, size_t body_len, uint32_t *id) -> esp_err_t;
+    auto drain() -> void; // Try to deliver now instead of waiting for the backoff
+    auto status() -> Status;
+}
@@ -0,0 +1,192 @@
+#include "outbox.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "flash_log.hpp"
+#include "network_helpers.hpp"
+#include "wifi_link.hpp"
+#include "power.hpp"
+
+namespace
+{
+    using namespace outbox;
+
+    constexpr auto TAG = "OUTBOX";
+    constexpr auto PARTITION_LABEL = "outbox";
+    constexpr auto RETRY_MIN_MS = 1000;    // Backoff after a failed delivery, doubled every time
+    constexpr auto RETRY_MAX_MS = 60000;   //
+    constexpr auto LINK_RETRY_MS = 5000;   // How long to wait before looking again when no WiFi link was asked for
+    constexpr auto TASK_STACK_SIZE = 6144; // HTTP client with its event handler runs on this stack
+    constexpr auto TASK_PRIORITY = 4;      // Draining runs below the command loop
+
+    // Queued request: method u8 | host \0 | path \0 | body
+    struct Request
+    {
+        esp_http_client_method_t method;
+        const char *host;
+        const char *path;
+        const char *body;
+        uint16_t body_len;
+    };
+
+    flash_log::Log log;
+    SemaphoreHandle_t mutex; // Guards "log"
+    TaskHandle_t drain_task = NULL;
+    Delivered delivered = NULL;
+    uint32_t retries = 0;
+    volatile bool waiting = false;
+
+    // Split a record read into "buf" (which has room for a terminator after it)
+    auto decode(char *buf, uint16_t len, Request *r) -> bool
+    {
+        if (len < 3)
+            return false;
+        buf[len] = '\0';
+        const auto host_end = (char *)memchr(buf + 1, '\0', len - 1);
+        if (host_end == NULL)
+            return false;
+        const auto path_end = (char *)memchr(host_end + 1, '\0', buf + len - host_end - 1);
+        if (path_end == NULL)
+            return false;
+        *r = Request{(esp_http_client_method_t)buf[0], buf + 1, host_end + 1, path_end + 1, (uint16_t)(buf + len - path_end - 1)};
+        return true;
+    }
+
+    auto post(const Request &r) -> int
+    {
+        auto status = -1;
+        const network_helpers::ResponseSink sink = {
+            .on_status = [](void *ctx, int code) { *(int *)ctx = code; },
+            .on_header = NULL,
+            .on_data = NULL,
+            .ctx = &status,
+        };
+        if (network_helpers::make_http_request(r.method, r.host, r.path, r.body_len > 0 ? r.body : NULL, r.body_len, &sink) != ESP_OK)
+            return -1;
+        return status;
+    }
+
+    // Drop the oldest record, unless the log wrapped around it while it was being sent
+    auto pop_if(uint32_t id) -> void
+    {
+        uint32_t oldest = 0;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        if (flash_log::tail_id(log, &oldest) == ESP_OK && oldest == id)
+            flash_log::pop(log);
+        xSemaphoreGive(mutex);
+    }
+
+    // Delivers the queued requests oldest first, one at a time
+    auto drain_queue(void *arg) -> void
+    {
+        static char buf[MAX_REQUEST_SIZE + 1];
+        auto backoff_ms = RETRY_MIN_MS;
+        while (true)
+        {
+            uint16_t len = 0;
+            uint32_t id = 0;
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            const auto err = flash_log::peek(log, (uint8_t *)buf, MAX_REQUEST_SIZE, &len, &id);
+            xSemaphoreGive(mutex);
+            if (err == ESP_ERR_NOT_FOUND)
+            {
+                waiting = false;
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+
+            Request r;
+            if (err != ESP_OK || !decode(buf, len, &r))
+            {
+                ESP_LOGE(TAG, "Dropping unreadable request %" PRIu32, id);
+                pop_if(id);
+                continue;
+            }
+
+            // Returns right away while nobody asked for a link, the request waits for one
+            if (!wifi_link::wait_up(portMAX_DELAY))
+            {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LINK_RETRY_MS));
+                continue;
+            }
+            power::wait_tx_window();
+            const auto status = post(r);
+
+            // Server errors are retried like network errors, anything else is the server's answer
+            if (status < 0 || status >= 500 || status == 429)
+            {
+                retries += 1;
+                waiting = true;
+                ESP_LOGW(TAG, "Request %" PRIu32 " failed (%d), retrying in %d ms", id, status, backoff_ms);
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(backoff_ms));
+                backoff_ms = backoff_ms * 2 < RETRY_MAX_MS ? backoff_ms * 2 : RETRY_MAX_MS;
+                continue;
+            }
+            backoff_ms = RETRY_MIN_MS;
+            waiting = false;
+            pop_if(id);
+            delivered(id, status);
+        }
+    }
+}
+
+namespace outbox
+{
+    auto init(Delivered on_delivered) -> esp_err_t
+    {
+        delivered = on_delivered;
+        mutex = xSemaphoreCreateMutex();
+        const auto err = flash_log::open(log, PARTITION_LABEL);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "No outbox partition (%s)", esp_err_to_name(err));
+            return err;
+        }
+        xTaskCreatePinnedToCore(drain_queue, "outbox_drain", TASK_STACK_SIZE, NULL, TASK_PRIORITY, &drain_task, CONFIG_MODEM_NETWORK_CORE);
+        return ESP_OK;
+    }
+
+    auto push(esp_http_client_method_t method, const char *host, const char *path, const char *body, size_t body_len, uint32_t *id) -> esp_err_t
+    {
+        const auto host_len = strlen(host) + 1;
+        const auto path_len = strlen(path) + 1;
+        const auto size = 1 + host_len + path_len + body_len;
+        if (drain_task == NULL)
+            return ESP_ERR_INVALID_STATE;
+        if (size > MAX_REQUEST_SIZE)
+            return ESP_ERR_INVALID_SIZE;
+
+        static uint8_t record[MAX_REQUEST_SIZE];
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        record[0] = method;
+        memcpy(record + 1, host, host_len);
+        memcpy(record + 1 + host_len, path, path_len);
+        if (body_len > 0)
+            memcpy(record + 1 + host_len + path_len, body, body_len);
+        const auto err = flash_log::append(log, record, size, id);
+        xSemaphoreGive(mutex);
+        if (err == ESP_OK)
+            xTaskNotifyGive(drain_task);
+        return err;
+    }
+
+    auto drain() -> void
+    {
+        if (drain_task != NULL)
+            xTaskNotifyGive(drain_task);
+    }
+
+    auto status() -> Status
+    {
+        if (drain_task == NULL)
+            return Status{};
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto s = Status{log.records, log.dropped, retries, waiting};
+        xSemaphoreGive(mutex);
+        return s;
+    }
+}
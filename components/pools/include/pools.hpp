@@ -0,0 +1,76 @@
+#pragma once
+
+#include "inttypes.h"
+#include "stddef.h"
+#include "freertos/FreeRTOS.h"
+
+// Fixed-size block pools reserved at build time.
+// The request path takes its buffers from here instead of the heap, so memory use is known up front
+// and does not degrade with fragmentation on units that run for weeks.
+namespace pools
+{
+    constexpr uint8_t MAX_POOLS = 8;                // Pools that report usage
+    constexpr size_t ALIGN = alignof(max_align_t); // Blocks and arena pieces can hold any type
+
+    struct Usage
+    {
+        const char *name;
+        size_t block_size;
+        uint8_t count;
+        uint8_t used;
+        uint8_t peak;      // Most blocks ever in use at once (the watermark)
+        uint32_t failures; // Requests that found every block taken
+    };
+
+    class Pool
+    {
+    public:
+        Pool(const char *name, uint8_t *storage, size_t block_size, uint8_t count);
+        auto take() -> void *; // NULL if every block is in use
+        auto give(void *block) -> void;
+        auto owns(const void *block) const -> bool;
+        auto block_size() const -> size_t { return size; }
+        auto usage() const -> Usage;
+
+    private:
+        const char *name;
+        uint8_t *storage;
+        size_t size;
+        uint8_t count;
+        uint32_t free_mask; // Bit per block, set while the block is free
+        uint8_t peak;
+        uint32_t failures;
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    };
+
+    template <size_t BLOCK_SIZE, uint8_t COUNT>
+    class StaticPool : public Pool
+    {
+        static_assert(COUNT <= 32, "Free blocks are tracked in a 32-bit mask");
+        static_assert(BLOCK_SIZE % ALIGN == 0, "Blocks are kept aligned for any type");
+
+    public:
+        StaticPool(const char *name) : Pool(name, blocks, BLOCK_SIZE, COUNT) {}
+
+    private:
+        alignas(ALIGN) uint8_t blocks[BLOCK_SIZE * COUNT];
+    };
+
+    // Bump allocator over a single block aligned to ALIGN (as pool blocks are), everything in it is released at once
+    class Arena
+    {
+    public:
+        Arena(void *block, size_t size) : base((uint8_t *)block), size(size) {}
+        auto alloc(size_t len) -> void *; // Aligned to ALIGN, NULL if it does not fit
+        auto used() const -> size_t { return offset; }
+
+    private:
+        uint8_t *base;
+        size_t size;
+        size_t offset = 0;
+    };
+
+    auto take(size_t len, size_t *capacity = NULL) -> void *; // Block from the smallest general pool that fits "len"
+    auto give(void *block) -> void;                            // Return a block from "take" (NULL is ignored)
+    auto usage(uint8_t index, Usage *usage) -> bool;           // Usage of every registered pool, false past the last one
+}
@@ -0,0 +1,107 @@
+#include "pools.hpp"
+
+#include "esp_log.h"
+
+namespace
+{
+    using namespace pools;
+
+    constexpr auto TAG = "POOLS";
+
+    // Filled while static objects are constructed, so it has to be constant-initialized itself
+    Pool *registered[MAX_POOLS] = {};
+    uint8_t registered_count = 0;
+
+    StaticPool<CONFIG_MODEM_POOL_SMALL_SIZE, CONFIG_MODEM_POOL_SMALL_COUNT> small("small");
+    StaticPool<CONFIG_MODEM_POOL_LARGE_SIZE, CONFIG_MODEM_POOL_LARGE_COUNT> large("large");
+    Pool *const general[] = {&small, &large}; // Smallest first
+}
+
+namespace pools
+{
+    Pool::Pool(const char *name, uint8_t *storage, size_t block_size, uint8_t count)
+        : name(name), storage(storage), size(block_size), count(count),
+          free_mask(count == 32 ? UINT32_MAX : (1u << count) - 1), peak(0), failures(0)
+    {
+        if (registered_count < MAX_POOLS)
+            registered[registered_count++] = this;
+    }
+
+    auto Pool::take() -> void *
+    {
+        portENTER_CRITICAL(&lock);
+        if (free_mask == 0)
+        {
+            failures += 1;
+            portEXIT_CRITICAL(&lock);
+            return NULL;
+        }
+        const auto index = __builtin_ctz(free_mask);
+        free_mask &= ~(1u << index);
+        const uint8_t used = count - __builtin_popcount(free_mask);
+        peak = used > peak ? used : peak;
+        portEXIT_CRITICAL(&lock);
+        return storage + index * size;
+    }
+
+    auto Pool::give(void *block) -> void
+    {
+        const auto index = ((uint8_t *)block - storage) / size;
+        portENTER_CRITICAL(&lock);
+        free_mask |= 1u << index;
+        portEXIT_CRITICAL(&lock);
+    }
+
+    auto Pool::owns(const void *block) const -> bool
+    {
+        return block >= storage && block < storage + size * count;
+    }
+
+    auto Pool::usage() const -> Usage
+    {
+        return Usage{name, size, count, (uint8_t)(count - __builtin_popcount(free_mask)), peak, failures};
+    }
+
+    auto Arena::alloc(size_t len) -> void *
+    {
+        const auto start = (offset + ALIGN - 1) & ~(ALIGN - 1);
+        if (start + len > size)
+            return NULL;
+        offset = start + len;
+        return base + start;
+    }
+
+    auto take(size_t len, size_t *capacity) -> void *
+    {
+        for (const auto pool : general)
+        {
+            if (pool->block_size() < len)
+                continue;
+            const auto block = pool->take();
+            if (block == NULL)
+                continue; // A bigger block still does the job
+            if (capacity != NULL)
+                *capacity = pool->block_size();
+            return block;
+        }
+        ESP_LOGW(TAG, "No block for %u bytes", (unsigned)len);
+        return NULL;
+    }
+
+    auto give(void *block) -> void
+    {
+        for (const auto pool : general)
+        {
+            if (pool->owns(block))
+                return pool->give(block);
+        }
+    }
+
+    auto usage(uint8_t index, Usage *usage) -> bool
+    {
+        if (index >= registered_count)
+            return false;
+        *usage = registered[index]->usage();
+        return true;
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "inttypes.h"
+
+// Power management.
+// The radio sleeps between beacons (modem sleep) and, when enabled, the chip light-sleeps whenever
+// the modem is idle. UART traffic keeps it awake for a short while, and queued background work is
+// released in short transmit windows so the radio wakes for dense bursts instead of for every request.
+namespace power
+{
+    struct Stats
+    {
+        uint32_t uptime_ms;
+        uint32_t awake_ms;      // Time light sleep was held off (UART traffic, commands, transmit windows)
+        uint32_t wakeups;       // Times the modem was kept awake after being idle
+        uint32_t windows;       // Transmit windows opened
+        uint32_t transmissions; // Background transmissions released in windows
+        uint32_t open_ms;       // Time windows were open
+        uint32_t deferred_ms;   // Time background transmissions waited for a window, summed
+    };
+
+    auto init(int uart_port) -> void; // Enable light sleep (if configured) with wake up on "uart_port"
+    auto activity() -> void;          // Hold off light sleep for a little while
+    auto wait_tx_window() -> void;    // Called by background senders before they transmit
+    auto stats() -> Stats;
+    auto reset_stats() -> void;
+    auto mode_name() -> const char *; // WiFi power save mode
+}
@@ -0,0 +1,192 @@
+#include "power.hpp"
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+namespace
+{
+    using namespace power;
+
+    constexpr auto TAG = "POWER";
+    constexpr int64_t AWAKE_AFTER_US = CONFIG_MODEM_AWAKE_AFTER_ACTIVITY_MS * 1000LL;
+    constexpr auto UART_WAKEUP_THRESHOLD = 3;      // Rising edges on RX that wake the chip (those bytes are lost)
+    constexpr int64_t BEACON_INTERVAL_US = 102400; // 100 TU, used by nearly every access point
+#if CONFIG_MODEM_WIFI_PS_MAX_MODEM
+    constexpr int64_t WAKE_PERIOD_US = BEACON_INTERVAL_US * CONFIG_MODEM_WIFI_LISTEN_INTERVAL;
+#else
+    constexpr int64_t WAKE_PERIOD_US = BEACON_INTERVAL_US; // Assumes a DTIM period of 1, the common default
+#endif
+#if CONFIG_MODEM_TX_WINDOWS
+    constexpr int64_t WINDOW_US = CONFIG_MODEM_TX_WINDOW_MS * 1000LL;
+#endif
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED; // Guards everything below
+    esp_timer_handle_t linger_timer = NULL;
+#if CONFIG_MODEM_LIGHT_SLEEP
+    esp_pm_lock_handle_t awake_lock;
+#endif
+    bool awake = false;
+    int64_t awake_since = 0;   // When light sleep was last held off
+    int64_t awake_until = 0;   // When it may be allowed again
+    int64_t window_end = 0;    // End of the current transmit window
+    int64_t counting_from = 0; // Start of the statistics
+    uint64_t awake_us = 0;
+    uint64_t open_us = 0;
+    uint64_t deferred_us = 0;
+    uint32_t wakeups = 0;
+    uint32_t windows = 0;
+    uint32_t transmissions = 0;
+
+    // Lets the chip sleep again once the UART has been quiet for long enough
+    auto linger_expired(void *arg) -> void
+    {
+        const auto now = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        const auto remaining = awake_until - now;
+        if (remaining <= 0)
+        {
+            awake = false;
+            awake_us += now - awake_since;
+        }
+        portEXIT_CRITICAL(&lock);
+
+        if (remaining > 0)
+            esp_timer_start_once(linger_timer, remaining);
+#if CONFIG_MODEM_LIGHT_SLEEP
+        else
+            esp_pm_lock_release(awake_lock);
+#endif
+    }
+}
+
+namespace power
+{
+    auto init(int uart_port) -> void
+    {
+        counting_from = esp_timer_get_time();
+        esp_timer_create_args_t args = {};
+        args.callback = linger_expired;
+        args.name = "power_linger";
+        ESP_ERROR_CHECK(esp_timer_create(&args, &linger_timer));
+
+#if CONFIG_MODEM_LIGHT_SLEEP
+        // Light sleep only: frequency scaling would change the APB clock the UART baud rate is derived from
+        ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "modem_awake", &awake_lock));
+        esp_pm_config_esp32_t config = {};
+        config.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+        config.min_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+        config.light_sleep_enable = true;
+        ESP_ERROR_CHECK(esp_pm_configure(&config));
+        ESP_ERROR_CHECK(uart_set_wakeup_threshold((uart_port_t)uart_port, UART_WAKEUP_THRESHOLD));
+        ESP_ERROR_CHECK(esp_sleep_enable_uart_wakeup(uart_port));
+        ESP_LOGI(TAG, "Light sleep enabled, waking on UART%d", uart_port);
+#endif
+        activity();
+    }
+
+    auto activity() -> void
+    {
+        if (linger_timer == NULL)
+            return;
+
+        const auto now = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        awake_until = now + AWAKE_AFTER_US;
+        const auto woke = !awake;
+        if (woke)
+        {
+            awake = true;
+            awake_since = now;
+            wakeups += 1;
+        }
+        portEXIT_CRITICAL(&lock);
+
+        if (!woke)
+            return;
+#if CONFIG_MODEM_LIGHT_SLEEP
+        esp_pm_lock_acquire(awake_lock);
+#endif
+        esp_timer_start_once(linger_timer, AWAKE_AFTER_US);
+    }
+
+    // Windows open on a grid of the radio wake period, everything that waits for one goes out together.
+    // The beacon times themselves are not exposed by the WiFi driver, so the grid is not locked to them.
+    auto wait_tx_window() -> void
+    {
+#if CONFIG_MODEM_TX_WINDOWS
+        const auto asked = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        const auto open = asked < window_end;
+        if (open)
+            transmissions += 1;
+        portEXIT_CRITICAL(&lock);
+        if (open)
+            return;
+
+        const auto start = (asked / WAKE_PERIOD_US + 1) * WAKE_PERIOD_US;
+        vTaskDelay(pdMS_TO_TICKS((start - asked + 999) / 1000));
+
+        const auto now = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        if (window_end < start + WINDOW_US)
+        {
+            window_end = start + WINDOW_US;
+            windows += 1;
+            open_us += WINDOW_US;
+        }
+        transmissions += 1;
+        deferred_us += now - asked;
+        portEXIT_CRITICAL(&lock);
+        activity();
+#endif
+    }
+
+    auto stats() -> Stats
+    {
+        const auto now = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        const auto awake_total = awake_us + (awake ? now - awake_since : 0);
+        const auto s = Stats{
+            .uptime_ms = (uint32_t)((now - counting_from) / 1000),
+            .awake_ms = (uint32_t)(awake_total / 1000),
+            .wakeups = wakeups,
+            .windows = windows,
+            .transmissions = transmissions,
+            .open_ms = (uint32_t)(open_us / 1000),
+            .deferred_ms = (uint32_t)(deferred_us / 1000),
+        };
+        portEXIT_CRITICAL(&lock);
+        return s;
+    }
+
+    auto reset_stats() -> void
+    {
+        const auto now = esp_timer_get_time();
+        portENTER_CRITICAL(&lock);
+        counting_from = now;
+        awake_since = now;
+        awake_us = 0;
+        open_us = 0;
+        deferred_us = 0;
+        wakeups = 0;
+        windows = 0;
+        transmissions = 0;
+        portEXIT_CRITICAL(&lock);
+    }
+
+    auto mode_name() -> const char *
+    {
+#if CONFIG_MODEM_WIFI_PS_NONE
+        return "NONE";
+#elif CONFIG_MODEM_WIFI_PS_MAX_MODEM
+        return "MAX_MODEM";
+#else
+        return "MIN_MODEM";
+#endif
+    }
+}
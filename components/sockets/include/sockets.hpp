@@ -0,0 +1,26 @@
+#pragma once
+
+#include "inttypes.h"
+#include "esp_err.h"
+
+// Raw TCP/UDP sockets for the host.
+// Sockets are addressed by a small id. Everything they receive is delivered from a single
+// receive task, so the host gets data as it arrives without polling.
+namespace sockets
+{
+    constexpr uint8_t MAX_SOCKETS = 4;
+
+    enum class Protocol : uint8_t
+    {
+        TCP,
+        UDP,
+    };
+
+    typedef void (*Receiver)(uint8_t id, const char *data, int len); // Data from a socket, "len" of 0 means the socket was closed
+
+    auto init(Receiver receiver) -> void;                                      // Start the receive task
+    auto open(Protocol protocol, const char *host, uint16_t port) -> int;      // Connect, returns the socket id or -1
+    auto send(uint8_t id, const char *data, int len) -> esp_err_t;             // Blocks until everything is handed to the stack
+    auto close(uint8_t id) -> esp_err_t;                                       // Closed asynchronously, the receiver is told once it is done
+    auto count() -> uint8_t;                                                   // Number of open sockets
+}
@@ -0,0 +1,242 @@
+#include "sockets.hpp"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_vfs_eventfd.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace
+{
+    using namespace sockets;
+
+    constexpr auto TAG = "SOCKETS";
+    constexpr auto TASK_STACK_SIZE = 4096;
+    constexpr auto TASK_PRIORITY = 5;
+    constexpr auto RECEIVE_BUF_SIZE = 1024; // Largest chunk delivered to the receiver at once
+
+    struct Slot
+    {
+        int fd;          // -1 when the slot is free
+        bool closing;    // Close requested, the receive task closes the descriptor
+        uint8_t senders; // "send" calls using the descriptor, it stays open until they are done
+    };
+
+    Slot slots[MAX_SOCKETS];
+    SemaphoreHandle_t mutex;
+    int wake_fd = -1; // eventfd that interrupts "select" when the set of sockets changes
+    Receiver receiver = NULL;
+
+    auto wake() -> void
+    {
+        const uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+
+    // Called by the receive task only, so no descriptor is closed while "select" waits on it.
+    // A descriptor still used by "send" is only shut down: closing it would let lwIP hand its number
+    // to another connection in the middle of the send. The last sender wakes the task to close it.
+    auto release_slot(uint8_t id) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        if (slots[id].senders > 0)
+        {
+            slots[id].closing = true;
+            shutdown(slots[id].fd, SHUT_RDWR); // A send blocked on a full window returns
+            xSemaphoreGive(mutex);
+            return;
+        }
+        ::close(slots[id].fd);
+        slots[id] = Slot{-1, false, 0};
+        xSemaphoreGive(mutex);
+        receiver(id, NULL, 0);
+    }
+
+    auto receive_task(void *arg) -> void
+    {
+        static char buf[RECEIVE_BUF_SIZE];
+        while (true)
+        {
+            // Build the set of sockets to wait on and close the ones the host is done with
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(wake_fd, &readable);
+            auto max_fd = wake_fd;
+            for (uint8_t id = 0; id < MAX_SOCKETS; id++)
+            {
+                if (slots[id].fd < 0)
+                    continue;
+                if (slots[id].closing)
+                {
+                    release_slot(id);
+                    continue;
+                }
+                FD_SET(slots[id].fd, &readable);
+                max_fd = slots[id].fd > max_fd ? slots[id].fd : max_fd;
+            }
+
+            if (select(max_fd + 1, &readable, NULL, NULL, NULL) < 0)
+            {
+                ESP_LOGE(TAG, "select failed: errno %d", errno);
+                vTaskDelay(pdMS_TO_TICKS(100));
+                continue;
+            }
+            if (FD_ISSET(wake_fd, &readable))
+            {
+                uint64_t count;
+                read(wake_fd, &count, sizeof(count));
+            }
+
+            // Forward whatever arrived, an orderly shutdown or an error closes the socket
+            for (uint8_t id = 0; id < MAX_SOCKETS; id++)
+            {
+                const auto fd = slots[id].fd;
+                if (fd < 0 || slots[id].closing || !FD_ISSET(fd, &readable))
+                    continue;
+                const auto len = recv(fd, buf, sizeof(buf), 0);
+                if (len > 0)
+                    receiver(id, buf, len);
+                else
+                    release_slot(id);
+            }
+        }
+    }
+
+    auto resolve(const char *host, uint16_t port, int type, struct sockaddr_in *addr) -> bool
+    {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = type;
+        struct addrinfo *result = NULL;
+        if (getaddrinfo(host, NULL, &hints, &result) != 0 || result == NULL)
+            return false;
+        memcpy(addr, result->ai_addr, sizeof(*addr));
+        addr->sin_port = htons(port);
+        freeaddrinfo(result);
+        return true;
+    }
+}
+
+namespace sockets
+{
+    auto init(Receiver on_receive) -> void
+    {
+        receiver = on_receive;
+        mutex = xSemaphoreCreateMutex();
+        for (auto &slot : slots)
+            slot = Slot{-1, false, 0};
+
+        esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+        ESP_ERROR_CHECK(esp_vfs_eventfd_register(&config));
+        wake_fd = eventfd(0, 0);
+        // select() and recv() run next to lwIP
+        xTaskCreatePinnedToCore(receive_task, "sockets", TASK_STACK_SIZE, NULL, TASK_PRIORITY, NULL, CONFIG_MODEM_NETWORK_CORE);
+    }
+
+    auto open(Protocol protocol, const char *host, uint16_t port) -> int
+    {
+        const auto type = protocol == Protocol::TCP ? SOCK_STREAM : SOCK_DGRAM;
+        struct sockaddr_in addr;
+        if (!resolve(host, port, type, &addr))
+        {
+            ESP_LOGE(TAG, "Failed to resolve %s", host);
+            return -1;
+        }
+
+        // UDP sockets are connected as well, so they only exchange datagrams with this peer
+        const auto fd = socket(AF_INET, type, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            ESP_LOGE(TAG, "Failed to connect to %s:%u: errno %d", host, port, errno);
+            ::close(fd);
+            return -1;
+        }
+        if (protocol == Protocol::TCP)
+        {
+            const int nodelay = 1; // Telemetry samples are small, send them right away
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+
+        // Take a free slot
+        auto id = -1;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (uint8_t i = 0; i < MAX_SOCKETS && id < 0; i++)
+        {
+            if (slots[i].fd >= 0)
+                continue;
+            slots[i] = Slot{fd, false, 0};
+            id = i;
+        }
+        xSemaphoreGive(mutex);
+        if (id < 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        wake();
+        return id;
+    }
+
+    auto send(uint8_t id, const char *data, int len) -> esp_err_t
+    {
+        if (id >= MAX_SOCKETS)
+            return ESP_ERR_INVALID_ARG;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto fd = slots[id].closing ? -1 : slots[id].fd;
+        if (fd >= 0)
+            slots[id].senders += 1; // Holds the descriptor open until the loop below is done
+        xSemaphoreGive(mutex);
+        if (fd < 0)
+            return ESP_ERR_INVALID_STATE;
+
+        auto err = ESP_OK;
+        for (auto sent = 0; sent < len;)
+        {
+            const auto n = ::send(fd, data + sent, len - sent, 0);
+            if (n < 0)
+            {
+                ESP_LOGE(TAG, "Socket %u send failed: errno %d", id, errno);
+                err = ESP_FAIL;
+                break;
+            }
+            sent += n;
+        }
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        slots[id].senders -= 1;
+        const auto release = slots[id].closing && slots[id].senders == 0;
+        xSemaphoreGive(mutex);
+        if (release)
+            wake(); // The receive task closes the descriptor now
+        return err;
+    }
+
+    auto close(uint8_t id) -> esp_err_t
+    {
+        if (id >= MAX_SOCKETS)
+            return ESP_ERR_INVALID_ARG;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto open = slots[id].fd >= 0 && !slots[id].closing;
+        slots[id].closing = open;
+        xSemaphoreGive(mutex);
+        if (!open)
+            return ESP_ERR_INVALID_STATE;
+        wake();
+        return ESP_OK;
+    }
+
+    auto count() -> uint8_t
+    {
+        uint8_t open = 0;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (const auto &slot : slots)
+            open += slot.fd >= 0 ? 1 : 0;
+        xSemaphoreGive(mutex);
+        return open;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "inttypes.h"
+
+// Latency samples and error counters of the command path.
+// Recording is lock-free so it can be called from any task, including HTTP event handlers.
+namespace stats
+{
+    enum class Stage : uint8_t
+    {
+        PARSE,     // First byte of a command received -> command ready for dispatch
+        COMPRESS,  // CPU time spent compressing a request body
+        CONNECT,   // Request started -> connection established (DNS + TCP + TLS, skipped on reused connections)
+        HANDSHAKE, // Same as CONNECT, but only for new HTTPS connections
+        SEND,      // Connection ready -> first response header (request sent + server time)
+        RECEIVE,   // First response header -> response complete
+        TOTAL,     // Whole HTTP request
+        COUNT,
+    };
+
+    struct Summary
+    {
+        uint32_t count;  // Samples recorded since boot (or the last reset)
+        uint32_t p50_us; // Percentiles over the most recent samples
+        uint32_t p99_us;
+        uint32_t max_us;
+        uint32_t errors;
+    };
+
+    auto record(Stage stage, int64_t duration_us) -> void;
+    auto record_error(Stage stage) -> void;
+    auto summarize(Stage stage) -> Summary;
+    auto reset() -> void;
+    auto stage_name(Stage stage) -> const char *;
+}
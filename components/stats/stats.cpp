@@ -0,0 +1,92 @@
+#include "stats.hpp"
+
+#include <atomic>
+
+namespace
+{
+    using namespace stats;
+
+    constexpr auto WINDOW = 64; // Recent samples kept per stage (percentiles are computed over these)
+    constexpr auto STAGE_COUNT = (int)Stage::COUNT;
+    constexpr const char *stage_names[STAGE_COUNT] = {"PARSE", "COMPRESS", "CONNECT", "HANDSHAKE", "SEND", "RECEIVE", "TOTAL"};
+
+    // Ring of samples for a single stage. Writers claim a slot with an atomic increment,
+    // a reader racing with a writer can at worst see one stale sample.
+    struct Ring
+    {
+        std::atomic<uint32_t> head;
+        std::atomic<uint32_t> max_us;
+        std::atomic<uint32_t> errors;
+        uint32_t samples[WINDOW];
+    };
+
+    Ring rings[STAGE_COUNT];
+
+    auto sort(uint32_t *values, int len) -> void
+    {
+        for (auto i = 1; i < len; i++)
+        {
+            const auto v = values[i];
+            auto j = i - 1;
+            for (; j >= 0 && values[j] > v; j--)
+                values[j + 1] = values[j];
+            values[j + 1] = v;
+        }
+    }
+}
+
+namespace stats
+{
+    auto record(Stage stage, int64_t duration_us) -> void
+    {
+        auto &ring = rings[(int)stage];
+        const auto us = duration_us > UINT32_MAX ? UINT32_MAX : duration_us < 0 ? 0 : (uint32_t)duration_us;
+        const auto index = ring.head.fetch_add(1, std::memory_order_relaxed);
+        ring.samples[index % WINDOW] = us;
+
+        auto max = ring.max_us.load(std::memory_order_relaxed);
+        while (us > max && !ring.max_us.compare_exchange_weak(max, us, std::memory_order_relaxed))
+            ;
+    }
+
+    auto record_error(Stage stage) -> void
+    {
+        rings[(int)stage].errors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto summarize(Stage stage) -> Summary
+    {
+        auto &ring = rings[(int)stage];
+        auto summary = Summary{};
+        summary.count = ring.head.load(std::memory_order_relaxed);
+        summary.max_us = ring.max_us.load(std::memory_order_relaxed);
+        summary.errors = ring.errors.load(std::memory_order_relaxed);
+
+        // Percentiles over a sorted copy of the window
+        const auto len = summary.count < WINDOW ? (int)summary.count : WINDOW;
+        if (len == 0)
+            return summary;
+        uint32_t sorted[WINDOW];
+        for (auto i = 0; i < len; i++)
+            sorted[i] = ring.samples[i];
+        sort(sorted, len);
+        summary.p50_us = sorted[(len - 1) * 50 / 100];
+        summary.p99_us = sorted[(len - 1) * 99 / 100];
+        return summary;
+    }
+
+    auto reset() -> void
+    {
+        for (auto &ring : rings)
+        {
+            ring.head.store(0, std::memory_order_relaxed);
+            ring.max_us.store(0, std::memory_order_relaxed);
+            ring.errors.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    auto stage_name(Stage stage) -> const char *
+    {
+        return stage_names[(int)stage];
+    }
+}
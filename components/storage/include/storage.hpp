@@ -1,14 +1,51 @@
+#include "inttypes.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+
 namespace storage
 {
-    struct WiFiCredentials
+    constexpr uint8_t MAX_PROFILES = CONFIG_MODEM_WIFI_PROFILES;
+
+    // Fixed address used instead of DHCP (addresses in network byte order, ip 0 uses DHCP, dns may be 0)
+    struct StaticIp
+    {
+        uint32_t ip;
+        uint32_t netmask;
+        uint32_t gateway;
+        uint32_t dns;
+    };
+
+    // A known WiFi network and how connecting to it went
+    struct Profile
+    {
+        char ssid[33];
+        char pass[65];
+        uint8_t priority;      // Set by the host, higher is preferred
+        uint8_t bssid[6];      // Access point joined last time, lets the next connect skip the scan
+        uint8_t channel;       // Its channel (0 if it never connected)
+        uint32_t last_success; // Order of the last successful connect among all profiles (0 if never)
+        uint16_t failures;     // Failed attempts since the last success (kept in RAM only)
+        StaticIp static_ip;    // Address on this network
+    };
+
+    // A network seen by a scan, used to rank the profiles
+    struct Sighting
     {
         const char *ssid;
-        const char *pass;
+        int8_t rssi;
+        const uint8_t *bssid;
+        uint8_t channel;
     };
 
-    auto init() -> void;
-    auto are_credentails_saved() -> bool;
-    auto get_credentials() -> WiFiCredentials;
-    auto save_credentials(WiFiCredentials cred) -> void;
-    auto forget_credentials() -> void;
-}
\ No newline at end of file
+    auto init() -> void; // Mount NVS and load the profiles (read once, kept in RAM)
+    auto profile_count() -> uint8_t;
+    auto snapshot(Profile *profiles, uint8_t max) -> uint8_t;                            // Copy of the profiles, ordered by priority, then by most recent success
+    auto save_profile(const char *ssid, const char *pass, uint8_t priority) -> esp_err_t; // Adds or updates, a full store replaces its least useful profile
+    auto forget_profile(const char *ssid) -> bool;
+    auto forget_credentials() -> void; // Forgets every profile
+    auto record_success(const char *ssid, const uint8_t *bssid, uint8_t channel) -> void;
+    auto record_failure(const char *ssid) -> void;
+    auto preferred_profile(Profile *profile) -> bool;                                                  // Best profile without a scan (last known good first)
+    auto best_profile(const Sighting *seen, uint8_t count, const char *avoid, Profile *profile) -> bool; // Best profile in range, "avoid" only if nothing else is
+    auto set_static_ip(const char *ssid, const StaticIp &ip) -> bool; // An ip of 0 goes back to DHCP, false if the profile is unknown
+}
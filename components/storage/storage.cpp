@@ -2,10 +2,175 @@
 
 #include "nvs_flash.h"
 #include "string.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 namespace
 {
+    using namespace storage;
+
     constexpr auto CREDENTIALS_NAMESPACE = "credentials";
+    constexpr auto PROFILES_KEY = "profiles";
+    constexpr auto STATIC_IP_KEY = "static_ip"; // Single address of earlier firmware, moved into a profile
+    constexpr int PRIORITY_WEIGHT = 10;     // One priority level is worth 10 dB of signal
+    constexpr int FAILURE_PENALTY = 10;     // Every failure since the last success costs 10 dB...
+    constexpr int MAX_FAILURE_PENALTY = 40; // ...up to this much, so a flaky network is still tried eventually
+    constexpr int RECENT_BONUS = 5;         // The network that worked last wins close calls
+    constexpr int AVOID_PENALTY = 1000;     // Network being failed over from, only picked if nothing else is in range
+
+    // Profiles as stored before they had a static address of their own
+    struct LegacyProfile
+    {
+        char ssid[33];
+        char pass[65];
+        uint8_t priority;
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint32_t last_success;
+        uint16_t failures;
+    };
+    static_assert(sizeof(LegacyProfile) != sizeof(Profile), "Layouts are told apart by size");
+
+    // Loaded once at "init", every change is written through to NVS
+    Profile profiles[MAX_PROFILES];
+    uint8_t profile_total = 0;
+    uint32_t latest_success = 0; // Highest "last_success" of all profiles
+    SemaphoreHandle_t mutex;     // Profiles are used by the command loop, the link manager and the portal
+
+    auto find_locked(const char *ssid) -> Profile *
+    {
+        for (uint8_t i = 0; i < profile_total; i++)
+            if (strcmp(profiles[i].ssid, ssid) == 0)
+                return &profiles[i];
+        return NULL;
+    }
+
+    // Higher priority first, then the most recent success, so the last profile is the least useful one
+    auto sort_locked() -> void
+    {
+        for (uint8_t i = 1; i < profile_total; i++)
+        {
+            const auto p = profiles[i];
+            auto j = i;
+            for (; j > 0 && (profiles[j - 1].priority < p.priority ||
+                             (profiles[j - 1].priority == p.priority && profiles[j - 1].last_success < p.last_success));
+                 j--)
+                profiles[j] = profiles[j - 1];
+            profiles[j] = p;
+        }
+    }
+
+    auto persist_locked() -> void
+    {
+        nvs_handle_t handle;
+        if (nvs_open(CREDENTIALS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+            return;
+        nvs_set_blob(handle, PROFILES_KEY, profiles, profile_total * sizeof(Profile));
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    // Firmware before profiles kept a single network under "ssid", "pass" and "ap"
+    auto migrate_single_network(nvs_handle_t handle) -> void
+    {
+        auto &p = profiles[0];
+        memset(&p, 0, sizeof(p));
+        size_t ssid_len = sizeof(p.ssid);
+        size_t pass_len = sizeof(p.pass);
+        if (nvs_get_str(handle, "ssid", p.ssid, &ssid_len) != ESP_OK || p.ssid[0] == '\0')
+            return;
+        nvs_get_str(handle, "pass", p.pass, &pass_len);
+
+        uint8_t ap[7]; // bssid + channel
+        size_t ap_len = sizeof(ap);
+        if (nvs_get_blob(handle, "ap", ap, &ap_len) == ESP_OK && ap_len == sizeof(ap))
+        {
+            memcpy(p.bssid, ap, sizeof(p.bssid));
+            p.channel = ap[6];
+            p.last_success = latest_success = 1;
+        }
+        profile_total = 1;
+
+        nvs_erase_key(handle, "ssid");
+        nvs_erase_key(handle, "pass");
+        nvs_erase_key(handle, "ap");
+    }
+
+    // Profiles written before they had a static address, "raw" holds "count" of them
+    auto migrate_legacy_profiles(const uint8_t *raw, uint8_t count) -> void
+    {
+        static LegacyProfile legacy[MAX_PROFILES];
+        memcpy(legacy, raw, count * sizeof(LegacyProfile));
+        for (uint8_t i = 0; i < count; i++)
+        {
+            auto &p = profiles[i];
+            memset(&p, 0, sizeof(p));
+            memcpy(p.ssid, legacy[i].ssid, sizeof(p.ssid));
+            memcpy(p.pass, legacy[i].pass, sizeof(p.pass));
+            p.priority = legacy[i].priority;
+            memcpy(p.bssid, legacy[i].bssid, sizeof(p.bssid));
+            p.channel = legacy[i].channel;
+            p.last_success = legacy[i].last_success;
+        }
+        profile_total = count;
+    }
+
+    // The single static address of earlier firmware belongs to the network that was last joined
+    auto migrate_static_ip(nvs_handle_t handle) -> void
+    {
+        StaticIp ip;
+        size_t len = sizeof(ip);
+        if (nvs_get_blob(handle, STATIC_IP_KEY, &ip, &len) != ESP_OK || len != sizeof(ip))
+            return;
+        if (profile_total > 0)
+        {
+            auto owner = &profiles[0];
+            for (uint8_t i = 0; i < profile_total; i++)
+                if (profiles[i].last_success > owner->last_success)
+                    owner = &profiles[i];
+            owner->static_ip = ip;
+        }
+        nvs_erase_key(handle, STATIC_IP_KEY);
+    }
+
+    auto load_profiles() -> void
+    {
+        nvs_handle_t handle;
+        if (nvs_open(CREDENTIALS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+            return;
+        size_t len = sizeof(profiles);
+        const auto found = nvs_get_blob(handle, PROFILES_KEY, profiles, &len) == ESP_OK;
+        if (found && len % sizeof(Profile) == 0)
+            profile_total = len / sizeof(Profile);
+        else if (found && len % sizeof(LegacyProfile) == 0 && len / sizeof(LegacyProfile) <= MAX_PROFILES)
+            migrate_legacy_profiles((const uint8_t *)profiles, len / sizeof(LegacyProfile));
+        else
+            migrate_single_network(handle);
+        if (!found || len % sizeof(Profile) != 0)
+        {
+            migrate_static_ip(handle);
+            nvs_set_blob(handle, PROFILES_KEY, profiles, profile_total * sizeof(Profile));
+            nvs_commit(handle);
+        }
+        nvs_close(handle);
+
+        for (uint8_t i = 0; i < profile_total; i++)
+        {
+            profiles[i].failures = 0;
+            if (profiles[i].last_success > latest_success)
+                latest_success = profiles[i].last_success;
+        }
+        sort_locked();
+    }
+
+    // Signal strength adjusted by what the host wants and by what happened last time
+    auto score(const Profile &p, int8_t rssi) -> int
+    {
+        auto penalty = p.failures * FAILURE_PENALTY;
+        penalty = penalty < MAX_FAILURE_PENALTY ? penalty : MAX_FAILURE_PENALTY;
+        const auto bonus = p.last_success != 0 && p.last_success == latest_success ? RECENT_BONUS : 0;
+        return rssi + p.priority * PRIORITY_WEIGHT + bonus - penalty;
+    }
 }
 
 namespace storage
@@ -19,58 +184,167 @@ namespace storage
             err = nvs_flash_init();
         }
         ESP_ERROR_CHECK(err);
+
+        mutex = xSemaphoreCreateMutex();
+        load_profiles();
     }
 
-    auto are_credentails_saved() -> bool
+    auto profile_count() -> uint8_t
     {
-        auto cred = get_credentials();
-        return strlen(cred.ssid) > 0;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto count = profile_total;
+        xSemaphoreGive(mutex);
+        return count;
     }
 
-    // Get saved credentials
-    auto get_credentials() -> WiFiCredentials
+    auto snapshot(Profile *copy, uint8_t max) -> uint8_t
     {
-        static char ssid[50] = "";
-        static char pass[50] = "";
-
-        // Open NVS
-        nvs_handle_t handle;
-        nvs_open(CREDENTIALS_NAMESPACE, NVS_READONLY, &handle);
-
-        // Read SSID
-        size_t ssid_len = 50;
-        nvs_get_str(handle, "ssid", ssid, &ssid_len);
-
-        // Read password
-        size_t pass_len = 50;
-        nvs_get_str(handle, "pass", pass, &pass_len);
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto count = profile_total < max ? profile_total : max;
+        memcpy(copy, profiles, count * sizeof(Profile));
+        xSemaphoreGive(mutex);
+        return count;
+    }
 
-        // Close NVS
-        nvs_close(handle);
+    auto save_profile(const char *ssid, const char *pass, uint8_t priority) -> esp_err_t
+    {
+        if (strlen(ssid) == 0 || strlen(ssid) >= sizeof(Profile::ssid) || strlen(pass) >= sizeof(Profile::pass))
+            return ESP_ERR_INVALID_ARG;
 
-        // Return credentials
-        return WiFiCredentials{
-            .ssid = ssid,
-            .pass = pass,
-        };
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        auto p = find_locked(ssid);
+        if (p == NULL)
+        {
+            p = &profiles[profile_total < MAX_PROFILES ? profile_total++ : MAX_PROFILES - 1];
+            memset(p, 0, sizeof(*p));
+            strcpy(p->ssid, ssid);
+        }
+        else if (strcmp(p->pass, pass) != 0)
+        {
+            p->channel = 0; // Cached access point and history belong to the old password
+            p->last_success = 0;
+            p->failures = 0;
+        }
+        strcpy(p->pass, pass);
+        p->priority = priority;
+        sort_locked();
+        persist_locked();
+        xSemaphoreGive(mutex);
+        return ESP_OK;
     }
 
-    auto save_credentials(WiFiCredentials cred) -> void
+    auto forget_profile(const char *ssid) -> bool
     {
-        nvs_handle_t handle;
-        nvs_open(CREDENTIALS_NAMESPACE, NVS_READWRITE, &handle);
-        nvs_set_str(handle, "ssid", cred.ssid);
-        nvs_set_str(handle, "pass", cred.pass);
-        nvs_commit(handle);
-        nvs_close(handle);
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto p = find_locked(ssid);
+        if (p != NULL)
+        {
+            *p = profiles[--profile_total];
+            sort_locked();
+            persist_locked();
+        }
+        xSemaphoreGive(mutex);
+        return p != NULL;
     }
 
     auto forget_credentials() -> void
     {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        profile_total = 0;
+        latest_success = 0;
         nvs_handle_t handle;
         nvs_open(CREDENTIALS_NAMESPACE, NVS_READWRITE, &handle);
         nvs_erase_all(handle);
         nvs_commit(handle);
         nvs_close(handle);
+        xSemaphoreGive(mutex);
+    }
+
+    // Only writes to flash when the order of successes or the access point changed
+    auto record_success(const char *ssid, const uint8_t *bssid, uint8_t channel) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto p = find_locked(ssid);
+        if (p != NULL)
+        {
+            p->failures = 0;
+            const auto changed = p->last_success != latest_success || p->channel != channel || memcmp(p->bssid, bssid, sizeof(p->bssid)) != 0;
+            if (changed)
+            {
+                p->last_success = ++latest_success;
+                memcpy(p->bssid, bssid, sizeof(p->bssid));
+                p->channel = channel;
+                sort_locked();
+                persist_locked();
+            }
+        }
+        xSemaphoreGive(mutex);
+    }
+
+    auto record_failure(const char *ssid) -> void
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto p = find_locked(ssid);
+        if (p != NULL && p->failures < UINT16_MAX)
+            p->failures += 1;
+        xSemaphoreGive(mutex);
+    }
+
+    auto preferred_profile(Profile *profile) -> bool
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const Profile *best = profile_total > 0 ? &profiles[0] : NULL;
+        for (uint8_t i = 0; i < profile_total; i++)
+            if (profiles[i].last_success != 0 && profiles[i].last_success == latest_success)
+                best = &profiles[i];
+        if (best != NULL)
+            *profile = *best;
+        xSemaphoreGive(mutex);
+        return best != NULL;
+    }
+
+    auto best_profile(const Sighting *seen, uint8_t count, const char *avoid, Profile *profile) -> bool
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const Sighting *best_sighting = NULL;
+        const Profile *best = NULL;
+        auto best_score = 0;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const auto p = find_locked(seen[i].ssid);
+            if (p == NULL)
+                continue;
+            auto s = score(*p, seen[i].rssi);
+            if (avoid != NULL && strcmp(p->ssid, avoid) == 0)
+                s -= AVOID_PENALTY;
+            if (best == NULL || s > best_score)
+            {
+                best = p;
+                best_sighting = &seen[i];
+                best_score = s;
+            }
+        }
+        if (best != NULL)
+        {
+            // Go straight for the access point that was heard best
+            *profile = *best;
+            memcpy(profile->bssid, best_sighting->bssid, sizeof(profile->bssid));
+            profile->channel = best_sighting->channel;
+        }
+        xSemaphoreGive(mutex);
+        return best != NULL;
+    }
+
+    auto set_static_ip(const char *ssid, const StaticIp &ip) -> bool
+    {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        const auto p = find_locked(ssid);
+        if (p != NULL)
+        {
+            p->static_ip = ip.ip != 0 ? ip : StaticIp{};
+            persist_locked();
+        }
+        xSemaphoreGive(mutex);
+        return p != NULL;
     }
 }
\ No newline at end of file
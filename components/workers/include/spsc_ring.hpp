@@ -0,0 +1,47 @@
+#pragma once
+
+#include "stddef.h"
+#include <atomic>
+
+// Lock-free ring buffer for exactly one producer task and one consumer task (they may run on different cores).
+// Each side only writes its own index, so neither ever waits for the other. Waking a blocked consumer
+// is left to the caller (e.g. a task notification after "push").
+template <typename T, size_t N>
+class SpscRing
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Producer side. Returns false if the ring is full.
+    auto push(const T &item) -> bool
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == N)
+            return false;
+        slots[head & (N - 1)] = item;
+        head_.store(head + 1, std::memory_order_release); // Publishes the slot
+        return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    auto pop(T *item) -> bool
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+            return false;
+        *item = slots[tail & (N - 1)];
+        tail_.store(tail + 1, std::memory_order_release); // Hands the slot back
+        return true;
+    }
+
+    // Either side, may be stale by the time it is used
+    auto size() const -> size_t
+    {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    T slots[N];
+    std::atomic<size_t> head_ = {0}; // Next slot to write, only the producer stores it
+    std::atomic<size_t> tail_ = {0}; // Next slot to read, only the consumer stores it
+};
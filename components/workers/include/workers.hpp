@@ -0,0 +1,11 @@
+#pragma once
+
+#include "commands.hpp"
+
+namespace workers
+{
+    typedef void (*Executor)(commands::Command c); // Runs a command on one of the worker tasks
+
+    auto init() -> void;                                                   // Start the worker tasks (pinned to the network core)
+    auto submit(Executor executor, const commands::Command &c) -> bool;    // Queue a command, returns false if the queue is full (command task only)
+}
@@ -0,0 +1,108 @@
+#include "workers.hpp"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "spsc_ring.hpp"
+
+namespace
+{
+    constexpr auto TAG = "WORKERS";
+    constexpr auto WORKER_COUNT = CONFIG_MODEM_WORKER_COUNT;           // Number of commands that can run at the same time
+    constexpr auto WORKER_STACK_SIZE = CONFIG_MODEM_WORKER_STACK_SIZE; // HTTP client with its event handler runs on this stack
+    constexpr auto WORKER_PRIORITY = 5;
+
+    constexpr auto queue_length(size_t n) -> size_t
+    {
+        size_t p = 1;
+        while (p < n)
+            p *= 2;
+        return p;
+    }
+
+    struct Job
+    {
+        workers::Executor executor;
+        commands::Command c; // Owned copy of the command
+    };
+
+    // Every worker has its own ring, filled by the command task and emptied by the worker,
+    // so handing over a command takes no lock shared with the other workers
+    struct Worker
+    {
+        SpscRing<Job, queue_length(CONFIG_MODEM_WORKER_QUEUE_LEN)> jobs;
+        TaskHandle_t task;
+        std::atomic<bool> busy; // Running a job (the ring may still be empty)
+    };
+
+    Worker workers_[WORKER_COUNT];
+    uint8_t next_worker = 0; // Round robin start, only used by the command task
+
+    auto worker_task(void *arg) -> void
+    {
+        auto &w = *(Worker *)arg;
+        Job job;
+        while (true)
+        {
+            while (w.jobs.pop(&job))
+            {
+                w.busy = true;
+                job.executor(job.c);
+                commands::release(job.c);
+                w.busy = false;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+
+    // An idle worker if there is one, otherwise the one with the shortest queue
+    auto pick_worker() -> Worker *
+    {
+        Worker *best = NULL;
+        size_t best_load = SIZE_MAX;
+        for (auto i = 0; i < WORKER_COUNT; i++)
+        {
+            auto &w = workers_[(next_worker + i) % WORKER_COUNT];
+            const auto load = w.jobs.size() + (w.busy ? 1 : 0);
+            if (load < best_load)
+            {
+                best = &w;
+                best_load = load;
+            }
+        }
+        next_worker = (next_worker + 1) % WORKER_COUNT;
+        return best;
+    }
+}
+
+namespace workers
+{
+    auto init() -> void
+    {
+        for (auto i = 0; i < WORKER_COUNT; i++)
+        {
+            char name[12];
+            snprintf(name, sizeof(name), "worker%d", i);
+            xTaskCreatePinnedToCore(worker_task, name, WORKER_STACK_SIZE, &workers_[i], WORKER_PRIORITY, &workers_[i].task, CONFIG_MODEM_NETWORK_CORE);
+        }
+    }
+
+    auto submit(Executor executor, const commands::Command &c) -> bool
+    {
+        auto job = Job{executor, commands::clone(c)};
+        if (job.c.cmd == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to copy the command");
+            return false;
+        }
+        auto w = pick_worker();
+        if (!w->jobs.push(job))
+        {
+            commands::release(job.c);
+            return false;
+        }
+        xTaskNotifyGive(w->task);
+        return true;
+    }
+}
@@ -0,0 +1,142 @@
+#include "esp_timer.h"
+
+#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    bool armed = false;
+    int64_t due_us = 0;
+    uint64_t period_us = 0; // 0 for one-shot timers
+};
+
+namespace
+{
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<esp_timer_handle_t> timers;
+    bool dispatcher_started = false;
+
+    auto next_due(int64_t *due) -> esp_timer_handle_t
+    {
+        esp_timer_handle_t next = NULL;
+        for (const auto t : timers)
+            if (t->armed && (next == NULL || t->due_us < next->due_us))
+                next = t;
+        if (next != NULL)
+            *due = next->due_us;
+        return next;
+    }
+
+    // Callbacks run one at a time without the lock, so they can start and stop timers themselves
+    auto dispatch() -> void
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            int64_t due = 0;
+            const auto next = next_due(&due);
+            const auto now = esp_timer_get_time();
+            if (next == NULL)
+            {
+                changed.wait(guard);
+                continue;
+            }
+            if (due > now)
+            {
+                changed.wait_for(guard, std::chrono::microseconds(due - now));
+                continue;
+            }
+            if (next->period_us > 0)
+                next->due_us += next->period_us;
+            else
+                next->armed = false;
+            guard.unlock();
+            next->callback(next->arg);
+            guard.lock();
+        }
+    }
+
+    auto start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us) -> esp_err_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (timer->armed)
+            return ESP_ERR_INVALID_STATE;
+        timer->armed = true;
+        timer->due_us = esp_timer_get_time() + timeout_us;
+        timer->period_us = period_us;
+        changed.notify_all();
+        return ESP_OK;
+    }
+}
+
+extern "C" {
+
+int64_t esp_timer_get_time(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    if (args == NULL || args->callback == NULL || out_handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+    auto timer = new esp_timer();
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+
+    std::lock_guard<std::mutex> guard(lock);
+    timers.push_back(timer);
+    if (!dispatcher_started)
+    {
+        std::thread(dispatch).detach();
+        dispatcher_started = true;
+    }
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    return start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    changed.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (timer->armed)
+        return ESP_ERR_INVALID_STATE;
+    for (auto it = timers.begin(); it != timers.end(); ++it)
+        if (*it == timer)
+        {
+            timers.erase(it);
+            break;
+        }
+    delete timer;
+    return ESP_OK;
+}
+
+}
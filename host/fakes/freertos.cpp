@@ -0,0 +1,399 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct tskTaskControlBlock
+{
+    pthread_t thread;
+    std::string name;
+    UBaseType_t priority;
+    BaseType_t core;
+    UBaseType_t number;
+    TaskFunction_t code;
+    void *param;
+    std::mutex lock;
+    std::condition_variable notified;
+    uint32_t notifications = 0;
+};
+
+struct QueueDefinition
+{
+    UBaseType_t length;
+    UBaseType_t item_size;
+    std::deque<std::vector<uint8_t>> items;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+struct EventGroupDef_t
+{
+    EventBits_t bits = 0;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+namespace
+{
+    std::mutex tasks_lock;
+    std::vector<TaskHandle_t> tasks; // Every task that has not been deleted
+    UBaseType_t next_number = 1;
+    thread_local TaskHandle_t current = NULL;
+    std::recursive_mutex critical;
+
+    auto now() -> timespec
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts;
+    }
+
+    // The point in time after "ticks", portMAX_DELAY never comes
+    auto deadline(TickType_t ticks) -> std::chrono::steady_clock::time_point
+    {
+        if (ticks == portMAX_DELAY)
+            return std::chrono::steady_clock::time_point::max();
+        return std::chrono::steady_clock::now() + std::chrono::milliseconds((uint64_t)ticks * portTICK_PERIOD_MS);
+    }
+
+    // Waits for "ready" until the deadline, the lock is held on return
+    template <typename Ready>
+    auto wait_until(std::condition_variable &cv, std::unique_lock<std::mutex> &guard, TickType_t ticks, Ready ready) -> bool
+    {
+        if (ticks == portMAX_DELAY)
+        {
+            cv.wait(guard, ready);
+            return true;
+        }
+        return cv.wait_until(guard, deadline(ticks), ready);
+    }
+
+    auto register_task(TaskHandle_t task) -> void
+    {
+        std::lock_guard<std::mutex> guard(tasks_lock);
+        task->number = next_number++;
+        tasks.push_back(task);
+    }
+
+    auto unregister_task(TaskHandle_t task) -> void
+    {
+        std::lock_guard<std::mutex> guard(tasks_lock);
+        for (auto it = tasks.begin(); it != tasks.end(); ++it)
+            if (*it == task)
+            {
+                tasks.erase(it);
+                return;
+            }
+    }
+
+    // Threads not started by xTaskCreate (main, test threads) become tasks the first time they need to be one
+    auto self() -> TaskHandle_t
+    {
+        if (current == NULL)
+        {
+            current = new tskTaskControlBlock();
+            current->thread = pthread_self();
+            current->name = "main";
+            current->priority = 1;
+            current->core = tskNO_AFFINITY;
+            register_task(current);
+        }
+        return current;
+    }
+
+    auto run_task(void *arg) -> void *
+    {
+        current = (TaskHandle_t)arg;
+        pthread_setname_np(pthread_self(), current->name.substr(0, 15).c_str());
+        current->code(current->param);
+        // Returning from a task is a bug on the chip, here it ends the thread as if it deleted itself
+        vTaskDelete(NULL);
+        return NULL;
+    }
+
+    auto push(QueueHandle_t queue, const void *item, TickType_t ticks, bool front) -> BaseType_t
+    {
+        std::unique_lock<std::mutex> guard(queue->lock);
+        if (!wait_until(queue->changed, guard, ticks, [&] { return queue->items.size() < queue->length; }))
+            return pdFALSE;
+        std::vector<uint8_t> copy(queue->item_size);
+        if (item != NULL && queue->item_size > 0)
+            memcpy(copy.data(), item, queue->item_size);
+        if (front)
+            queue->items.push_front(std::move(copy));
+        else
+            queue->items.push_back(std::move(copy));
+        queue->changed.notify_all();
+        return pdTRUE;
+    }
+
+    auto create_queue(UBaseType_t length, UBaseType_t item_size, UBaseType_t filled) -> QueueHandle_t
+    {
+        auto queue = new QueueDefinition();
+        queue->length = length;
+        queue->item_size = item_size;
+        for (UBaseType_t i = 0; i < filled; i++)
+            queue->items.emplace_back(item_size);
+        return queue;
+    }
+}
+
+extern "C" {
+
+void vPortEnterCritical(portMUX_TYPE *)
+{
+    critical.lock();
+}
+
+void vPortExitCritical(portMUX_TYPE *)
+{
+    critical.unlock();
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    const auto core = self()->core;
+    return core == tskNO_AFFINITY ? 0 : core;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t, void *param,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core_id)
+{
+    auto task = new tskTaskControlBlock();
+    task->name = name;
+    task->priority = priority;
+    task->core = core_id;
+    task->code = code;
+    task->param = param;
+    register_task(task);
+    if (created != NULL)
+        *created = task;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 1 << 20); // Host frames are bigger than on the chip, the stack size is ignored
+    const auto rc = pthread_create(&task->thread, &attr, run_task, task);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+    {
+        unregister_task(task);
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack_depth, void *param,
+                       UBaseType_t priority, TaskHandle_t *created)
+{
+    return xTaskCreatePinnedToCore(code, name, stack_depth, param, priority, created, tskNO_AFFINITY);
+}
+
+// Threads cannot be stopped from the outside, deleting another task only forgets about it
+void vTaskDelete(TaskHandle_t task)
+{
+    const auto target = task != NULL ? task : self();
+    unregister_task(target);
+    if (target == current)
+        pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    const auto ms = (uint64_t)ticks * portTICK_PERIOD_MS;
+    timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000};
+    while (nanosleep(&ts, &ts) != 0)
+    {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    const auto ts = now();
+    return (TickType_t)(((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / portTICK_PERIOD_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return self();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    std::lock_guard<std::mutex> guard(task->lock);
+    task->notifications += 1;
+    task->notified.notify_all();
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    const auto task = self();
+    std::unique_lock<std::mutex> guard(task->lock);
+    wait_until(task->notified, guard, ticks_to_wait, [&] { return task->notifications > 0; });
+    const auto value = task->notifications;
+    if (value > 0)
+        task->notifications = clear_on_exit ? 0 : value - 1;
+    return value;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    std::lock_guard<std::mutex> guard(tasks_lock);
+    return tasks.size();
+}
+
+// Run time is the CPU time of each thread, the total is the wall clock since the first call
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t max_count, uint32_t *total_run_time)
+{
+    std::lock_guard<std::mutex> guard(tasks_lock);
+    if (tasks.size() > max_count)
+        return 0;
+    UBaseType_t count = 0;
+    for (const auto task : tasks)
+    {
+        clockid_t clock;
+        timespec cpu = {};
+        if (pthread_getcpuclockid(task->thread, &clock) == 0)
+            clock_gettime(clock, &cpu);
+        auto &s = status[count++];
+        s = {};
+        s.xHandle = task;
+        s.pcTaskName = task->name.c_str();
+        s.xTaskNumber = task->number;
+        s.eCurrentState = task == current ? eRunning : eBlocked;
+        s.uxCurrentPriority = s.uxBasePriority = task->priority;
+        s.ulRunTimeCounter = (uint32_t)((uint64_t)cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000);
+        s.usStackHighWaterMark = 1 << 20;
+        s.xCoreID = task->core;
+    }
+    if (total_run_time != NULL)
+    {
+        const auto ts = now();
+        *total_run_time = (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    }
+    return count;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t)
+{
+    return 1 << 20;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    return create_queue(length, item_size, 0);
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    return push(queue, item, ticks_to_wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    return push(queue, item, ticks_to_wait, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> guard(queue->lock);
+    if (!wait_until(queue->changed, guard, ticks_to_wait, [&] { return !queue->items.empty(); }))
+        return pdFALSE;
+    if (item != NULL && queue->item_size > 0)
+        memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    queue->items.clear();
+    queue->changed.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    return queue->items.size();
+}
+
+// Not recursive, and without priority inheritance (the host has no priorities to invert)
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return create_queue(1, 0, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return create_queue(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return create_queue(max_count, 0, initial_count);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    return new EventGroupDef_t();
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    std::lock_guard<std::mutex> guard(group->lock);
+    group->bits |= bits;
+    group->changed.notify_all();
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    std::lock_guard<std::mutex> guard(group->lock);
+    const auto before = group->bits;
+    group->bits &= ~bits;
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    std::lock_guard<std::mutex> guard(group->lock);
+    return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> guard(group->lock);
+    const auto met = [&] { return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0; };
+    const auto ok = wait_until(group->changed, guard, ticks_to_wait, met);
+    const auto value = group->bits;
+    if (ok && clear_on_exit)
+        group->bits &= ~bits;
+    return value;
+}
+
+}
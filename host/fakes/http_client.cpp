@@ -0,0 +1,430 @@
+#include "esp_http_client.h"
+#include "esp_tls.h"
+#include "esp_crt_bundle.h"
+#include "esp_log.h"
+#include "tcp.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct esp_http_client
+{
+    std::string host;
+    int port;
+    std::string path;
+    esp_http_client_method_t method;
+    esp_http_client_transport_t transport;
+    http_event_handle_cb handler;
+    void *user_data;
+    int timeout_ms;
+    std::vector<std::pair<std::string, std::string>> headers; // Kept between requests, like the real client
+    const char *post_data;
+    int post_len;
+
+    int fd;
+    host_fakes::Reader reader;
+    int status;
+    int64_t content_length; // -1 for chunked bodies and bodies that end with the connection
+    bool chunked;
+    int64_t left;           // Bytes left in the body or in the current chunk
+    bool body_done;
+    bool server_closes;     // The response said "Connection: close"
+};
+
+namespace
+{
+    constexpr auto TAG = "HTTP_CLIENT";
+    constexpr auto DEFAULT_TIMEOUT_MS = 5000;
+
+    constexpr const char *method_names[] = {"GET", "POST", "PUT", "PATCH", "DELETE", "HEAD", "NOTIFY", "SUBSCRIBE", "UNSUBSCRIBE", "OPTIONS"};
+
+    auto dispatch(esp_http_client_handle_t client, esp_http_client_event_id_t id, void *data = NULL, int len = 0,
+                  const char *key = NULL, const char *value = NULL) -> void
+    {
+        if (client->handler == NULL)
+            return;
+        esp_http_client_event_t event = {id, client, data, len, client->user_data, (char *)key, (char *)value};
+        client->handler(&event);
+    }
+
+    auto disconnect(esp_http_client_handle_t client) -> void
+    {
+        if (client->fd < 0)
+            return;
+        close(client->fd);
+        client->fd = -1;
+        dispatch(client, HTTP_EVENT_DISCONNECTED);
+    }
+
+    auto fail(esp_http_client_handle_t client, esp_err_t err) -> esp_err_t
+    {
+        dispatch(client, HTTP_EVENT_ERROR);
+        disconnect(client);
+        return err;
+    }
+
+    auto find_header(esp_http_client_handle_t client, const char *key) -> std::pair<std::string, std::string> *
+    {
+        for (auto &h : client->headers)
+            if (strcasecmp(h.first.c_str(), key) == 0)
+                return &h;
+        return NULL;
+    }
+
+    auto set_header(esp_http_client_handle_t client, const char *key, const std::string &value) -> void
+    {
+        const auto h = find_header(client, key);
+        if (h != NULL)
+            h->second = value;
+        else
+            client->headers.emplace_back(key, value);
+    }
+
+    // "http://host:port/path", or only a path that replaces the one of the last request
+    auto parse_url(esp_http_client_handle_t client, const char *url) -> esp_err_t
+    {
+        auto rest = url;
+        if (strncasecmp(url, "http://", 7) == 0 || strncasecmp(url, "https://", 8) == 0)
+        {
+            const auto secure = tolower(url[4]) == 's';
+            client->transport = secure ? HTTP_TRANSPORT_OVER_SSL : HTTP_TRANSPORT_OVER_TCP;
+            client->port = secure ? 443 : 80;
+            rest = url + (secure ? 8 : 7);
+            const auto end = rest + strcspn(rest, ":/");
+            client->host.assign(rest, end);
+            rest = end;
+            if (*rest == ':')
+                client->port = strtol(rest + 1, (char **)&rest, 10);
+        }
+        if (*rest != '\0' && *rest != '/')
+            return ESP_ERR_INVALID_ARG;
+        client->path = *rest != '\0' ? rest : "/";
+        return ESP_OK;
+    }
+
+    auto connect_if_needed(esp_http_client_handle_t client) -> esp_err_t
+    {
+        if (client->fd >= 0)
+            return ESP_OK;
+        if (client->transport == HTTP_TRANSPORT_OVER_SSL)
+        {
+            ESP_LOGE(TAG, "No TLS on the host, cannot connect to %s", client->host.c_str());
+            return fail(client, ESP_ERR_HTTP_CONNECT);
+        }
+        client->fd = host_fakes::connect_tcp(client->host, client->port, client->timeout_ms);
+        if (client->fd < 0)
+        {
+            ESP_LOGE(TAG, "Connection to %s:%d failed", client->host.c_str(), client->port);
+            return fail(client, ESP_ERR_HTTP_CONNECT);
+        }
+        host_fakes::reset(client->reader, client->fd);
+        dispatch(client, HTTP_EVENT_ON_CONNECTED);
+        return ESP_OK;
+    }
+
+    // Request line and headers. A negative "write_len" announces a chunked body the caller frames itself.
+    auto send_request(esp_http_client_handle_t client, int write_len) -> esp_err_t
+    {
+        auto err = connect_if_needed(client);
+        if (err != ESP_OK)
+            return err;
+        if (write_len >= 0)
+            set_header(client, "Content-Length", std::to_string(write_len));
+        else
+        {
+            set_header(client, "Transfer-Encoding", "chunked");
+            esp_http_client_delete_header(client, "Content-Length");
+        }
+        auto request = std::string(method_names[client->method]) + " " + client->path + " HTTP/1.1\r\nHost: " + client->host;
+        if (client->port != 80)
+            request += ":" + std::to_string(client->port);
+        request += "\r\nUser-Agent: ESP32 HTTP Client/1.0\r\n";
+        for (const auto &h : client->headers)
+            request += h.first + ": " + h.second + "\r\n";
+        request += "\r\n";
+
+        client->status = 0;
+        client->content_length = 0;
+        client->body_done = false;
+        if (!host_fakes::write_all(client->fd, request.data(), request.size()))
+            return fail(client, ESP_ERR_HTTP_WRITE_DATA);
+        dispatch(client, HTTP_EVENT_HEADER_SENT);
+        return ESP_OK;
+    }
+
+    auto read_status_and_headers(esp_http_client_handle_t client) -> bool
+    {
+        std::string line;
+        do
+        {
+            if (!host_fakes::read_line(client->reader, &line) || line.compare(0, 5, "HTTP/") != 0)
+                return false;
+            const auto space = line.find(' ');
+            client->status = space != std::string::npos ? atoi(line.c_str() + space + 1) : 0;
+            client->server_closes = line.compare(0, 8, "HTTP/1.0") == 0;
+            client->chunked = false;
+            client->content_length = -1;
+            while (true)
+            {
+                if (!host_fakes::read_line(client->reader, &line))
+                    return false;
+                if (line.empty())
+                    break;
+                const auto colon = line.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                auto key = line.substr(0, colon);
+                auto value = line.substr(line.find_first_not_of(" \t", colon + 1) == std::string::npos ? line.size() : line.find_first_not_of(" \t", colon + 1));
+                if (strcasecmp(key.c_str(), "Content-Length") == 0)
+                    client->content_length = strtoll(value.c_str(), NULL, 10);
+                else if (strcasecmp(key.c_str(), "Transfer-Encoding") == 0 && strcasecmp(value.c_str(), "chunked") == 0)
+                    client->chunked = true;
+                else if (strcasecmp(key.c_str(), "Connection") == 0)
+                    client->server_closes = strcasecmp(value.c_str(), "close") == 0;
+                if (client->status >= 200)
+                    dispatch(client, HTTP_EVENT_ON_HEADER, NULL, 0, key.c_str(), value.c_str());
+            }
+        } while (client->status >= 100 && client->status < 200); // "100 Continue" is followed by the real response
+
+        const auto no_body = client->method == HTTP_METHOD_HEAD || client->status == 204 || client->status == 304;
+        if (no_body || (!client->chunked && client->content_length == 0))
+        {
+            client->content_length = 0;
+            client->chunked = false;
+            client->body_done = true;
+        }
+        if (client->chunked)
+            client->content_length = -1;
+        client->left = client->chunked ? 0 : client->content_length;
+        return true;
+    }
+
+    // Decoded body bytes, 0 at the end of the body, -1 if the connection broke
+    auto read_body(esp_http_client_handle_t client, char *buf, int len) -> int
+    {
+        if (client->body_done || len <= 0)
+            return 0;
+        if (client->chunked && client->left == 0)
+        {
+            std::string line;
+            if (!host_fakes::read_line(client->reader, &line))
+                return -1;
+            client->left = strtoll(line.c_str(), NULL, 16);
+            if (client->left == 0)
+            {
+                while (host_fakes::read_line(client->reader, &line) && !line.empty())
+                    ; // Trailers
+                client->body_done = true;
+                return 0;
+            }
+        }
+        const auto want = client->left >= 0 && client->left < len ? (int)client->left : len;
+        const auto n = host_fakes::read_some(client->reader, (uint8_t *)buf, want);
+        if (n < 0 || (n == 0 && client->left >= 0))
+            return -1;
+        if (n == 0)
+        {
+            client->body_done = true; // The body ended with the connection
+            client->server_closes = true;
+            return 0;
+        }
+        if (client->left >= 0)
+            client->left -= n;
+        if (client->chunked && client->left == 0)
+        {
+            std::string crlf;
+            host_fakes::read_line(client->reader, &crlf);
+        }
+        else if (!client->chunked && client->left == 0)
+            client->body_done = true;
+        dispatch(client, HTTP_EVENT_ON_DATA, buf, n);
+        return n;
+    }
+
+    auto finish(esp_http_client_handle_t client) -> void
+    {
+        if (client->server_closes)
+            disconnect(client);
+    }
+}
+
+extern "C" {
+
+esp_err_t esp_tls_get_and_clear_last_error(esp_tls_error_handle_t, int *esp_tls_code, int *esp_tls_flags)
+{
+    if (esp_tls_code != NULL)
+        *esp_tls_code = 0;
+    if (esp_tls_flags != NULL)
+        *esp_tls_flags = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_crt_bundle_attach(void *)
+{
+    return ESP_OK;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+    auto client = new esp_http_client();
+    client->fd = -1;
+    client->method = config->method;
+    client->handler = config->event_handler;
+    client->user_data = config->user_data;
+    client->timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : DEFAULT_TIMEOUT_MS;
+    client->transport = config->transport_type == HTTP_TRANSPORT_OVER_SSL ? HTTP_TRANSPORT_OVER_SSL : HTTP_TRANSPORT_OVER_TCP;
+    client->port = config->port != 0 ? config->port : client->transport == HTTP_TRANSPORT_OVER_SSL ? 443 : 80;
+    client->path = "/";
+    if (config->host != NULL)
+        client->host = config->host;
+    if (config->path != NULL)
+        client->path = config->path;
+    if (config->url != NULL && parse_url(client, config->url) != ESP_OK)
+    {
+        delete client;
+        return NULL;
+    }
+    if (client->host.empty())
+    {
+        delete client;
+        return NULL;
+    }
+    return client;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url)
+{
+    return parse_url(client, url);
+}
+
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len)
+{
+    client->post_data = data;
+    client->post_len = data != NULL ? len : 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+{
+    set_header(client, key, value);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key)
+{
+    for (auto it = client->headers.begin(); it != client->headers.end(); ++it)
+        if (strcasecmp(it->first.c_str(), key) == 0)
+        {
+            client->headers.erase(it);
+            break;
+        }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method)
+{
+    client->method = method;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *data)
+{
+    client->user_data = data;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client)
+{
+    auto err = send_request(client, client->post_len);
+    if (err != ESP_OK)
+        return err;
+    if (client->post_len > 0 && !host_fakes::write_all(client->fd, client->post_data, client->post_len))
+        return fail(client, ESP_ERR_HTTP_WRITE_DATA);
+    if (!read_status_and_headers(client))
+        return fail(client, ESP_ERR_HTTP_FETCH_HEADER);
+    char buf[512];
+    int n;
+    while ((n = read_body(client, buf, sizeof(buf))) > 0)
+        ;
+    if (n < 0)
+        return fail(client, ESP_FAIL);
+    dispatch(client, HTTP_EVENT_ON_FINISH);
+    finish(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+    return send_request(client, write_len);
+}
+
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len)
+{
+    if (client->fd < 0)
+        return -1;
+    return host_fakes::write_all(client->fd, buffer, len) ? len : -1;
+}
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+    if (client->fd < 0 || !read_status_and_headers(client))
+    {
+        fail(client, ESP_ERR_HTTP_FETCH_HEADER);
+        return ESP_FAIL;
+    }
+    return client->content_length;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    if (client->fd < 0)
+        return client->body_done ? 0 : -1;
+    const auto n = read_body(client, buffer, len);
+    if (n < 0)
+        fail(client, ESP_FAIL);
+    else if (client->body_done)
+        finish(client);
+    return n;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client)
+{
+    return client->status;
+}
+
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client)
+{
+    return client->content_length;
+}
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client)
+{
+    return client->body_done;
+}
+
+esp_http_client_transport_t esp_http_client_get_transport_type(esp_http_client_handle_t client)
+{
+    return client->transport;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+{
+    disconnect(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+    if (client == NULL)
+        return ESP_FAIL;
+    disconnect(client);
+    delete client;
+    return ESP_OK;
+}
+
+}
@@ -0,0 +1,368 @@
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "host_fakes.hpp"
+#include "tcp.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    constexpr auto TAG = "HTTPD";
+
+    struct Connection
+    {
+        int fd;
+        host_fakes::Reader reader;
+        uint64_t last_used; // For the LRU purge
+    };
+
+    struct Server
+    {
+        httpd_config_t config;
+        int listen_fd;
+        int wake[2]; // httpd_stop() writes here to end the poll
+        std::thread thread;
+        std::vector<httpd_uri_t> routes;
+        std::vector<Connection *> connections;
+        uint64_t requests;
+    };
+
+    // What a handler sees behind "httpd_req_t"
+    struct Request
+    {
+        httpd_req_t req = {};
+        Connection *connection;
+        std::vector<std::pair<std::string, std::string>> headers;
+        size_t body_left;
+        std::string status;
+        std::string type;
+        std::vector<std::pair<std::string, std::string>> resp_headers;
+        bool headers_sent;
+        bool chunked;
+        bool failed;
+    };
+
+    auto of(httpd_req_t *r) -> Request *
+    {
+        return (Request *)r; // "req" is the first member
+    }
+
+    auto send_head(Request *r, ssize_t content_len) -> bool
+    {
+        auto head = "HTTP/1.1 " + r->status + "\r\nContent-Type: " + r->type + "\r\n";
+        if (content_len >= 0)
+            head += "Content-Length: " + std::to_string(content_len) + "\r\n";
+        else
+            head += "Transfer-Encoding: chunked\r\n";
+        for (const auto &h : r->resp_headers)
+            head += h.first + ": " + h.second + "\r\n";
+        head += "\r\n";
+        r->headers_sent = true;
+        r->chunked = content_len < 0;
+        return host_fakes::write_all(r->connection->fd, head.data(), head.size());
+    }
+
+    auto read_request(Request &r) -> bool
+    {
+        std::string line;
+        if (!host_fakes::read_line(r.connection->reader, &line))
+            return false;
+        const auto first = line.find(' ');
+        const auto second = line.find(' ', first + 1);
+        if (first == std::string::npos || second == std::string::npos || second - first - 1 > 512)
+            return false;
+        const auto method = line.substr(0, first);
+        r.req.method = method == "GET" ? HTTP_GET : method == "POST" ? HTTP_POST : method == "PUT" ? HTTP_PUT
+                     : method == "DELETE" ? HTTP_DELETE : method == "HEAD" ? HTTP_HEAD : -1;
+        memcpy((char *)r.req.uri, line.data() + first + 1, second - first - 1);
+        while (host_fakes::read_line(r.connection->reader, &line) && !line.empty())
+        {
+            const auto colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            const auto value_at = line.find_first_not_of(" \t", colon + 1);
+            r.headers.emplace_back(line.substr(0, colon), value_at != std::string::npos ? line.substr(value_at) : "");
+            if (strcasecmp(r.headers.back().first.c_str(), "Content-Length") == 0)
+                r.req.content_len = strtoul(r.headers.back().second.c_str(), NULL, 10);
+        }
+        r.body_left = r.req.content_len;
+        return line.empty();
+    }
+
+    // The default matcher: the path has to be equal, the query string is left out
+    auto find_route(Server *server, const Request &r) -> const httpd_uri_t *
+    {
+        const auto path_len = strcspn(r.req.uri, "?");
+        for (const auto &route : server->routes)
+            if ((int)route.method == r.req.method && strlen(route.uri) == path_len && strncmp(route.uri, r.req.uri, path_len) == 0)
+                return &route;
+        return NULL;
+    }
+
+    // One request on a connection, returns false if the connection has to be closed
+    auto serve(Server *server, Connection *c) -> bool
+    {
+        auto r = new Request();
+        r->req.handle = server;
+        r->connection = c;
+        r->status = "200 OK";
+        r->type = "text/html";
+        auto keep = read_request(*r);
+        if (keep)
+        {
+            const auto route = find_route(server, *r);
+            if (route == NULL)
+            {
+                r->status = "404 Not Found";
+                httpd_resp_send(&r->req, "Nothing here", HTTPD_RESP_USE_STRLEN);
+            }
+            else
+            {
+                r->req.user_ctx = route->user_ctx;
+                keep = route->handler(&r->req) == ESP_OK && !r->failed;
+            }
+            // Whatever the handler left unread goes, so the next request starts where it should
+            char discard[256];
+            while (keep && r->body_left > 0)
+            {
+                const auto n = httpd_req_recv(&r->req, discard, sizeof(discard));
+                keep = n > 0;
+            }
+            if (keep && !r->headers_sent)
+                httpd_resp_send(&r->req, NULL, 0);
+            keep = keep && !r->failed;
+        }
+        delete r;
+        return keep;
+    }
+
+    auto close_connection(Server *server, size_t index) -> void
+    {
+        close(server->connections[index]->fd);
+        delete server->connections[index];
+        server->connections.erase(server->connections.begin() + index);
+    }
+
+    auto accept_connection(Server *server) -> void
+    {
+        const auto fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        if (server->connections.size() >= server->config.max_open_sockets)
+        {
+            if (!server->config.lru_purge_enable)
+            {
+                close(fd);
+                return;
+            }
+            size_t oldest = 0;
+            for (size_t i = 1; i < server->connections.size(); i++)
+                if (server->connections[i]->last_used < server->connections[oldest]->last_used)
+                    oldest = i;
+            close_connection(server, oldest);
+        }
+        timeval tv = {server->config.recv_wait_timeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        tv.tv_sec = server->config.send_wait_timeout;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        auto c = new Connection();
+        c->fd = fd;
+        c->last_used = server->requests;
+        host_fakes::reset(c->reader, fd);
+        server->connections.push_back(c);
+    }
+
+    auto run(Server *server) -> void
+    {
+        while (true)
+        {
+            std::vector<pollfd> fds = {{server->wake[0], POLLIN, 0}, {server->listen_fd, POLLIN, 0}};
+            for (const auto c : server->connections)
+                fds.push_back({c->fd, POLLIN, 0});
+            if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+                break;
+            if (fds[0].revents != 0)
+                break;
+            for (size_t i = fds.size(); i-- > 2;)
+            {
+                if (fds[i].revents == 0)
+                    continue;
+                const auto c = server->connections[i - 2];
+                c->last_used = ++server->requests;
+                if (!serve(server, c))
+                    close_connection(server, i - 2);
+            }
+            if (fds[1].revents & POLLIN)
+                accept_connection(server); // After serving, a purge moves the connections around
+        }
+        while (!server->connections.empty())
+            close_connection(server, 0);
+    }
+}
+
+extern "C" {
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    auto server = new Server();
+    server->config = *config;
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    const auto one = 1;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(host_fakes::listen_port_for(config->server_port));
+    if (bind(server->listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(server->listen_fd, config->backlog_conn) != 0 ||
+        pipe(server->wake) != 0)
+    {
+        ESP_LOGE(TAG, "Cannot listen on port %u (%s)", ntohs(addr.sin_port), strerror(errno));
+        close(server->listen_fd);
+        delete server;
+        return ESP_ERR_HTTPD_TASK;
+    }
+    socklen_t addr_len = sizeof(addr);
+    getsockname(server->listen_fd, (sockaddr *)&addr, &addr_len);
+    host_fakes::set_listening(config->server_port, ntohs(addr.sin_port));
+    server->thread = std::thread(run, server);
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    auto server = (Server *)handle;
+    if (server == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (write(server->wake[1], "", 1) != 1)
+        return ESP_FAIL;
+    server->thread.join();
+    host_fakes::set_listening(server->config.server_port, 0);
+    close(server->listen_fd);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    delete server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    auto server = (Server *)handle;
+    if (server == NULL || uri_handler == NULL)
+        return ESP_ERR_INVALID_ARG;
+    for (const auto &route : server->routes)
+        if (route.method == uri_handler->method && strcmp(route.uri, uri_handler->uri) == 0)
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+    if (server->routes.size() >= server->config.max_uri_handlers)
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    server->routes.push_back(*uri_handler);
+    return ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t buf_len)
+{
+    auto r = of(req);
+    if (r->body_left == 0)
+        return 0;
+    const auto n = host_fakes::read_some(r->connection->reader, (uint8_t *)buf, buf_len < r->body_left ? buf_len : r->body_left);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    if (n <= 0)
+    {
+        r->failed = true;
+        return HTTPD_SOCK_ERR_FAIL;
+    }
+    r->body_left -= n;
+    return n;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *req, const char *field)
+{
+    for (const auto &h : of(req)->headers)
+        if (strcasecmp(h.first.c_str(), field) == 0)
+            return h.second.size();
+    return 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *req, const char *field, char *val, size_t val_size)
+{
+    for (const auto &h : of(req)->headers)
+    {
+        if (strcasecmp(h.first.c_str(), field) != 0)
+            continue;
+        if (val_size == 0)
+            return ESP_ERR_HTTPD_RESULT_TRUNC;
+        snprintf(val, val_size, "%s", h.second.c_str());
+        return h.second.size() < val_size ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *req, const char *status)
+{
+    of(req)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type)
+{
+    of(req)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *req, const char *field, const char *value)
+{
+    of(req)->resp_headers.emplace_back(field, value);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *req, const char *buf, ssize_t buf_len)
+{
+    auto r = of(req);
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+        buf_len = buf != NULL ? strlen(buf) : 0;
+    if (r->headers_sent)
+        return ESP_ERR_HTTPD_RESP_HDR;
+    if (!send_head(r, buf_len) || (buf_len > 0 && !host_fakes::write_all(r->connection->fd, buf, buf_len)))
+    {
+        r->failed = true;
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t buf_len)
+{
+    auto r = of(req);
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+        buf_len = buf != NULL ? strlen(buf) : 0;
+    if (!r->headers_sent && !send_head(r, -1))
+        r->failed = true;
+    if (r->failed || !r->chunked)
+        return ESP_ERR_HTTPD_RESP_SEND;
+    char size_line[12];
+    snprintf(size_line, sizeof(size_line), "%x\r\n", (unsigned)(buf != NULL ? buf_len : 0));
+    const auto ok = host_fakes::write_all(r->connection->fd, size_line, strlen(size_line)) &&
+                    (buf == NULL || buf_len == 0 || host_fakes::write_all(r->connection->fd, buf, buf_len)) &&
+                    host_fakes::write_all(r->connection->fd, "\r\n", 2);
+    r->failed |= !ok;
+    return ok ? ESP_OK : ESP_ERR_HTTPD_RESP_SEND;
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *req, const char *str)
+{
+    return httpd_resp_send_chunk(req, str, str != NULL ? HTTPD_RESP_USE_STRLEN : 0);
+}
+
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t esp_sleep_enable_uart_wakeup(int uart_num);
+
+#ifdef __cplusplus
+}
+#endif
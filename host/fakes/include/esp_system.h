@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_bit_defs.h"
+
+// From esp_mac.h, which esp_system.h still includes in IDF 4.4
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Ends the process with host_fakes::RESTART_EXIT_CODE, whoever started it starts it again
+void esp_restart(void) __attribute__((noreturn));
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+uint32_t esp_random(void);
+
+#ifdef __cplusplus
+}
+#endif
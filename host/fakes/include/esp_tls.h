@@ -0,0 +1,16 @@
+// There is no TLS on the host, the error handle is always empty
+#pragma once
+
+#include "esp_err.h"
+
+typedef struct esp_tls_last_error *esp_tls_error_handle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t esp_tls_get_and_clear_last_error(esp_tls_error_handle_t h, int *esp_tls_code, int *esp_tls_flags);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,22 @@
+// Linux has eventfd, the VFS registration has nothing to do
+#pragma once
+
+#include <sys/eventfd.h>
+#include "esp_err.h"
+
+typedef struct
+{
+    size_t max_fds;
+} esp_vfs_eventfd_config_t;
+
+#define ESP_VFS_EVENTD_CONFIG_DEFAULT() {.max_fds = 5}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+esp_err_t esp_vfs_eventfd_register(const esp_vfs_eventfd_config_t *config);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,22 @@
+// Semaphores are queues of empty items, like in FreeRTOS
+#pragma once
+
+#include "freertos/queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define xSemaphoreTake(sem, ticks) xQueueReceive(sem, NULL, ticks)
+#define xSemaphoreGive(sem) xQueueSend(sem, NULL, 0)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "stdint.h"
+#include "stddef.h"
+#include "esp_err.h"
+
+// Controls for the host stand-ins of the ESP-IDF drivers, used by the tests and by modem_host.
+// Nothing here exists on the chip.
+namespace host_fakes
+{
+    constexpr auto RESTART_EXIT_CODE = 3; // Exit code of esp_restart(), whoever started the modem starts it again
+
+    /* ---------------------------------- UART --------------------------------- */
+
+    // Bytes read by the driver come from rx_fd, written ones go to tx_fd (UART0 uses stdin/stdout by default)
+    auto attach_uart(int port, int rx_fd, int tx_fd) -> void;
+    // Called from the reading task once rx_fd reached its end, by default the task blocks forever
+    auto on_uart_hangup(void (*handler)(int port)) -> void;
+    // Bytes take as long as they would on the wire at the port's baud rate (10 bits each), pipes are instant otherwise
+    auto pace_uart(bool paced) -> void;
+
+    /* -------------------------------- Storage -------------------------------- */
+
+    // NVS keys and partition images are files in this directory (created if missing), they survive restarts
+    auto set_storage_dir(const char *dir) -> esp_err_t;
+    auto storage_dir() -> const char *;
+    // Partitions from an ESP-IDF partition table, sizes in hex, decimal or with a K / M suffix
+    auto load_partitions(const char *csv_path) -> esp_err_t;
+    auto add_partition(const char *label, int type, int subtype, uint32_t size) -> esp_err_t;
+    // Flash writes stop after "bytes" more bytes, the write in progress is torn (a power cut), -1 to disable
+    auto power_cut_after(int64_t bytes) -> void;
+    auto power_was_cut() -> bool;
+
+    /* ---------------------------------- WiFi --------------------------------- */
+
+    // An access point in range of the station, connecting to it gets "ip" from its DHCP server
+    struct AccessPoint
+    {
+        const char *ssid; // Empty for a hidden network
+        const char *password;
+        uint8_t bssid[6];
+        uint8_t channel;
+        int8_t rssi;
+        const char *ip;
+    };
+    auto add_access_point(const AccessPoint &ap) -> void;
+    auto clear_access_points() -> void;
+    auto drop_station() -> void; // The access point went away, the station gets a disconnect event
+
+    /* -------------------------------- Network -------------------------------- */
+
+    // Clients connecting to "port" go to "to" instead, so test servers need neither port 80 nor root
+    auto redirect_port(uint16_t port, uint16_t to) -> void;
+    auto redirected_port(uint16_t port) -> uint16_t;
+    // Servers asked to listen on "port" listen on "to" (0 picks a free port, see listening_port())
+    auto redirect_listen(uint16_t port, uint16_t to) -> void;
+    auto listen_port_for(uint16_t port) -> uint16_t;
+    auto listening_port(uint16_t port) -> uint16_t; // Where the server asked for "port" ended up, 0 if none runs
+}
@@ -0,0 +1,12 @@
+// lwIP speaks the BSD socket API, the host stack is used as is
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
@@ -0,0 +1,418 @@
+#include "mqtt_client.h"
+#include "esp_log.h"
+#include "tcp.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct esp_mqtt_client
+{
+    std::string host;
+    uint16_t port;
+    std::string client_id;
+    std::string username;
+    std::string password;
+    bool clean_session;
+    int reconnect_ms;
+    int network_timeout_ms;
+    int buffer_size;
+
+    struct Handler
+    {
+        esp_mqtt_event_id_t event;
+        esp_event_handler_t handler;
+        void *arg;
+    };
+    std::vector<Handler> handlers;
+
+    std::thread thread;
+    std::mutex lock; // Guards the socket for writers and the state below
+    std::condition_variable stopped;
+    int fd;
+    bool connected;
+    bool stopping;
+    uint16_t next_msg_id;
+};
+
+namespace
+{
+    constexpr auto TAG = "MQTT_CLIENT";
+    constexpr auto MQTT_EVENTS = "MQTT_EVENTS";
+    constexpr auto DEFAULT_RECONNECT_MS = 1000; // The chip waits 10 s, the tests would rather not
+    constexpr auto DEFAULT_NETWORK_TIMEOUT_MS = 10000;
+    constexpr auto DEFAULT_BUFFER_SIZE = 1024;  // Bigger incoming messages are handed out in parts of this size
+
+    constexpr uint8_t CONNECT = 0x10, CONNACK = 0x20, PUBLISH = 0x30, PUBACK = 0x40, SUBSCRIBE = 0x82, SUBACK = 0x90,
+                      UNSUBSCRIBE = 0xA2, UNSUBACK = 0xB0, PINGRESP = 0xD0;
+
+    auto dispatch(esp_mqtt_client_handle_t client, esp_mqtt_event_t &event) -> void
+    {
+        event.client = client;
+        for (const auto &h : client->handlers)
+            if (h.event == MQTT_EVENT_ANY || h.event == event.event_id)
+                h.handler(h.arg, MQTT_EVENTS, event.event_id, &event);
+    }
+
+    auto dispatch(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t id, int msg_id = 0) -> void
+    {
+        esp_mqtt_event_t event = {};
+        event.event_id = id;
+        event.msg_id = msg_id;
+        dispatch(client, event);
+    }
+
+    auto put_string(std::string &out, const std::string &s) -> void
+    {
+        out += (char)(s.size() >> 8);
+        out += (char)(s.size() & 0xFF);
+        out += s;
+    }
+
+    auto put_id(std::string &out, uint16_t id) -> void
+    {
+        out += (char)(id >> 8);
+        out += (char)(id & 0xFF);
+    }
+
+    auto packet(uint8_t type, const std::string &body) -> std::string
+    {
+        std::string out(1, (char)type);
+        auto len = body.size();
+        do
+        {
+            auto digit = (uint8_t)(len % 128);
+            len /= 128;
+            out += (char)(len > 0 ? digit | 0x80 : digit);
+        } while (len > 0);
+        return out + body;
+    }
+
+    // Writers share the socket with the reading thread, only one of them writes at a time
+    auto send_locked(esp_mqtt_client_handle_t client, const std::string &bytes) -> bool
+    {
+        return client->fd >= 0 && host_fakes::write_all(client->fd, bytes.data(), bytes.size());
+    }
+
+    auto take_msg_id_locked(esp_mqtt_client_handle_t client) -> uint16_t
+    {
+        if (++client->next_msg_id == 0)
+            client->next_msg_id = 1;
+        return client->next_msg_id;
+    }
+
+    auto read_packet(host_fakes::Reader &reader, uint8_t *type, std::string *body) -> bool
+    {
+        if (!host_fakes::read_exact(reader, type, 1))
+            return false;
+        size_t len = 0;
+        for (auto shift = 0; shift < 28; shift += 7)
+        {
+            uint8_t digit;
+            if (!host_fakes::read_exact(reader, &digit, 1))
+                return false;
+            len |= (size_t)(digit & 0x7F) << shift;
+            if ((digit & 0x80) == 0)
+                break;
+        }
+        body->resize(len);
+        return len == 0 || host_fakes::read_exact(reader, (uint8_t *)&(*body)[0], len);
+    }
+
+    auto connect_packet(esp_mqtt_client_handle_t client) -> std::string
+    {
+        std::string body;
+        put_string(body, "MQTT");
+        body += (char)4; // Protocol level 3.1.1
+        auto flags = client->clean_session ? 0x02 : 0x00;
+        flags |= client->username.empty() ? 0 : 0x80;
+        flags |= client->password.empty() ? 0 : 0x40;
+        body += (char)flags;
+        put_id(body, 0); // No keep-alive, loopback connections do not go stale
+        put_string(body, client->client_id);
+        if (!client->username.empty())
+            put_string(body, client->username);
+        if (!client->password.empty())
+            put_string(body, client->password);
+        return packet(CONNECT, body);
+    }
+
+    auto on_publish(esp_mqtt_client_handle_t client, uint8_t type, const std::string &body) -> void
+    {
+        const auto qos = (type >> 1) & 0x03;
+        if (body.size() < 2)
+            return;
+        const auto topic_len = (uint8_t)body[0] << 8 | (uint8_t)body[1];
+        auto pos = 2 + topic_len;
+        uint16_t msg_id = 0;
+        if (qos > 0 && body.size() >= (size_t)pos + 2)
+        {
+            msg_id = (uint8_t)body[pos] << 8 | (uint8_t)body[pos + 1];
+            pos += 2;
+        }
+        if ((size_t)pos > body.size())
+            return;
+
+        const auto total = (int)body.size() - pos;
+        auto offset = 0;
+        do
+        {
+            const auto part = total - offset < client->buffer_size ? total - offset : client->buffer_size;
+            esp_mqtt_event_t event = {};
+            event.event_id = MQTT_EVENT_DATA;
+            event.msg_id = msg_id;
+            event.qos = qos;
+            event.retain = (type & 0x01) != 0;
+            event.topic = offset == 0 ? (char *)body.data() + 2 : NULL;
+            event.topic_len = offset == 0 ? topic_len : 0;
+            event.data = (char *)body.data() + pos + offset;
+            event.data_len = part;
+            event.current_data_offset = offset;
+            event.total_data_len = total;
+            dispatch(client, event);
+            offset += part;
+        } while (offset < total);
+
+        if (qos > 0)
+        {
+            std::string ack;
+            put_id(ack, msg_id);
+            std::lock_guard<std::mutex> guard(client->lock);
+            send_locked(client, packet(PUBACK, ack));
+        }
+    }
+
+    // One connection: CONNECT, then packets until the broker or the network goes away
+    auto session(esp_mqtt_client_handle_t client) -> void
+    {
+        const auto fd = host_fakes::connect_tcp(client->host, client->port, client->network_timeout_ms);
+        if (fd < 0)
+        {
+            ESP_LOGE(TAG, "Cannot connect to %s:%u", client->host.c_str(), client->port);
+            dispatch(client, MQTT_EVENT_ERROR);
+            return;
+        }
+        host_fakes::Reader reader;
+        host_fakes::reset(reader, fd);
+        {
+            std::lock_guard<std::mutex> guard(client->lock);
+            if (client->stopping)
+            {
+                close(fd);
+                return;
+            }
+            client->fd = fd;
+            send_locked(client, connect_packet(client));
+        }
+
+        uint8_t type;
+        std::string body;
+        if (!read_packet(reader, &type, &body) || type != CONNACK || body.size() < 2 || body[1] != 0)
+            ESP_LOGE(TAG, "Broker refused the connection");
+        else
+        {
+            timeval forever = {0, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+            {
+                std::lock_guard<std::mutex> guard(client->lock);
+                client->connected = true;
+            }
+            ESP_LOGI(TAG, "Connected to %s:%u", client->host.c_str(), client->port);
+            esp_mqtt_event_t event = {};
+            event.event_id = MQTT_EVENT_CONNECTED;
+            event.session_present = body[0] & 0x01;
+            dispatch(client, event);
+
+            while (read_packet(reader, &type, &body))
+            {
+                const auto msg_id = body.size() >= 2 ? (uint8_t)body[0] << 8 | (uint8_t)body[1] : 0;
+                switch (type & 0xF0)
+                {
+                case PUBLISH:
+                    on_publish(client, type, body);
+                    break;
+                case PUBACK:
+                    dispatch(client, MQTT_EVENT_PUBLISHED, msg_id);
+                    break;
+                case SUBACK:
+                    dispatch(client, MQTT_EVENT_SUBSCRIBED, msg_id);
+                    break;
+                case UNSUBACK:
+                    dispatch(client, MQTT_EVENT_UNSUBSCRIBED, msg_id);
+                    break;
+                case PINGRESP:
+                default:
+                    break;
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(client->lock);
+            client->connected = false;
+            client->fd = -1;
+            close(fd);
+        }
+        dispatch(client, MQTT_EVENT_DISCONNECTED);
+    }
+
+    auto run(esp_mqtt_client_handle_t client) -> void
+    {
+        std::unique_lock<std::mutex> guard(client->lock);
+        while (!client->stopping)
+        {
+            guard.unlock();
+            session(client);
+            guard.lock();
+            client->stopped.wait_for(guard, std::chrono::milliseconds(client->reconnect_ms), [client] { return client->stopping; });
+        }
+    }
+
+    // "mqtt://[user:password@]host[:port][/path]"
+    auto parse_uri(esp_mqtt_client_handle_t client, const char *uri) -> bool
+    {
+        if (strncmp(uri, "mqtt://", 7) != 0 && strncmp(uri, "tcp://", 6) != 0)
+        {
+            ESP_LOGE(TAG, "Only plain mqtt:// works on the host, not %s", uri);
+            return false;
+        }
+        auto rest = strstr(uri, "://") + 3;
+        const auto at = strchr(rest, '@');
+        if (at != NULL)
+        {
+            const auto colon = (const char *)memchr(rest, ':', at - rest);
+            client->username.assign(rest, colon != NULL ? colon : at);
+            if (colon != NULL)
+                client->password.assign(colon + 1, at);
+            rest = at + 1;
+        }
+        const auto end = rest + strcspn(rest, ":/");
+        client->host.assign(rest, end);
+        client->port = *end == ':' ? atoi(end + 1) : 1883;
+        return !client->host.empty();
+    }
+}
+
+extern "C" {
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    auto client = new esp_mqtt_client();
+    client->fd = -1;
+    client->port = config->port != 0 ? config->port : 1883;
+    if (config->host != NULL)
+        client->host = config->host;
+    if (config->uri != NULL && !parse_uri(client, config->uri))
+    {
+        delete client;
+        return NULL;
+    }
+    if (config->client_id != NULL)
+        client->client_id = config->client_id;
+    else
+        client->client_id = "ESP32_" + std::to_string(getpid());
+    if (config->username != NULL)
+        client->username = config->username;
+    if (config->password != NULL)
+        client->password = config->password;
+    client->clean_session = !config->disable_clean_session;
+    client->reconnect_ms = config->reconnect_timeout_ms > 0 ? config->reconnect_timeout_ms : DEFAULT_RECONNECT_MS;
+    client->network_timeout_ms = config->network_timeout_ms > 0 ? config->network_timeout_ms : DEFAULT_NETWORK_TIMEOUT_MS;
+    client->buffer_size = config->buffer_size > 0 ? config->buffer_size : DEFAULT_BUFFER_SIZE;
+    return client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler, void *event_handler_arg)
+{
+    if (client == NULL || client->thread.joinable())
+        return ESP_ERR_INVALID_STATE;
+    client->handlers.push_back({event, event_handler, event_handler_arg});
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL || client->thread.joinable())
+        return ESP_FAIL;
+    client->stopping = false;
+    client->thread = std::thread(run, client);
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL || !client->thread.joinable())
+        return ESP_FAIL;
+    {
+        std::lock_guard<std::mutex> guard(client->lock);
+        client->stopping = true;
+        if (client->fd >= 0)
+            shutdown(client->fd, SHUT_RDWR); // Wakes the reading thread
+        client->stopped.notify_all();
+    }
+    client->thread.join();
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (client->thread.joinable())
+        esp_mqtt_client_stop(client);
+    delete client;
+    return ESP_OK;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    if (qos > 1)
+        return -1; // QoS 2 is not spoken here
+    if (len == 0 && data != NULL)
+        len = strlen(data);
+    std::lock_guard<std::mutex> guard(client->lock);
+    if (!client->connected)
+        return -1;
+    std::string body;
+    put_string(body, topic);
+    const auto msg_id = qos > 0 ? take_msg_id_locked(client) : 0;
+    if (qos > 0)
+        put_id(body, msg_id);
+    body.append(data != NULL ? data : "", len);
+    if (!send_locked(client, packet(PUBLISH | qos << 1 | (retain ? 1 : 0), body)))
+        return -1;
+    return msg_id;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+    std::lock_guard<std::mutex> guard(client->lock);
+    if (!client->connected)
+        return -1;
+    std::string body;
+    const auto msg_id = take_msg_id_locked(client);
+    put_id(body, msg_id);
+    put_string(body, topic);
+    body += (char)qos;
+    return send_locked(client, packet(SUBSCRIBE, body)) ? msg_id : -1;
+}
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic)
+{
+    std::lock_guard<std::mutex> guard(client->lock);
+    if (!client->connected)
+        return -1;
+    std::string body;
+    const auto msg_id = take_msg_id_locked(client);
+    put_id(body, msg_id);
+    put_string(body, topic);
+    return send_locked(client, packet(UNSUBSCRIBE, body)) ? msg_id : -1;
+}
+
+}
@@ -0,0 +1,258 @@
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "host_fakes.hpp"
+#include "storage_dir.hpp"
+
+#include <errno.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Handle
+    {
+        std::string dir;
+        nvs_open_mode_t mode;
+    };
+
+    std::mutex lock;
+    std::map<nvs_handle_t, Handle> handles;
+    nvs_handle_t next_handle = 1;
+    bool initialized = false;
+
+    auto nvs_root() -> std::string
+    {
+        return host_fakes::storage_path("nvs");
+    }
+
+    auto remove_tree(const std::string &path) -> void
+    {
+        const auto dir = opendir(path.c_str());
+        if (dir == NULL)
+        {
+            unlink(path.c_str());
+            return;
+        }
+        while (const auto entry = readdir(dir))
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                remove_tree(path + "/" + entry->d_name);
+        closedir(dir);
+        rmdir(path.c_str());
+    }
+
+    // Values of different types are different entries, like in NVS, so the type is part of the file name
+    auto entry_path(nvs_handle_t handle, const char *key, const char *type, std::string *path, bool writing) -> esp_err_t
+    {
+        const auto it = handles.find(handle);
+        if (it == handles.end())
+            return ESP_ERR_NVS_INVALID_HANDLE;
+        if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE)
+            return ESP_ERR_NVS_KEY_TOO_LONG;
+        if (writing && it->second.mode == NVS_READONLY)
+            return ESP_ERR_NVS_READ_ONLY;
+        *path = it->second.dir + "/" + key + "." + type;
+        return ESP_OK;
+    }
+
+    auto write_entry(nvs_handle_t handle, const char *key, const char *type, const void *value, size_t length) -> esp_err_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::string path;
+        const auto err = entry_path(handle, key, type, &path, true);
+        if (err != ESP_OK)
+            return err;
+        // Written aside and renamed, so a value is never seen half written
+        const auto temp = path + ".new";
+        const auto file = fopen(temp.c_str(), "wb");
+        if (file == NULL)
+            return ESP_FAIL;
+        const auto ok = fwrite(value, 1, length, file) == length;
+        if (fclose(file) != 0 || !ok || rename(temp.c_str(), path.c_str()) != 0)
+            return ESP_FAIL;
+        return ESP_OK;
+    }
+
+    auto read_entry(nvs_handle_t handle, const char *key, const char *type, std::vector<uint8_t> *value) -> esp_err_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::string path;
+        const auto err = entry_path(handle, key, type, &path, false);
+        if (err != ESP_OK)
+            return err;
+        const auto file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+            return ESP_ERR_NVS_NOT_FOUND;
+        uint8_t chunk[512];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+            value->insert(value->end(), chunk, chunk + n);
+        fclose(file);
+        return ESP_OK;
+    }
+
+    // The caller learns the size with a NULL buffer, a buffer that is too small is an error
+    auto read_sized(nvs_handle_t handle, const char *key, const char *type, void *out_value, size_t *length) -> esp_err_t
+    {
+        std::vector<uint8_t> value;
+        const auto err = read_entry(handle, key, type, &value);
+        if (err != ESP_OK)
+            return err;
+        if (out_value == NULL)
+        {
+            *length = value.size();
+            return ESP_OK;
+        }
+        if (*length < value.size())
+        {
+            *length = value.size();
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        memcpy(out_value, value.data(), value.size());
+        *length = value.size();
+        return ESP_OK;
+    }
+
+    template <typename T>
+    auto read_integer(nvs_handle_t handle, const char *key, const char *type, T *out_value) -> esp_err_t
+    {
+        std::vector<uint8_t> value;
+        const auto err = read_entry(handle, key, type, &value);
+        if (err != ESP_OK)
+            return err;
+        if (value.size() != sizeof(T))
+            return ESP_ERR_NVS_NOT_FOUND;
+        memcpy(out_value, value.data(), sizeof(T));
+        return ESP_OK;
+    }
+}
+
+extern "C" {
+
+esp_err_t nvs_flash_init(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (mkdir(nvs_root().c_str(), 0755) != 0 && errno != EEXIST)
+        return ESP_FAIL;
+    initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    remove_tree(nvs_root());
+    initialized = false;
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    if (name == NULL || strlen(name) >= NVS_KEY_NAME_MAX_SIZE)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    const auto dir = nvs_root() + "/" + name;
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0)
+    {
+        if (open_mode == NVS_READONLY)
+            return ESP_ERR_NVS_NOT_FOUND;
+        if (mkdir(dir.c_str(), 0755) != 0)
+            return ESP_FAIL;
+    }
+    handles[next_handle] = {dir, open_mode};
+    *out_handle = next_handle++;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    handles.erase(handle);
+}
+
+// Values are written through, there is nothing left to commit
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return handles.count(handle) > 0 ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = false;
+    for (const auto type : {"u8", "u32", "str", "blob"})
+    {
+        std::string path;
+        const auto err = entry_path(handle, key, type, &path, true);
+        if (err != ESP_OK)
+            return err;
+        found |= unlink(path.c_str()) == 0;
+    }
+    return found ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const auto it = handles.find(handle);
+    if (it == handles.end())
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    if (it->second.mode == NVS_READONLY)
+        return ESP_ERR_NVS_READ_ONLY;
+    remove_tree(it->second.dir);
+    mkdir(it->second.dir.c_str(), 0755);
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    return write_entry(handle, key, "u8", &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    return read_integer(handle, key, "u8", out_value);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return write_entry(handle, key, "u32", &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    return read_integer(handle, key, "u32", out_value);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
+{
+    return write_entry(handle, key, "str", value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length)
+{
+    return read_sized(handle, key, "str", out_value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return write_entry(handle, key, "blob", value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    return read_sized(handle, key, "blob", out_value, length);
+}
+
+}
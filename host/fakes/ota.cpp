@@ -0,0 +1,328 @@
+#include "esp_ota_ops.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "host_fakes.hpp"
+#include "storage_dir.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+
+// The otadata file plays the part of the bootloader: it picks the image at start and rolls back an
+// image that restarted while still pending verification
+namespace
+{
+    constexpr auto TAG = "OTA_FAKE";
+    constexpr uint8_t IMAGE_MAGIC = 0xE9;        // First byte of every app image
+    constexpr uint32_t APP_DESC_MAGIC = 0xABCD5432;
+    constexpr uint32_t APP_DESC_OFFSET = 0x20;   // After the image header and the first segment header
+    constexpr auto MAX_SLOTS = 4;
+
+    struct OtaData
+    {
+        char boot[17];
+        char last_invalid[17];
+        uint32_t states[MAX_SLOTS]; // esp_ota_img_states_t of ota_0.., ESP_OTA_IMG_UNDEFINED if never written
+    };
+
+    struct Session
+    {
+        esp_ota_handle_t handle;
+        const esp_partition_t *partition;
+        uint32_t wrote;
+        uint32_t erased_to;
+        bool sequential;
+    };
+
+    std::recursive_mutex lock;
+    bool loaded = false;
+    OtaData otadata;
+    const esp_partition_t *running = NULL;
+    Session session = {};
+    esp_ota_handle_t next_handle = 1;
+    esp_app_desc_t app_desc = {};
+
+    auto slot_of(const esp_partition_t *p) -> int
+    {
+        if (p == NULL || p->type != ESP_PARTITION_TYPE_APP || p->subtype < ESP_PARTITION_SUBTYPE_APP_OTA_0)
+            return -1;
+        const auto slot = p->subtype - ESP_PARTITION_SUBTYPE_APP_OTA_0;
+        return slot < MAX_SLOTS ? slot : -1;
+    }
+
+    auto app_slot(int slot) -> const esp_partition_t *
+    {
+        return esp_partition_find_first(ESP_PARTITION_TYPE_APP, (esp_partition_subtype_t)(ESP_PARTITION_SUBTYPE_APP_OTA_0 + slot), NULL);
+    }
+
+    auto save() -> void
+    {
+        const auto path = host_fakes::storage_path("otadata");
+        const auto file = fopen(path.c_str(), "wb");
+        if (file == NULL)
+            return;
+        fwrite(&otadata, sizeof(otadata), 1, file);
+        fclose(file);
+    }
+
+    auto has_image(const esp_partition_t *p) -> bool
+    {
+        uint8_t magic = 0;
+        return p != NULL && esp_partition_read(p, 0, &magic, 1) == ESP_OK && magic == IMAGE_MAGIC;
+    }
+
+    // ota_0 holds the host build itself, as if it had been flashed over the serial port
+    auto bootable(int slot) -> bool
+    {
+        const auto state = otadata.states[slot];
+        return state != ESP_OTA_IMG_INVALID && state != ESP_OTA_IMG_ABORTED && (slot == 0 || has_image(app_slot(slot)));
+    }
+
+    // What the bootloader does before the app starts
+    auto boot() -> void
+    {
+        if (loaded)
+            return;
+        loaded = true;
+        memset(&otadata, 0, sizeof(otadata));
+        for (auto &state : otadata.states)
+            state = ESP_OTA_IMG_UNDEFINED;
+        const auto path = host_fakes::storage_path("otadata");
+        const auto file = fopen(path.c_str(), "rb");
+        if (file != NULL)
+        {
+            if (fread(&otadata, sizeof(otadata), 1, file) != 1)
+                ESP_LOGW(TAG, "otadata is damaged, booting ota_0");
+            fclose(file);
+        }
+
+        running = otadata.boot[0] != '\0' ? esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, otadata.boot) : NULL;
+        auto slot = slot_of(running);
+        if (slot >= 0 && otadata.states[slot] == ESP_OTA_IMG_PENDING_VERIFY)
+        {
+            // Restarted without confirming the new image
+            ESP_LOGW(TAG, "%s was not confirmed, rolling back", running->label);
+            otadata.states[slot] = ESP_OTA_IMG_ABORTED;
+            snprintf(otadata.last_invalid, sizeof(otadata.last_invalid), "%s", running->label);
+            running = NULL;
+        }
+        else if (slot >= 0 && otadata.states[slot] == ESP_OTA_IMG_NEW)
+            otadata.states[slot] = ESP_OTA_IMG_PENDING_VERIFY;
+        if (running == NULL || !bootable(slot_of(running)))
+        {
+            running = NULL;
+            for (auto s = 0; s < MAX_SLOTS && running == NULL; s++)
+                if (app_slot(s) != NULL && bootable(s))
+                    running = app_slot(s);
+        }
+        if (running == NULL)
+            running = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+        if (running != NULL)
+            snprintf(otadata.boot, sizeof(otadata.boot), "%s", running->label);
+        save();
+
+        // The description of an image written by an update, or the one of the host build
+        esp_app_desc_t desc;
+        if (running != NULL && has_image(running) && esp_partition_read(running, APP_DESC_OFFSET, &desc, sizeof(desc)) == ESP_OK &&
+            desc.magic_word == APP_DESC_MAGIC)
+            app_desc = desc;
+        else
+        {
+            app_desc.magic_word = APP_DESC_MAGIC;
+            snprintf(app_desc.version, sizeof(app_desc.version), "host");
+            snprintf(app_desc.project_name, sizeof(app_desc.project_name), "esp_wifi_modem");
+            snprintf(app_desc.date, sizeof(app_desc.date), "%s", __DATE__);
+            snprintf(app_desc.time, sizeof(app_desc.time), "%s", __TIME__);
+        }
+    }
+
+    auto erase_until(uint32_t end) -> esp_err_t
+    {
+        while (session.erased_to < end)
+        {
+            const auto err = esp_partition_erase_range(session.partition, session.erased_to, SPI_FLASH_SEC_SIZE);
+            if (err != ESP_OK)
+                return err;
+            session.erased_to += SPI_FLASH_SEC_SIZE;
+        }
+        return ESP_OK;
+    }
+
+    auto other_slot() -> const esp_partition_t *
+    {
+        for (auto s = 0; s < MAX_SLOTS; s++)
+            if (app_slot(s) != NULL && app_slot(s) != running && bootable(s))
+                return app_slot(s);
+        return NULL;
+    }
+}
+
+extern "C" {
+
+const esp_app_desc_t *esp_ota_get_app_description(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    return &app_desc;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    return running;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    const auto from = slot_of(start_from != NULL ? start_from : running);
+    for (auto i = 1; i <= MAX_SLOTS; i++)
+    {
+        const auto p = app_slot((from + i) % MAX_SLOTS);
+        if (p != NULL && p != running)
+            return p;
+    }
+    return NULL;
+}
+
+const esp_partition_t *esp_ota_get_last_invalid_partition(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    if (otadata.last_invalid[0] == '\0')
+        return NULL;
+    return esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, otadata.last_invalid);
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    const auto slot = slot_of(partition);
+    if (slot < 0 || ota_state == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (otadata.states[slot] == ESP_OTA_IMG_UNDEFINED)
+        return ESP_ERR_NOT_FOUND;
+    *ota_state = (esp_ota_img_states_t)otadata.states[slot];
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    if (slot_of(partition) < 0 || out_handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (partition == running)
+        return ESP_ERR_INVALID_STATE;
+    session = {next_handle++, partition, 0, 0, image_size == OTA_WITH_SEQUENTIAL_WRITES};
+    if (!session.sequential)
+    {
+        const auto end = image_size == OTA_SIZE_UNKNOWN ? partition->size : (image_size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+        const auto err = erase_until(end);
+        if (err != ESP_OK)
+            return err;
+    }
+    otadata.states[slot_of(partition)] = ESP_OTA_IMG_UNDEFINED;
+    save();
+    *out_handle = session.handle;
+    return ESP_OK;
+}
+
+// Sequential writes erase each sector when the image reaches it
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (handle != session.handle || session.partition == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (session.wrote == 0 && size > 0 && ((const uint8_t *)data)[0] != IMAGE_MAGIC)
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    if (session.wrote + size > session.partition->size)
+        return ESP_ERR_INVALID_SIZE;
+    if (session.sequential)
+    {
+        const auto err = erase_until((session.wrote + size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK)
+            return err;
+    }
+    const auto err = esp_partition_write(session.partition, session.wrote, data, size);
+    if (err == ESP_OK)
+        session.wrote += size;
+    return err;
+}
+
+// Only the magic byte is checked, host images have no segments or hash
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (handle != session.handle || session.partition == NULL)
+        return ESP_ERR_NOT_FOUND;
+    const auto ok = session.wrote > 0 && has_image(session.partition);
+    session = {};
+    return ok ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (handle != session.handle || session.partition == NULL)
+        return ESP_ERR_NOT_FOUND;
+    session = {};
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    const auto slot = slot_of(partition);
+    if (slot < 0)
+        return ESP_ERR_INVALID_ARG;
+    if (!has_image(partition))
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    if (partition != running)
+        otadata.states[slot] = ESP_OTA_IMG_NEW;
+    snprintf(otadata.boot, sizeof(otadata.boot), "%s", partition->label);
+    save();
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    const auto slot = slot_of(running);
+    if (slot < 0)
+        return ESP_ERR_NOT_FOUND;
+    otadata.states[slot] = ESP_OTA_IMG_VALID;
+    save();
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void)
+{
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        boot();
+        const auto previous = other_slot();
+        const auto slot = slot_of(running);
+        if (previous == NULL || slot < 0)
+            return ESP_FAIL;
+        otadata.states[slot] = ESP_OTA_IMG_INVALID;
+        snprintf(otadata.last_invalid, sizeof(otadata.last_invalid), "%s", running->label);
+        snprintf(otadata.boot, sizeof(otadata.boot), "%s", previous->label);
+        save();
+    }
+    esp_restart();
+}
+
+bool esp_ota_check_rollback_is_possible(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    boot();
+    return other_slot() != NULL;
+}
+
+}
@@ -0,0 +1,294 @@
+#include "esp_partition.h"
+#include "esp_log.h"
+#include "host_fakes.hpp"
+#include "storage_dir.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace
+{
+    constexpr auto TAG = "FLASH";
+
+    struct Partition
+    {
+        esp_partition_t info;
+        int fd;
+    };
+
+    std::mutex lock;
+    std::vector<Partition *> partitions;
+    uint32_t next_address = 0x9000; // Where the table leaves off, for partitions without an offset
+    int64_t write_budget = -1;      // Bytes until the power cut, -1 without one
+    bool power_cut = false;
+
+    auto find(const esp_partition_t *partition) -> Partition *
+    {
+        for (const auto p : partitions)
+            if (&p->info == partition)
+                return p;
+        return NULL;
+    }
+
+    // The image file is created erased the first time the partition is used
+    auto file_of(Partition *p) -> int
+    {
+        if (p->fd >= 0)
+            return p->fd;
+        const auto path = host_fakes::storage_path(p->info.label) + ".bin";
+        p->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (p->fd < 0)
+        {
+            ESP_LOGE(TAG, "Cannot open %s (%s)", path.c_str(), strerror(errno));
+            return -1;
+        }
+        struct stat st;
+        fstat(p->fd, &st);
+        if ((uint64_t)st.st_size < p->info.size)
+        {
+            std::vector<uint8_t> erased(p->info.size - st.st_size, 0xFF);
+            pwrite(p->fd, erased.data(), erased.size(), st.st_size);
+        }
+        return p->fd;
+    }
+
+    // How many of "size" bytes still reach the flash before the power goes
+    auto spend(size_t size) -> size_t
+    {
+        if (power_cut)
+            return 0;
+        if (write_budget < 0 || (int64_t)size < write_budget)
+        {
+            if (write_budget >= 0)
+                write_budget -= size;
+            return size;
+        }
+        const auto reached = (size_t)write_budget;
+        write_budget = 0;
+        power_cut = true;
+        ESP_LOGW(TAG, "Power cut, the last write is torn after %u bytes", (unsigned)reached);
+        return reached;
+    }
+
+    auto parse_number(const char *text, uint32_t *value) -> bool
+    {
+        char *end;
+        auto n = strtoul(text, &end, 0);
+        if (end == text)
+            return false;
+        if (*end == 'K' || *end == 'k')
+            n *= 1024, end++;
+        else if (*end == 'M' || *end == 'm')
+            n *= 1024 * 1024, end++;
+        *value = n;
+        return *end == '\0';
+    }
+
+    auto parse_type(const char *text, int *type) -> bool
+    {
+        if (strcmp(text, "app") == 0)
+            *type = ESP_PARTITION_TYPE_APP;
+        else if (strcmp(text, "data") == 0)
+            *type = ESP_PARTITION_TYPE_DATA;
+        else
+        {
+            uint32_t n;
+            if (!parse_number(text, &n))
+                return false;
+            *type = n;
+        }
+        return true;
+    }
+
+    auto parse_subtype(const char *text, int *subtype) -> bool
+    {
+        struct Name
+        {
+            const char *name;
+            int subtype;
+        };
+        static const Name names[] = {
+            {"factory", 0x00}, {"test", 0x20}, {"ota", 0x00}, {"phy", 0x01}, {"nvs", 0x02}, {"coredump", 0x03},
+            {"nvs_keys", 0x04}, {"efuse", 0x05}, {"esphttpd", 0x80}, {"fat", 0x81}, {"spiffs", 0x82},
+        };
+        for (const auto &n : names)
+            if (strcmp(text, n.name) == 0)
+            {
+                *subtype = n.subtype;
+                return true;
+            }
+        if (strncmp(text, "ota_", 4) == 0)
+        {
+            *subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0 + atoi(text + 4);
+            return true;
+        }
+        uint32_t n;
+        if (!parse_number(text, &n))
+            return false;
+        *subtype = n;
+        return true;
+    }
+
+    auto trim(char *s) -> char *
+    {
+        while (*s == ' ' || *s == '\t')
+            s++;
+        auto end = s + strlen(s);
+        while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+            *--end = '\0';
+        return s;
+    }
+
+    auto add(const char *label, int type, int subtype, uint32_t address, uint32_t size) -> esp_err_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto p : partitions)
+            if (strcmp(p->info.label, label) == 0)
+                return ESP_ERR_INVALID_STATE;
+        auto p = new Partition();
+        p->info.type = (esp_partition_type_t)type;
+        p->info.subtype = (esp_partition_subtype_t)subtype;
+        p->info.address = address;
+        p->info.size = size;
+        snprintf(p->info.label, sizeof(p->info.label), "%s", label);
+        p->fd = -1;
+        partitions.push_back(p);
+        next_address = address + size;
+        return ESP_OK;
+    }
+}
+
+namespace host_fakes
+{
+    auto load_partitions(const char *csv_path) -> esp_err_t
+    {
+        const auto file = fopen(csv_path, "r");
+        if (file == NULL)
+            return ESP_ERR_NOT_FOUND;
+        char line[256];
+        auto err = ESP_OK;
+        while (err == ESP_OK && fgets(line, sizeof(line), file) != NULL)
+        {
+            if (trim(line)[0] == '#' || trim(line)[0] == '\0')
+                continue;
+            char *fields[6] = {};
+            auto count = 0;
+            for (auto field = strtok(line, ","); field != NULL && count < 6; field = strtok(NULL, ","))
+                fields[count++] = trim(field);
+            int type, subtype;
+            uint32_t address = 0, size = 0;
+            if (count < 5 || !parse_type(fields[1], &type) || !parse_subtype(fields[2], &subtype) || !parse_number(fields[4], &size))
+            {
+                err = ESP_ERR_INVALID_ARG;
+                break;
+            }
+            if (fields[3][0] == '\0' || !parse_number(fields[3], &address))
+            {
+                const auto align = type == ESP_PARTITION_TYPE_APP ? 0x10000 : 0x1000;
+                address = (next_address + align - 1) / align * align;
+            }
+            err = add(fields[0], type, subtype, address, size);
+        }
+        fclose(file);
+        return err;
+    }
+
+    auto add_partition(const char *label, int type, int subtype, uint32_t size) -> esp_err_t
+    {
+        return add(label, type, subtype, (next_address + 0xFFF) / 0x1000 * 0x1000, size);
+    }
+
+    auto power_cut_after(int64_t bytes) -> void
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        write_budget = bytes;
+        power_cut = false;
+    }
+
+    auto power_was_cut() -> bool
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return power_cut;
+    }
+}
+
+extern "C" {
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (const auto p : partitions)
+        if (p->info.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p->info.subtype == subtype) &&
+            (label == NULL || strcmp(p->info.label, label) == 0))
+            return &p->info;
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const auto p = find(partition);
+    if (p == NULL || dst == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (src_offset > partition->size || size > partition->size - src_offset)
+        return ESP_ERR_INVALID_SIZE;
+    const auto fd = file_of(p);
+    if (fd < 0 || pread(fd, dst, size, src_offset) != (ssize_t)size)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+// NOR flash only clears bits, writing over data that was not erased ANDs the old and new bytes
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const auto p = find(partition);
+    if (p == NULL || src == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (dst_offset > partition->size || size > partition->size - dst_offset)
+        return ESP_ERR_INVALID_SIZE;
+    const auto fd = file_of(p);
+    if (fd < 0)
+        return ESP_FAIL;
+    std::vector<uint8_t> cells(spend(size));
+    if (cells.empty())
+        return ESP_OK; // Nobody is left to see the write fail
+    if (pread(fd, cells.data(), cells.size(), dst_offset) != (ssize_t)cells.size())
+        return ESP_FAIL;
+    for (size_t i = 0; i < cells.size(); i++)
+        cells[i] &= ((const uint8_t *)src)[i];
+    if (pwrite(fd, cells.data(), cells.size(), dst_offset) != (ssize_t)cells.size())
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const auto p = find(partition);
+    if (p == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0)
+        return ESP_ERR_INVALID_SIZE;
+    if (offset > partition->size || size > partition->size - offset)
+        return ESP_ERR_INVALID_SIZE;
+    const auto fd = file_of(p);
+    if (fd < 0)
+        return ESP_FAIL;
+    if (power_cut)
+        return ESP_OK;
+    std::vector<uint8_t> erased(size, 0xFF);
+    if (pwrite(fd, erased.data(), size, offset) != (ssize_t)size)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+}
@@ -0,0 +1,59 @@
+#include "host_fakes.hpp"
+#include "storage_dir.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <mutex>
+
+namespace
+{
+    std::mutex lock;
+    std::string dir = "";
+
+    // MODEM_STORAGE_DIR keeps the flash of modem_host between runs, otherwise every run starts erased
+    auto pick_default() -> void
+    {
+        const auto env = getenv("MODEM_STORAGE_DIR");
+        if (env != NULL && env[0] != '\0')
+        {
+            mkdir(env, 0755);
+            dir = env;
+            return;
+        }
+        char temp[] = "/tmp/modem_flash_XXXXXX";
+        if (mkdtemp(temp) == NULL)
+        {
+            perror("mkdtemp");
+            abort();
+        }
+        dir = temp;
+    }
+}
+
+namespace host_fakes
+{
+    auto set_storage_dir(const char *path) -> esp_err_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            return ESP_FAIL;
+        dir = path;
+        return ESP_OK;
+    }
+
+    auto storage_dir() -> const char *
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (dir.empty())
+            pick_default();
+        return dir.c_str();
+    }
+
+    auto storage_path(const std::string &name) -> std::string
+    {
+        return std::string(storage_dir()) + "/" + name;
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+
+namespace host_fakes
+{
+    // Path of "name" inside the storage directory, the directory is picked on first use if it was not set
+    auto storage_path(const std::string &name) -> std::string;
+}
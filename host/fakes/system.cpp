@@ -0,0 +1,163 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_http_client.h"
+#include "sdkconfig.h"
+#include "host_fakes.hpp"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+namespace
+{
+    // Heap the modem would have left on an ESP32 with WiFi running, the host reports it as constant
+    constexpr uint32_t HEAP_FREE = 160 * 1024;
+    constexpr uint32_t HEAP_LARGEST_BLOCK = 110 * 1024;
+
+    esp_log_level_t level = (esp_log_level_t)CONFIG_LOG_DEFAULT_LEVEL;
+    int64_t started_ms = -1;
+
+    auto now_ms() -> int64_t
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    struct ErrorName
+    {
+        esp_err_t code;
+        const char *name;
+    };
+    constexpr ErrorName error_names[] = {
+        {ESP_OK, "ESP_OK"},
+        {ESP_FAIL, "ESP_FAIL"},
+        {ESP_ERR_NO_MEM, "ESP_ERR_NO_MEM"},
+        {ESP_ERR_INVALID_ARG, "ESP_ERR_INVALID_ARG"},
+        {ESP_ERR_INVALID_STATE, "ESP_ERR_INVALID_STATE"},
+        {ESP_ERR_INVALID_SIZE, "ESP_ERR_INVALID_SIZE"},
+        {ESP_ERR_NOT_FOUND, "ESP_ERR_NOT_FOUND"},
+        {ESP_ERR_NOT_SUPPORTED, "ESP_ERR_NOT_SUPPORTED"},
+        {ESP_ERR_TIMEOUT, "ESP_ERR_TIMEOUT"},
+        {ESP_ERR_INVALID_RESPONSE, "ESP_ERR_INVALID_RESPONSE"},
+        {ESP_ERR_INVALID_CRC, "ESP_ERR_INVALID_CRC"},
+        {ESP_ERR_NVS_NOT_INITIALIZED, "ESP_ERR_NVS_NOT_INITIALIZED"},
+        {ESP_ERR_NVS_NOT_FOUND, "ESP_ERR_NVS_NOT_FOUND"},
+        {ESP_ERR_NVS_INVALID_HANDLE, "ESP_ERR_NVS_INVALID_HANDLE"},
+        {ESP_ERR_NVS_INVALID_LENGTH, "ESP_ERR_NVS_INVALID_LENGTH"},
+        {ESP_ERR_NVS_NO_FREE_PAGES, "ESP_ERR_NVS_NO_FREE_PAGES"},
+        {ESP_ERR_NVS_NEW_VERSION_FOUND, "ESP_ERR_NVS_NEW_VERSION_FOUND"},
+        {ESP_ERR_OTA_VALIDATE_FAILED, "ESP_ERR_OTA_VALIDATE_FAILED"},
+        {ESP_ERR_HTTP_CONNECT, "ESP_ERR_HTTP_CONNECT"},
+        {ESP_ERR_HTTP_FETCH_HEADER, "ESP_ERR_HTTP_FETCH_HEADER"},
+        {ESP_ERR_HTTP_EAGAIN, "ESP_ERR_HTTP_EAGAIN"},
+    };
+}
+
+extern "C" {
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    for (const auto &e : error_names)
+        if (e.code == code)
+            return e.name;
+    return "UNKNOWN ERROR";
+}
+
+void esp_log_level_set(const char *, esp_log_level_t new_level)
+{
+    level = new_level;
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    if (started_ms < 0)
+        started_ms = now_ms();
+    return (uint32_t)(now_ms() - started_ms);
+}
+
+void esp_log_write(esp_log_level_t msg_level, const char *, const char *format, ...)
+{
+    if (msg_level > level)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void esp_restart(void)
+{
+    fflush(NULL);
+    _exit(host_fakes::RESTART_EXIT_CODE);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return HEAP_FREE;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return HEAP_FREE;
+}
+
+uint32_t esp_random(void)
+{
+    uint32_t value = 0;
+    while (getrandom(&value, sizeof(value), 0) != sizeof(value))
+    {
+    }
+    return value;
+}
+
+size_t heap_caps_get_free_size(uint32_t)
+{
+    return HEAP_FREE;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t)
+{
+    return HEAP_FREE;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t)
+{
+    return HEAP_LARGEST_BLOCK;
+}
+
+esp_err_t esp_pm_configure(const void *)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t, int, const char *, esp_pm_lock_handle_t *out_handle)
+{
+    *out_handle = NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_uart_wakeup(int)
+{
+    return ESP_OK;
+}
+
+}
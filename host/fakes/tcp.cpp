@@ -0,0 +1,159 @@
+#include "host_fakes.hpp"
+#include "tcp.hpp"
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <map>
+#include <mutex>
+
+namespace
+{
+    std::mutex lock;
+    std::map<uint16_t, uint16_t> redirects;
+    std::map<uint16_t, uint16_t> listen_redirects;
+    std::map<uint16_t, uint16_t> listening;
+}
+
+namespace host_fakes
+{
+    auto redirect_port(uint16_t port, uint16_t to) -> void
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        redirects[port] = to;
+    }
+
+    auto redirected_port(uint16_t port) -> uint16_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const auto it = redirects.find(port);
+        return it != redirects.end() ? it->second : port;
+    }
+
+    auto redirect_listen(uint16_t port, uint16_t to) -> void
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        listen_redirects[port] = to;
+    }
+
+    auto listen_port_for(uint16_t port) -> uint16_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const auto it = listen_redirects.find(port);
+        return it != listen_redirects.end() ? it->second : port;
+    }
+
+    auto set_listening(uint16_t port, uint16_t actual) -> void
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        listening[port] = actual;
+    }
+
+    auto listening_port(uint16_t port) -> uint16_t
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const auto it = listening.find(port);
+        return it != listening.end() ? it->second : 0;
+    }
+
+    auto connect_tcp(const std::string &host, uint16_t port, int timeout_ms) -> int
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *found = NULL;
+        const auto service = std::to_string(redirected_port(port));
+        if (getaddrinfo(host.c_str(), service.c_str(), &hints, &found) != 0 || found == NULL)
+            return -1;
+        const auto fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+        if (fd >= 0)
+        {
+            timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            const auto one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen) != 0)
+        {
+            close(fd);
+            freeaddrinfo(found);
+            return -1;
+        }
+        freeaddrinfo(found);
+        return fd;
+    }
+
+    auto reset(Reader &r, int fd) -> void
+    {
+        r.fd = fd;
+        r.pos = 0;
+        r.len = 0;
+    }
+
+    auto read_some(Reader &r, uint8_t *out, size_t max) -> int
+    {
+        if (r.pos == r.len)
+        {
+            ssize_t n;
+            do
+                n = recv(r.fd, r.buf, sizeof(r.buf), 0);
+            while (n < 0 && errno == EINTR);
+            if (n <= 0)
+                return n;
+            r.pos = 0;
+            r.len = n;
+        }
+        const auto n = r.len - r.pos < max ? r.len - r.pos : max;
+        memcpy(out, r.buf + r.pos, n);
+        r.pos += n;
+        return n;
+    }
+
+    auto read_exact(Reader &r, uint8_t *out, size_t len) -> bool
+    {
+        for (size_t got = 0; got < len;)
+        {
+            const auto n = read_some(r, out + got, len - got);
+            if (n <= 0)
+                return false;
+            got += n;
+        }
+        return true;
+    }
+
+    auto read_line(Reader &r, std::string *line) -> bool
+    {
+        line->clear();
+        uint8_t c;
+        while (read_some(r, &c, 1) == 1)
+        {
+            if (c == '\n')
+            {
+                if (!line->empty() && line->back() == '\r')
+                    line->pop_back();
+                return true;
+            }
+            line->push_back(c);
+        }
+        return false;
+    }
+
+    auto write_all(int fd, const void *data, size_t len) -> bool
+    {
+        for (size_t sent = 0; sent < len;)
+        {
+            const auto n = send(fd, (const uint8_t *)data + sent, len - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace host_fakes
+{
+    // Blocking TCP connection to "host" (a name or an address), honours redirect_port(). Returns -1 on failure.
+    auto set_listening(uint16_t port, uint16_t actual) -> void; // 0 once the server stopped
+
+    auto connect_tcp(const std::string &host, uint16_t port, int timeout_ms) -> int;
+
+    // Buffered reads from a socket, for the line based protocols of the clients
+    struct Reader
+    {
+        int fd;
+        uint8_t buf[2048];
+        size_t pos;
+        size_t len;
+    };
+    auto reset(Reader &r, int fd) -> void;
+    auto read_some(Reader &r, uint8_t *out, size_t max) -> int; // 0 once the peer closed, -1 on errors
+    auto read_exact(Reader &r, uint8_t *out, size_t len) -> bool;
+    auto read_line(Reader &r, std::string *line) -> bool; // Without the CRLF
+    auto write_all(int fd, const void *data, size_t len) -> bool;
+}
@@ -0,0 +1,252 @@
+#include "driver/uart.h"
+#include "esp_vfs_dev.h"
+#include "esp_vfs_eventfd.h"
+#include "host_fakes.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+namespace
+{
+    struct Port
+    {
+        int rx_fd;
+        int tx_fd;
+        uint32_t baud_rate;
+        bool installed;
+        int64_t rx_line_us; // When the bytes handed out so far finished arriving on the wire (see "pace_uart")
+        int64_t tx_line_us; // When the bytes written so far are out
+    };
+
+    Port ports[UART_NUM_MAX] = {
+        {STDIN_FILENO, STDOUT_FILENO, 115200, false, 0, 0},
+        {-1, -1, 115200, false, 0, 0},
+        {-1, -1, 115200, false, 0, 0},
+    };
+    void (*hangup_handler)(int port) = NULL;
+    bool paced = false;
+
+    auto valid(uart_port_t port) -> bool
+    {
+        return port >= 0 && port < UART_NUM_MAX && ports[port].rx_fd >= 0;
+    }
+
+    auto now_ms() -> int64_t
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    auto now_us() -> int64_t
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // Waits until "bytes" more bytes made it over the wire, a line that was idle starts now
+    auto pace(const Port &port, int64_t &line_us, size_t bytes) -> void
+    {
+        if (!paced)
+            return;
+        const auto now = now_us();
+        line_us = (line_us > now ? line_us : now) + (int64_t)bytes * 10 * 1000000 / port.baud_rate;
+        if (line_us > now)
+            usleep(line_us - now);
+    }
+
+    auto hang_up(uart_port_t port) -> void
+    {
+        if (hangup_handler != NULL)
+            hangup_handler(port);
+        while (true)
+            pause();
+    }
+}
+
+namespace host_fakes
+{
+    auto attach_uart(int port, int rx_fd, int tx_fd) -> void
+    {
+        ports[port].rx_fd = rx_fd;
+        ports[port].tx_fd = tx_fd;
+    }
+
+    auto on_uart_hangup(void (*handler)(int port)) -> void
+    {
+        hangup_handler = handler;
+    }
+
+    auto pace_uart(bool on) -> void
+    {
+        paced = on;
+    }
+}
+
+extern "C" {
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int, int, int queue_size, QueueHandle_t *uart_queue, int)
+{
+    if (!valid(uart_num) || ports[uart_num].installed)
+        return ESP_FAIL;
+    ports[uart_num].installed = true;
+    // Pipes lose nothing, so the queue never gets an event
+    if (uart_queue != NULL)
+        *uart_queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t uart_num)
+{
+    if (!valid(uart_num))
+        return ESP_ERR_INVALID_ARG;
+    ports[uart_num].installed = false;
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    if (!valid(uart_num))
+        return ESP_ERR_INVALID_ARG;
+    ports[uart_num].baud_rate = uart_config->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int, int, int, int)
+{
+    return valid(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// A pipe has no line rate, the rate only counts when the port is paced
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate)
+{
+    if (!valid(uart_num))
+        return ESP_ERR_INVALID_ARG;
+    ports[uart_num].baud_rate = baudrate;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t uart_num, uint32_t *baudrate)
+{
+    if (!valid(uart_num))
+        return ESP_ERR_INVALID_ARG;
+    *baudrate = ports[uart_num].baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_hw_flow_ctrl(uart_port_t uart_num, uart_hw_flowcontrol_t, uint8_t)
+{
+    return valid(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_wakeup_threshold(uart_port_t uart_num, int)
+{
+    return valid(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    if (!valid(uart_num))
+        return ESP_ERR_INVALID_ARG;
+    char discard[256];
+    size_t buffered = 0;
+    while (uart_get_buffered_data_len(uart_num, &buffered) == ESP_OK && buffered > 0)
+        if (read(ports[uart_num].rx_fd, discard, buffered < sizeof(discard) ? buffered : sizeof(discard)) <= 0)
+            break;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size)
+{
+    if (!valid(uart_num))
+        return ESP_ERR_INVALID_ARG;
+    int available = 0;
+    if (ioctl(ports[uart_num].rx_fd, FIONREAD, &available) != 0)
+        available = 0;
+    *size = available;
+    return ESP_OK;
+}
+
+// Writes block until the reader took the bytes, so everything is out already
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t)
+{
+    return valid(uart_num) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// Like the driver: waits until "length" bytes arrived or the time ran out, returns what arrived
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    if (!valid(uart_num))
+        return -1;
+    const auto fd = ports[uart_num].rx_fd;
+    const auto forever = ticks_to_wait == portMAX_DELAY;
+    const auto deadline = now_ms() + (int64_t)ticks_to_wait * portTICK_PERIOD_MS;
+    uint32_t got = 0;
+    while (got < length)
+    {
+        const auto left = forever ? -1 : (int)(deadline - now_ms());
+        if (!forever && left <= 0)
+            break;
+        pollfd p = {fd, POLLIN, 0};
+        const auto ready = poll(&p, 1, left);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            break;
+        const auto n = read(fd, (uint8_t *)buf + got, length - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (got > 0)
+                break; // Hand out the last bytes first
+            hang_up(uart_num);
+        }
+        pace(ports[uart_num], ports[uart_num].rx_line_us, n);
+        got += n;
+    }
+    return got;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size)
+{
+    if (!valid(uart_num) || ports[uart_num].tx_fd < 0)
+        return -1;
+    size_t written = 0;
+    while (written < size)
+    {
+        const auto n = write(ports[uart_num].tx_fd, (const uint8_t *)src + written, size - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        pace(ports[uart_num], ports[uart_num].tx_line_us, n);
+        written += n;
+    }
+    return written;
+}
+
+void esp_vfs_dev_uart_use_driver(int)
+{
+}
+
+int esp_vfs_dev_uart_port_set_rx_line_endings(int, esp_line_endings_t)
+{
+    return 0;
+}
+
+int esp_vfs_dev_uart_port_set_tx_line_endings(int, esp_line_endings_t)
+{
+    return 0;
+}
+
+esp_err_t esp_vfs_eventfd_register(const esp_vfs_eventfd_config_t *)
+{
+    return ESP_OK;
+}
+
+}
@@ -0,0 +1,545 @@
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "host_fakes.hpp"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+struct esp_event_handler_instance_context
+{
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void *arg;
+};
+
+struct esp_netif_obj
+{
+    const char *key;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns;
+    bool dhcp; // Cleared for a static address
+};
+
+namespace
+{
+    constexpr auto TAG = "WIFI_FAKE";
+    constexpr auto ASSOCIATE_MS = 20; // Time from esp_wifi_connect() to the connected event
+    constexpr auto DHCP_MS = 30;      // Time from the connected event to the address
+    constexpr auto SCAN_MS = 50;      // Duration of a blocking scan
+
+    /* ------------------------------- Event loop ------------------------------ */
+
+    struct Posted
+    {
+        esp_event_base_t base;
+        int32_t id;
+        std::vector<uint8_t> data;
+    };
+
+    std::mutex loop_lock;
+    std::condition_variable loop_changed;
+    std::deque<Posted> posted;
+    std::vector<esp_event_handler_instance_t> handlers;
+    bool loop_running = false;
+
+    // Handlers may register and unregister others, so each event walks a copy of the list
+    auto run_loop() -> void
+    {
+        std::unique_lock<std::mutex> guard(loop_lock);
+        while (true)
+        {
+            loop_changed.wait(guard, [] { return !posted.empty(); });
+            auto event = std::move(posted.front());
+            posted.pop_front();
+            const auto targets = handlers;
+            guard.unlock();
+            for (const auto h : targets)
+            {
+                {
+                    std::lock_guard<std::mutex> check(loop_lock);
+                    auto still = false;
+                    for (const auto current : handlers)
+                        still |= current == h;
+                    if (!still)
+                        continue;
+                }
+                if (strcmp(h->base, event.base) == 0 && (h->id == ESP_EVENT_ANY_ID || h->id == event.id))
+                    h->handler(h->arg, event.base, event.id, event.data.empty() ? NULL : event.data.data());
+            }
+            guard.lock();
+        }
+    }
+
+    auto post(esp_event_base_t base, int32_t id, const void *data, size_t size) -> void
+    {
+        std::lock_guard<std::mutex> guard(loop_lock);
+        Posted p = {base, id, {}};
+        if (data != NULL)
+            p.data.assign((const uint8_t *)data, (const uint8_t *)data + size);
+        posted.push_back(std::move(p));
+        loop_changed.notify_all();
+    }
+
+    /* --------------------------------- Driver -------------------------------- */
+
+    struct AccessPoint
+    {
+        std::string ssid;
+        std::string password;
+        uint8_t bssid[6];
+        uint8_t channel;
+        int8_t rssi;
+        uint32_t ip;
+    };
+
+    esp_netif_obj sta_netif = {"WIFI_STA_DEF", {}, {}, true};
+    esp_netif_obj ap_netif = {"WIFI_AP_DEF", {}, {}, false};
+
+    std::recursive_mutex lock;
+    std::vector<AccessPoint> access_points;
+    bool initialized = false;
+    bool started = false;
+    wifi_mode_t mode = WIFI_MODE_NULL;
+    wifi_ps_type_t power_save = WIFI_PS_MIN_MODEM;
+    wifi_config_t sta_config = {};
+    wifi_config_t ap_config = {};
+    int connected = -1;        // Access point the station is associated with
+    uint32_t attempt = 0;      // Bumped by every connect and disconnect, stale attempts give up
+    std::vector<wifi_ap_record_t> scan_results;
+
+    auto has_sta() -> bool
+    {
+        return mode == WIFI_MODE_STA || mode == WIFI_MODE_APSTA;
+    }
+
+    auto record_of(const AccessPoint &ap) -> wifi_ap_record_t
+    {
+        wifi_ap_record_t r = {};
+        memcpy(r.bssid, ap.bssid, sizeof(r.bssid));
+        memcpy(r.ssid, ap.ssid.c_str(), ap.ssid.size() < 32 ? ap.ssid.size() : 32);
+        r.primary = ap.channel;
+        r.rssi = ap.rssi;
+        r.authmode = ap.password.empty() ? WIFI_AUTH_OPEN : WIFI_AUTH_WPA2_PSK;
+        return r;
+    }
+
+    auto disconnected(uint8_t reason) -> void
+    {
+        wifi_event_sta_disconnected_t ev = {};
+        memcpy(ev.ssid, sta_config.sta.ssid, sizeof(ev.ssid));
+        ev.ssid_len = strnlen((const char *)sta_config.sta.ssid, sizeof(sta_config.sta.ssid));
+        ev.reason = reason;
+        post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &ev, sizeof(ev));
+    }
+
+    // Association and DHCP of one connect attempt, on its own thread like the driver task
+    auto associate(uint32_t my_attempt) -> void
+    {
+        usleep(ASSOCIATE_MS * 1000);
+        std::unique_lock<std::recursive_mutex> guard(lock);
+        if (my_attempt != attempt)
+            return;
+        const auto &want = sta_config.sta;
+        const auto ssid = std::string((const char *)want.ssid, strnlen((const char *)want.ssid, sizeof(want.ssid)));
+        const auto password = std::string((const char *)want.password, strnlen((const char *)want.password, sizeof(want.password)));
+        auto found = -1;
+        for (size_t i = 0; i < access_points.size(); i++)
+        {
+            const auto &ap = access_points[i];
+            if (ap.ssid != ssid && !(ap.ssid.empty() && want.bssid_set))
+                continue; // A hidden network answers probes for its SSID, the fake knows it by BSSID
+            if (want.bssid_set && memcmp(ap.bssid, want.bssid, 6) != 0)
+                continue;
+            if (want.channel != 0 && ap.channel != want.channel)
+                continue;
+            if (found < 0 || ap.rssi > access_points[found].rssi)
+                found = i;
+        }
+        if (found < 0)
+            return disconnected(WIFI_REASON_NO_AP_FOUND);
+        if (access_points[found].password != password)
+            return disconnected(WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT);
+
+        connected = found;
+        wifi_event_sta_connected_t ev = {};
+        memcpy(ev.ssid, want.ssid, sizeof(ev.ssid));
+        ev.ssid_len = ssid.size();
+        memcpy(ev.bssid, access_points[found].bssid, 6);
+        ev.channel = access_points[found].channel;
+        ev.authmode = record_of(access_points[found]).authmode;
+        post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &ev, sizeof(ev));
+
+        if (sta_netif.dhcp)
+        {
+            guard.unlock();
+            usleep(DHCP_MS * 1000);
+            guard.lock();
+            if (my_attempt != attempt)
+                return;
+            sta_netif.ip_info.ip.addr = access_points[found].ip;
+            sta_netif.ip_info.netmask.addr = htonl(0xFFFFFF00);
+            sta_netif.ip_info.gw.addr = (access_points[found].ip & htonl(0xFFFFFF00)) | htonl(1);
+        }
+        ip_event_got_ip_t got = {};
+        got.esp_netif = &sta_netif;
+        got.ip_info = sta_netif.ip_info;
+        got.ip_changed = true;
+        post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got, sizeof(got));
+    }
+
+    auto drop_link(uint8_t reason) -> void
+    {
+        attempt += 1;
+        if (connected < 0)
+            return;
+        connected = -1;
+        if (sta_netif.dhcp)
+            sta_netif.ip_info = {};
+        disconnected(reason);
+    }
+}
+
+namespace host_fakes
+{
+    auto add_access_point(const AccessPoint &ap) -> void
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        ::AccessPoint a = {ap.ssid != NULL ? ap.ssid : "", ap.password != NULL ? ap.password : "", {}, ap.channel, ap.rssi, 0};
+        memcpy(a.bssid, ap.bssid, sizeof(a.bssid));
+        inet_pton(AF_INET, ap.ip != NULL ? ap.ip : "192.168.4.2", &a.ip);
+        access_points.push_back(a);
+    }
+
+    auto clear_access_points() -> void
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        drop_link(WIFI_REASON_BEACON_TIMEOUT);
+        access_points.clear();
+    }
+
+    auto drop_station() -> void
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        drop_link(WIFI_REASON_BEACON_TIMEOUT);
+    }
+}
+
+extern "C" {
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    std::lock_guard<std::mutex> guard(loop_lock);
+    if (loop_running)
+        return ESP_ERR_INVALID_STATE;
+    loop_running = true;
+    std::thread(run_loop).detach();
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler,
+                                              void *event_handler_arg, esp_event_handler_instance_t *instance)
+{
+    std::lock_guard<std::mutex> guard(loop_lock);
+    if (!loop_running)
+        return ESP_ERR_INVALID_STATE;
+    auto h = new esp_event_handler_instance_context{event_base, event_id, event_handler, event_handler_arg};
+    handlers.push_back(h);
+    if (instance != NULL)
+        *instance = h;
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_unregister(esp_event_base_t, int32_t, esp_event_handler_instance_t instance)
+{
+    std::lock_guard<std::mutex> guard(loop_lock);
+    for (auto it = handlers.begin(); it != handlers.end(); ++it)
+        if (*it == instance)
+        {
+            handlers.erase(it);
+            return ESP_OK; // The context is leaked on purpose, the loop may still hold a copy of the list
+        }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data, size_t event_data_size, TickType_t)
+{
+    post(event_base, event_id, event_data, event_data_size);
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void)
+{
+    return &sta_netif;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_ap(void)
+{
+    inet_pton(AF_INET, "192.168.4.1", &ap_netif.ip_info.ip.addr);
+    inet_pton(AF_INET, "255.255.255.0", &ap_netif.ip_info.netmask.addr);
+    ap_netif.ip_info.gw = ap_netif.ip_info.ip;
+    return &ap_netif;
+}
+
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *if_key)
+{
+    if (strcmp(if_key, sta_netif.key) == 0)
+        return &sta_netif;
+    if (strcmp(if_key, ap_netif.key) == 0)
+        return &ap_netif;
+    return NULL;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *esp_netif)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    esp_netif->dhcp = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *esp_netif)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    esp_netif->dhcp = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t *esp_netif, const esp_netif_ip_info_t *ip_info)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (esp_netif->dhcp)
+        return ESP_ERR_INVALID_STATE; // Like lwIP, the DHCP client has to be stopped first
+    esp_netif->ip_info = *ip_info;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    *ip_info = esp_netif->ip_info;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t, esp_netif_dns_info_t *dns)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    esp_netif->dns = *dns;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t, esp_netif_dns_info_t *dns)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    *dns = esp_netif->dns;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_str_to_ip4(const char *src, esp_ip4_addr_t *dst)
+{
+    return inet_pton(AF_INET, src, &dst->addr) == 1 ? ESP_OK : ESP_FAIL;
+}
+
+char *esp_ip4addr_ntoa(const esp_ip4_addr_t *addr, char *buf, int buflen)
+{
+    return inet_ntop(AF_INET, &addr->addr, buf, buflen) != NULL ? buf : NULL;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_deinit(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (started)
+        return ESP_ERR_WIFI_NOT_STOPPED;
+    initialized = false;
+    mode = WIFI_MODE_NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t new_mode)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    const auto had_sta = has_sta();
+    mode = new_mode;
+    if (started && had_sta && !has_sta())
+        drop_link(WIFI_REASON_ASSOC_LEAVE);
+    if (started && !had_sta && has_sta())
+        post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mode(wifi_mode_t *out_mode)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    *out_mode = mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    if (started)
+        return ESP_OK;
+    started = true;
+    if (has_sta())
+        post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0);
+    if (mode == WIFI_MODE_AP || mode == WIFI_MODE_APSTA)
+        post(WIFI_EVENT, WIFI_EVENT_AP_START, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    drop_link(WIFI_REASON_ASSOC_LEAVE);
+    started = false;
+    post(WIFI_EVENT, WIFI_EVENT_STA_STOP, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    if (!started)
+        return ESP_ERR_WIFI_NOT_STARTED;
+    if (!has_sta())
+        return ESP_ERR_WIFI_MODE;
+    if (connected >= 0)
+        return ESP_ERR_WIFI_CONN;
+    attempt += 1;
+    std::thread(associate, attempt).detach();
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    if (!started)
+        return ESP_ERR_WIFI_NOT_STARTED;
+    drop_link(WIFI_REASON_ASSOC_LEAVE);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    if (interface == WIFI_IF_STA)
+        sta_config = *conf;
+    else
+        ap_config = *conf;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(wifi_interface_t interface, wifi_config_t *conf)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    *conf = interface == WIFI_IF_STA ? sta_config : ap_config;
+    return ESP_OK;
+}
+
+// Hidden networks answer with an empty SSID, like on the air
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block)
+{
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        if (!initialized)
+            return ESP_ERR_WIFI_NOT_INIT;
+        if (!started)
+            return ESP_ERR_WIFI_NOT_STARTED;
+        if (!has_sta())
+            return ESP_ERR_WIFI_MODE;
+        scan_results.clear();
+        for (const auto &ap : access_points)
+            if (config == NULL || config->show_hidden || !ap.ssid.empty())
+                scan_results.push_back(record_of(ap));
+    }
+    if (block)
+        usleep(SCAN_MS * 1000);
+    wifi_event_sta_scan_done_t done = {0, (uint8_t)scan_results.size(), 0};
+    post(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &done, sizeof(done));
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t *number)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    *number = scan_results.size();
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *number, wifi_ap_record_t *ap_records)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!initialized)
+        return ESP_ERR_WIFI_NOT_INIT;
+    const auto count = scan_results.size() < *number ? scan_results.size() : *number;
+    for (size_t i = 0; i < count; i++)
+        ap_records[i] = scan_results[i];
+    *number = count;
+    scan_results.clear(); // The driver frees the results once they are read
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (connected < 0)
+        return ESP_ERR_WIFI_NOT_CONNECT;
+    *ap_info = record_of(access_points[connected]);
+    memcpy(ap_info->ssid, sta_config.sta.ssid, sizeof(sta_config.sta.ssid)); // Hidden networks report the SSID that was asked for
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    power_save = type;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_ps(wifi_ps_type_t *type)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    *type = power_save;
+    return ESP_OK;
+}
+
+}
@@ -0,0 +1,81 @@
+// The modem as a Linux process: the host talks to it over stdin / stdout as it would over UART0.
+//
+//   MODEM_STORAGE_DIR   NVS and flash images, kept between runs (a fresh temporary directory without it)
+//   MODEM_NETWORKS      Access points in range: "ssid:password:channel:rssi;..." (empty ssid for a hidden one)
+//   MODEM_HTTP_PORT     Where HTTP requests to port 80 go, for a local test server
+//   MODEM_PORTAL_PORT   Where the configuration portal listens instead of port 80 (0 picks a free one)
+//   MODEM_UART_PACED    1 makes the UART as slow as its baud rate (see uart_bench)
+//
+// esp_restart() exits with host_fakes::RESTART_EXIT_CODE, whoever started it decides whether to start it again.
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "host_fakes.hpp"
+
+extern "C" void app_main(void);
+
+namespace
+{
+    constexpr auto TAG = "MODEM_HOST";
+
+    // The host closed the line, nothing will ever be asked again
+    auto hang_up(int port) -> void
+    {
+        ESP_LOGI(TAG, "UART%d closed, stopping", port);
+        fflush(NULL);
+        _exit(0);
+    }
+
+    auto add_networks(const char *spec) -> void
+    {
+        auto list = strdup(spec);
+        uint8_t index = 0;
+        char *save = NULL;
+        for (auto entry = strtok_r(list, ";", &save); entry != NULL; entry = strtok_r(NULL, ";", &save))
+        {
+            const char *fields[4] = {"", "", "1", "-50"};
+            auto field = entry;
+            for (auto i = 0; i < 4 && field != NULL; i++)
+            {
+                fields[i] = field;
+                field = strchr(field, ':');
+                if (field != NULL)
+                    *field++ = '\0';
+            }
+            index += 1;
+            char ip[16];
+            snprintf(ip, sizeof(ip), "192.168.%u.2", index);
+            host_fakes::AccessPoint ap = {fields[0], fields[1], {0x02, 0, 0, 0, 0, index}, (uint8_t)atoi(fields[2]), (int8_t)atoi(fields[3]), ip};
+            host_fakes::add_access_point(ap);
+        }
+        free(list);
+    }
+}
+
+int main()
+{
+    setvbuf(stderr, NULL, _IOLBF, 0);
+    host_fakes::on_uart_hangup(hang_up);
+    if (host_fakes::load_partitions(PARTITION_TABLE) != ESP_OK)
+    {
+        fprintf(stderr, "Cannot load %s\n", PARTITION_TABLE);
+        return 1;
+    }
+    if (const auto networks = getenv("MODEM_NETWORKS"))
+        add_networks(networks);
+    if (const auto port = getenv("MODEM_HTTP_PORT"))
+        host_fakes::redirect_port(80, atoi(port));
+    if (const auto port = getenv("MODEM_PORTAL_PORT"))
+        host_fakes::redirect_listen(80, atoi(port));
+    if (const auto paced = getenv("MODEM_UART_PACED"))
+        host_fakes::pace_uart(atoi(paced) != 0);
+    ESP_LOGI(TAG, "Flash and NVS in %s", host_fakes::storage_dir());
+
+    app_main();
+    while (true)
+        pause(); // The tasks run on their own threads
+}
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+# BATCH against the local stand-in: items for one destination go out as a single POST, newline separated
+# or as a JSON array, on FLUSH, once the batch is full, or once its first item is old enough.
+# Every upload is acknowledged with one event for all of its items.
+import argparse
+import json
+import re
+import sys
+import time
+
+from http_standin import StandIn
+from modem_process import Modem
+
+MAX_BYTES = 2048  # CONFIG_MODEM_BATCH_MAX_BYTES in sdkconfig
+MAX_AGE_S = 30    # CONFIG_MODEM_BATCH_MAX_AGE_MS
+
+
+class Test:
+    def __init__(self, modem, server):
+        self.modem = modem
+        self.server = server
+        self.failures = 0
+
+    def expect(self, what, ok):
+        print('%-58s %s' % (what, 'ok' if ok else 'FAILED'))
+        self.failures += 0 if ok else 1
+
+    def add(self, path, item, json_format=False):
+        """(batch, index) the item went to, None if it was refused"""
+        self.modem.send('ESP_CMD BATCH ADD 127.0.0.1 %s%s ESP_DATA_STREAM %d' % (path, ' JSON' if json_format else '', len(item)))
+        self.modem.write(item)
+        lines = self.modem.wait_for(lambda line: line.text in ('ESP_RESP OK', 'ESP_RESP FAIL', 'ESP_RESP BUSY'))
+        for line in lines:
+            match = re.match(r'^ESP_RESP BATCH (\d+) (\d+)$', line.text)
+            if match:
+                return int(match.group(1)), int(match.group(2))
+        return None
+
+    def acknowledged(self, timeout=10):
+        """(ACK or NACK, batch, items, status) of the next upload"""
+        line = self.modem.wait_for('ESP_EVT BATCH ', timeout)[-1]
+        kind, batch, items, status = line.text.split()[2:]
+        return kind, int(batch), int(items), int(status)
+
+    def bodies(self, path):
+        return [body for p, body in self.server.bodies if p == path]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    server = StandIn().start()
+    modem = Modem(args.binary, env={'MODEM_NETWORKS': 'TestNet:testpass1:1:-40', 'MODEM_HTTP_PORT': str(server.port)})
+    t = Test(modem, server)
+    try:
+        modem.boot()
+        modem.connect_wifi('TestNet', 'testpass1')
+
+        # Newline separated, uploaded on FLUSH
+        items = [b'{"reading":%d}' % i for i in range(5)]
+        tickets = [t.add('/lines', item) for item in items]
+        t.expect('items for one destination share a batch', len({b for b, _ in tickets}) == 1 and [i for _, i in tickets] == list(range(5)))
+        t.expect('nothing is sent before the flush', t.bodies('/lines') == [])
+        t.expect('BATCH FLUSH answers OK', modem.command('BATCH FLUSH')[-1].text == 'ESP_RESP OK')
+        t.expect('one ACK for all the items', t.acknowledged() == ('ACK', tickets[0][0], 5, 200))
+        t.expect('in one POST, one item per line', t.bodies('/lines') == [b''.join(item + b'\n' for item in items)])
+
+        # JSON array, flushed by destination
+        items = [b'{"a":%d}' % i for i in range(3)]
+        batch = [t.add('/json', item, json_format=True) for item in items][0][0]
+        t.add('/other', b'left open')
+        modem.command('BATCH FLUSH 127.0.0.1 /json')
+        t.expect('FLUSH <host> <path> uploads that destination', t.acknowledged() == ('ACK', batch, 3, 200))
+        bodies = t.bodies('/json')
+        t.expect('as a JSON array', len(bodies) == 1 and json.loads(bodies[0]) == [{'a': 0}, {'a': 1}, {'a': 2}])
+        t.expect('other destinations stay open', t.bodies('/other') == [])
+        modem.command('BATCH FLUSH')
+        t.acknowledged()
+
+        # A full batch is uploaded on its own, the item that did not fit starts the next one
+        item = b'x' * 299
+        first = t.add('/full', item)
+        tickets = [first]
+        while tickets[-1][0] == first[0]:
+            tickets.append(t.add('/full', item))
+        kind, batch, count, status = t.acknowledged()
+        t.expect('a full batch goes out without a flush', (kind, batch, status) == ('ACK', first[0], 200) and count == len(tickets) - 1)
+        bodies = t.bodies('/full')
+        t.expect('and stays under the size limit', len(bodies) == 1 and len(bodies[0]) <= MAX_BYTES and bodies[0].count(b'\n') == count)
+        t.expect('the next item opened a new batch at index 0', tickets[-1][1] == 0)
+        modem.command('BATCH FLUSH')
+        t.acknowledged()
+
+        # A failed upload is reported for all of its items
+        batch = [t.add('/drop', b'lost %d' % i) for i in range(2)][0][0]
+        modem.command('BATCH FLUSH')
+        t.expect('a failed upload is a NACK', t.acknowledged() == ('NACK', batch, 2, -1))
+
+        # Left alone, a batch goes out once its first item is old enough
+        started = time.monotonic()
+        batch = t.add('/aged', b'old')[0]
+        t.expect('an old batch is uploaded without a flush', t.acknowledged(MAX_AGE_S + 10) == ('ACK', batch, 1, 200))
+        t.expect('not before it is old enough', time.monotonic() - started >= MAX_AGE_S - 1)
+    finally:
+        code = modem.close()
+        server.shutdown()
+    return 0 if code == 0 and t.failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,50 @@
+// Minimal checks for the C++ host tests: a failed CHECK is reported and makes the test exit with 1.
+#pragma once
+
+#include "stdio.h"
+#include "stdint.h"
+#include "time.h"
+
+namespace check
+{
+    inline int failures = 0;
+
+    inline auto fail(const char *file, int line, const char *what) -> void
+    {
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, what);
+        failures += 1;
+    }
+
+    inline auto result() -> int
+    {
+        if (failures > 0)
+            fprintf(stderr, "%d check(s) failed\n", failures);
+        return failures > 0 ? 1 : 0;
+    }
+
+    // Deterministic generator, so a failing run can be repeated
+    struct Random
+    {
+        uint64_t state;
+        auto next() -> uint32_t
+        {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            return (uint32_t)(state >> 33);
+        }
+        auto below(uint32_t n) -> uint32_t { return next() % n; }
+    };
+
+    inline auto seconds() -> double
+    {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec / 1e9;
+    }
+}
+
+#define CHECK(cond)                                       \
+    do                                                    \
+    {                                                     \
+        if (!(cond))                                      \
+            check::fail(__FILE__, __LINE__, #cond);       \
+    } while (0)
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Throughput and latency of the command path on the host: UART parser, dispatch, workers and the HTTP
+# client, with modem_host behind pipes and the local HTTP stand-in as the server. Pipes have no line
+# rate, so this is what the code costs, the link speed comes on top (see uart_bench).
+import argparse
+import sys
+import time
+
+from http_standin import StandIn
+from modem_process import Modem
+
+
+def percentile(values, p):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))]
+
+
+def report(name, latencies, elapsed, count):
+    if latencies:
+        spread = 'p50=%7.3f ms  p99=%7.3f ms' % (percentile(latencies, 50) * 1000, percentile(latencies, 99) * 1000)
+    else:
+        spread = '%-27s' % '(pipelined)'
+    print('%-26s n=%-5d %s  %8.0f cmd/s' % (name, count, spread, count / elapsed))
+
+
+def round_trips(modem, text, count, final='ESP_RESP OK'):
+    latencies = []
+    started = time.monotonic()
+    for _ in range(count):
+        sent = time.monotonic()
+        lines = modem.command(text)
+        if lines[-1].text != final:
+            raise AssertionError('%s answered %r' % (text, lines[-1].text))
+        latencies.append(lines[-1].at - sent)
+    return latencies, time.monotonic() - started
+
+
+def pipelined(modem, texts, done, window=None):
+    """Sends "texts" back to back, keeping at most "window" unanswered (all of them without a window)"""
+    window = window or len(texts)
+    started = time.monotonic()
+    sent = finished = 0
+    while finished < len(texts):
+        burst = texts[sent:finished + window]
+        if burst:
+            modem.write(b''.join(('ESP_CMD ' + t + '\n').encode() for t in burst))
+            sent += len(burst)
+        line = modem.next()
+        if done(line):
+            finished += 1
+        elif 'FAIL' in line.text or 'BUSY' in line.text:
+            raise AssertionError('pipelined command answered %r' % line.text)
+    return time.monotonic() - started
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    parser.add_argument('--count', type=int, default=200)
+    args = parser.parse_args()
+
+    server = StandIn().start()
+    modem = Modem(args.binary, env={'MODEM_NETWORKS': 'BenchNet:benchpass1:1:-40', 'MODEM_HTTP_PORT': str(server.port)})
+    try:
+        modem.boot()
+        modem.connect_wifi('BenchNet', 'benchpass1')
+        n = args.count
+
+        latencies, elapsed = round_trips(modem, 'CLOSE', n)
+        report('sync CLOSE', latencies, elapsed, n)
+
+        elapsed = pipelined(modem, ['CLOSE'] * n, lambda line: line.text == 'ESP_RESP OK')
+        report('pipelined CLOSE', [], elapsed, n)
+
+        before = dict(server.counters)
+        latencies, elapsed = round_trips(modem, 'HTTP GET 127.0.0.1 /bytes/64', n)
+        report('sync HTTP GET 64 B', latencies, elapsed, n)
+        opened = server.counters['connections'] - before['connections']
+        print('%-26s %d for %d requests' % ('connections opened', opened, n))
+        if opened > 1:
+            raise AssertionError('keep-alive pool opened %d connections for sequential requests' % opened)
+
+        latencies, elapsed = round_trips(modem, 'HTTP GET 127.0.0.1 /bytes/4096 FWD', n // 4)
+        report('sync HTTP GET 4 KiB FWD', latencies, elapsed, n // 4)
+
+        # Workers run these in parallel and reply in any order. More than the workers plus their queue
+        # (CONFIG_MODEM_WORKER_COUNT + CONFIG_MODEM_WORKER_QUEUE_LEN) in flight would be answered BUSY.
+        texts = ['ASYNC %d HTTP GET 127.0.0.1 /bytes/256 FWD' % i for i in range(n)]
+        elapsed = pipelined(modem, texts, lambda line: line.text.endswith(' OK') and line.text.startswith('ESP_RESP '), window=7)
+        report('async HTTP GET 256 B FWD', [], elapsed, n)
+    finally:
+        code = modem.close()
+        server.shutdown()
+    return 0 if code == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
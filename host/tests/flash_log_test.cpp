@@ -0,0 +1,196 @@
+// flash_log on the partition fake: order and ids across reopen, wrap-around dropping the oldest sector,
+// writes torn by a power cut at every byte of an append, and peeking past popped records.
+//   flash_log_test
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <string>
+#include <vector>
+
+#include "flash_log.hpp"
+#include "host_fakes.hpp"
+#include "log_format.hpp"
+#include "check.hpp"
+
+namespace
+{
+    constexpr uint32_t SECTORS = 3;
+
+    // Every case gets its own erased partition
+    auto fresh_log(flash_log::Log &log) -> void
+    {
+        static int count = 0;
+        char label[16];
+        snprintf(label, sizeof(label), "log%d", count++);
+        CHECK(host_fakes::add_partition(label, ESP_PARTITION_TYPE_DATA, flash_log::PARTITION_SUBTYPE,
+                                        SECTORS * log_format::SECTOR_SIZE) == ESP_OK);
+        CHECK(flash_log::open(log, label) == ESP_OK);
+    }
+
+    auto reopen(flash_log::Log &log) -> void
+    {
+        const std::string label = log.partition->label;
+        CHECK(flash_log::open(log, label.c_str()) == ESP_OK);
+    }
+
+    // Payload of record "n", "size" bytes long
+    auto payload(uint32_t n, uint16_t size) -> std::vector<uint8_t>
+    {
+        std::vector<uint8_t> bytes(size);
+        for (uint16_t i = 0; i < size; i++)
+            bytes[i] = (uint8_t)(n * 31 + i);
+        return bytes;
+    }
+
+    auto append_record(flash_log::Log &log, uint32_t n, uint16_t size, uint32_t *id = NULL) -> esp_err_t
+    {
+        const auto bytes = payload(n, size);
+        return flash_log::append(log, bytes.data(), size, id);
+    }
+
+    // Pops records first..last, checking their payload and that ids grow
+    auto pop_records(flash_log::Log &log, uint32_t first, uint32_t last, uint16_t size) -> void
+    {
+        std::vector<uint8_t> buf(flash_log::max_record_size());
+        uint32_t previous_id = 0;
+        for (auto n = first; n <= last; n++)
+        {
+            uint16_t len = 0;
+            uint32_t id = 0, tail = 0;
+            CHECK(flash_log::tail_id(log, &tail) == ESP_OK);
+            CHECK(flash_log::peek(log, buf.data(), buf.size(), &len, &id) == ESP_OK);
+            CHECK(len == size && memcmp(buf.data(), payload(n, size).data(), size) == 0);
+            CHECK(id == tail && (n == first || id > previous_id));
+            CHECK(flash_log::pop(log) == ESP_OK);
+            previous_id = id;
+        }
+    }
+
+    // Pops records first..last, and nothing comes after them
+    auto drain(flash_log::Log &log, uint32_t first, uint32_t last, uint16_t size) -> void
+    {
+        pop_records(log, first, last, size);
+        uint8_t buf[16];
+        uint16_t len;
+        CHECK(flash_log::peek(log, buf, sizeof(buf), &len) == ESP_ERR_NOT_FOUND);
+        CHECK(log.records == 0);
+    }
+
+    auto order_and_reopen() -> void
+    {
+        flash_log::Log log;
+        fresh_log(log);
+        uint32_t first_id, id;
+        CHECK(append_record(log, 0, 40, &first_id) == ESP_OK);
+        for (uint32_t n = 1; n < 100; n++)
+            CHECK(append_record(log, n, 40, &id) == ESP_OK && id > first_id);
+        CHECK(log.records == 100);
+
+        uint32_t tail;
+        CHECK(flash_log::tail_id(log, &tail) == ESP_OK && tail == first_id);
+        pop_records(log, 0, 9, 40);
+        reopen(log);
+        CHECK(log.records == 90);
+        drain(log, 10, 99, 40);
+
+        reopen(log);
+        CHECK(log.records == 0 && flash_log::tail_id(log, &tail) == ESP_ERR_NOT_FOUND);
+    }
+
+    // Filling more than the ring holds drops the oldest sector, what is left stays in order
+    auto wrap_around() -> void
+    {
+        constexpr uint16_t SIZE = 200;
+        const auto per_sector = (log_format::SECTOR_SIZE - log_format::FIRST_RECORD) / log_format::record_size(SIZE);
+        const auto total = per_sector * SECTORS * 3;
+        flash_log::Log log;
+        fresh_log(log);
+        for (uint32_t n = 0; n < total; n++)
+            CHECK(append_record(log, n, SIZE) == ESP_OK);
+        CHECK(log.dropped > 0 && log.records + log.dropped == total);
+        CHECK(log.records <= per_sector * SECTORS);
+
+        reopen(log);
+        CHECK(log.records > 0);
+        drain(log, total - log.records, total - 1, SIZE);
+    }
+
+    // The power goes at every byte of one append: the records before it survive, the torn one never shows
+    // up, and the log takes the record again after the reboot
+    auto power_cuts() -> void
+    {
+        constexpr uint16_t SIZE = 60;
+        const auto append_bytes = SIZE + sizeof(log_format::RecordHeader);
+        for (uint32_t cut = 0; cut < append_bytes; cut++)
+        {
+            flash_log::Log log;
+            fresh_log(log);
+            for (uint32_t n = 0; n < 5; n++)
+                CHECK(append_record(log, n, SIZE) == ESP_OK);
+            host_fakes::power_cut_after(cut);
+            append_record(log, 5, SIZE);
+            CHECK(host_fakes::power_was_cut());
+            host_fakes::power_cut_after(-1);
+
+            reopen(log);
+            CHECK(log.records == 5);
+            CHECK(append_record(log, 5, SIZE) == ESP_OK); // Sent again after the reboot
+            drain(log, 0, 5, SIZE);
+            reopen(log);
+            CHECK(log.records == 0);
+        }
+    }
+
+    // A popped record larger than the caller's buffer sits in front of the tail (after a reopen the tail
+    // starts at the beginning of the sector): it is skipped by its size, never read into the buffer
+    auto popped_in_front() -> void
+    {
+        flash_log::Log log;
+        fresh_log(log);
+        CHECK(append_record(log, 0, 1000) == ESP_OK);
+        CHECK(append_record(log, 1, 16) == ESP_OK);
+        std::vector<uint8_t> big(1000);
+        uint16_t len;
+        CHECK(flash_log::peek(log, big.data(), big.size(), &len) == ESP_OK && len == 1000);
+        CHECK(flash_log::pop(log) == ESP_OK);
+        reopen(log);
+
+        // Guard bytes after the small buffer catch a read past its end
+        std::vector<uint8_t> small(16 + 64, 0xEE);
+        uint32_t id, tail;
+        CHECK(flash_log::tail_id(log, &tail) == ESP_OK);
+        CHECK(flash_log::peek(log, small.data(), 16, &len, &id) == ESP_OK && len == 16 && id == tail);
+        CHECK(memcmp(small.data(), payload(1, 16).data(), 16) == 0);
+        for (size_t i = 16; i < small.size(); i++)
+            CHECK(small[i] == 0xEE);
+
+        // A live record that does not fit is reported with its id, and stays
+        CHECK(append_record(log, 2, 100) == ESP_OK);
+        CHECK(flash_log::pop(log) == ESP_OK);
+        CHECK(flash_log::peek(log, small.data(), 16, &len, &id) == ESP_ERR_INVALID_SIZE);
+        CHECK(flash_log::tail_id(log, &tail) == ESP_OK && id == tail && log.records == 1);
+    }
+
+    auto too_large() -> void
+    {
+        flash_log::Log log;
+        fresh_log(log);
+        CHECK(append_record(log, 0, flash_log::max_record_size()) == ESP_OK);
+        std::vector<uint8_t> bytes(flash_log::max_record_size() + 1);
+        CHECK(flash_log::append(log, bytes.data(), bytes.size()) == ESP_ERR_INVALID_SIZE);
+        drain(log, 0, 0, flash_log::max_record_size());
+    }
+}
+
+int main()
+{
+    char dir[] = "/tmp/flash_log_test_XXXXXX";
+    if (mkdtemp(dir) == NULL || host_fakes::set_storage_dir(dir) != ESP_OK)
+        return 1;
+    order_and_reopen();
+    wrap_around();
+    power_cuts();
+    popped_in_front();
+    too_large();
+    return check::result();
+}
@@ -0,0 +1,219 @@
+// Form bodies (form) fed in pieces: every split of a body decodes like the whole body, "%XX" sequences cut at
+// chunk boundaries or at the end, keys past MAX_KEY_LEN, and values longer than their field.
+//   form_fuzz [bodies]
+#include "stdlib.h"
+#include "string.h"
+#include <string>
+#include <vector>
+
+#include "form.hpp"
+#include "check.hpp"
+
+namespace
+{
+    using namespace form;
+
+    constexpr size_t CAPACITY = 12;                                       // Small, so random values overflow now and then
+    const char *const NAMES[] = {"ssid", "pass", "x", "abcdefghijklmno"}; // The last one is MAX_KEY_LEN long
+    constexpr uint8_t FIELD_COUNT = sizeof(NAMES) / sizeof(NAMES[0]);
+    const char *const PIECES[] = {"ssid", "pass", "x", "abcdefghijklmno", "abcdefghijklmnop", // Keys, the last one too long
+                                  "=", "&", "+", "%", "%4", "%41", "%2B", "%26", "%3D", "%g", "%a", "%7e", "a", "Z", "0", " "};
+    constexpr size_t PIECE_COUNT = sizeof(PIECES) / sizeof(PIECES[0]);
+
+    struct Decoded
+    {
+        std::string value; // Whole value, also past the capacity
+        bool found;
+    };
+
+    auto hex_value(char c) -> int
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            return (c | 0x20) - 'a' + 10;
+        return -1;
+    }
+
+    // Decodes one key or value the way a browser encodes it, a "%" without two hex digits stays as it is
+    auto decode(const std::string &s) -> std::string
+    {
+        std::string out;
+        for (size_t i = 0; i < s.size(); i++)
+        {
+            if (s[i] == '%' && i + 2 < s.size() && hex_value(s[i + 1]) >= 0 && hex_value(s[i + 2]) >= 0)
+            {
+                out += (char)(hex_value(s[i + 1]) * 16 + hex_value(s[i + 2]));
+                i += 2;
+            }
+            else
+                out += s[i] == '+' ? ' ' : s[i];
+        }
+        return out;
+    }
+
+    // Whole-body reference: pairs split on '&', the first '=' ends the key, the last occurrence of a field wins
+    auto reference(const std::string &body) -> std::vector<Decoded>
+    {
+        std::vector<Decoded> fields(FIELD_COUNT, Decoded{"", false});
+        for (size_t start = 0; start <= body.size();)
+        {
+            auto end = body.find('&', start);
+            end = end == std::string::npos ? body.size() : end;
+            const auto pair = body.substr(start, end - start);
+            const auto equals = pair.find('=');
+            if (equals != std::string::npos)
+            {
+                const auto key = decode(pair.substr(0, equals));
+                for (uint8_t i = 0; i < FIELD_COUNT; i++)
+                    if (key == NAMES[i])
+                        fields[i] = Decoded{decode(pair.substr(equals + 1)), true};
+            }
+            start = end + 1;
+        }
+        return fields;
+    }
+
+    struct Result
+    {
+        char values[FIELD_COUNT][CAPACITY];
+        Field fields[FIELD_COUNT];
+        bool fits;
+    };
+
+    // Feeds "body" in the pieces that start at "cuts"
+    auto parse(const std::string &body, const std::vector<size_t> &cuts, Result &r) -> void
+    {
+        for (uint8_t i = 0; i < FIELD_COUNT; i++)
+            r.fields[i] = Field{NAMES[i], r.values[i], CAPACITY, 0, false};
+        Parser p;
+        init(p, r.fields, FIELD_COUNT);
+        size_t from = 0;
+        for (const auto cut : cuts)
+        {
+            feed(p, body.data() + from, cut - from);
+            from = cut;
+        }
+        feed(p, body.data() + from, body.size() - from);
+        r.fits = finish(p);
+    }
+
+    auto matches(const Result &r, const std::vector<Decoded> &expected) -> bool
+    {
+        auto fits = true;
+        for (uint8_t i = 0; i < FIELD_COUNT; i++)
+        {
+            const auto &f = r.fields[i];
+            const auto &e = expected[i];
+            const auto kept = e.value.size() < CAPACITY ? e.value.size() : CAPACITY - 1;
+            if (f.found != e.found || f.len != e.value.size() || memcmp(f.value, e.value.data(), kept) != 0 || f.value[kept] != '\0')
+                return false;
+            fits = fits && e.value.size() < CAPACITY;
+        }
+        return r.fits == fits;
+    }
+
+    auto random_body(check::Random &rng) -> std::string
+    {
+        std::string body;
+        for (auto n = rng.below(24); n > 0; n--)
+            body += PIECES[rng.below(PIECE_COUNT)];
+        return body;
+    }
+
+    // Hand-picked bodies, split at every byte and fed a byte at a time
+    auto every_split() -> void
+    {
+        const char *const bodies[] = {
+            "ssid=Home+Net&pass=p%40ss%25",
+            "pass=%", "pass=%4", "pass=%4&x=1", "pass=%a", "pass=%aZ", "pass=%%41", "pass=%g1",
+            "x=%3d%3D&ssid=%2B+", "ss%69d=key+escaped", "x=1&x=2&x=", "x", "=x&&x=a=b",
+            "abcdefghijklmno=fifteen", "abcdefghijklmnop=sixteen", "abcdefghijklmno%70=sixteen",
+        };
+        for (const auto body : bodies)
+        {
+            const std::string s = body;
+            const auto expected = reference(s);
+            Result r;
+            for (size_t cut = 0; cut <= s.size(); cut++)
+            {
+                parse(s, {cut}, r);
+                CHECK(matches(r, expected));
+            }
+            std::vector<size_t> bytes;
+            for (size_t cut = 1; cut < s.size(); cut++)
+                bytes.push_back(cut);
+            parse(s, bytes, r);
+            CHECK(matches(r, expected));
+        }
+    }
+
+    // "%" and "%X" at the end of a chunk are completed by the next one, at the end of the body they stay literal
+    auto escapes() -> void
+    {
+        Result r;
+        parse("pass=a%4", {7}, r); // "%" ends the first chunk, the body ends after one digit
+        CHECK(r.fits && strcmp(r.values[1], "a%4") == 0);
+        parse("pass=a%41b", {8}, r); // The chunk ends between the digits
+        CHECK(r.fits && strcmp(r.values[1], "aAb") == 0);
+        parse("pass=%e&x=%", {7}, r); // A lower case digit is kept as sent
+        CHECK(strcmp(r.values[1], "%e") == 0 && strcmp(r.values[2], "%") == 0);
+        parse("pass=%41", {6, 7}, r); // One byte per chunk
+        CHECK(strcmp(r.values[1], "A") == 0);
+    }
+
+    // A key one character past MAX_KEY_LEN never matches, not even the field it starts with
+    auto long_keys() -> void
+    {
+        Result r;
+        parse("abcdefghijklmno=ok", {}, r);
+        CHECK(r.fields[3].found && strcmp(r.values[3], "ok") == 0);
+        parse("abcdefghijklmnop=no&abcdefghijklmno%20=no", {}, r);
+        CHECK(!r.fields[3].found && r.values[3][0] == '\0');
+        std::string key(200, 'x');
+        parse(key + "=no&x=yes", {100}, r);
+        CHECK(r.fields[2].found && strcmp(r.values[2], "yes") == 0);
+    }
+
+    // A value longer than its field: finish() fails, the value is cut and terminated, "len" has the whole length
+    auto over_capacity() -> void
+    {
+        Result r;
+        const std::string exact(CAPACITY - 1, 'a');
+        parse("ssid=" + exact, {}, r);
+        CHECK(r.fits && r.fields[0].len == CAPACITY - 1 && exact == r.values[0]);
+        parse("ssid=" + exact + "b&pass=1", {9}, r);
+        CHECK(!r.fits && r.fields[0].len == CAPACITY && exact == r.values[0] && strcmp(r.values[1], "1") == 0);
+        parse("ssid=" + exact + "%41%41%41", {CAPACITY + 5}, r);
+        CHECK(!r.fits && r.fields[0].len == CAPACITY + 2 && exact == r.values[0]);
+        parse("ssid=" + exact + "zz&ssid=short", {}, r); // A later occurrence that fits replaces it
+        CHECK(r.fits && strcmp(r.values[0], "short") == 0);
+    }
+
+    // Random bodies in random pieces against the whole-body reference
+    auto random_bodies(check::Random &rng, int count) -> void
+    {
+        Result r;
+        for (int i = 0; i < count; i++)
+        {
+            const auto body = random_body(rng);
+            std::vector<size_t> cuts;
+            for (size_t at = 0; at < body.size(); at += 1 + rng.below(6))
+                cuts.push_back(at);
+            parse(body, cuts, r);
+            CHECK(matches(r, reference(body)));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const auto count = argc > 1 ? atoi(argv[1]) : 2000;
+    check::Random rng = {2121};
+    every_split();
+    escapes();
+    long_keys();
+    over_capacity();
+    random_bodies(rng, count);
+    return check::result();
+}
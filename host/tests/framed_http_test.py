@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Binary frames end to end: the link is switched to framed mode and HTTP bodies with NUL bytes in them
+# are sent as frame payloads. The local stand-in must receive every byte. The other commands have frame
+# ids of their own and answer the way they do in text.
+import argparse
+import sys
+
+from http_standin import StandIn
+from modem_process import CMD_CLOSE, CMD_HTTP, CMD_STATS, Modem
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    server = StandIn().start()
+    modem = Modem(args.binary, env={'MODEM_NETWORKS': 'TestNet:testpass1:1:-40', 'MODEM_HTTP_PORT': str(server.port)})
+    failures = 0
+    try:
+        modem.boot()
+        modem.connect_wifi('TestNet', 'testpass1')
+        modem.framed()
+
+        for size in (1, 300, 4000):
+            body = bytes((i * 7) % 256 for i in range(size))  # Starts with a NUL byte, and has more of them
+            modem.send_frame(CMD_HTTP, ['POST', '127.0.0.1', '/echo'], body)
+            final = modem.wait_for(lambda line: line.text in ('ESP_RESP OK', 'ESP_RESP FAIL'))[-1]
+            if final.text != 'ESP_RESP OK' or server.last_body != body:
+                got = len(server.last_body) if server.last_body is not None else None
+                print('%d byte body: %s, server got %s bytes' % (size, final.text, got))
+                failures += 1
+        print('binary bodies delivered' if failures == 0 else '%d bodies broken' % failures)
+
+        modem.send_frame(CMD_STATS)
+        lines = modem.wait_for(lambda line: line.text in ('ESP_RESP OK', 'ESP_RESP FAIL'))
+        stats = lines[-1].text == 'ESP_RESP OK' and any(' TOTAL ' in line.text for line in lines)
+        modem.send_frame(CMD_CLOSE, ['127.0.0.1'])
+        close = modem.wait_for(lambda line: line.text in ('ESP_RESP OK', 'ESP_RESP FAIL'))[-1].text == 'ESP_RESP OK'
+        print('STATS and CLOSE frames %s' % ('answered' if stats and close else 'FAILED'))
+        failures += 0 if stats and close else 1
+    finally:
+        code = modem.close()
+        server.shutdown()
+    return 0 if code == 0 and failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,185 @@
+// Binary framing against byte streams: encode / parse round trips, garbage and corruption between frames,
+// random bytes, and the parser throughput when reading straight into its buffer like the UART loop does.
+//   frames_fuzz [frames]
+#include "stdlib.h"
+#include "string.h"
+#include <string>
+#include <vector>
+
+#include "frames.hpp"
+#include "check.hpp"
+
+namespace
+{
+    constexpr size_t FRAME_BUF_SIZE = 4096; // Same as the firmware (commands.cpp)
+
+    struct Sample
+    {
+        uint8_t cmd_id;
+        std::vector<std::string> args;
+        std::vector<uint8_t> data;
+    };
+
+    auto random_sample(check::Random &rng, size_t max_data) -> Sample
+    {
+        Sample s;
+        s.cmd_id = rng.below(256);
+        const auto argc = rng.below(frames::MAX_ARGS + 1);
+        for (uint32_t i = 0; i < argc; i++)
+        {
+            std::string arg(rng.below(24), ' ');
+            for (auto &c : arg)
+                c = 1 + rng.below(255); // Anything but the terminator
+            s.args.push_back(arg);
+        }
+        s.data.resize(rng.below(max_data + 1));
+        for (auto &b : s.data)
+            b = rng.below(256); // Binary, NUL bytes included
+        return s;
+    }
+
+    auto encode(const Sample &s, std::vector<uint8_t> &out) -> size_t
+    {
+        const char *args[frames::MAX_ARGS];
+        for (size_t i = 0; i < s.args.size(); i++)
+            args[i] = s.args[i].c_str();
+        uint8_t buf[FRAME_BUF_SIZE];
+        const auto len = frames::encode(buf, sizeof(buf), s.cmd_id, args, s.args.size(), s.data.data(), s.data.size());
+        out.insert(out.end(), buf, buf + len);
+        return len;
+    }
+
+    auto matches(const frames::Frame &f, const Sample &s) -> bool
+    {
+        if (f.cmd_id != s.cmd_id || f.argc != s.args.size() || f.data_len != s.data.size())
+            return false;
+        for (size_t i = 0; i < s.args.size(); i++)
+            if (s.args[i] != f.args[i])
+                return false;
+        return memcmp(f.data, s.data.data(), s.data.size()) == 0 && f.data[f.data_len] == '\0';
+    }
+
+    // Runs "stream" through the parser in random pieces, the way bytes come out of the UART driver
+    template <typename OnFrame>
+    auto parse(const std::vector<uint8_t> &stream, check::Random &rng, OnFrame on_frame) -> void
+    {
+        static uint8_t buf[FRAME_BUF_SIZE];
+        frames::Parser p;
+        frames::init(p, buf, sizeof(buf));
+        size_t pos = 0;
+        while (pos < stream.size())
+        {
+            const auto piece = 1 + rng.below(64);
+            const auto len = piece < stream.size() - pos ? piece : stream.size() - pos;
+            size_t consumed = 0;
+            const auto status = frames::feed(p, stream.data() + pos, len, &consumed);
+            CHECK(consumed > 0 && consumed <= len);
+            pos += consumed;
+            if (status == frames::Status::FRAME)
+                on_frame(p.frame);
+        }
+    }
+
+    // Frames back to back with unrelated bytes between them come out whole and in order
+    auto round_trip(check::Random &rng, int count) -> void
+    {
+        std::vector<Sample> samples;
+        std::vector<uint8_t> stream;
+        for (int i = 0; i < count; i++)
+        {
+            samples.push_back(random_sample(rng, 512));
+            encode(samples.back(), stream);
+            for (auto gap = rng.below(4); gap > 0; gap--)
+            {
+                const uint8_t noise = rng.below(256);
+                stream.push_back(noise == frames::MAGIC_0 ? 0 : noise); // A magic byte here could start a frame
+            }
+        }
+        size_t next = 0;
+        parse(stream, rng, [&](const frames::Frame &f) {
+            CHECK(next < samples.size() && matches(f, samples[next]));
+            next += 1;
+        });
+        CHECK(next == samples.size());
+    }
+
+    // A flipped bit loses its frame (and maybe a few after it), but never yields a frame that was not sent
+    auto corrupted(check::Random &rng, int count) -> void
+    {
+        std::vector<Sample> samples;
+        std::vector<uint8_t> stream;
+        for (int i = 0; i < count; i++)
+        {
+            samples.push_back(random_sample(rng, 256));
+            const auto start = stream.size();
+            const auto len = encode(samples.back(), stream);
+            if (rng.below(4) == 0)
+                stream[start + rng.below(len)] ^= 1 << rng.below(8);
+        }
+        size_t parsed = 0;
+        size_t next = 0;
+        parse(stream, rng, [&](const frames::Frame &f) {
+            while (next < samples.size() && !matches(f, samples[next]))
+                next += 1;
+            CHECK(next < samples.size()); // Every frame out is one that went in, in order
+            parsed += 1;
+        });
+        CHECK(parsed > (size_t)count / 2);
+    }
+
+    // Noise only: the parser must stay inside its buffer and keep going
+    auto noise(check::Random &rng, size_t bytes) -> void
+    {
+        std::vector<uint8_t> stream(bytes);
+        for (auto &b : stream)
+            b = rng.below(8) == 0 ? frames::MAGIC_0 : rng.below(8) == 0 ? frames::MAGIC_1 : rng.below(256);
+        parse(stream, rng, [&](const frames::Frame &f) { CHECK(f.argc <= frames::MAX_ARGS); });
+    }
+
+    // Parse rate with the bytes already in memory, as the command loop reads them from the UART ring
+    auto throughput(check::Random &rng, int count, size_t data_len) -> void
+    {
+        Sample s;
+        s.cmd_id = frames::CMD_HTTP;
+        s.args = {"POST", "api.example.com", "/v1/readings"};
+        s.data.resize(data_len);
+        for (auto &b : s.data)
+            b = rng.below(256);
+        std::vector<uint8_t> one;
+        encode(s, one);
+        std::vector<uint8_t> stream;
+        for (int i = 0; i < count; i++)
+            stream.insert(stream.end(), one.begin(), one.end());
+
+        static uint8_t buf[FRAME_BUF_SIZE];
+        frames::Parser p;
+        frames::init(p, buf, sizeof(buf));
+        auto parsed = 0;
+        size_t pos = 0;
+        const auto started = check::seconds();
+        while (pos < stream.size())
+        {
+            uint8_t *dst;
+            const auto want = frames::next_chunk(p, &dst);
+            memcpy(dst, stream.data() + pos, want);
+            pos += want;
+            if (frames::commit(p, want) == frames::Status::FRAME)
+                parsed += 1;
+        }
+        const auto elapsed = check::seconds() - started;
+        CHECK(parsed == count);
+        printf("%5zu B payload: %9.0f frames/s %8.1f MB/s\n", data_len, count / elapsed, stream.size() / elapsed / 1e6);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const auto count = argc > 1 ? atoi(argv[1]) : 2000;
+    check::Random rng = {12345};
+    round_trip(rng, count);
+    corrupted(rng, count);
+    noise(rng, count * 256);
+    for (const auto size : {16, 256, 4000})
+        throughput(rng, count * 10, size);
+    return check::result();
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# Keep-alive connection pool against the local stand-in, which counts the connections it accepts:
+# reuse, CLOSE, servers closing the connection, and the single retry on a stale connection.
+import argparse
+import sys
+import time
+
+from http_standin import StandIn
+from modem_process import Modem
+
+
+class Test:
+    def __init__(self, modem, server):
+        self.modem = modem
+        self.server = server
+        self.failures = 0
+
+    def expect(self, what, ok):
+        print('%-58s %s' % (what, 'ok' if ok else 'FAILED'))
+        self.failures += 0 if ok else 1
+
+    def request(self, text):
+        return self.modem.command(text)[-1].text
+
+    def opened(self, text, count=1):
+        """Connections the stand-in accepted while "text" ran "count" times, None if one of them failed"""
+        before = self.server.counters['connections']
+        for _ in range(count):
+            if self.request(text) != 'ESP_RESP OK':
+                return None
+        return self.server.counters['connections'] - before
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    server = StandIn().start()
+    modem = Modem(args.binary, env={'MODEM_NETWORKS': 'TestNet:testpass1:1:-40', 'MODEM_HTTP_PORT': str(server.port)})
+    t = Test(modem, server)
+    try:
+        modem.boot()
+        modem.connect_wifi('TestNet', 'testpass1')
+
+        t.expect('20 sequential GETs share one connection', t.opened('HTTP GET 127.0.0.1 /bytes/64', 20) == 1)
+        t.expect('POSTs to the same host reuse it', t.opened('HTTP POST 127.0.0.1 /echo', 5) == 0)
+
+        t.expect('CLOSE <host> answers OK', t.request('CLOSE 127.0.0.1') == 'ESP_RESP OK')
+        t.expect('the request after CLOSE opens a new connection', t.opened('HTTP GET 127.0.0.1 /bytes/64') == 1)
+
+        t.expect('"Connection: close" from the server is honoured', t.opened('HTTP GET 127.0.0.1 /close') == 0)
+        t.expect('the next request reconnects', t.opened('HTTP GET 127.0.0.1 /bytes/64') == 1)
+
+        # The server dropped the idle connection: one retry on a fresh one, the POST arrives once
+        server.drop_connections()
+        time.sleep(0.1)
+        before = server.counters.get('/echo', 0)
+        t.expect('a stale connection is replaced', t.opened('HTTP POST 127.0.0.1 /echo') == 1)
+        t.expect('the retried POST reached the server once', server.counters.get('/echo', 0) - before == 1)
+
+        # The connection breaks after the headers were forwarded: no retry, the host already has part of the answer
+        t.request('HTTP GET 127.0.0.1 /bytes/8')
+        lines = modem.command('HTTP POST 127.0.0.1 /drop FWD')
+        t.expect('a response cut short fails', lines[-1].text == 'ESP_RESP FAIL')
+        time.sleep(0.5)
+        t.expect('and is not sent again', server.counters.get('/drop', 0) == 1)
+
+        # A failed request does not leave a broken connection behind
+        t.expect('the pool recovers after the failure', t.opened('HTTP GET 127.0.0.1 /bytes/64', 3) == 1)
+    finally:
+        code = modem.close()
+        server.shutdown()
+    return 0 if code == 0 and t.failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+# Local stand-in for the web servers the modem talks to: HTTP/1.1 with keep-alive, counts accepted connections.
+#   GET  /bytes/<n>   n bytes of JSON-looking text
+#   POST /echo        the request body back, with its length in "X-Body-Length"
+#   *    /close       answers with "Connection: close"
+#   *    /drop        sends the headers and part of the body, then hangs up
+# Requests are counted per path too ("counters['/echo']"), POST bodies are kept in "bodies" as (path, body).
+# Chunked and gzip encoded bodies are decoded, "last_wire_len" is the size before decoding.
+# Run on its own it prints "PORT <n>" and serves until killed.
+import gzip
+import http.server
+import socket
+import socketserver
+import sys
+import threading
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    disable_nagle_algorithm = True  # Headers and body are two writes, Nagle would hold the body for the delayed ACK
+
+    def log_message(self, *args):
+        pass
+
+    def body(self):
+        """The request body as sent, chunked encoding undone and gzip inflated"""
+        if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+            data = b''
+            while True:
+                size = int(self.rfile.readline().split(b';')[0], 16)
+                data += self.rfile.read(size)
+                self.rfile.readline()
+                if size == 0:
+                    break
+        else:
+            data = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        self.server.last_wire_len = len(data)
+        if self.headers.get('Content-Encoding', '').lower() == 'gzip':
+            data = gzip.decompress(data)
+        return data
+
+    def reply(self, payload, extra=()):
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(payload)))
+        for key, value in extra:
+            self.send_header(key, value)
+        self.end_headers()
+        self.wfile.write(payload)
+        self.server.count('requests')
+
+    def drop(self):
+        self.send_response(200)
+        self.send_header('Content-Length', '100')
+        self.end_headers()
+        self.wfile.write(b'{"partial":')
+        self.wfile.flush()
+        self.close_connection = True
+        self.connection.shutdown(socket.SHUT_RDWR)
+
+    def do_GET(self):
+        self.body()
+        self.server.count(self.path)
+        if self.path == '/drop':
+            return self.drop()
+        if self.path.startswith('/bytes/'):
+            n = int(self.path[len('/bytes/'):])
+            text = b'{"reading":1234,"unit":"mV"},' * (n // 29 + 1)
+            return self.reply(text[:n])
+        if self.path == '/close':
+            self.close_connection = True
+            return self.reply(b'{}', [('Connection', 'close')])
+        self.reply(b'{"ok":true}')
+
+    def do_POST(self):
+        data = self.body()
+        self.server.count(self.path)
+        if self.path == '/drop':
+            return self.drop()
+        self.server.last_body = data
+        self.server.last_headers = dict(self.headers)
+        with self.server.lock:
+            self.server.bodies.append((self.path, data))
+        if self.path == '/close':
+            self.close_connection = True
+            return self.reply(data, [('Connection', 'close'), ('X-Body-Length', str(len(data)))])
+        self.reply(data, [('X-Body-Length', str(len(data)))])
+
+
+class StandIn(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, port=0):
+        super().__init__(('127.0.0.1', port), Handler)
+        self.lock = threading.Lock()
+        self.counters = {'connections': 0, 'requests': 0}
+        self.last_body = None
+        self.last_headers = None
+        self.last_wire_len = 0
+        self.bodies = []
+        self.open_sockets = []
+
+    def count(self, name):
+        with self.lock:
+            self.counters[name] = self.counters.get(name, 0) + 1
+
+    def drop_connections(self):
+        """Hangs up on every client without a word, like a server timing out idle keep-alive connections"""
+        with self.lock:
+            sockets, self.open_sockets = self.open_sockets, []
+        for sock in sockets:
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def handle_error(self, request, client_address):
+        pass  # Clients dropping idle keep-alive connections is what the tests do on purpose
+
+    def get_request(self):
+        request = super().get_request()
+        self.count('connections')
+        with self.lock:
+            self.open_sockets.append(request[0])
+        return request
+
+    @property
+    def port(self):
+        return self.server_address[1]
+
+    def start(self):
+        threading.Thread(target=self.serve_forever, daemon=True).start()
+        return self
+
+
+if __name__ == '__main__':
+    server = StandIn(int(sys.argv[1]) if len(sys.argv) > 1 else 0)
+    print('PORT', server.port, flush=True)
+    server.serve_forever()
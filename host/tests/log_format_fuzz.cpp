@@ -0,0 +1,144 @@
+// flash_log sector images (log_format) against damage: valid sectors read back record by record, and
+// flipped bits, torn tails and random bytes never yield a record reaching outside the sector.
+//   log_format_fuzz [sectors]
+#include "stdlib.h"
+#include "string.h"
+#include <vector>
+
+#include "log_format.hpp"
+#include "check.hpp"
+
+namespace
+{
+    using namespace log_format;
+
+    struct Written
+    {
+        uint32_t in_sector;
+        std::vector<uint8_t> payload;
+        bool popped;
+    };
+
+    // A sector the way flash_log writes it, records until the next one does not fit
+    auto random_sector(check::Random &rng, std::vector<uint8_t> &sector, std::vector<Written> &written) -> void
+    {
+        sector.assign(SECTOR_SIZE, 0xFF);
+        const SectorHeader header = {SECTOR_MAGIC, rng.next()};
+        memcpy(sector.data(), &header, sizeof(header));
+        written.clear();
+        for (uint32_t offset = FIRST_RECORD;;)
+        {
+            const uint16_t len = rng.below(8) == 0 ? rng.below(MAX_PAYLOAD + 1) : rng.below(200);
+            if (offset + record_size(len) > SECTOR_SIZE)
+                break;
+            Written w = {offset, std::vector<uint8_t>(len), rng.below(3) == 0};
+            for (auto &b : w.payload)
+                b = rng.below(256);
+            const RecordHeader record = {RECORD_MAGIC, len, crc16(w.payload.data(), len), w.popped ? RECORD_POPPED : RECORD_LIVE, 0xFF};
+            memcpy(sector.data() + offset, &record, sizeof(record));
+            memcpy(sector.data() + offset + sizeof(record), w.payload.data(), len);
+            written.push_back(w);
+            offset += record_size(len);
+        }
+    }
+
+    // Walks the records the way flash_log::open does, returns them up to the end of the sector
+    auto walk(const std::vector<uint8_t> &sector) -> std::vector<std::pair<uint32_t, Record>>
+    {
+        std::vector<std::pair<uint32_t, Record>> found;
+        RecordHeader header;
+        for (auto offset = FIRST_RECORD;;)
+        {
+            const auto r = read_record(sector.data(), offset, &header);
+            if (r == Record::END)
+                break;
+            CHECK(offset + record_size(header.len) <= SECTOR_SIZE); // Nothing reaches past the sector
+            found.push_back({offset, r});
+            offset += record_size(header.len);
+        }
+        return found;
+    }
+
+    auto valid(check::Random &rng, int count) -> void
+    {
+        std::vector<uint8_t> sector;
+        std::vector<Written> written;
+        for (int i = 0; i < count; i++)
+        {
+            random_sector(rng, sector, written);
+            uint32_t seq;
+            CHECK(read_sector(sector.data(), &seq));
+            const auto found = walk(sector);
+            CHECK(found.size() == written.size());
+            for (size_t j = 0; j < found.size() && j < written.size(); j++)
+            {
+                CHECK(found[j].first == written[j].in_sector);
+                CHECK(found[j].second == (written[j].popped ? Record::POPPED : Record::LIVE));
+            }
+        }
+    }
+
+    // Flipped bits and a torn tail: the records in front of the damage read back as they were
+    auto damaged(check::Random &rng, int count) -> void
+    {
+        std::vector<uint8_t> sector;
+        std::vector<Written> written;
+        for (int i = 0; i < count; i++)
+        {
+            random_sector(rng, sector, written);
+            const auto first_damage = FIRST_RECORD + rng.below(SECTOR_SIZE - FIRST_RECORD);
+            if (rng.below(2) == 0)
+                memset(sector.data() + first_damage, 0xFF, SECTOR_SIZE - first_damage); // Power cut before the rest was written
+            else
+                for (auto flips = 1 + rng.below(8), at = first_damage; flips > 0 && at < SECTOR_SIZE; flips--, at += rng.below(256))
+                    sector[at] ^= 1 << rng.below(8);
+
+            const auto found = walk(sector);
+            for (size_t j = 0; j < written.size() && written[j].in_sector + record_size(written[j].payload.size()) <= first_damage; j++)
+            {
+                CHECK(j < found.size() && found[j].first == written[j].in_sector);
+                CHECK(j < found.size() && found[j].second == (written[j].popped ? Record::POPPED : Record::LIVE));
+            }
+        }
+    }
+
+    // Random bytes, with a record magic planted now and then
+    auto noise(check::Random &rng, int count) -> void
+    {
+        std::vector<uint8_t> sector(SECTOR_SIZE);
+        for (int i = 0; i < count; i++)
+        {
+            for (auto &b : sector)
+                b = rng.below(256);
+            for (auto at = FIRST_RECORD; at + sizeof(RECORD_MAGIC) <= SECTOR_SIZE; at += 4)
+                if (rng.below(4) == 0)
+                    memcpy(sector.data() + at, &RECORD_MAGIC, sizeof(RECORD_MAGIC));
+            uint32_t seq;
+            read_sector(sector.data(), &seq);
+            walk(sector);
+        }
+    }
+
+    // Ids grow with the offset inside a sector and from one sector to the next
+    auto ids(check::Random &rng, int count) -> void
+    {
+        for (int i = 0; i < count; i++)
+        {
+            const auto seq = rng.below(1 << 20);
+            const auto in_sector = FIRST_RECORD + rng.below(SECTOR_SIZE - FIRST_RECORD - 4) / 4 * 4;
+            CHECK(record_id(seq, in_sector) < record_id(seq, in_sector + 4));
+            CHECK(record_id(seq, SECTOR_SIZE - 4) < record_id(seq + 1, FIRST_RECORD));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const auto count = argc > 1 ? atoi(argv[1]) : 2000;
+    check::Random rng = {4242};
+    valid(rng, count);
+    damaged(rng, count);
+    noise(rng, count);
+    ids(rng, count);
+    return check::result();
+}
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+# Runs modem_host as the host side of the UART would see it: lines go in on stdin, answers come back on stdout.
+# Payloads that follow "DATA <len>" lines are read as bytes and attached to the line they belong to.
+# After framed() the link uses binary frames, answers are turned back into the lines they stand for.
+import os
+import queue
+import re
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+
+PAYLOAD_LINES = [
+    re.compile(rb'^ESP_RESP (?:\d+ )?DATA (\d+)$'),
+    re.compile(rb'^ESP_EVT SOCK \d+ DATA (\d+)$'),
+    re.compile(rb'^ESP_EVT MQTT (?:MSG \S+|PART \d+ \d+) (\d+)$'),
+]
+
+
+FRAME_MAGIC = b'\xe5\x1a'
+CMD_HTTP = 0x03
+CMD_ASYNC = 0x04
+CMD_STATS = 0x07
+CMD_CLOSE = 0x10
+CMD_RESP = 0x80
+CMD_DATA = 0x81
+CMD_EVT = 0x82
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE, as in frames.cpp"""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def encode_frame(cmd_id, args=(), data=b''):
+    table = b''.join(a.encode() + b'\0' for a in args)
+    body = struct.pack('<BBHH', cmd_id, len(args), len(table), len(data)) + table + data
+    return FRAME_MAGIC + body + struct.pack('<H', crc16(body))
+
+
+def read_frame(out):
+    """Next frame from a stream as (cmd_id, args, data), None at the end"""
+    window = b''
+    while window != FRAME_MAGIC:
+        byte = out.read(1)
+        if not byte:
+            return None
+        window = (window + byte)[-2:]
+    header = out.read(6)
+    cmd_id, argc, args_size, data_len = struct.unpack('<BBHH', header)
+    rest = out.read(args_size + data_len + 2)
+    if crc16(header + rest[:-2]) != struct.unpack('<H', rest[-2:])[0]:
+        raise ValueError('bad frame CRC from the modem')
+    args = [a.decode() for a in rest[:args_size].split(b'\0')[:argc]]
+    return cmd_id, args, rest[args_size:args_size + data_len]
+
+
+class Line:
+    def __init__(self, text, payload=b''):
+        self.text = text
+        self.payload = payload
+        self.at = time.monotonic()
+
+    def __repr__(self):
+        return 'Line(%r, %d bytes)' % (self.text, len(self.payload))
+
+
+class Modem:
+    def __init__(self, binary, storage=None, env=None, log=None):
+        self.storage = storage or tempfile.mkdtemp(prefix='modem_flash_')
+        full_env = dict(os.environ, MODEM_STORAGE_DIR=self.storage)
+        full_env.update(env or {})
+        self.log = open(log or os.devnull, 'ab')
+        self.process = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=self.log, env=full_env, bufsize=0)
+        self.lines = queue.Queue()
+        self.switching = False  # The next "ESP_RESP OK" is the last line before frames
+        self.framing = False
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _read_frame(self, out):
+        frame = read_frame(out)
+        if frame is None:
+            self.lines.put(None)
+            return False
+        cmd_id, args, data = frame
+        tag = ' '.join(['ESP_RESP'] + args)
+        if cmd_id == CMD_RESP:
+            self.lines.put(Line('%s %s' % (tag, data.decode(errors='replace'))))
+        elif cmd_id == CMD_DATA:
+            self.lines.put(Line('%s DATA %d' % (tag, len(data)), data))
+        elif cmd_id == CMD_EVT and args:
+            self.lines.put(Line('ESP_EVT %s %d' % (args[0], len(data)), data))
+        else:
+            self.lines.put(Line('ESP_EVT ' + data.decode(errors='replace')))
+        return True
+
+    def _read(self):
+        out = self.process.stdout
+        while True:
+            if self.framing:
+                if not self._read_frame(out):
+                    return
+                continue
+            raw = out.readline()
+            if not raw:
+                self.lines.put(None)
+                return
+            raw = raw.rstrip(b'\r\n')
+            if self.switching and raw == b'ESP_RESP OK':
+                self.switching = False
+                self.framing = True
+            payload = b''
+            for pattern in PAYLOAD_LINES:
+                match = pattern.match(raw)
+                if match:
+                    payload = out.read(int(match.group(1)))
+                    break
+            self.lines.put(Line(raw.decode(errors='replace'), payload))
+
+    def send(self, text):
+        data = text.encode() if isinstance(text, str) else text
+        self.process.stdin.write(data if data.endswith(b'\n') else data + b'\n')
+
+    def write(self, data):
+        self.process.stdin.write(data)
+
+    def framed(self):
+        """Switches the link to binary frames"""
+        self.switching = True
+        self.command('FRAMED')
+
+    def send_frame(self, cmd_id, args=(), data=b''):
+        self.process.stdin.write(encode_frame(cmd_id, args, data))
+
+    def next(self, timeout=10):
+        line = self.lines.get(timeout=timeout)
+        if line is None:
+            raise EOFError('modem_host exited with %s' % self.process.wait())
+        return line
+
+    def wait_for(self, predicate, timeout=10):
+        """Lines up to and including the first one "predicate" accepts (a string matches as a prefix)"""
+        if isinstance(predicate, str):
+            prefix = predicate
+            predicate = lambda line: line.text.startswith(prefix)
+        deadline = time.monotonic() + timeout
+        seen = []
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise TimeoutError('no match after %r' % seen[-5:])
+            line = self.next(left)
+            seen.append(line)
+            if predicate(line):
+                return seen
+
+    def command(self, text, timeout=10, final=('ESP_RESP OK', 'ESP_RESP FAIL')):
+        """Sends a synchronous command and returns every line up to its final answer"""
+        self.send('ESP_CMD ' + text)
+        return self.wait_for(lambda line: line.text in final or line.text.startswith('ESP_RESP QUEUED'), timeout)
+
+    def boot(self, timeout=10):
+        return self.wait_for('ESP_RESP BOOTED', timeout)
+
+    def connect_wifi(self, ssid, password, timeout=10):
+        self.command('PROFILE ADD %s %s' % (ssid, password))
+        self.command('CONNECT')
+        self.wait_for('ESP_EVT WIFI UP', timeout)
+
+    def close(self, timeout=5):
+        if self.process.poll() is None:
+            try:
+                self.process.stdin.close()
+            except BrokenPipeError:
+                pass
+            try:
+                self.process.wait(timeout)
+            except subprocess.TimeoutExpired:
+                self.process.kill()
+                self.process.wait()
+        self.log.close()
+        return self.process.returncode
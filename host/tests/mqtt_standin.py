@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+# Local stand-in for an MQTT 3.1.1 broker, enough for the modem's client: CONNECT, PUBLISH at QoS 0 / 1,
+# SUBSCRIBE / UNSUBSCRIBE with "+" and "#" filters, PINGREQ and DISCONNECT. No sessions, no retained messages.
+#   published            every PUBLISH received, as (topic, payload) in arrival order
+#   subscribe_count      SUBSCRIBE packets received (a reconnecting client subscribes again)
+#   inject(topic, data)  publishes to the matching subscribers as if another client had
+#   stop() / start()     the broker goes away (connections dropped) and comes back on the same port
+# Run on its own it prints "PORT <n>" and serves until killed.
+import socket
+import struct
+import sys
+import threading
+
+CONNECT, CONNACK, PUBLISH, PUBACK, SUBSCRIBE, SUBACK = 0x10, 0x20, 0x30, 0x40, 0x80, 0x90
+UNSUBSCRIBE, UNSUBACK, PINGREQ, PINGRESP, DISCONNECT = 0xA0, 0xB0, 0xC0, 0xD0, 0xE0
+
+
+def packet(first, body=b''):
+    length = b''
+    n = len(body)
+    while True:
+        digit, n = n % 128, n // 128
+        length += bytes([digit | (0x80 if n else 0)])
+        if not n:
+            return bytes([first]) + length + body
+
+
+def string(text):
+    data = text.encode()
+    return struct.pack('>H', len(data)) + data
+
+
+def matches(topic_filter, topic):
+    parts, words = topic_filter.split('/'), topic.split('/')
+    for i, part in enumerate(parts):
+        if part == '#':
+            return True
+        if i >= len(words) or (part != '+' and part != words[i]):
+            return False
+    return len(parts) == len(words)
+
+
+class Session:
+    def __init__(self, broker, sock):
+        self.broker = broker
+        self.sock = sock
+        self.filters = {}  # Filter -> granted QoS
+        self.write_lock = threading.Lock()
+        self.next_id = 0
+
+    def read_exact(self, n):
+        data = b''
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return data
+
+    def read_packet(self):
+        first = self.read_exact(1)[0]
+        length, shift = 0, 0
+        while True:
+            digit = self.read_exact(1)[0]
+            length |= (digit & 0x7F) << shift
+            shift += 7
+            if not digit & 0x80:
+                break
+        return first, self.read_exact(length) if length else b''
+
+    def send(self, data):
+        with self.write_lock:
+            self.sock.sendall(data)
+
+    def deliver(self, topic, payload, qos):
+        body = string(topic)
+        if qos:
+            with self.write_lock:
+                self.next_id = self.next_id % 0xFFFF + 1
+                msg_id = self.next_id
+            body += struct.pack('>H', msg_id)
+        self.send(packet(PUBLISH | qos << 1, body + payload))
+
+    def run(self):
+        try:
+            first, _ = self.read_packet()
+            if first != CONNECT:
+                return
+            self.send(packet(CONNACK, b'\x00\x00'))
+            while True:
+                first, body = self.read_packet()
+                kind = first & 0xF0
+                if kind == PUBLISH:
+                    qos = (first >> 1) & 0x03
+                    topic_len = struct.unpack('>H', body[:2])[0]
+                    topic = body[2:2 + topic_len].decode()
+                    pos = 2 + topic_len
+                    if qos:
+                        msg_id = body[pos:pos + 2]
+                        pos += 2
+                    self.broker.received(topic, body[pos:], qos)
+                    if qos:
+                        self.send(packet(PUBACK, msg_id))
+                elif kind == SUBSCRIBE:
+                    msg_id, pos, granted = body[:2], 2, b''
+                    while pos < len(body):
+                        n = struct.unpack('>H', body[pos:pos + 2])[0]
+                        topic_filter, qos = body[pos + 2:pos + 2 + n].decode(), min(body[pos + 2 + n], 1)
+                        self.filters[topic_filter] = qos
+                        granted += bytes([qos])
+                        pos += 3 + n
+                    self.broker.count('subscribe_count')
+                    self.send(packet(SUBACK, msg_id + granted))
+                elif kind == UNSUBSCRIBE:
+                    msg_id, pos = body[:2], 2
+                    while pos < len(body):
+                        n = struct.unpack('>H', body[pos:pos + 2])[0]
+                        self.filters.pop(body[pos + 2:pos + 2 + n].decode(), None)
+                        pos += 2 + n
+                    self.send(packet(UNSUBACK, msg_id))
+                elif kind == PINGREQ:
+                    self.send(packet(PINGRESP))
+                elif kind == DISCONNECT:
+                    return
+        except (EOFError, OSError):
+            pass
+        finally:
+            self.broker.forget(self)
+
+
+class MqttStandIn:
+    def __init__(self, port=0):
+        self.lock = threading.Lock()
+        self.sessions = []
+        self.published = []
+        self.subscribe_count = 0
+        self.listener = None
+        self.port = port
+
+    def start(self):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(('127.0.0.1', self.port))
+        self.listener.listen(8)
+        self.port = self.listener.getsockname()[1]
+        threading.Thread(target=self._accept, args=(self.listener,), daemon=True).start()
+        return self
+
+    def stop(self):
+        """Stops listening and hangs up on every client"""
+        try:
+            self.listener.shutdown(socket.SHUT_RDWR)  # Wakes the accepting thread, closing alone would not
+        except OSError:
+            pass
+        self.listener.close()
+        with self.lock:
+            sessions, self.sessions = self.sessions, []
+        for s in sessions:
+            try:
+                s.sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def _accept(self, listener):
+        while True:
+            try:
+                sock, _ = listener.accept()
+            except OSError:
+                return
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            session = Session(self, sock)
+            with self.lock:
+                self.sessions.append(session)
+            threading.Thread(target=session.run, daemon=True).start()
+
+    def forget(self, session):
+        with self.lock:
+            if session in self.sessions:
+                self.sessions.remove(session)
+        session.sock.close()
+
+    def count(self, name):
+        with self.lock:
+            setattr(self, name, getattr(self, name) + 1)
+
+    def received(self, topic, payload, qos):
+        with self.lock:
+            self.published.append((topic, payload))
+        self.inject(topic, payload, qos)
+
+    def inject(self, topic, payload, qos=0):
+        with self.lock:
+            targets = [(s, q) for s in self.sessions for f, q in list(s.filters.items()) if matches(f, topic)]
+        for session, granted in targets:
+            try:
+                session.deliver(topic, payload, min(qos, granted))
+            except OSError:
+                pass
+
+    def connected(self):
+        with self.lock:
+            return len(self.sessions)
+
+
+if __name__ == '__main__':
+    broker = MqttStandIn(int(sys.argv[1]) if len(sys.argv) > 1 else 0).start()
+    print('PORT', broker.port, flush=True)
+    threading.Event().wait()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+# MQTT against the local broker stand-in: publish / subscribe loopback, messages larger than the client
+# buffer arriving in parts, the offline queue (RAM, then the flash spool) replayed in order once the broker
+# is back, and DISCONNECT racing publishes running on the workers.
+import argparse
+import sys
+import time
+
+from modem_process import Modem
+from mqtt_standin import MqttStandIn
+
+FINAL = ('ESP_RESP OK', 'ESP_RESP FAIL', 'ESP_RESP QUEUED')
+
+
+class Test:
+    def __init__(self, modem, broker):
+        self.modem = modem
+        self.broker = broker
+        self.failures = 0
+
+    def expect(self, what, ok):
+        print('%-58s %s' % (what, 'ok' if ok else 'FAILED'))
+        self.failures += 0 if ok else 1
+
+    def publish(self, topic, payload, qos=1):
+        """Final answer to MQTT PUB with "payload" streamed after the command"""
+        self.modem.send('ESP_CMD MQTT PUB %s %d ESP_DATA_STREAM %d' % (topic, qos, len(payload)))
+        self.modem.write(payload)
+        return self.modem.wait_for(lambda line: line.text in FINAL)[-1].text
+
+    def status(self):
+        lines = self.modem.command('MQTT STATUS')  # Messages from the subscription may come in between
+        line = [l.text for l in lines if l.text.startswith('ESP_RESP MQTT state=')][0]
+        return dict(field.split('=', 1) for field in line.split()[2:])
+
+    def wait(self, condition, timeout=10):
+        deadline = time.monotonic() + timeout
+        while not condition():
+            if time.monotonic() > deadline:
+                return False
+            time.sleep(0.05)
+        return True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    broker = MqttStandIn().start()
+    modem = Modem(args.binary, env={'MODEM_NETWORKS': 'TestNet:testpass1:1:-40'})
+    t = Test(modem, broker)
+    uri = 'mqtt://127.0.0.1:%d' % broker.port
+    try:
+        modem.boot()
+        modem.connect_wifi('TestNet', 'testpass1')
+
+        t.expect('MQTT CONNECT answers OK', modem.command('MQTT CONNECT %s modem-test' % uri)[-1].text == 'ESP_RESP OK')
+        modem.wait_for('ESP_EVT MQTT UP')
+        t.expect('MQTT SUB answers OK', modem.command('MQTT SUB sensors/+ 1')[-1].text == 'ESP_RESP OK')
+        t.wait(lambda: broker.subscribe_count == 1)
+
+        t.expect('a publish goes straight out', t.publish('sensors/a', b'hello') == 'ESP_RESP OK')
+        msg = modem.wait_for('ESP_EVT MQTT MSG')[-1]
+        t.expect('and comes back to the subscription', msg.text == 'ESP_EVT MQTT MSG sensors/a 5' and msg.payload == b'hello')
+        t.expect('the broker got it once', broker.published == [('sensors/a', b'hello')])
+
+        # Larger than the client buffer: the first part carries the topic, the others their offset
+        big = bytes(i % 251 for i in range(2500))
+        broker.inject('sensors/big', big, 1)
+        lines = modem.wait_for('ESP_EVT MQTT PART 2048 2500')
+        parts = [l for l in lines if l.text.startswith('ESP_EVT MQTT')]
+        t.expect('a large message arrives in parts', len(parts) == 3 and parts[0].text.startswith('ESP_EVT MQTT MSG sensors/big'))
+        t.expect('which add up to the message', b''.join(p.payload for p in parts) == big)
+
+        # The broker goes away: publishes are queued, the ones past the RAM queue in the flash spool
+        broker.stop()
+        modem.wait_for('ESP_EVT MQTT DOWN')
+        sent = [('sensors/q%d' % i, b'queued %d' % i) for i in range(12)]
+        answers = [t.publish(topic, payload) for topic, payload in sent]
+        t.expect('offline publishes answer QUEUED', all(a == 'ESP_RESP QUEUED' for a in answers))
+        status = t.status()
+        t.expect('4 wait in RAM, 8 in flash', status.get('ram') == '4' and status.get('flash') == '8')
+
+        broker.published.clear()
+        broker.start()
+        modem.wait_for('ESP_EVT MQTT UP')
+        t.wait(lambda: len(broker.published) >= len(sent))
+        t.expect('the queue is replayed in order once the broker is back', broker.published == sent)
+        t.expect('the subscription is restored on reconnect', broker.subscribe_count == 2)
+        t.expect('nothing is left in the queues', t.wait(lambda: t.status() == {'state': 'UP', 'ram': '0', 'flash': '0', 'dropped': '0'}))
+
+        # DISCONNECT while publishes run on the workers: every command is answered, the link ends up down
+        for i in range(8):
+            modem.send('ESP_CMD ASYNC %d MQTT PUB sensors/r 0 ESP_DATA_BEGIN' % (100 + i))
+            modem.send('racing %d' % i)
+            modem.send('ESP_DATA_END')
+        modem.send('ESP_CMD MQTT DISCONNECT')
+        answered = set()
+        disconnected = False
+        while len(answered) < 8 or not disconnected:
+            text = modem.next(timeout=15).text
+            if text.startswith('ESP_RESP 10'):
+                answered.add(text.split()[1])
+            disconnected = disconnected or text == 'ESP_RESP OK'
+        t.expect('publishes racing DISCONNECT are all answered', len(answered) == 8)
+        t.expect('the link is down afterwards', t.status().get('state') == 'DOWN')
+        t.expect('PUB without a connection fails', t.publish('sensors/x', b'x') == 'ESP_RESP FAIL')
+    finally:
+        code = modem.close()
+        broker.stop()
+    return 0 if code == 0 and t.failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+# Firmware update with tools/ota_upload.py over the modem's pipe: lost and corrupted blocks are sent again,
+# a modem killed in the middle of the transfer resumes from the point it saved in NVS, and the slot ends up
+# holding the image, which boots on the next start.
+import argparse
+import os
+import queue
+import random
+import struct
+import sys
+import zlib
+
+from modem_process import Modem
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'tools'))
+import ota_upload  # noqa: E402
+
+IMAGE_SIZE = 200 * 1024 + 123
+KILL_AT = 150 * 1024       # Past the second resume point (saved every 64 KB)
+STALL_TIMEOUT = 2          # Seconds before a lost block makes the tool start again with BEGIN
+APP_DESC_MAGIC = 0xABCD5432
+SLOT = 'ota_1'             # modem_host runs from ota_0
+
+
+class Test:
+    def __init__(self):
+        self.failures = 0
+
+    def expect(self, what, ok):
+        print('%-58s %s' % (what, 'ok' if ok else 'FAILED'))
+        self.failures += 0 if ok else 1
+
+
+class Killed(Exception):
+    pass
+
+
+class PipePort:
+    """What ota_upload expects of a serial port, on top of the modem's stdin / stdout. Blocks listed in "lose"
+    never arrive and the ones in "corrupt" get a flipped bit (counted by the order they are sent in)."""
+
+    def __init__(self, modem, lose=(), corrupt=()):
+        self.modem = modem
+        self.lose = set(lose)
+        self.corrupt = set(corrupt)
+        self.blocks = 0
+        self.begins = 0
+
+    def write(self, data):
+        self.begins += 1 if b' OTA BEGIN ' in data else 0
+        if b' OTA WRITE ' in data:
+            self.blocks += 1
+            if self.blocks in self.lose:
+                return
+            if self.blocks in self.corrupt:
+                data = bytearray(data)
+                data[-1] ^= 0x01
+                data = bytes(data)
+        self.modem.write(data)
+
+    def readline(self):
+        try:
+            return (self.modem.next(timeout=0.5).text + '\n').encode()
+        except queue.Empty:
+            return b''
+
+
+class PipeLink(ota_upload.Link):
+    def answer(self, timeout=STALL_TIMEOUT):
+        return super().answer(timeout)
+
+
+def make_image():
+    """Random bytes behind an app image header and a description the fake bootloader reads back"""
+    rng = random.Random(25)
+    image = bytearray(rng.getrandbits(8) for _ in range(IMAGE_SIZE))
+    image[0] = 0xE9
+    desc = struct.pack('<II8x32s', APP_DESC_MAGIC, 0, b'ota-test')
+    image[0x20:0x20 + len(desc)] = desc
+    return bytes(image)
+
+
+def upload(transfer, progress=lambda offset: None):
+    """Runs the tool's transfer the way its main() does, returns the offset the modem started at"""
+    first = None
+    for _ in range(ota_upload.MAX_STALLS):
+        offset = transfer.begin()
+        first = offset if first is None else first
+        if transfer.transfer(offset, progress):
+            return first
+    raise RuntimeError('transfer stalled')
+
+
+def resume_point(storage):
+    """(offset, prefix CRC) of the resume point saved by components/ota, None without one"""
+    path = os.path.join(storage, 'nvs', 'ota', 'resume.blob')
+    if not os.path.exists(path):
+        return None
+    with open(path, 'rb') as f:
+        _, _, _, offset, crc = struct.unpack('<5I', f.read())
+    return offset, crc
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    image = make_image()
+    modem = Modem(args.binary)
+    t = Test()
+    try:
+        modem.boot()
+
+        # First attempt: a few blocks lost or corrupted, then the modem dies
+        port = PipePort(modem, lose=(7, 90), corrupt=(3, 41, 42))
+        transfer = ota_upload.Upload(PipeLink(port), image, 0, 0)
+
+        def kill(offset):
+            if offset >= KILL_AT:
+                modem.process.kill()
+                raise Killed()
+        try:
+            upload(transfer, kill)
+            t.expect('the modem was killed during the transfer', False)
+        except Killed:
+            pass
+        t.expect('corrupted blocks are sent again', transfer.resent >= 2)
+        t.expect('a lost block makes the tool start again with BEGIN', port.begins >= 3)
+        modem.close()
+        point = resume_point(modem.storage)
+        t.expect('a resume point was saved', point is not None and 0 < point[0] <= KILL_AT)
+        t.expect('the resume point covers what is in the slot', point is not None and zlib.crc32(image[:point[0]]) == point[1])
+
+        # Second attempt on the restarted modem goes on from the saved point
+        modem = Modem(args.binary, storage=modem.storage)
+        modem.boot()
+        port = PipePort(modem, corrupt=(5,))
+        transfer = ota_upload.Upload(PipeLink(port), image, 0, 0)
+        first = upload(transfer)
+        t.expect('the transfer resumes at the saved point', point is not None and first == point[0])
+        t.expect('a corrupted block after the restart is sent again', transfer.resent == 1)
+        rest = (IMAGE_SIZE - first + transfer.block - 1) // transfer.block
+        t.expect('only the rest of the image is sent', port.blocks <= rest + transfer.window)
+        answer = transfer.link.command('OTA END')
+        t.expect('OTA END answers DONE <sent> <ms> <rate>', answer is not None and answer.startswith('DONE ') and
+                 int(answer.split()[1]) == IMAGE_SIZE - first)
+        t.expect('the modem restarts into the new image', modem.process.wait(10) == 3)
+        modem.close()
+        with open(os.path.join(modem.storage, SLOT + '.bin'), 'rb') as f:
+            t.expect('the slot holds the image', f.read(IMAGE_SIZE) == image)
+        t.expect('the resume point is gone', resume_point(modem.storage) is None)
+
+        modem = Modem(args.binary, storage=modem.storage)
+        modem.boot()
+        status = [line.text for line in modem.command('OTA STATUS')]
+        t.expect('the new image runs', 'ESP_RESP OTA slot=%s state=VALID version=ota-test' % SLOT in status)
+    finally:
+        code = modem.close()
+    return 0 if code == 0 and t.failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
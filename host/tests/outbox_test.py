@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+# Outbox against the local stand-in: requests that fail while the server is down are queued in flash,
+# survive a restart of the modem, and are delivered in order once the link and the server are back.
+# QUEUE DRAIN skips the backoff. FWD and streamed requests are never queued.
+import argparse
+import re
+import sys
+import time
+
+from http_standin import StandIn
+from modem_process import Modem
+
+
+class Test:
+    def __init__(self):
+        self.failures = 0
+
+    def expect(self, what, ok):
+        print('%-58s %s' % (what, 'ok' if ok else 'FAILED'))
+        self.failures += 0 if ok else 1
+
+
+def post(modem, path, body, options=''):
+    """Final answer to an HTTP POST with "body" sent inline"""
+    modem.send('ESP_CMD HTTP POST 127.0.0.1 %s%s ESP_DATA_BEGIN' % (path, options))
+    modem.send(body)
+    modem.send('ESP_DATA_END')
+    final = ('ESP_RESP OK', 'ESP_RESP FAIL', 'ESP_RESP NOLINK')
+    return modem.wait_for(lambda line: line.text in final or line.text.startswith('ESP_RESP QUEUED'))[-1].text
+
+
+def queued_id(answer):
+    match = re.match(r'^ESP_RESP QUEUED (\d+)$', answer)
+    return int(match.group(1)) if match else None
+
+
+def queue_status(modem):
+    line = [l.text for l in modem.command('QUEUE STATUS') if l.text.startswith('ESP_RESP QUEUE ')][0]
+    return dict(field.split('=', 1) for field in line.split()[2:])
+
+
+def sent_events(modem, count, seen=(), timeout=15):
+    """(id, status) of the next "count" deliveries, the ones among the lines already "seen" first"""
+    lines = [line for line in seen if line.text.startswith('ESP_EVT QUEUE SENT')]
+    while len(lines) < count:
+        lines.append(modem.wait_for('ESP_EVT QUEUE SENT', timeout)[-1])
+    return [(int(line.text.split()[3]), int(line.text.split()[4])) for line in lines]
+
+
+def wait_for_retries(modem, retries, timeout=10):
+    deadline = time.monotonic() + timeout
+    while int(queue_status(modem)['retries']) < retries:
+        if time.monotonic() > deadline:
+            return False
+        time.sleep(0.1)
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    # Take a free port for the server that is not running yet
+    server = StandIn()
+    port = server.port
+    server.server_close()
+
+    env = {'MODEM_NETWORKS': 'TestNet:testpass1:1:-40', 'MODEM_HTTP_PORT': str(port)}
+    modem = Modem(args.binary, env=env)
+    t = Test()
+    try:
+        modem.boot()
+        modem.connect_wifi('TestNet', 'testpass1')
+
+        bodies = [b'{"reading":%d}' % i for i in range(3)]
+        ids = [queued_id(post(modem, '/echo', body.decode())) for body in bodies]
+        t.expect('a POST to a server that is down is QUEUED', all(i is not None for i in ids))
+        t.expect('ids grow in the order of the requests', ids == sorted(set(ids)))
+        t.expect('QUEUE STATUS counts them', queue_status(modem).get('pending') == '3')
+        t.expect('FWD requests are not queued', post(modem, '/echo', 'x', ' FWD') == 'ESP_RESP FAIL')
+        modem.send('ESP_CMD HTTP POST 127.0.0.1 /echo ESP_DATA_STREAM 5')
+        modem.write(b'x' * 5)
+        final = modem.wait_for(lambda line: line.text in ('ESP_RESP FAIL', 'ESP_RESP OK') or 'QUEUED' in line.text)[-1].text
+        t.expect('streamed requests are not queued', final == 'ESP_RESP FAIL')
+
+        t.expect('failed deliveries back off', wait_for_retries(modem, 2) and queue_status(modem).get('state') == 'BACKOFF')
+
+        # The queue is in flash: a restarted modem still has it, and adds to it while it has no link
+        t.expect('the modem stops cleanly', modem.close() == 0)
+        modem = Modem(args.binary, storage=modem.storage, env=env)
+        modem.boot()
+        t.expect('the queue survives a restart', queue_status(modem).get('pending') == '3')
+        ids.append(queued_id(post(modem, '/echo', 'offline')))
+        bodies.append(b'offline')
+        t.expect('a POST without a link is QUEUED', ids[-1] is not None and queue_status(modem).get('pending') == '4')
+
+        server = StandIn(port).start()
+        time.sleep(0.5)
+        t.expect('nothing is sent before there is a link', server.bodies == [] and queue_status(modem).get('pending') == '4')
+        seen = modem.command('CONNECT') + modem.wait_for('ESP_EVT WIFI UP')  # The profile is still stored
+        t.expect('the link coming up delivers the queue, oldest first', sent_events(modem, 4, seen) == [(i, 200) for i in ids])
+        t.expect('the server got every body once, in order', [b for p, b in server.bodies if p == '/echo'] == bodies)
+        t.expect('the queue is empty afterwards', queue_status(modem).get('pending') == '0')
+
+        # QUEUE DRAIN cuts the backoff short once the server is back
+        server.shutdown()
+        server.server_close()
+        server.drop_connections()
+        retries = int(queue_status(modem)['retries'])
+        late = queued_id(post(modem, '/echo', 'late'))
+        t.expect('the server going away queues the next POST', late is not None)
+        wait_for_retries(modem, retries + 2)  # The next attempt is 4 s away
+        server = StandIn(port).start()
+        modem.command('QUEUE DRAIN')
+        t.expect('QUEUE DRAIN delivers without waiting out the backoff', sent_events(modem, 1, timeout=3) == [(late, 200)])
+    finally:
+        code = modem.close()
+        server.server_close()
+    return 0 if code == 0 and t.failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
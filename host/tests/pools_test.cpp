@@ -0,0 +1,151 @@
+// Block pools and arenas: exhaustion, the peak and failure counters, the general pools handing out the
+// smallest block that fits, arena alignment and overflow, and take / give racing from several threads.
+//   pools_test [iterations per thread]
+#include "stdlib.h"
+#include "string.h"
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "pools.hpp"
+#include "check.hpp"
+
+namespace
+{
+    pools::StaticPool<64, 4> small_pool("test4");
+    pools::StaticPool<32, 32> full_mask_pool("test32");
+    pools::StaticPool<16, 8> shared_pool("shared");
+
+    auto usage_of(const char *name) -> pools::Usage
+    {
+        pools::Usage u = {};
+        for (uint8_t i = 0; pools::usage(i, &u); i++)
+            if (strcmp(u.name, name) == 0)
+                return u;
+        CHECK(!"pool is registered");
+        return pools::Usage{};
+    }
+
+    // Every block once, aligned and inside the pool, then NULL
+    template <typename P>
+    auto exhaust(P &pool, uint8_t count) -> std::vector<void *>
+    {
+        std::vector<void *> blocks;
+        std::set<void *> distinct;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const auto block = pool.take();
+            CHECK(block != NULL && pool.owns(block) && (uintptr_t)block % pools::ALIGN == 0);
+            blocks.push_back(block);
+            distinct.insert(block);
+        }
+        CHECK(distinct.size() == count);
+        CHECK(pool.take() == NULL);
+        return blocks;
+    }
+
+    auto static_pool() -> void
+    {
+        auto blocks = exhaust(small_pool, 4);
+        auto u = usage_of("test4");
+        CHECK(u.block_size == 64 && u.count == 4 && u.used == 4 && u.peak == 4 && u.failures == 1);
+        for (const auto block : blocks)
+            memset(block, 0xAB, 64); // Blocks do not overlap
+        small_pool.give(blocks[1]);
+        const auto again = small_pool.take();
+        CHECK(again == blocks[1]);
+        for (const auto block : blocks)
+            small_pool.give(block);
+        u = usage_of("test4");
+        CHECK(u.used == 0 && u.peak == 4 && u.failures == 1); // The watermark stays
+
+        int local;
+        CHECK(!small_pool.owns(&local));
+        for (const auto block : exhaust(full_mask_pool, 32))
+            full_mask_pool.give(block);
+        CHECK(usage_of("test32").used == 0);
+    }
+
+    // The general pools hand out the smallest block that fits, and a larger one once those are gone
+    auto general_pools() -> void
+    {
+        pools::Usage small = usage_of("small"), large = usage_of("large");
+        size_t capacity = 0;
+        const auto a = pools::take(100, &capacity);
+        CHECK(a != NULL && capacity == small.block_size);
+        const auto b = pools::take(small.block_size + 1, &capacity);
+        CHECK(b != NULL && capacity == large.block_size);
+        CHECK(pools::take(large.block_size + 1) == NULL);
+        pools::give(a);
+        pools::give(b);
+        pools::give(NULL);
+
+        std::vector<void *> taken;
+        for (uint8_t i = 0; i < small.count; i++)
+            taken.push_back(pools::take(1));
+        CHECK(usage_of("small").used == small.count);
+        const auto spill = pools::take(1, &capacity);
+        CHECK(spill != NULL && capacity == large.block_size);
+        CHECK(usage_of("small").failures > small.failures);
+        pools::give(spill);
+        for (const auto block : taken)
+            pools::give(block);
+        CHECK(usage_of("small").used == 0 && usage_of("large").used == 0);
+    }
+
+    // Every piece is aligned for any type: clone() keeps the argument pointer table in an arena
+    auto arena() -> void
+    {
+        constexpr auto A = pools::ALIGN;
+        alignas(A) uint8_t block[8 * A];
+        pools::Arena a(block, sizeof(block));
+        const auto first = (uint8_t *)a.alloc(1);
+        const auto second = (uint8_t *)a.alloc(3);
+        CHECK(first == block && second == block + A && a.used() == A + 3);
+        const auto table = (char **)a.alloc(3 * sizeof(char *));
+        CHECK((uint8_t *)table == block + 2 * A && (uintptr_t)table % alignof(char *) == 0);
+        const auto free_from = (a.used() + A - 1) / A * A;
+        CHECK(a.alloc(sizeof(block) - free_from + 1) == NULL && a.used() == 2 * A + 3 * sizeof(char *)); // A failed alloc takes nothing
+        CHECK(a.alloc(sizeof(block) - free_from) == block + free_from && a.used() == sizeof(block));
+        CHECK(a.alloc(0) == block + sizeof(block) && a.alloc(1) == NULL);
+    }
+
+    // Threads take and give the same pool: a block is never handed out twice, and all of them come back
+    auto threads(int iterations) -> void
+    {
+        std::atomic<int> collisions = {0};
+        std::vector<std::thread> workers;
+        for (uint8_t t = 0; t < 4; t++)
+            workers.emplace_back([&, t] {
+                check::Random rng = {t + 1u};
+                for (int i = 0; i < iterations; i++)
+                {
+                    const auto block = (uint8_t *)shared_pool.take();
+                    if (block == NULL)
+                        continue;
+                    memset(block, t, 16);
+                    for (auto spin = rng.below(16); spin > 0; spin--)
+                        std::this_thread::yield();
+                    for (int j = 0; j < 16; j++)
+                        if (block[j] != t)
+                            collisions += 1;
+                    shared_pool.give(block);
+                }
+            });
+        for (auto &w : workers)
+            w.join();
+        const auto u = usage_of("shared");
+        CHECK(collisions == 0);
+        CHECK(u.used == 0 && u.peak <= 8);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static_pool();
+    general_pools();
+    arena();
+    threads(argc > 1 ? atoi(argv[1]) : 20000);
+    return check::result();
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# STATS against known traffic: sample counts per stage, connection reuse, errors charged to the right stage,
+# the link / heap / pool lines, and STATS RESET.
+import argparse
+import sys
+
+from http_standin import StandIn
+from modem_process import Modem
+
+
+def read_stats(modem):
+    """{"PARSE": {"n": .., "p50": .., ...}, ..., "UART": {...}, "HEAP": {...}, "POOL": {...}}"""
+    lines = modem.command('STATS')
+    result = {}
+    for line in lines[:-1]:
+        words = line.text.split()[1:]  # Without "ESP_RESP"
+        if words[0] == 'STAT':
+            name, fields = words[1], words[2:]
+        else:
+            name, fields = words[0], words[1:]
+        result[name] = dict(field.split('=', 1) for field in fields if '=' in field)
+    return result
+
+
+def number(stats, stage, field):
+    return int(stats[stage][field])
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    server = StandIn().start()
+    modem = Modem(args.binary, env={'MODEM_NETWORKS': 'TestNet:testpass1:1:-40', 'MODEM_HTTP_PORT': str(server.port)})
+    failures = 0
+
+    def expect(what, ok):
+        nonlocal failures
+        print('%-52s %s' % (what, 'ok' if ok else 'FAILED'))
+        failures += 0 if ok else 1
+
+    try:
+        modem.boot()
+        modem.connect_wifi('TestNet', 'testpass1')
+        expect('STATS RESET answers OK', modem.command('STATS RESET')[-1].text == 'ESP_RESP OK')
+        stats = read_stats(modem)
+        expect('nothing recorded after a reset', all(number(stats, s, 'n') == 0 for s in ('CONNECT', 'SEND', 'RECEIVE', 'TOTAL')))
+
+        requests = 10
+        for _ in range(requests):
+            modem.command('HTTP GET 127.0.0.1 /bytes/512')
+        stats = read_stats(modem)
+        expect('every command is timed by the parser', number(stats, 'PARSE', 'n') >= requests)
+        expect('one CONNECT sample, the other requests reuse it', number(stats, 'CONNECT', 'n') == 1)
+        expect('SEND, RECEIVE and TOTAL for every request',
+               all(number(stats, s, 'n') == requests for s in ('SEND', 'RECEIVE', 'TOTAL')))
+        expect('p50 <= p99 <= max',
+               all(number(stats, s, 'p50') <= number(stats, s, 'p99') <= number(stats, s, 'max') for s in ('SEND', 'TOTAL')))
+        expect('no errors so far', all(number(stats, s, 'err') == 0 for s in ('CONNECT', 'SEND', 'RECEIVE', 'TOTAL')))
+
+        # Nothing listens there: the error belongs to the connect stage (FWD keeps it out of the outbox)
+        modem.command('HTTP GET 127.0.0.2 /bytes/8 FWD')
+        stats = read_stats(modem)
+        expect('a refused connection counts as a CONNECT error', number(stats, 'CONNECT', 'err') == 1)
+        expect('and as a TOTAL error', number(stats, 'TOTAL', 'err') == 1)
+        expect('but not as a SEND or RECEIVE error', number(stats, 'SEND', 'err') + number(stats, 'RECEIVE', 'err') == 0)
+
+        expect('UART line with baud rate and overruns', 'baud' in stats.get('UART', {}) and 'overruns' in stats['UART'])
+        expect('HEAP line with the watermark', 'min' in stats.get('HEAP', {}))
+        expect('POOL line with the open connection', number(stats, 'POOL', 'open') >= 1)
+
+        modem.command('STATS RESET')
+        stats = read_stats(modem)
+        expect('RESET clears samples and errors', number(stats, 'TOTAL', 'n') == 0 and number(stats, 'CONNECT', 'err') == 0)
+    finally:
+        code = modem.close()
+        server.shutdown()
+    return 0 if code == 0 and failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Link throughput on the host: after "BAUD <rate> [RTSCTS]" a body is streamed to the modem ("ESP_DATA_STREAM")
+# and posted to the local HTTP stand-in, for every rate with and without flow control. modem_host runs with
+# MODEM_UART_PACED=1, so its UART takes as long as the wire would (10 bits a byte) and the numbers show how
+# much of the line rate the command path keeps. Pipes never overflow, flow control costs nothing here.
+import argparse
+import sys
+import time
+
+from http_standin import StandIn
+from modem_process import Modem
+
+RATES = (115200, 460800, 921600, 3000000)
+LINE_SECONDS = 0.5  # Time each body takes on the wire, the body grows with the rate
+
+
+def stream(modem, server, body):
+    """Seconds from the command line to the answer, None if the body did not arrive intact"""
+    started = time.monotonic()
+    modem.send('ESP_CMD HTTP POST 127.0.0.1 /echo ESP_DATA_STREAM %d' % len(body))
+    modem.write(body)
+    final = modem.wait_for(lambda line: line.text in ('ESP_RESP OK', 'ESP_RESP FAIL'), timeout=30)[-1]
+    if final.text != 'ESP_RESP OK' or server.last_body != body:
+        return None
+    return final.at - started
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    parser.add_argument('--count', type=int, default=5)
+    args = parser.parse_args()
+
+    server = StandIn().start()
+    env = {'MODEM_NETWORKS': 'BenchNet:benchpass1:1:-40', 'MODEM_HTTP_PORT': str(server.port), 'MODEM_UART_PACED': '1'}
+    modem = Modem(args.binary, env=env)
+    failures = 0
+    try:
+        modem.boot()
+        modem.connect_wifi('BenchNet', 'benchpass1')
+        print('%-8s %-7s %7s %10s %10s %6s' % ('baud', 'flow', 'body', 'line B/s', 'got B/s', 'kept'))
+        for rate in RATES:
+            for flow in ('', 'RTSCTS'):
+                if modem.command(('BAUD %d %s' % (rate, flow)).strip())[-1].text != 'ESP_RESP OK':
+                    print('%-8d %-7s BAUD refused' % (rate, flow or 'none'))
+                    failures += 1
+                    continue
+                body = bytes(i % 251 for i in range(int(rate / 10 * LINE_SECONDS)))
+                times = [stream(modem, server, body) for _ in range(args.count)]
+                if None in times:
+                    print('%-8d %-7s body did not arrive intact' % (rate, flow or 'none'))
+                    failures += 1
+                    continue
+                got = len(body) / min(times)
+                print('%-8d %-7s %7d %10.0f %10.0f %5.0f%%' % (rate, flow or 'none', len(body), rate / 10, got, 1000 * got / rate))
+    finally:
+        code = modem.close()
+        server.shutdown()
+    return 0 if code == 0 and failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+# WiFi profiles with their own addressing: a static address is used on its own network only. Failing over
+# to a DHCP network starts DHCP again, and the addresses survive a restart and an update from the single address
+# of earlier firmware.
+import argparse
+import os
+import socket
+import struct
+import sys
+import tempfile
+
+from modem_process import Modem
+
+NETWORKS = 'Home:homepass1:1:-40;Backup:backpass1:6:-60'  # Backup gets 192.168.2.2 from its DHCP server
+
+
+class Test:
+    def __init__(self):
+        self.failures = 0
+
+    def expect(self, what, ok):
+        print('%-58s %s' % (what, 'ok' if ok else 'FAILED'))
+        self.failures += 0 if ok else 1
+
+
+def answer(modem, command):
+    return modem.command(command)[-1].text
+
+
+def write_legacy_store(storage):
+    """Profiles as firmware before per-profile addresses stored them, next to the single "static_ip" key"""
+    directory = os.path.join(storage, 'nvs', 'credentials')
+    os.makedirs(directory, exist_ok=True)
+    home = struct.pack('<33s65sB6sBxxIHxx', b'Home', b'homepass1', 1, bytes([2, 0, 0, 0, 0, 1]), 1, 1, 0)
+    with open(os.path.join(directory, 'profiles.blob'), 'wb') as f:
+        f.write(home)
+    with open(os.path.join(directory, 'static_ip.blob'), 'wb') as f:
+        f.write(b''.join(socket.inet_aton(a) for a in ('10.9.0.77', '255.255.255.0', '10.9.0.1', '0.0.0.0')))
+
+
+def address_when_up(modem, timeout=20):
+    """Address the station reports once the link is up"""
+    return modem.wait_for('ESP_EVT WIFI UP', timeout)[-1].text.split()[-1]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', required=True)
+    args = parser.parse_args()
+
+    env = {'MODEM_NETWORKS': NETWORKS}
+    modem = Modem(args.binary, env=env)
+    t = Test()
+    try:
+        modem.boot()
+        t.expect('IPCONFIG needs a known profile', answer(modem, 'IPCONFIG Home 10.9.0.50 255.255.255.0 10.9.0.1') == 'ESP_RESP FAIL')
+
+        # Home is preferred but its password is wrong, so the link fails over to Backup
+        answer(modem, 'PROFILE ADD Home wrongpass1 1')
+        answer(modem, 'PROFILE ADD Backup backpass1 0')
+        t.expect('IPCONFIG <ssid> <ip> <netmask> <gateway> answers OK', answer(modem, 'IPCONFIG Home 10.9.0.50 255.255.255.0 10.9.0.1') == 'ESP_RESP OK')
+        t.expect('a malformed address is refused', answer(modem, 'IPCONFIG Backup 10.9.0.300 255.255.255.0 10.9.0.1') == 'ESP_RESP FAIL')
+        answer(modem, 'CONNECT')
+        t.expect('failing over to a DHCP network gets a lease', address_when_up(modem) == '192.168.2.2')
+
+        # With the right password Home comes up with its own address, after a restart
+        answer(modem, 'PROFILE ADD Home homepass1 1')
+        answer(modem, 'PROFILE DEL Backup')
+        t.expect('the modem stops cleanly', modem.close() == 0)
+        modem = Modem(args.binary, storage=modem.storage, env=env)
+        modem.boot()
+        answer(modem, 'CONNECT')
+        t.expect('the static address of a profile survives a restart', address_when_up(modem) == '10.9.0.50')
+
+        # Back to DHCP on Home
+        t.expect('IPCONFIG <ssid> DHCP answers OK', answer(modem, 'IPCONFIG Home DHCP') == 'ESP_RESP OK')
+        t.expect('the modem stops cleanly', modem.close() == 0)
+        modem = Modem(args.binary, storage=modem.storage, env=env)
+        modem.boot()
+        answer(modem, 'CONNECT')
+        t.expect('a profile back on DHCP gets a lease', address_when_up(modem) == '192.168.1.2')
+
+        # A store written by earlier firmware: the single static address moves into the profile it was used with
+        t.expect('the modem stops cleanly', modem.close() == 0)
+        storage = tempfile.mkdtemp(prefix='modem_flash_')
+        write_legacy_store(storage)
+        modem = Modem(args.binary, storage=storage, env=env)
+        modem.boot()
+        answer(modem, 'CONNECT')
+        t.expect('an earlier store keeps its network and static address', address_when_up(modem) == '10.9.0.77')
+    finally:
+        code = modem.close()
+    return 0 if code == 0 and t.failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
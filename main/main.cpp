@@ -5,46 +5,288 @@
 #include "esp_http_client.h"
 #include "esp_tls.h"
 #include "esp_netif.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_ota_ops.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "config_server.hpp"
 #include "network_helpers.hpp"
 #include "storage.hpp"
 #include "commands.hpp"
+#include "workers.hpp"
+#include "registry.hpp"
+#include "stats.hpp"
+#include "http_pool.hpp"
+#include "wifi_link.hpp"
+#include "sockets.hpp"
+#include "mqtt_link.hpp"
+#include "batch.hpp"
+#include "outbox.hpp"
+#include "pools.hpp"
+#include "scan_cache.hpp"
+#include "power.hpp"
+#include "ota.hpp"
 
-constexpr auto TAG = "MAIN";              // Tag used for logging
-constexpr auto max_scanned_networks = 10; // Maximum number of networks found while scanning
+constexpr auto TAG = "MAIN";            // Tag used for logging
+constexpr auto link_wait_ms = 10000;    // How long commands running on a worker wait for the WiFi link
+constexpr auto max_held_payload = 1024; // Largest streamed payload kept in RAM (MQTT PUB, BATCH ADD)
+constexpr auto host_task_priority = 6;  // Above the workers, below the UART event task
+constexpr auto reboot_delay_ms = 200;   // Time for a last answer to go out before restarting
 
-auto got_wifi_configuration(const char *ssid, const char *pass) -> void
+
+/* -------------------------------------------------------------------------- */
+/* ---------------------------- Response forwarding ------------------------- */
+/* -------------------------------------------------------------------------- */
+
+// The sink context holds the request id of the command
+auto forward_status(void *ctx, int status_code) -> void
+{
+    char line[32];
+    snprintf(line, sizeof(line), "STATUS %d", status_code);
+    commands::send_resp(*(int32_t *)ctx, line);
+}
+
+auto forward_header(void *ctx, const char *key, const char *value) -> void
+{
+    char line[160];
+    snprintf(line, sizeof(line), "HEADER %s: %s", key, value);
+    commands::send_resp(*(int32_t *)ctx, line);
+}
+
+auto forward_data(void *ctx, const char *data, int len) -> void
+{
+    commands::send_data(*(int32_t *)ctx, data, len);
+}
+
+// Socket data is not an answer to any command, so it goes out as events
+auto forward_socket_data(uint8_t id, const char *data, int len) -> void
+{
+    char event[24];
+    if (len == 0)
+    {
+        snprintf(event, sizeof(event), "SOCK %u CLOSED", id);
+        return commands::send_event(event);
+    }
+    snprintf(event, sizeof(event), "SOCK %u DATA", id);
+    commands::send_event(event, data, len);
+}
+
+// Every item of the batch shares the outcome of its upload
+auto forward_batch_ack(uint32_t id, uint16_t count, int status) -> void
+{
+    char event[48];
+    const auto ok = status >= 200 && status < 300;
+    snprintf(event, sizeof(event), "BATCH %s %" PRIu32 " %u %d", ok ? "ACK" : "NACK", id, count, status);
+    commands::send_event(event);
+}
+
+auto forward_delivery(uint32_t id, int status) -> void
+{
+    char event[40];
+    snprintf(event, sizeof(event), "QUEUE SENT %" PRIu32 " %d", id, status);
+    commands::send_event(event);
+}
+
+auto forward_mqtt_state(bool connected) -> void
+{
+    commands::send_event(connected ? "MQTT UP" : "MQTT DOWN");
+}
+
+// Large messages arrive in parts, the parts after the first one carry their offset instead of the topic
+auto forward_mqtt_message(const char *topic, const char *data, int len, int offset, int total) -> void
+{
+    char event[160];
+    if (offset == 0)
+        snprintf(event, sizeof(event), "MQTT MSG %s", topic);
+    else
+        snprintf(event, sizeof(event), "MQTT PART %d %d", offset, total);
+    commands::send_event(event, data, len);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --------------------------------- WiFi link ------------------------------ */
+/* -------------------------------------------------------------------------- */
+
+// Link state changes are pushed to the host, and kept in the history of the network in use
+auto on_link_change(wifi_link::State state, const char *detail) -> void
+{
+    char line[64];
+    if (detail != NULL)
+        snprintf(line, sizeof(line), "WIFI %s %s", wifi_link::state_name(state), detail);
+    else
+        snprintf(line, sizeof(line), "WIFI %s", wifi_link::state_name(state));
+    commands::send_event(line);
+
+    uint8_t bssid[6];
+    uint8_t channel;
+    if (state == wifi_link::State::UP && wifi_link::access_point(bssid, &channel))
+        storage::record_success(wifi_link::ssid(), bssid, channel);
+    else if (state == wifi_link::State::BACKOFF)
+        storage::record_failure(wifi_link::ssid());
+}
+
+// Picks the known network to join from a fresh scan (signal strength, priority and history)
+auto select_network(const char *failed, wifi_link::Network *next) -> bool
+{
+    static wifi_ap_record_t found[scan_cache::MAX_NETWORKS];
+    static storage::Sighting seen[scan_cache::MAX_NETWORKS];
+    if (storage::profile_count() < 2 && failed != NULL)
+        return false; // Nowhere to fail over to, skip the scan
+
+    const auto count = network_helpers::scan_wifi(found, scan_cache::MAX_NETWORKS);
+    for (uint16_t i = 0; i < count; i++)
+        seen[i] = {(const char *)found[i].ssid, found[i].rssi, found[i].bssid, found[i].primary};
+    storage::Profile best;
+    if (!storage::best_profile(seen, count, failed, &best))
+        return false;
+    if (failed != NULL)
+        storage::record_failure(failed); // Failing over skips the backoff, which would have counted it otherwise
+
+    strcpy(next->ssid, best.ssid);
+    strcpy(next->pass, best.pass);
+    memcpy(next->bssid, best.bssid, sizeof(next->bssid));
+    next->channel = best.channel;
+    next->address = {best.static_ip.ip, best.static_ip.netmask, best.static_ip.gateway, best.static_ip.dns};
+    return true;
+}
+
+// Progress of the credentials submitted on the provisioning portal
+auto on_provisioning_result(config_server::Result result, const char *ssid) -> void
+{
+    char line[64];
+    snprintf(line, sizeof(line), "PROV %s %s", config_server::result_name(result), ssid);
+    commands::send_event(line);
+}
+
+// Credentials from the portal got an address, keep them and let the link manager take the station over
+auto on_provisioned(const char *ssid, const char *pass, const uint8_t *bssid, uint8_t channel) -> void
+{
+    // A network that is already known keeps the priority the host gave it
+    static storage::Profile known[storage::MAX_PROFILES];
+    const auto count = storage::snapshot(known, storage::MAX_PROFILES);
+    uint8_t priority = 0;
+    for (uint8_t i = 0; i < count; i++)
+        if (strcmp(known[i].ssid, ssid) == 0)
+            priority = known[i].priority;
+    storage::save_profile(ssid, pass, priority);
+    storage::record_success(ssid, bssid, channel);
+
+    wifi_link::StationHint hint = {};
+    memcpy(hint.bssid, bssid, sizeof(hint.bssid));
+    hint.channel = channel;
+    if (wifi_link::start(ssid, pass, hint, on_link_change, select_network) != ESP_OK)
+        commands::send_event("PROV FAILED");
+}
+
+// Answer a command that will not run, skipping its streamed payload first so it is not read as commands
+auto reject(const commands::Command &c, const char *reply) -> void
 {
-    storage::save_credentials({ssid, pass});
-    commands::send_resp("OK");
-    esp_restart();
+    commands::discard_data(c.stream_len);
+    commands::send_resp(c.id, reply);
+}
+
+// Commands on a worker wait for the link to come back, commands on the command loop fail fast
+auto link_ready(const commands::Command &c) -> bool
+{
+    const auto on_worker = c.id >= 0 && c.stream_len == 0;
+    return wifi_link::wait_up(on_worker ? pdMS_TO_TICKS(link_wait_ms) : 0);
 }
 
 /* -------------------------------------------------------------------------- */
 /* ---------------------------- Command executors --------------------------- */
 /* -------------------------------------------------------------------------- */
 
+// SERVE - Starts the provisioning portal, results are reported with "ESP_EVT PROV ..." while commands keep running
 auto execute_serve(commands::Command c) -> void
 {
-    network_helpers::init_wifi_as_apsta("Water Solution");                            // Initialize WiFi as access point + station
-    static wifi_ap_record_t networks[max_scanned_networks];                           // Array containging information on networks found
-    auto networks_count = network_helpers::scan_wifi(networks, max_scanned_networks); // Scan WiFi for available networks
-    config_server::run(got_wifi_configuration, networks, networks_count);             // Run the config server
+    if (wifi_link::state() != wifi_link::State::IDLE || config_server::running())
+        return commands::send_resp(c.id, "FAIL");
+
+    network_helpers::init_wifi_as_apsta("Water Solution"); // Initialize WiFi as access point + station
+    scan_cache::refresh();                                 // Fill the network list before the first page load
+    if (config_server::run({on_provisioning_result, on_provisioned}) != ESP_OK)
+        return commands::send_resp(c.id, "FAIL");
+    commands::send_resp(c.id, "OK");
 }
 
 auto execute_connect(commands::Command c) -> void
 {
-    if (!storage::are_credentails_saved())
-        return commands::send_resp("FAIL");
-    auto cred = storage::get_credentials();
-    if (network_helpers::init_wifi_as_sta(cred.ssid, cred.pass) != ESP_OK)
+    storage::Profile profile;
+    if (!storage::preferred_profile(&profile) || config_server::running())
+        return commands::send_resp(c.id, "FAIL");
+
+    // Reuse the access point and address from last time so the connect can skip the scan (and DHCP).
+    // Without a known access point the link manager scans and picks the best known network in range.
+    wifi_link::StationHint hint = {};
+    memcpy(hint.bssid, profile.bssid, sizeof(hint.bssid));
+    hint.channel = profile.channel;
+    hint.address = {profile.static_ip.ip, profile.static_ip.netmask, profile.static_ip.gateway, profile.static_ip.dns};
+
+    // Returns at once, progress is reported with "ESP_EVT WIFI ..." and failed attempts are retried (or failed over) in the background
+    if (wifi_link::start(profile.ssid, profile.pass, hint, on_link_change, select_network) != ESP_OK)
+        return commands::send_resp(c.id, "FAIL");
+    commands::send_resp(c.id, "OK");
+}
+
+// PROFILE LIST | PROFILE ADD <ssid> [password] [priority] | PROFILE DEL <ssid>
+auto execute_profile(commands::Command c) -> void
+{
+    if (strcmp(c.args[0], "LIST") == 0)
+    {
+        static storage::Profile profiles[storage::MAX_PROFILES];
+        const auto count = storage::snapshot(profiles, storage::MAX_PROFILES);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const auto &p = profiles[i];
+            char line[96];
+            snprintf(line, sizeof(line), "PROFILE %u %u %" PRIu32 " %u %.32s",
+                     p.priority, p.channel, p.last_success, p.failures, p.ssid);
+            commands::send_resp(c.id, line);
+        }
+        return commands::send_resp(c.id, "OK");
+    }
+    if (strcmp(c.args[0], "ADD") == 0 && c.args_len >= 2)
     {
-        commands::send_resp("FAIL");
-        storage::forget_credentials();
-        return esp_restart();
+        const auto pass = c.args_len >= 3 ? c.args[2] : "";
+        const auto priority = c.args_len == 4 ? strtoul(c.args[3], NULL, 10) : 0;
+        if (priority > UINT8_MAX || storage::save_profile(c.args[1], pass, priority) != ESP_OK)
+            return commands::send_resp(c.id, "FAIL");
+        return commands::send_resp(c.id, "OK");
     }
-    commands::send_resp("OK");
+    if (strcmp(c.args[0], "DEL") == 0 && c.args_len == 2 && storage::forget_profile(c.args[1]))
+        return commands::send_resp(c.id, "OK");
+    commands::send_resp(c.id, "FAIL");
+}
+
+// IPCONFIG <ssid> DHCP | IPCONFIG <ssid> <ip> <netmask> <gateway> [dns], used whenever the station joins that network
+auto execute_ipconfig(commands::Command c) -> void
+{
+    const auto ssid = c.args[0];
+    if (c.args_len == 2 && strcmp(c.args[1], "DHCP") == 0)
+        return commands::send_resp(c.id, storage::set_static_ip(ssid, {}) ? "OK" : "FAIL");
+
+    esp_ip4_addr_t addr[4] = {};
+    if (c.args_len < 4)
+        return commands::send_resp(c.id, "FAIL");
+    for (uint8_t i = 1; i < c.args_len; i++)
+        if (esp_netif_str_to_ip4(c.args[i], &addr[i - 1]) != ESP_OK)
+            return commands::send_resp(c.id, "FAIL");
+    const auto saved = storage::set_static_ip(ssid, {addr[0].addr, addr[1].addr, addr[2].addr, addr[3].addr});
+    commands::send_resp(c.id, saved ? "OK" : "FAIL");
+}
+
+// Keep a request that could not be delivered in the outbox, unless its response was wanted right away
+auto queue_or_fail(const commands::Command &c, const char *reply, bool forwarded) -> void
+{
+    const auto method = strcmp(c.args[0], "POST") == 0 ? HTTP_METHOD_POST : HTTP_METHOD_GET;
+    uint32_t id = 0;
+    if (forwarded || c.stream_len > 0 || outbox::push(method, c.args[1], c.args[2], (const char *)c.data, c.data_len, &id) != ESP_OK)
+        return commands::send_resp(c.id, reply);
+    char line[24];
+    snprintf(line, sizeof(line), "QUEUED %" PRIu32, id); // Delivery is reported with "ESP_EVT QUEUE SENT <id> <status>"
+    commands::send_resp(c.id, line);
 }
 
 auto execute_http(commands::Command c) -> void
@@ -53,21 +295,499 @@ auto execute_http(commands::Command c) -> void
     const auto host = c.args[1];
     const auto path = c.args[2];
     const auto body = (char *)c.data;
-    const auto err = network_helpers::make_http_request(method, host, path, body);
+
+    // Options after the path: FWD forwards the response to the host, GZIP / PLAIN override the default body compression
+    auto forwarded = false;
+    auto compression = network_helpers::Compression::DEFAULT;
+    for (uint8_t i = 3; i < c.args_len; i++)
+    {
+        if (strcmp(c.args[i], "FWD") == 0)
+            forwarded = true;
+        else if (strcmp(c.args[i], "GZIP") == 0)
+            compression = network_helpers::Compression::GZIP;
+        else if (strcmp(c.args[i], "PLAIN") == 0)
+            compression = network_helpers::Compression::NONE;
+    }
+    if (!link_ready(c))
+    {
+        commands::discard_data(c.stream_len); // A streamed body is not queued
+        return queue_or_fail(c, "NOLINK", forwarded);
+    }
+
+    // Sends the response of the request back to the host
+    const network_helpers::ResponseSink host_sink = {
+        .on_status = forward_status,
+        .on_header = forward_header,
+        .on_data = forward_data,
+        .ctx = &c.id,
+    };
+    const auto sink = forwarded ? &host_sink : NULL;
+    const auto err = c.stream_len > 0
+                         ? network_helpers::make_http_stream_request(method, host, path, c.stream_len, commands::read_data, sink, compression)
+                         : network_helpers::make_http_request(method, host, path, body, c.data_len, sink, compression);
     if (err != ESP_OK)
-        return commands::send_resp("FAIL");
-    return commands::send_resp("OK");
+        return queue_or_fail(c, "FAIL", forwarded);
+    return commands::send_resp(c.id, "OK");
+}
+
+auto execute_close(commands::Command c) -> void
+{
+    const auto host = c.args_len > 0 ? c.args[0] : NULL; // Close every connection if no host is given
+    network_helpers::close_connections(host);
+    commands::send_resp(c.id, "OK");
+}
+
+// Forward a command payload (inline or streamed) to a socket
+auto send_to_socket(const commands::Command &c, uint8_t id) -> esp_err_t
+{
+    if (c.stream_len == 0)
+        return sockets::send(id, (const char *)c.data, c.data_len);
+
+    // Keep reading after an error so the host stream stays in sync
+    static char chunk[512];
+    auto err = ESP_OK;
+    for (auto remaining = c.stream_len; remaining > 0;)
+    {
+        const auto len = commands::read_data(chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+        if (len <= 0)
+            return ESP_ERR_TIMEOUT;
+        remaining -= len;
+        if (err == ESP_OK)
+            err = sockets::send(id, chunk, len);
+    }
+    return err;
+}
+
+// SOCK OPEN TCP|UDP <host> <port> | SOCK SEND <id> + data | SOCK CLOSE <id>
+auto execute_sock(commands::Command c) -> void
+{
+    const auto op = c.args[0];
+    if (strcmp(op, "OPEN") == 0 && c.args_len == 4 && c.stream_len == 0)
+    {
+        const auto tcp = strcmp(c.args[1], "TCP") == 0;
+        const auto port = strtoul(c.args[3], NULL, 10);
+        if ((!tcp && strcmp(c.args[1], "UDP") != 0) || port == 0 || port > 65535)
+            return commands::send_resp(c.id, "FAIL");
+        if (!link_ready(c))
+            return commands::send_resp(c.id, "NOLINK");
+        const auto id = sockets::open(tcp ? sockets::Protocol::TCP : sockets::Protocol::UDP, c.args[2], port);
+        if (id < 0)
+            return commands::send_resp(c.id, "FAIL");
+        char line[16];
+        snprintf(line, sizeof(line), "SOCK %d", id);
+        commands::send_resp(c.id, line);
+        return commands::send_resp(c.id, "OK");
+    }
+
+    const auto id = c.args_len == 2 ? strtoul(c.args[1], NULL, 10) : sockets::MAX_SOCKETS;
+    if (strcmp(op, "SEND") == 0 && id < sockets::MAX_SOCKETS)
+        return commands::send_resp(c.id, send_to_socket(c, id) == ESP_OK ? "OK" : "FAIL");
+    if (strcmp(op, "CLOSE") == 0 && id < sockets::MAX_SOCKETS && c.stream_len == 0)
+        return commands::send_resp(c.id, sockets::close(id) == ESP_OK ? "OK" : "FAIL");
+    reject(c, "FAIL");
+}
+
+// Payload of a command that needs it in RAM as a whole, NULL if it does not fit.
+// Streamed payloads only run on the command loop, so one buffer is enough for them.
+auto hold_payload(const commands::Command &c, uint16_t *len) -> const uint8_t *
+{
+    static uint8_t held[max_held_payload];
+    if (c.stream_len == 0)
+    {
+        *len = c.data_len;
+        return c.data;
+    }
+
+    // Keep reading an oversized stream so the host stays in sync
+    auto fits = c.stream_len <= sizeof(held);
+    uint32_t filled = 0;
+    while (filled < c.stream_len)
+    {
+        char chunk[64];
+        const auto remaining = c.stream_len - filled;
+        const auto n = commands::read_data(chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+        if (n <= 0)
+            return NULL;
+        if (fits)
+            memcpy(held + filled, chunk, n);
+        filled += n;
+    }
+    *len = filled;
+    return fits ? held : NULL;
+}
+
+// MQTT CONNECT <uri> [client_id] [user] [pass] | MQTT PUB <topic> <qos> [RETAIN] + data |
+// MQTT SUB <topic> <qos> | MQTT UNSUB <topic> | MQTT DISCONNECT | MQTT STATUS
+auto execute_mqtt(commands::Command c) -> void
+{
+    const auto op = c.args[0];
+    auto err = ESP_ERR_INVALID_ARG;
+    if (c.stream_len > 0 && (strcmp(op, "PUB") != 0 || c.args_len < 3))
+        return reject(c, "FAIL"); // Only PUB carries a payload
+    if (strcmp(op, "PUB") == 0 && c.args_len >= 3)
+    {
+        uint16_t len = 0;
+        const auto payload = hold_payload(c, &len);
+        const auto qos = strtoul(c.args[2], NULL, 10);
+        const auto retain = c.args_len > 3 && strcmp(c.args[3], "RETAIN") == 0;
+        auto queued = false;
+        if (payload != NULL)
+            err = mqtt_link::publish(c.args[1], payload, len, qos, retain, &queued);
+        if (err == ESP_OK && queued)
+            return commands::send_resp(c.id, "QUEUED"); // Sent once the broker is reachable again
+    }
+    else if (strcmp(op, "CONNECT") == 0 && c.args_len >= 2)
+    {
+        const auto arg = [&](uint8_t i) { return c.args_len > i ? c.args[i] : NULL; };
+        err = mqtt_link::connect(c.args[1], arg(2), arg(3), arg(4));
+    }
+    else if (strcmp(op, "SUB") == 0 && c.args_len == 3)
+        err = mqtt_link::subscribe(c.args[1], strtoul(c.args[2], NULL, 10));
+    else if (strcmp(op, "UNSUB") == 0 && c.args_len == 2)
+        err = mqtt_link::unsubscribe(c.args[1]);
+    else if (strcmp(op, "DISCONNECT") == 0)
+    {
+        mqtt_link::disconnect();
+        err = ESP_OK;
+    }
+    else if (strcmp(op, "STATUS") == 0)
+    {
+        const auto s = mqtt_link::status();
+        char line[96];
+        snprintf(line, sizeof(line), "MQTT state=%s ram=%" PRIu32 " flash=%" PRIu32 " dropped=%" PRIu32,
+                 s.connected ? "UP" : "DOWN", s.queued_ram, s.queued_flash, s.dropped);
+        commands::send_resp(c.id, line);
+        err = ESP_OK;
+    }
+    commands::send_resp(c.id, err == ESP_OK ? "OK" : "FAIL");
+}
+
+// BATCH ADD <host> <path> [JSON] + data | BATCH FLUSH [<host> <path>]
+// Items are acknowledged per batch with "ESP_EVT BATCH ACK|NACK <batch> <items> <status>"
+auto execute_batch(commands::Command c) -> void
+{
+    const auto op = c.args[0];
+    if (strcmp(op, "ADD") == 0 && c.args_len >= 3)
+    {
+        uint16_t len = 0;
+        const auto item = hold_payload(c, &len);
+        const auto format = c.args_len > 3 && strcmp(c.args[3], "JSON") == 0 ? batch::Format::JSON : batch::Format::LINES;
+        batch::Ticket ticket = {};
+        const auto err = item != NULL ? batch::add(c.args[1], c.args[2], format, (const char *)item, len, &ticket) : ESP_ERR_INVALID_SIZE;
+        if (err == ESP_ERR_NO_MEM)
+            return commands::send_resp(c.id, "BUSY"); // Every batch is waiting for its upload
+        if (err != ESP_OK)
+            return commands::send_resp(c.id, "FAIL");
+        char line[32];
+        snprintf(line, sizeof(line), "BATCH %" PRIu32 " %u", ticket.id, ticket.index);
+        commands::send_resp(c.id, line);
+        return commands::send_resp(c.id, "OK");
+    }
+    if (strcmp(op, "FLUSH") == 0 && (c.args_len == 1 || c.args_len == 3) && c.stream_len == 0)
+    {
+        batch::flush(c.args_len == 3 ? c.args[1] : NULL, c.args_len == 3 ? c.args[2] : NULL);
+        return commands::send_resp(c.id, "OK");
+    }
+    reject(c, "FAIL");
+}
+
+// QUEUE STATUS | QUEUE DRAIN
+auto execute_queue(commands::Command c) -> void
+{
+    if (strcmp(c.args[0], "DRAIN") == 0)
+    {
+        outbox::drain();
+        return commands::send_resp(c.id, "OK");
+    }
+    if (strcmp(c.args[0], "STATUS") != 0)
+        return commands::send_resp(c.id, "FAIL");
+    const auto s = outbox::status();
+    char line[96];
+    snprintf(line, sizeof(line), "QUEUE pending=%" PRIu32 " dropped=%" PRIu32 " retries=%" PRIu32 " state=%s",
+             s.pending, s.dropped, s.retries, s.waiting ? "BACKOFF" : "IDLE");
+    commands::send_resp(c.id, line);
+    commands::send_resp(c.id, "OK");
+}
+
+// SCAN - Lists the cached networks right away (strongest first) and asks for a fresh scan
+auto execute_scan(commands::Command c) -> void
+{
+    static scan_cache::Network networks[scan_cache::MAX_NETWORKS];
+    const auto count = scan_cache::snapshot(networks, scan_cache::MAX_NETWORKS);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const auto &n = networks[i];
+        char line[96]; // The longest line, with every number at its widest and a 32 byte SSID, takes 86
+        snprintf(line, sizeof(line), "AP %d %u %d %02x:%02x:%02x:%02x:%02x:%02x %" PRIu32 " %.32s",
+                 n.rssi, n.channel, n.authmode, n.bssid[0], n.bssid[1], n.bssid[2], n.bssid[3], n.bssid[4], n.bssid[5], n.age_s, n.ssid);
+        commands::send_resp(c.id, line);
+    }
+    scan_cache::refresh();
+    commands::send_resp(c.id, "OK");
+}
+
+auto execute_stats(commands::Command c) -> void
+{
+    char line[128];
+    if (c.args_len > 0 && strcmp(c.args[0], "RESET") == 0)
+    {
+        stats::reset();
+        power::reset_stats();
+        return commands::send_resp(c.id, "OK");
+    }
+
+    // Latency of every stage of the command path (microseconds)
+    for (uint8_t i = 0; i < (uint8_t)stats::Stage::COUNT; i++)
+    {
+        const auto stage = (stats::Stage)i;
+        const auto s = stats::summarize(stage);
+        snprintf(line, sizeof(line), "STAT %s n=%" PRIu32 " p50=%" PRIu32 " p99=%" PRIu32 " max=%" PRIu32 " err=%" PRIu32,
+                 stats::stage_name(stage), s.count, s.p50_us, s.p99_us, s.max_us, s.errors);
+        commands::send_resp(c.id, line);
+    }
+
+    // Link and memory health
+    const auto link = commands::link_stats();
+    snprintf(line, sizeof(line), "UART baud=%" PRIu32 " flow=%s overruns=%" PRIu32 " line_errors=%" PRIu32,
+             link.baud_rate, link.flow_control ? "RTSCTS" : "NONE", link.overruns, link.line_errors);
+    commands::send_resp(c.id, line);
+    snprintf(line, sizeof(line), "HEAP free=%" PRIu32 " min=%" PRIu32 " largest=%u",
+             esp_get_free_heap_size(), esp_get_minimum_free_heap_size(), (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    commands::send_resp(c.id, line);
+    const auto pool = http_pool::usage();
+    snprintf(line, sizeof(line), "POOL open=%u tls=%u heap=%" PRIu32, pool.open, pool.secure, pool.heap_cost);
+    commands::send_resp(c.id, line);
+    pools::Usage mem;
+    for (uint8_t i = 0; pools::usage(i, &mem); i++)
+    {
+        snprintf(line, sizeof(line), "MEM %s block=%u used=%u peak=%u of=%u fails=%" PRIu32,
+                 mem.name, (unsigned)mem.block_size, mem.used, mem.peak, mem.count, mem.failures);
+        commands::send_resp(c.id, line);
+    }
+    const auto gzip = network_helpers::compression_stats();
+    const auto ratio = gzip.bytes_in > 0 ? (uint32_t)(100ull * gzip.bytes_out / gzip.bytes_in) : 100; // Compressed size in % of the original
+    snprintf(line, sizeof(line), "GZIP n=%" PRIu32 " in=%" PRIu32 " out=%" PRIu32 " ratio=%" PRIu32 "%%",
+             gzip.requests, gzip.bytes_in, gzip.bytes_out, ratio);
+    commands::send_resp(c.id, line);
+
+    // Share of the time the modem was held awake, and how well queued transmissions were grouped
+    const auto power = power::stats();
+    const auto duty = power.uptime_ms > 0 ? (uint32_t)(100ull * power.awake_ms / power.uptime_ms) : 100;
+    snprintf(line, sizeof(line), "POWER ps=%s awake=%" PRIu32 " of=%" PRIu32 " duty=%" PRIu32 "%% wakeups=%" PRIu32,
+             power::mode_name(), power.awake_ms, power.uptime_ms, duty, power.wakeups);
+    commands::send_resp(c.id, line);
+    snprintf(line, sizeof(line), "TXWIN n=%" PRIu32 " sends=%" PRIu32 " open=%" PRIu32 " duty=%" PRIu32 "%% deferred=%" PRIu32,
+             power.windows, power.transmissions, power.open_ms,
+             power.uptime_ms > 0 ? (uint32_t)(100ull * power.open_ms / power.uptime_ms) : 0, power.deferred_ms);
+    commands::send_resp(c.id, line);
+    commands::send_resp(c.id, "OK");
+}
+
+// Where every task runs, how much of its stack it has ever used and its share of the CPU since the last TASKS
+auto execute_tasks(commands::Command c) -> void
+{
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    constexpr auto max_tasks = 32;
+    struct Sample
+    {
+        TaskHandle_t handle;
+        uint32_t run_time;
+    };
+    static TaskStatus_t tasks[max_tasks]; // Too big for the stack of the command task
+    static Sample last[max_tasks];        // Run time counters of the previous call
+    static uint8_t last_count = 0;
+    static uint32_t last_total = 0;
+
+    uint32_t total;
+    const auto count = uxTaskGetSystemState(tasks, max_tasks, &total);
+    if (count == 0)
+        return commands::send_resp(c.id, "FAIL");
+    const auto elapsed = total - last_total; // Counters wrap, the difference stays correct
+
+    char line[96];
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        const auto &t = tasks[i];
+        auto previous = 0u;
+        for (uint8_t j = 0; j < last_count; j++)
+            if (last[j].handle == t.xHandle)
+                previous = last[j].run_time;
+        const auto cpu = elapsed > 0 ? (uint32_t)(100ull * (t.ulRunTimeCounter - previous) / elapsed) : 0;
+        const auto core = t.xCoreID == tskNO_AFFINITY ? -1 : (int)t.xCoreID;
+        snprintf(line, sizeof(line), "TASK %s core=%d prio=%u stack_free=%" PRIu32 " cpu=%" PRIu32 "%%",
+                 t.pcTaskName, core, (unsigned)t.uxCurrentPriority, (uint32_t)t.usStackHighWaterMark, cpu);
+        commands::send_resp(c.id, line);
+    }
+
+    for (UBaseType_t i = 0; i < count; i++)
+        last[i] = {tasks[i].xHandle, tasks[i].ulRunTimeCounter};
+    last_count = count;
+    last_total = total;
+    commands::send_resp(c.id, "OK");
+#else
+    commands::send_resp(c.id, "FAIL"); // Needs FREERTOS_USE_TRACE_FACILITY and FREERTOS_GENERATE_RUN_TIME_STATS
+#endif
+}
+
+// A block sent as a binary frame is already in memory, it is handed out like a streamed one
+const uint8_t *framed_block = NULL;
+uint32_t framed_left = 0;
+
+auto read_framed_block(char *buf, int max_len) -> int
+{
+    const auto n = framed_left < (uint32_t)max_len ? framed_left : (uint32_t)max_len;
+    memcpy(buf, framed_block, n);
+    framed_block += n;
+    framed_left -= n;
+    return n;
+}
+
+// OTA BEGIN <size> <crc32> | OTA WRITE <offset> <crc32> + block | OTA END | OTA ABORT | OTA STATUS | OTA ROLLBACK
+// CRCs are hexadecimal. Blocks are streamed ("ESP_DATA_STREAM <len>") or sent as the data of a frame.
+auto execute_ota(commands::Command c) -> void
+{
+    char line[128];
+    const auto has_data = c.data != NULL || c.stream_len > 0;
+    if (strcmp(c.args[0], "WRITE") == 0 && c.args_len == 3 && has_data)
+    {
+        const auto offset = strtoul(c.args[1], NULL, 10);
+        const auto crc = strtoul(c.args[2], NULL, 16);
+        auto len = c.stream_len;
+        auto reader = commands::read_data;
+        if (c.stream_len == 0)
+        {
+            framed_block = c.data;
+            framed_left = len = c.data_len;
+            reader = read_framed_block;
+        }
+        uint32_t next = 0;
+        switch (ota::receive_block(offset, crc, len, reader, &next))
+        {
+        case ota::Block::ACK:
+            snprintf(line, sizeof(line), "ACK %" PRIu32, next);
+            return commands::send_resp(c.id, line);
+        case ota::Block::RESEND:
+            snprintf(line, sizeof(line), "NAK %" PRIu32, next);
+            return commands::send_resp(c.id, line);
+        default:
+            return commands::send_resp(c.id, "FAIL");
+        }
+    }
+    if (has_data)
+        return reject(c, "FAIL");
+
+    if (strcmp(c.args[0], "BEGIN") == 0 && c.args_len == 3)
+    {
+        ota::Offer offer;
+        const auto err = ota::begin(strtoul(c.args[1], NULL, 10), strtoul(c.args[2], NULL, 16), &offer);
+        if (err != ESP_OK)
+            return commands::send_resp(c.id, "FAIL");
+        snprintf(line, sizeof(line), "READY %" PRIu32 " %" PRIu32 " %" PRIu32, offer.offset, offer.max_block, offer.window);
+        return commands::send_resp(c.id, line);
+    }
+    if (strcmp(c.args[0], "END") == 0)
+    {
+        if (ota::finish() != ESP_OK)
+            return commands::send_resp(c.id, "FAIL");
+
+        // Throughput of the transfer that completed the image (a resumed one only counts what it sent)
+        const auto s = ota::stats();
+        const auto sent = s.received - s.resumed_from;
+        const auto rate = s.elapsed_ms > 0 ? (uint32_t)(1000ull * sent / s.elapsed_ms) : 0;
+        snprintf(line, sizeof(line), "DONE %" PRIu32 " %" PRIu32 " %" PRIu32, sent, s.elapsed_ms, rate);
+        commands::send_resp(c.id, line);
+        vTaskDelay(pdMS_TO_TICKS(reboot_delay_ms)); // Let the answer leave the UART
+        esp_restart();
+    }
+    if (strcmp(c.args[0], "ABORT") == 0)
+    {
+        ota::abort();
+        return commands::send_resp(c.id, "OK");
+    }
+    if (strcmp(c.args[0], "STATUS") == 0)
+    {
+        const auto s = ota::stats();
+        const auto sent = s.received - s.resumed_from;
+        const auto rate = s.elapsed_ms > 0 ? (uint32_t)(1000ull * sent / s.elapsed_ms) : 0;
+        snprintf(line, sizeof(line), "OTA slot=%s state=%s version=%s",
+                 ota::running_slot(), ota::trial_state(), esp_ota_get_app_description()->version);
+        commands::send_resp(c.id, line);
+        snprintf(line, sizeof(line), "OTA %s %" PRIu32 "/%" PRIu32 " resumed=%" PRIu32 " blocks=%" PRIu32 " dup=%" PRIu32 " resent=%" PRIu32 " ms=%" PRIu32 " rate=%" PRIu32,
+                 s.active ? "RECEIVING" : "IDLE", s.received, s.image_size, s.resumed_from, s.blocks, s.duplicates, s.rejected, s.elapsed_ms, rate);
+        commands::send_resp(c.id, line);
+        return commands::send_resp(c.id, "OK");
+    }
+    if (strcmp(c.args[0], "ROLLBACK") == 0)
+    {
+        if (!ota::can_roll_back() || ota::rollback() != ESP_OK)
+            return commands::send_resp(c.id, "FAIL"); // No other valid image
+        commands::send_resp(c.id, "OK");
+        vTaskDelay(pdMS_TO_TICKS(reboot_delay_ms)); // Let the answer leave the UART
+        esp_restart();
+    }
+    commands::send_resp(c.id, "FAIL");
+}
+
+/* -------------------------------------------------------------------------- */
+/* -------------------------------- Dispatch -------------------------------- */
+/* -------------------------------------------------------------------------- */
+
+// All commands understood by the modem: name, min/max arguments, payload, async, executor
+constexpr registry::Entry command_table[] = {
+    {"SERVE", 0, 0, false, false, execute_serve},
+    {"CONNECT", 0, 0, false, false, execute_connect},
+    {"IPCONFIG", 2, 5, false, false, execute_ipconfig},
+    {"HTTP", 3, 5, true, true, execute_http},
+    {"CLOSE", 0, 1, false, false, execute_close},
+    {"STATS", 0, 1, false, false, execute_stats},
+    {"SOCK", 2, 4, true, true, execute_sock},
+    {"MQTT", 1, 5, true, true, execute_mqtt},
+    {"BATCH", 1, 4, true, true, execute_batch},
+    {"QUEUE", 1, 1, false, false, execute_queue},
+    {"SCAN", 0, 0, false, false, execute_scan},
+    {"PROFILE", 1, 4, false, false, execute_profile},
+    {"TASKS", 0, 0, false, false, execute_tasks},
+    {"OTA", 1, 3, true, false, execute_ota},
+};
+constexpr auto command_registry = registry::make_registry(command_table);
+static_assert(command_registry.valid(), "No perfect hash found for the command table");
+
+auto dispatch(commands::Command c) -> void
+{
+    const auto entry = command_registry.find(c.cmd);
+    const auto has_data = c.data != NULL || c.stream_len > 0;
+    if (entry == NULL || c.args_len < entry->min_args || c.args_len > entry->max_args || (has_data && !entry->takes_data))
+        return reject(c, "FAIL");
+
+    // Requests with an id run on the worker pool, the reply comes back tagged with the id.
+    // Streamed payloads are read from the UART, so those always run here.
+    if (c.id >= 0 && entry->can_run_async && c.stream_len == 0)
+    {
+        if (!workers::submit(entry->handler, c))
+            commands::send_resp(c.id, "BUSY");
+        return;
+    }
+    entry->handler(c);
 }
 
 /* -------------------------------------------------------------------------- */
 /* ---------------------------------- Main ---------------------------------- */
 /* -------------------------------------------------------------------------- */
 
-extern "C" void app_main(void)
+// Runs the whole modem on the host core: the UART driver (and its interrupt) is installed from here,
+// so the parser and the synchronous commands never compete with the WiFi stack for a core
+auto host_task(void *) -> void
 {
-    storage::init();                   // Initialize NVS
-    commands::init();                  // Initialize the commands system
-    network_helpers::init_tcp_stack(); // Initialize the TCP stack
+    storage::init();                                             // Initialize NVS
+    ota::init();                                                 // Put a freshly updated image on trial
+    commands::init();                                            // Initialize the commands system
+    network_helpers::init_tcp_stack();                           // Initialize the TCP stack
+    workers::init();                                             // Start the workers running asynchronous commands
+    sockets::init(forward_socket_data);                          // Start receiving on raw sockets
+    mqtt_link::init({forward_mqtt_state, forward_mqtt_message}); // Mount the MQTT offline queue
+    batch::init(forward_batch_ack);                              // Start uploading batched requests
+    outbox::init(forward_delivery);                              // Resume delivering requests queued before the reboot
+    scan_cache::start();                                         // Keep a list of nearby networks once WiFi is up
 
     // Inform host that the booting process has finished
     commands::send_resp("BOOTED");
@@ -75,22 +795,14 @@ extern "C" void app_main(void)
     // Run the main loop
     while (true)
     {
-        auto c = commands::wait_for_cmd();
-        if (strcmp(c.cmd, "SERVE") == 0)
-        {
-            execute_serve(c);
-        }
-        else if (strcmp(c.cmd, "CONNECT") == 0)
-        {
-            execute_connect(c);
-        }
-        else if (strcmp(c.cmd, "HTTP") == 0)
-        {
-            execute_http(c);
-        }
-        else
-        {
-            commands::send_resp("FAIL");
-        }
+        const auto c = commands::wait_for_cmd();
+        ota::confirm_boot(); // The host can reach this image, keep it
+        dispatch(c);
     }
 }
+
+extern "C" void app_main(void)
+{
+    // The main task returns (and frees its stack) once the host task is running
+    xTaskCreatePinnedToCore(host_task, "host", CONFIG_MODEM_HOST_TASK_STACK_SIZE, NULL, host_task_priority, NULL, CONFIG_MODEM_HOST_CORE);
+}
@@ -0,0 +1,172 @@
+#!/usr/bin/env python
+# Streams a firmware image to the modem over its UART link ("ESP_CMD OTA ..."), from the host side.
+#
+# Blocks carry their offset and CRC-32 and up to "window" of them are in flight. Every block is
+# answered with the offset the modem expects next ("ACK <next>" or "NAK <next>"); after a NAK the
+# remaining answers are collected and sending starts again from the requested offset (go-back-N).
+# Running the tool again after an interruption continues from the last resume point the modem saved.
+#
+#   python tools/ota_upload.py --port /dev/ttyUSB0 build/esp_wifi_modem.bin
+#
+# --port takes anything pyserial understands, including URLs such as socket://host:port.
+import argparse
+import sys
+import time
+import zlib
+
+ANSWER_TIMEOUT = 10  # Seconds to wait for the answer to a block (covers erasing a flash sector)
+BOOT_TIMEOUT = 30    # Seconds to wait for the new image to report BOOTED
+MAX_STALLS = 5       # Times the transfer is restarted with BEGIN before giving up
+
+
+class Link:
+    def __init__(self, port):
+        self.port = port
+
+    def send(self, line, data=b''):
+        self.port.write(('ESP_CMD ' + line + '\r\n').encode() + data)
+
+    # Next "ESP_RESP" line without the prefix, None on timeout. Logs and events are skipped.
+    def answer(self, timeout=ANSWER_TIMEOUT):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            line = self.port.readline().decode(errors='replace').strip()
+            if line.startswith('ESP_RESP '):
+                return line[len('ESP_RESP '):]
+        return None
+
+    def command(self, line, timeout=ANSWER_TIMEOUT):
+        self.send(line)
+        return self.answer(timeout)
+
+
+class Upload:
+    def __init__(self, link, image, block, window):
+        self.link = link
+        self.image = image
+        self.crc = zlib.crc32(image)
+        self.block = block
+        self.window = window
+        self.resent = 0
+
+    # Returns the offset the modem wants next
+    def begin(self):
+        self.link.send('OTA BEGIN %d %08x' % (len(self.image), self.crc))
+        answer = self.link.answer()
+        while answer is not None and answer != 'FAIL' and not answer.startswith('READY '):  # BOOTED, late answers to blocks
+            answer = self.link.answer()
+        if answer is None or not answer.startswith('READY '):
+            raise RuntimeError('modem refused the update: %s' % answer)
+        offset, max_block, window = (int(v) for v in answer.split()[1:4])
+        self.block = min(self.block or max_block, max_block)
+        self.window = self.window or window
+        return offset
+
+    def send_block(self, offset):
+        chunk = self.image[offset:offset + self.block]
+        self.link.send('OTA WRITE %d %08x ESP_DATA_STREAM %d' % (offset, zlib.crc32(chunk), len(chunk)), chunk)
+        return offset + len(chunk)
+
+    # Go-back-N: keep the window full, rewind to the modem's offset after a NAK
+    def transfer(self, start, progress):
+        acked = start
+        next_send = start
+        in_flight = 0
+        rewinding = False
+        while acked < len(self.image):
+            while not rewinding and in_flight < self.window and next_send < len(self.image):
+                next_send = self.send_block(next_send)
+                in_flight += 1
+            answer = self.link.answer()
+            if answer is None:
+                return False
+            in_flight -= 1
+            kind, _, value = answer.partition(' ')
+            if kind == 'ACK':
+                acked = max(acked, int(value))
+            elif kind == 'NAK':
+                acked = int(value)
+                if not rewinding:
+                    self.resent += 1
+                rewinding = True
+            else:
+                raise RuntimeError('update failed at %d: %s' % (acked, answer))
+            if rewinding and in_flight == 0:
+                next_send = acked
+                rewinding = False
+            progress(acked)
+        return True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--port', required=True)
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--speed', type=int, default=0, help='switch the link to this baud rate for the transfer')
+    parser.add_argument('--block', type=int, default=0, help='block size (default: the largest the modem accepts)')
+    parser.add_argument('--window', type=int, default=0, help='blocks in flight (default: what the modem offers)')
+    parser.add_argument('--no-reboot-check', action='store_true', help='do not wait for the new image to come up')
+    parser.add_argument('image')
+    args = parser.parse_args()
+    import serial  # Only needed for a real port, host/tests/ota_test.py drives Upload over a pipe
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    port = serial.serial_for_url(args.port, baudrate=args.baud, timeout=0.5)
+    link = Link(port)
+    if args.speed:
+        if link.command('BAUD %d' % args.speed) != 'OK':
+            raise RuntimeError('modem refused %d baud' % args.speed)
+        time.sleep(0.1)
+        port.baudrate = args.speed
+    upload = Upload(link, image, args.block, args.window)
+
+    started = time.monotonic()
+    first = None
+
+    shown = [-1]
+
+    def progress(offset):
+        percent = 100 * offset // len(image)
+        if percent != shown[0]:
+            shown[0] = percent
+            sys.stdout.write('\r%7d / %d bytes (%d%%)' % (offset, len(image), percent))
+            sys.stdout.flush()
+
+    for attempt in range(MAX_STALLS):
+        offset = upload.begin()
+        if first is None:
+            first = offset
+            if offset > 0:
+                print('Resuming at %d' % offset)
+        if upload.transfer(offset, progress):
+            break
+        print('\nNo answer, restarting from the modem\'s position')
+    else:
+        raise RuntimeError('transfer stalled')
+    elapsed = time.monotonic() - started
+    print()
+
+    answer = link.command('OTA END')
+    if answer is None or not answer.startswith('DONE '):
+        raise RuntimeError('image rejected: %s' % answer)
+    sent, modem_ms, modem_rate = (int(v) for v in answer.split()[1:4])
+    print('Sent %d bytes in %.1f s (%.0f B/s here, %d B/s on the modem), %d rewinds, block %d, window %d'
+          % (len(image) - first, elapsed, (len(image) - first) / elapsed, modem_rate, upload.resent, upload.block, upload.window))
+
+    if args.no_reboot_check:
+        return
+    # The new image starts at the default baud rate. The first command it answers takes it off trial.
+    port.baudrate = args.baud
+    if link.answer(BOOT_TIMEOUT) != 'BOOTED':
+        raise RuntimeError('new image did not boot, the modem rolls back to the previous one')
+    link.send('OTA STATUS')
+    while True:
+        answer = link.answer()
+        if answer is None or answer in ('OK', 'FAIL'):
+            break
+        print(answer)
+
+
+if __name__ == '__main__':
+    main()